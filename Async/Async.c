@@ -23,6 +23,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 /****************************************************************************
 
+1.26   * Serial port is read in blocks of all the queued bytes, and the
+         packet parser takes its chars from that read-ahead buffer.
+       * Output file is flushed once a second instead of after every
+         packet, and committed to disk every 10 seconds.
+
 1.25   * TRACE_IO option should be off in release version.
        * Still some failures with eTrex, but fail limit is 5000.
 
@@ -54,7 +59,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 ****************************************************************************/
 
-#define VERSION 1.25
+#define VERSION 1.26
 
 //Uncomment this only for serial IO debugging  purposes
 //#define TRACE_IO
@@ -67,6 +72,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <time.h>
 #include <sys/types.h>
 #include <sys/timeb.h>
+#include <io.h>
 #include <windows.h>
 #include <winbase.h>
 
@@ -116,6 +122,10 @@ static const char MONTH[12][4] = {"Jan", "Feb", "Mar", "Apr", "May",
 
 #define MAXBUF 512
 
+#define OUT_BUF_BYTES   16384   // stdio buffer for the output file
+#define FLUSH_MSECS     1000    // Output is flushed at most this often
+#define COMMIT_MSECS    10000   // and committed to disk this often
+
 #define EOD 0x0C    // End of Data (in request commands)
 
 #define DLE 0x10
@@ -179,6 +189,10 @@ int mRxState = DAT_ST;
 BYTE mBuffer[MAXBUF];
 BYTE mInBuffer[MAXBUF];
 
+BYTE mRxBuffer[MAXBUF];     // Read-ahead from the serial port
+UINT mRxHead;               // Next char to hand out
+UINT mRxCount;              // Chars in the read-ahead
+
 char mPort[32];
 ULONG* mErrCodePtr;
 ULONG mReadTimeOut=100;
@@ -324,6 +338,7 @@ BOOLEAN open_port(char *ComPort)
         set_error(E_PURGE);
         return 0;
     }
+    mRxHead = mRxCount = 0;
 
     return 1;
 }
@@ -408,15 +423,28 @@ UINT strip_packet(UINT n, BYTE *ack)
 
 /////////////////////////////////////////////////////////////////////////////
 // WAIT UNTIL A CHAR (*x) IS READ FROM SERIAL PORT OR A TIMEOUT OCCURS
+// Chars come from mRxBuffer; when it is empty, one ReadFile takes all
+// the chars queued in the port (at least one, as before).
 // RETURN 0 when TIMEOUT, 1 if OK
 /////////////////////////////////////////////////////////////////////////////
 BOOLEAN read_char(BYTE *x)
 {
     ULONG nb;
     double CPMS=CLOCKS_PER_SEC/1000.0;
-    clock_t start=clock();
+    clock_t start;
     BOOLEAN res;
+    DWORD errors;
+    COMSTAT stat;
+    DWORD want;
+
+    if(mRxHead<mRxCount)
+    {
+        *x=mRxBuffer[mRxHead++];
+        mCharsRead++;
+        return 1;
+    }
 
+    start=clock();
     do
     {
         if((clock()-start)/CPMS> mReadTimeOut)
@@ -428,7 +456,13 @@ BOOLEAN read_char(BYTE *x)
             fflush(TRACE);
 #endif
         }
-        res=ReadFile(mComHnd, x, 1, &nb, NULL);
+        want=1;
+        if(ClearCommError(mComHnd, &errors, &stat) && stat.cbInQue>want)
+        {
+            want=stat.cbInQue;
+            if(want>MAXBUF) want=MAXBUF;
+        }
+        res=ReadFile(mComHnd, mRxBuffer, want, &nb, NULL);
         if(res==0)
         {
             set_error(E_READ);
@@ -438,8 +472,11 @@ BOOLEAN read_char(BYTE *x)
     }
     while(nb==0);
 
+    mRxCount=nb;
+    mRxHead=1;
+    *x=mRxBuffer[0];
     mCharsRead++;
-    return (BOOLEAN)nb;
+    return 1;
 }
 
 
@@ -948,10 +985,32 @@ int clear_line()
     return 1;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// WRITE THE PACKET IN INBUFFER[] TO THE OUTPUT FILE
+// Flushing after every packet costs a disk write per packet, so the
+// stdio buffer is flushed every FLUSH_MSECS, and the file committed to
+// disk every COMMIT_MSECS. A crash loses at most that much data.
+/////////////////////////////////////////////////////////////////////////////
 void write_packet(FILE *dest)
 {
+    static clock_t last_flush=0;
+    static clock_t last_commit=0;
+    double CPMS=CLOCKS_PER_SEC/1000.0;
+    clock_t now=clock();
+
     fwrite(INI_PACKET,1,L_PACKET+2,dest);
-    fflush(dest);
+
+    if((now-last_flush)/CPMS >= FLUSH_MSECS)
+    {
+        fflush(dest);
+        last_flush=now;
+
+        if((now-last_commit)/CPMS >= COMMIT_MSECS)
+        {
+            _commit(_fileno(dest));
+            last_commit=now;
+        }
+    }
 }
 
 void log_packets_0x33(FILE *f_bin)
@@ -1617,6 +1676,7 @@ int main(int argc, char **argv)
     if((command!=IDENT) && (command!=CHECK))
     {
         fd = (mIsStdOut==0)? fopen(fich,"wb"): stdout;
+        setvbuf(fd,NULL,_IOFBF,OUT_BUF_BYTES);
     }
 
     switch(command)
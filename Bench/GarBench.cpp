@@ -0,0 +1,855 @@
+/****************************************************************************
+GARBENCH measures the throughput of the Garmin capture pipeline
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+
+/****************************************************************************
+
+1.02   * The stats stage is back, timing collect_stats() in process
+         through convert_g12 -stat.
+
+1.01   * The rinex and nav stages time generate_rinex() and generate_nav()
+         in process, gar2rnx being built in as a library (convert_g12),
+         instead of whole runs of a gar2rnx executable, which added the
+         start of a process and the loading of the program to every run.
+         -gar2rnx and the stats stage are gone.
+       * Baseline.csv is the reference "make check" compares against.
+
+1.00   First version.
+       * Stages: deframe (CGarminFramer::Consume on the stuffed byte
+         stream, as read from the port), chksum (IsValidFrame on every
+         frame), write (G12 records to a file through a 16 KB stdio
+         buffer, as Async does) and, when -gar2rnx is given, the stats,
+         rinex and nav conversions of that gar2rnx executable.
+       * Data is a G12 file (-file) or synthetic: 9 satellites with
+         measurement, Doppler and navigation (correct parity) records,
+         from a fixed seed, so every run converts the same bytes.
+       * Each stage is run -reps times and the fastest run is kept.
+         Results are CSV, and can be saved as a baseline and compared
+         against it (exit code 2 when a stage got slower).
+       * -out writes the synthetic data to a G12 file instead, as test
+         input for the other programs.
+
+****************************************************************************/
+
+#define VERSION 1.02
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "GarminLink.h"
+#include "../Gar2rnx/gar2rnx.h"
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define RECV_BLOCK_BYTES    4096    // Span passed to the framer, as GarminBinary reads
+#define OUT_BUF_BYTES       16384   // stdio buffer of the G12 file, as Async
+#define DEFAULT_TOLERANCE   0.10    // Slowdown reported as a regression
+#define MAX_RESULTS         64
+
+/////////////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////////////
+
+typedef unsigned char BYTE;
+
+struct t_Result
+{
+    char stage[16];
+    char data[64];
+    long secs;              // Seconds of data, 0 if not known
+    double bytes;
+    double records;
+    double best;            // Fastest run, in secs
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Global variables
+/////////////////////////////////////////////////////////////////////////////
+
+// Options
+std::vector<long> mSizes;   // Seconds of synthetic data
+char *mRecordedFile;
+char *mSaveFile;
+char *mBaseFile;
+char *mOutFile;
+char *mTempDir = (char *)".";
+int mReps = 3;
+double mTolerance = DEFAULT_TOLERANCE;
+
+t_Result mResults[MAX_RESULTS];
+int mNumResults;
+
+// Keeps the optimizer from dropping the work
+volatile unsigned long mSink;
+
+/////////////////////////////////////////////////////////////////////////////
+// Auxiliary functions
+/////////////////////////////////////////////////////////////////////////////
+
+double now_secs()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift32, so the synthetic data is the same on every machine
+uint32_t mRnd = 1;
+
+uint32_t rnd()
+{
+    mRnd ^= mRnd << 13;
+    mRnd ^= mRnd >> 17;
+    mRnd ^= mRnd << 5;
+    return mRnd;
+}
+
+// Uniform in [lo, hi)
+double rnd_range(double lo, double hi)
+{
+    return lo + (hi - lo) * (rnd() / 4294967296.0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Synthetic G12 data
+/////////////////////////////////////////////////////////////////////////////
+
+// Appends little endian fields of a record. Assumes a little endian host,
+// as the receivers and the other programs do.
+struct t_Record
+{
+    BYTE buf[256];
+    int len;
+
+    t_Record() : len(0) {}
+    template <class T> void put(T val)
+    {
+        memcpy(buf + len, &val, sizeof(val));
+        len += sizeof(val);
+    }
+    void put_bytes(const void *p, int n)
+    {
+        memcpy(buf + len, p, n);
+        len += n;
+    }
+};
+
+void add_record(std::vector<BYTE> &g12, BYTE id, const t_Record &r)
+{
+    g12.push_back(id);
+    g12.push_back((BYTE)r.len);
+    g12.insert(g12.end(), r.buf, r.buf + r.len);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// NAVIGATION WORD WITH PARITY, AS SENT BY THE SATELLITE
+// src24 are the 24 data bits, p29/p30 the last 2 bits of the previous word
+/////////////////////////////////////////////////////////////////////////////
+uint32_t parity_word(uint32_t src24, int p29, int p30)
+{
+    static const int taps[6][16] =
+    {
+        {1, 2, 3, 5, 6, 10, 11, 12, 13, 14, 17, 18, 20, 23, 0},
+        {2, 3, 4, 6, 7, 11, 12, 13, 14, 15, 18, 19, 21, 24, 0},
+        {1, 3, 4, 5, 7, 8, 12, 13, 14, 15, 16, 19, 20, 22, 0},
+        {2, 4, 5, 6, 8, 9, 13, 14, 15, 16, 17, 20, 21, 23, 0},
+        {1, 3, 5, 6, 7, 9, 10, 14, 15, 16, 17, 18, 21, 22, 24, 0},
+        {3, 5, 6, 8, 9, 10, 11, 13, 15, 19, 22, 23, 24, 0},
+    };
+    static const int first[6] = {29, 30, 29, 30, 30, 29};
+    uint32_t parity = 0;
+    int k, j;
+
+    for(k = 0; k < 6; k++)
+    {
+        int bit = (first[k] == 29) ? p29 : p30;
+        for(j = 0; taps[k][j]; j++) bit ^= (src24 >> (24 - taps[k][j])) & 1;
+        parity = (parity << 1) | bit;
+    }
+
+    if(p30) src24 ^= 0xffffff;
+
+    return (uint32_t)p29 << 31 | (uint32_t)p30 << 30 | src24 << 6 | parity;
+}
+
+struct t_Sat
+{
+    BYTE sv;
+    int p29, p30;
+    BYTE iode;
+    long frame;             // Frame and word to send next
+    int word;
+    uint32_t words[10];     // Data bits of the subframe being sent
+    long tracked;
+    double range;
+    uint32_t phase;
+};
+
+// Bits numbered from 1, as in the ICD
+void put_bits(BYTE *bits, int start, int len, uint32_t val)
+{
+    for(int i = 0; i < len; i++) bits[start - 1 + i] = (val >> (len - 1 - i)) & 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// DATA BITS OF A SUBFRAME: TLM, HOW, AND THE FIELDS GAR2RNX CHECKS
+/////////////////////////////////////////////////////////////////////////////
+void make_subframe(t_Sat &s, long frame, int week)
+{
+    BYTE bits[240];
+    int sfid = (int)(frame % 5) + 1;
+    int k, w;
+
+    for(k = 0; k < 240; k++) bits[k] = rnd() & 1;
+
+    put_bits(bits, 1, 8, 0x8b);                      // Preamble
+    put_bits(bits, 25, 17, (frame + 1) & 0x1ffff);   // TOW count
+    put_bits(bits, 44, 3, sfid);
+    put_bits(bits, 47, 2, 0);
+
+    if(sfid == 1)
+    {
+        put_bits(bits, 49, 10, week - 1024);
+        put_bits(bits, 65, 6, 0);                    // Healthy
+        put_bits(bits, 169, 8, s.iode);
+    }
+    if(sfid == 2) put_bits(bits, 49, 8, s.iode);
+    if(sfid == 3) put_bits(bits, 217, 8, s.iode);
+
+    for(w = 0; w < 10; w++)
+    {
+        uint32_t v = 0;
+        for(k = 0; k < 24; k++) v = (v << 1) | bits[w * 24 + k];
+        s.words[w] = v;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// BUILD secs SECONDS OF G12 RECORDS, ONE EPOCH PER SECOND
+/////////////////////////////////////////////////////////////////////////////
+void synthesize(long secs, std::vector<BYTE> &g12)
+{
+    static const BYTE svs[] = {1, 4, 7, 10, 13, 17, 20, 24, 28};
+    const int nsats = sizeof(svs);
+    const int week = 2000;
+    const unsigned long garmin_wdays = (week - 521) * 7;
+    const double t0 = 345600.0 + 7 * 3600;
+    const double lat = 40.4 * M_PI / 180, lon = -3.7 * M_PI / 180;
+    uint32_t c511 = 123456789;
+    t_Sat sats[nsats];
+    t_Record r;
+    long sec;
+    int k;
+
+    mRnd = 1;
+    g12.clear();
+    g12.reserve((size_t)secs * 700);
+
+    // Product, date and position, as logged at the start.
+    r = t_Record();
+    r.put<uint16_t>(77);
+    r.put<uint16_t>(460);
+    r.put_bytes("GPS 12 Software Version 4.60\0", 30);
+    add_record(g12, 0xFF, r);
+
+    r = t_Record();
+    r.put<BYTE>(6);
+    r.put<BYTE>(15);
+    r.put<int16_t>(2018);
+    r.put<int16_t>(7);
+    r.put<uint16_t>(0);
+    add_record(g12, 0x0E, r);
+
+    r = t_Record();
+    r.put<double>(lat);
+    r.put<double>(lon);
+    add_record(g12, 0x11, r);
+
+    for(k = 0; k < nsats; k++)
+    {
+        t_Sat &s = sats[k];
+        s.sv = svs[k];
+        s.p29 = s.p30 = 0;
+        s.iode = (BYTE)rnd();
+        s.frame = (long)((t0 - 5) * 50 - 30) / 300;
+        s.word = 0;
+        make_subframe(s, s.frame, week);
+        s.tracked = (rnd() % 200) << 8 | (rnd() % 254 + 1);
+        s.range = rnd_range(2.0e7, 2.3e7);
+        s.phase = rnd() & 0xfffff;
+    }
+
+    for(sec = 0; sec < secs; sec++)
+    {
+        double tow = t0 + sec;
+
+        // Navigation words received up to this second.
+        for(k = 0; k < nsats; k++)
+        {
+            t_Sat &s = sats[k];
+
+            for(;;)
+            {
+                uint32_t c50 = (uint32_t)(30 + 300 * s.frame + 30 * s.word);
+                uint32_t nw;
+
+                if(c50 / 50.0 > tow + 1) break;
+
+                nw = parity_word(s.words[s.word], s.p29, s.p30);
+                s.p29 = (nw >> 1) & 1;
+                s.p30 = nw & 1;
+
+                r = t_Record();
+                r.put<uint32_t>(c50 + rnd() % 3);
+                r.put<uint32_t>(nw);
+                r.put<BYTE>(s.sv);
+                add_record(g12, 0x36, r);
+
+                if(++s.word == 10)
+                {
+                    s.word = 0;
+                    make_subframe(s, ++s.frame, week);
+                }
+            }
+        }
+
+        // Measurements and Doppler.
+        for(k = 0; k < nsats; k++)
+        {
+            t_Sat &s = sats[k];
+
+            s.range += rnd_range(-800, 800);
+            s.phase += (rnd() % 8000) - 4000;
+            s.tracked += rnd() % 40;
+
+            r = t_Record();
+            r.put<uint32_t>(rnd());
+            r.put<int32_t>(s.tracked & 0x7fffffff);
+            r.put<uint16_t>(32768 + rnd() % 6000 - 3000);
+            r.put<uint32_t>(s.phase);
+            r.put<double>(s.range);
+            r.put<uint32_t>(c511);
+            r.put<uint16_t>(2000 + rnd() % 8000);
+            r.put<double>(tow);
+            r.put<BYTE>(s.sv);
+            add_record(g12, 0x38, r);
+
+            r = t_Record();
+            r.put<float>((float)rnd_range(-800, 800));
+            r.put<float>(1.0f);
+            r.put<double>(s.range);
+            r.put<float>(2.0f);
+            r.put<BYTE>(s.sv);
+            r.put<BYTE>(0);
+            r.put<BYTE>(0);
+            r.put<BYTE>(0);
+            add_record(g12, 0x16, r);
+        }
+
+        // Channel status every 5 secs.
+        if(sec % 5 == 0)
+        {
+            r = t_Record();
+            for(k = 0; k < 12; k++)
+            {
+                r.put<BYTE>(k < nsats ? sats[k].sv : 0xff);
+                r.put<BYTE>(k < nsats ? 30 + k : 0);
+                r.put<uint16_t>(k < nsats ? 100 : 0);
+                r.put<uint16_t>(k < nsats ? 5000 : 0);
+                r.put<BYTE>(k < nsats);
+                r.put<BYTE>(0);
+            }
+            add_record(g12, 0x1A, r);
+        }
+
+        // PVT every minute.
+        if(sec % 60 == 0)
+        {
+            r = t_Record();
+            r.put<float>(650.0f);
+            r.put<float>(5.0f);
+            r.put<float>(6.0f);
+            r.put<float>(7.0f);
+            r.put<uint16_t>(3);
+            r.put<double>(tow);
+            r.put<double>(lat);
+            r.put<double>(lon);
+            r.put<float>(0.1f);
+            r.put<float>(0.2f);
+            r.put<float>(0.3f);
+            r.put<float>(50.0f);
+            r.put<uint16_t>(18);
+            r.put<uint32_t>(garmin_wdays);
+            add_record(g12, 0x33, r);
+        }
+
+        c511 += 511500 + rnd() % 7 - 3;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// READ A RECORDED G12 FILE, DROPPING A TRUNCATED LAST RECORD
+/////////////////////////////////////////////////////////////////////////////
+bool load_g12(const char *file, std::vector<BYTE> &g12)
+{
+    FILE *f = fopen(file, "rb");
+    size_t pos;
+    long len;
+
+    if(f == NULL) return false;
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    g12.resize(len);
+    if(len > 0 && fread(&g12[0], 1, len, f) != (size_t)len)
+    {
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    for(pos = 0; pos + 2 <= g12.size() && pos + 2 + g12[pos + 1] <= g12.size(); pos += 2 + g12[pos + 1]);
+    g12.resize(pos);
+
+    return true;
+}
+
+bool save_g12(const char *file, const std::vector<BYTE> &g12)
+{
+    FILE *f = fopen(file, "wb");
+    bool ok;
+
+    if(f == NULL) return false;
+    ok = g12.empty() || fwrite(&g12[0], 1, g12.size(), f) == g12.size();
+    return fclose(f) == 0 && ok;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Stages
+/////////////////////////////////////////////////////////////////////////////
+
+// Everything the stages work on, built before the clock starts.
+struct t_Input
+{
+    std::string name;
+    long secs;
+    std::vector<BYTE> g12;          // Records as stored: id, size, payload
+    std::vector<BYTE> wire;         // The same records framed and stuffed
+    std::vector<BYTE> frames;       // Unstuffed frames, back to back
+    std::vector<uint32_t> offsets;  // Start of each frame in frames
+    std::string file;               // g12 on disk, for gar2rnx
+};
+
+void prepare(t_Input &in)
+{
+    BYTE stuffed[CGarminFramer::MAX_STUFFED_BYTES];
+    size_t pos;
+
+    in.wire.clear();
+    in.frames.clear();
+    in.offsets.clear();
+
+    for(pos = 0; pos < in.g12.size(); pos += 2 + in.g12[pos + 1])
+    {
+        BYTE id = in.g12[pos], size = in.g12[pos + 1];
+        const BYTE *payload = &in.g12[pos + 2];
+        size_t n = CGarminFramer::BuildFrame(id, size, payload, stuffed);
+
+        in.wire.insert(in.wire.end(), stuffed, stuffed + n);
+
+        in.offsets.push_back((uint32_t)in.frames.size());
+        in.frames.push_back(CGarminFramer::DLE);
+        in.frames.push_back(id);
+        in.frames.push_back(size);
+        in.frames.insert(in.frames.end(), payload, payload + size);
+        in.frames.push_back(CGarminFramer::Checksum(id, size, payload));
+    }
+}
+
+void count_frame(void *pContext, const uint8_t *pFrame, size_t nBytes, bool bValid)
+{
+    (void)pFrame;
+    (void)nBytes;
+    if(bValid) ++*(unsigned long *)pContext;
+}
+
+// Deframing, as the receive thread does: spans of RECV_BLOCK_BYTES.
+double run_deframe(const t_Input &in, double &bytes)
+{
+    unsigned long good = 0;
+    CGarminFramer framer(count_frame, &good);
+    size_t pos, n;
+    double start = now_secs();
+
+    for(pos = 0; pos < in.wire.size(); pos += n)
+    {
+        n = in.wire.size() - pos;
+        if(n > RECV_BLOCK_BYTES) n = RECV_BLOCK_BYTES;
+        framer.Consume(&in.wire[pos], n);
+    }
+
+    start = now_secs() - start;
+    if(good != in.offsets.size())
+    {
+        printf("deframe: %lu of %lu frames decoded\n", good, (unsigned long)in.offsets.size());
+    }
+    mSink += good;
+    bytes = (double)in.wire.size();
+    return start;
+}
+
+double run_chksum(const t_Input &in, double &bytes)
+{
+    unsigned long good = 0;
+    size_t k;
+    double start = now_secs();
+
+    for(k = 0; k < in.offsets.size(); k++)
+    {
+        const BYTE *frame = &in.frames[in.offsets[k]];
+        good += CGarminFramer::IsValidFrame(frame, (size_t)frame[2] + 4);
+    }
+
+    start = now_secs() - start;
+    mSink += good;
+    bytes = (double)in.frames.size();
+    return start;
+}
+
+// Record by record, as the loggers write the G12 file.
+double run_write(const t_Input &in, double &bytes)
+{
+    std::string file = std::string(mTempDir) + "/garbench.g12";
+    FILE *f;
+    size_t pos;
+    double start = now_secs();
+
+    f = fopen(file.c_str(), "wb");
+    if(f == NULL)
+    {
+        printf("Can't create %s\n", file.c_str());
+        exit(1);
+    }
+    setvbuf(f, NULL, _IOFBF, OUT_BUF_BYTES);
+
+    for(pos = 0; pos < in.g12.size(); pos += 2 + in.g12[pos + 1])
+    {
+        fwrite(&in.g12[pos], 1, 2 + in.g12[pos + 1], f);
+    }
+    fclose(f);
+
+    start = now_secs() - start;
+    remove(file.c_str());
+    bytes = (double)in.g12.size();
+    return start;
+}
+
+// A whole gar2rnx conversion, the G12 file read and converted by
+// generate_rinex(), generate_nav() or collect_stats(), output to the null
+// device. The
+// capability file gar2rnx keeps is a temporary one.
+double run_convert(const t_Input &in, const char *options, double &bytes)
+{
+    char file[256], line[512], out[] = NULL_DEVICE;
+    long n;
+    double start;
+
+    snprintf(file, sizeof(file), "%s", in.file.c_str());
+    snprintf(line, sizeof(line), "-caps \"%s/garbench.caps\" %s", mTempDir, options);
+
+    start = now_secs();
+    n = convert_g12(file, line, out);
+    start = now_secs() - start;
+
+    if(n <= 0)
+    {
+        printf("gar2rnx %s: nothing written from %s\n", options, in.name.c_str());
+    }
+    mSink += n;
+    bytes = (double)in.g12.size();
+    return start;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// RUN A STAGE mReps TIMES AND KEEP THE FASTEST
+/////////////////////////////////////////////////////////////////////////////
+void bench(const char *stage, const t_Input &in, const char *options)
+{
+    t_Result &res = mResults[mNumResults];
+    double best = 0, bytes = 0;
+    int k;
+
+    if(mNumResults == MAX_RESULTS) return;
+
+    for(k = 0; k < mReps; k++)
+    {
+        double t;
+
+        if(!strcmp(stage, "deframe")) t = run_deframe(in, bytes);
+        else if(!strcmp(stage, "chksum")) t = run_chksum(in, bytes);
+        else if(!strcmp(stage, "write")) t = run_write(in, bytes);
+        else t = run_convert(in, options, bytes);
+
+        if(k == 0 || t < best) best = t;
+    }
+
+    snprintf(res.stage, sizeof(res.stage), "%s", stage);
+    snprintf(res.data, sizeof(res.data), "%s", in.name.c_str());
+    res.secs = in.secs;
+    res.bytes = bytes;
+    res.records = (double)in.offsets.size();
+    res.best = best > 1e-9 ? best : 1e-9;
+    mNumResults++;
+}
+
+void bench_input(t_Input &in)
+{
+    prepare(in);
+
+    bench("deframe", in, NULL);
+    bench("chksum", in, NULL);
+    bench("write", in, NULL);
+
+    bool temp = in.file.empty();
+
+    if(temp)
+    {
+        in.file = std::string(mTempDir) + "/garbench_in.g12";
+        if(!save_g12(in.file.c_str(), in.g12))
+        {
+            printf("Can't create %s\n", in.file.c_str());
+            exit(1);
+        }
+    }
+
+    bench("stats", in, "-stat");
+    bench("rinex", in, "");
+    bench("nav", in, "-nav");
+
+    if(temp) remove(in.file.c_str());
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Results
+/////////////////////////////////////////////////////////////////////////////
+
+#define CSV_HEADER "stage,data,data_secs,bytes,records,secs,records_per_sec,mb_per_sec,nsec_per_record"
+
+void print_result(FILE *f, const t_Result &r)
+{
+    fprintf(f, "%s,%s,%ld,%.0f,%.0f,%.6f,%.0f,%.2f,%.1f\n",
+            r.stage, r.data, r.secs, r.bytes, r.records, r.best,
+            r.records / r.best, r.bytes / r.best / 1e6,
+            r.records ? r.best * 1e9 / r.records : 0.0);
+}
+
+bool save_results(const char *file)
+{
+    FILE *f = fopen(file, "w");
+    int k;
+
+    if(f == NULL) return false;
+
+    fprintf(f, "%s\n", CSV_HEADER);
+    for(k = 0; k < mNumResults; k++) print_result(f, mResults[k]);
+
+    return fclose(f) == 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// COMPARE WITH A SAVED BASELINE, BY MB/S OF THE SAME STAGE AND DATA
+// RETURN the number of stages slower than the tolerance allows
+/////////////////////////////////////////////////////////////////////////////
+int compare_baseline(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    char line[512];
+    int slower = 0, k;
+
+    if(f == NULL)
+    {
+        printf("Can't open baseline %s\n", file);
+        return -1;
+    }
+
+    printf("\nstage,data,base_mb_per_sec,mb_per_sec,ratio,verdict\n");
+
+    while(fgets(line, sizeof(line), f))
+    {
+        char stage[16], data[64];
+        double mbps;
+
+        // Take stage, data and the 8th column (mb_per_sec).
+        if(sscanf(line, "%15[^,],%63[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%lf", stage, data, &mbps) != 3) continue;
+
+        for(k = 0; k < mNumResults; k++)
+        {
+            const t_Result &r = mResults[k];
+            double now, ratio;
+
+            if(strcmp(r.stage, stage) || strcmp(r.data, data)) continue;
+
+            now = r.bytes / r.best / 1e6;
+            ratio = mbps > 0 ? now / mbps : 1.0;
+            printf("%s,%s,%.2f,%.2f,%.3f,%s\n", stage, data, mbps, now, ratio,
+                   ratio < 1 - mTolerance ? "SLOWER" : ratio > 1 + mTolerance ? "faster" : "same");
+            if(ratio < 1 - mTolerance) slower++;
+        }
+    }
+
+    fclose(f);
+    return slower;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Main
+/////////////////////////////////////////////////////////////////////////////
+
+void show_usage()
+{
+    printf("GARBENCH %.2f: throughput of the Garmin capture pipeline\n\n", VERSION);
+    printf("Usage: GarBench [options]\n");
+    printf("  -secs n,n,...  Seconds of synthetic data (600,3600,86400)\n");
+    printf("  -file g12      Also run on a recorded G12 file\n");
+    printf("  -reps n        Runs of each stage, the fastest is kept (3)\n");
+    printf("  -tmp dir       Where the files are written (.)\n");
+    printf("  -save csv      Save the results as a baseline\n");
+    printf("  -base csv      Compare with a baseline, exit code 2 if slower\n");
+    printf("  -tol x         Slowdown allowed against the baseline (0.10)\n");
+    printf("  -out g12       Only write the first -secs of synthetic data to a file\n");
+}
+
+bool parse_args(int argc, char **argv)
+{
+    int k;
+
+    for(k = 1; k < argc; k++)
+    {
+        if(!strcmp(argv[k], "-secs") && k + 1 < argc)
+        {
+            char *p = argv[++k];
+            mSizes.clear();
+            while(*p)
+            {
+                long secs = strtol(p, &p, 10);
+                if(secs <= 0) return false;
+                mSizes.push_back(secs);
+                if(*p == ',') p++;
+                else if(*p) return false;
+            }
+        }
+        else if(!strcmp(argv[k], "-file") && k + 1 < argc) mRecordedFile = argv[++k];
+        else if(!strcmp(argv[k], "-reps") && k + 1 < argc) mReps = atoi(argv[++k]);
+        else if(!strcmp(argv[k], "-tmp") && k + 1 < argc) mTempDir = argv[++k];
+        else if(!strcmp(argv[k], "-save") && k + 1 < argc) mSaveFile = argv[++k];
+        else if(!strcmp(argv[k], "-base") && k + 1 < argc) mBaseFile = argv[++k];
+        else if(!strcmp(argv[k], "-tol") && k + 1 < argc) mTolerance = atof(argv[++k]);
+        else if(!strcmp(argv[k], "-out") && k + 1 < argc) mOutFile = argv[++k];
+        else return false;
+    }
+
+    return mReps > 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t k;
+    int slower = 0;
+
+    mSizes.push_back(600);
+    mSizes.push_back(3600);
+    mSizes.push_back(86400);
+
+    if(!parse_args(argc, argv))
+    {
+        show_usage();
+        return 1;
+    }
+
+    if(mOutFile)
+    {
+        std::vector<BYTE> g12;
+
+        synthesize(mSizes[0], g12);
+        if(!save_g12(mOutFile, g12))
+        {
+            printf("Can't write %s\n", mOutFile);
+            return 1;
+        }
+        return 0;
+    }
+
+    for(k = 0; k < mSizes.size(); k++)
+    {
+        t_Input in;
+        char name[32];
+
+        snprintf(name, sizeof(name), "synth%ld", mSizes[k]);
+        in.name = name;
+        in.secs = mSizes[k];
+        synthesize(mSizes[k], in.g12);
+        bench_input(in);
+    }
+
+    if(mRecordedFile)
+    {
+        t_Input in;
+        const char *base = strrchr(mRecordedFile, '/');
+
+        if(!load_g12(mRecordedFile, in.g12))
+        {
+            printf("Can't read %s\n", mRecordedFile);
+            return 1;
+        }
+        in.name = base ? base + 1 : mRecordedFile;
+        in.secs = 0;
+        in.file = mRecordedFile;
+        bench_input(in);
+    }
+
+    remove((std::string(mTempDir) + "/garbench.caps").c_str());
+
+    printf("%s\n", CSV_HEADER);
+    for(k = 0; k < (size_t)mNumResults; k++) print_result(stdout, mResults[k]);
+
+    if(mSaveFile && !save_results(mSaveFile))
+    {
+        printf("Can't write %s\n", mSaveFile);
+        return 1;
+    }
+
+    if(mBaseFile)
+    {
+        slower = compare_baseline(mBaseFile);
+        if(slower < 0) return 1;
+    }
+
+    return slower ? 2 : 0;
+}
@@ -23,6 +23,47 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 /****************************************************************************
 
+1.51 * RINEX observation files are generated in a single pass over the
+       input. Header info is taken from the first records (lookahead
+       window) instead of rewinding, so -rinex also works with stdin
+     * All modes share one record reader: files are memory mapped (POSIX)
+       or read in big chunks, and truncated trailing records are reported
+     * Added -index option: writes a sidecar index (g12file.idx) used to
+       go straight to the -start/-stop/-time window. -nav honours them too.
+       Its offsets are 64 bits, and the size, modification time and a
+       checksum of the first bytes of g12file tell a stale index
+     * Added -batch mode: converts many G12 files (.O and .N for each one)
+       using several threads (-j). Per file state is now thread local.
+       The .O and .N of a G12 file always get the same session number
+     * -rinex -j N splits long files in N chunks converted at the same
+       time. The output is the same as converting the file in one go
+     * Observation records are built in memory with a fixed point
+       formatter and written in one go per epoch (same output as printf)
+     * Faster D19.12 numbers in the navigation files (same output)
+     * Navigation word parity computed with one mask per parity bit
+     * Subframe fields read with 64-bit shifts, ephemeris parameters
+       of subframes 1-3 described by tables
+     * Streaming interface (gar2rnx.h): built with GAR2RNX_LIBRARY,
+       records are converted as they are pushed (used by GarminBinary).
+       Its options may quote a path holding blanks. An option missing its
+       value makes them wrong, never ends the program. convert_g12() runs
+       a whole file conversion in process (used by GarBench)
+     * Added -compress option: writes a lossless compressed copy of the
+       G12 file (G12Z), read by every mode as if it were the G12 file.
+       0x38 and 0x36 fields are stored as per satellite differences,
+       in blocks with an index for random access. Its offsets are 64
+       bits (version 2), so G12 files of 4 GB or more can be compressed
+     * Added -crx option: the observation file is written as Compact
+       RINEX 1.0 (Hatanaka) while it is generated
+     * Epoch observations kept as one array per field, with bit masks of
+       the satellites used. Records are chosen by pointer, not copied
+     * Receiver capability file (GarminCaps.txt next to the program,
+       -caps), shared with GarminBinary. The 0x38 record layout is taken
+       from it for the receiver in the 0xFF record, or told from the
+       records and saved there, so -etrex is no longer needed. Added
+       -gps12 option. Only a layout the records agree on is saved, never
+       -etrex/-gps12. Its writers take turns (a named mutex on Windows)
+
 1.50 * Bring header up to 2.11 format
      * Fix all compile warnings
 
@@ -46,14 +87,39 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 ****************************************************************************/
 
+// 64-bit off_t, fseeko and stat on 32-bit POSIX systems
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <intrin.h>
+// From <windows.h>, whose UINT and INT are not the ones of the records
+__declspec(dllimport) int __stdcall MoveFileExA(const char *from, const char *to, unsigned long flags);
+__declspec(dllimport) void* __stdcall CreateMutexA(void *attributes, int owner, const char *name);
+__declspec(dllimport) unsigned long __stdcall WaitForSingleObject(void *handle, unsigned long msecs);
+__declspec(dllimport) int __stdcall ReleaseMutex(void *handle);
+#define MOVEFILE_REPLACE_EXISTING 0x00000001
+#define INFINITE 0xFFFFFFFF
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
-#define VERSION 1.50
+#include "gar2rnx.h"
+
+#define VERSION 1.51
 
 
 #define AS_BYTE   0
@@ -75,23 +141,65 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define lambda (c/L1)   // L1 wavelength
 #define WGS84_PI 3.1415926535898
 
+#define RINEX_BUFFER 65536L     // stdio buffer of the RINEX files
+
+// File offsets are 64 bits everywhere, long is 32 bits on Windows
+#ifdef _WIN32
+#define FSEEK64 _fseeki64
+#define FTELL64 _ftelli64
+#else
+#define FSEEK64 fseeko
+#define FTELL64 ftello
+#endif
+
 
 typedef unsigned char BOOLEAN;
 typedef unsigned char BYTE;
+// Record fields are 32 bits. long is, on Windows but not on 64 bit Linux
+#ifdef _WIN32
 typedef unsigned long ULONG;
+#else
+typedef unsigned int ULONG;
+#endif
 typedef unsigned short int UINT;
 typedef short int INT;
+typedef unsigned int UINT32;
+typedef unsigned long long UINT64;
+typedef long long INT64;
+
+
+// Variables that belong to the file being converted. In batch mode
+// every thread converts its own files, so each one gets its own copy.
+// Thread local storage is used instead of a context passed down to every
+// function, which would have touched most of the conversion code. The
+// limits that come with it:
+//  - The state belongs to the thread, it can't be handed to another one.
+//    A conversion (or a stream, see gar2rnx.h) is started, carried on
+//    and finished on the same thread.
+//  - A new thread starts with the initial values, not the ones of the
+//    thread that created it. The -j chunk threads are given the ones
+//    they need by hand (chunk_thread), and anything made JOB_LOCAL that
+//    a chunk needs has to be added there.
+// Options are the same for every file and stay ordinary globals.
+#ifdef _MSC_VER
+#define JOB_LOCAL __declspec(thread)
+#else
+#define JOB_LOCAL __thread
+#endif
 
 
-BOOLEAN VC_format=1;
+JOB_LOCAL BOOLEAN VC_format=1;
 BOOLEAN STDIN=0;
 
-BOOLEAN ETREX;
+JOB_LOCAL BOOLEAN ETREX;
+BYTE LAYOUT_ARG;        // 'E' -etrex, 'G' -gps12, 0 to find it out
+char CAPS_FILE[256];
 BOOLEAN RESET_CLOCK;
 BYTE ONLY_STATS, SELECTED_SV, ONE_SAT, DIF_RECORDS;
 int SELECTED_SF,SELECTED_PAGE;
 BYTE VERBOSE,VERBOSE_NAV;
 BYTE NAV_GENERATION,MONITOR_NAV,PARSE_RECORDS,RINEX_GENERATION,VERIFY_TIME_TAGS,NO_SNR;
+BYTE BUILD_INDEX,COMPRESS,CRX;
 BYTE OPT1,RELAX;
 
 double USER_XYZ[3];
@@ -104,68 +212,37 @@ int SELECTED_RECORDS[16];
 BYTE RINEX_FILE;
 BYTE OBS_MASK,N_OBS;
 UINT INTERVAL;
-long START,LAST,ELAPSED;
+long LAST,ELAPSED;
+JOB_LOCAL long START;
 
-char DATAFILE[60];
+JOB_LOCAL char DATAFILE[256];
+JOB_LOCAL BOOLEAN PAIRED;   // A batch job, writing both the .O and the .n
+JOB_LOCAL int SESSION;      // Its session number, 0 until the first is named
 char COMMAND_LINE[256];
 char location[6];
+char nav_location[6];
 char marker[32];
 
+// Batch mode: list of files to convert and number of threads
+BOOLEAN BATCH;
+char **BATCH_FILES;
+int N_BATCH,MAX_BATCH,N_THREADS;
+long START_ARG;     // -start as given, START is modified by each job
 
-BYTE LSB[32] = { 7, 6, 5, 4, 3, 2, 1, 0,
-                 15,14,13,12,11,10, 9, 8,
-                 23,22,21,20,19,18,17,16,
-                 31,30,29,28,27,26,25,24
-               };
-
-ULONG NAV_WORD;
-
-// data bits: bits 30 -> 7 within ULONG NAV_WORD
-#define d1  ( (NAV_WORD>>29) & 1 )
-#define d2  ( (NAV_WORD>>28) & 1 )
-
-#define d3  ( (NAV_WORD>>27) & 1 )
-#define d4  ( (NAV_WORD>>26) & 1 )
-#define d5  ( (NAV_WORD>>25) & 1 )
-#define d6  ( (NAV_WORD>>24) & 1 )
-#define d7  ( (NAV_WORD>>23) & 1 )
-#define d8  ( (NAV_WORD>>22) & 1 )
-#define d9  ( (NAV_WORD>>21) & 1 )
-#define d10  ( (NAV_WORD>>20) & 1 )
-
-#define d11  ( (NAV_WORD>>19) & 1 )
-#define d12  ( (NAV_WORD>>18) & 1 )
-#define d13  ( (NAV_WORD>>17) & 1 )
-#define d14  ( (NAV_WORD>>16) & 1 )
-#define d15  ( (NAV_WORD>>15) & 1 )
-#define d16  ( (NAV_WORD>>14) & 1 )
-#define d17  ( (NAV_WORD>>13) & 1 )
-#define d18  ( (NAV_WORD>>12) & 1 )
-#define d19  ( (NAV_WORD>>11) & 1 )
-#define d20  ( (NAV_WORD>>10) & 1 )
-#define d21  ( (NAV_WORD>>9) & 1 )
-#define d22  ( (NAV_WORD>>8) & 1 )
-#define d23  ( (NAV_WORD>>7) & 1 )
-#define d24  ( (NAV_WORD>>6) & 1 )
-
-// Parity bits: bits 6 -> 1 within ULONG NAV_WORD
-#define D25  ( (NAV_WORD>>5) & 1 )
-#define D26  ( (NAV_WORD>>4) & 1 )
-#define D27  ( (NAV_WORD>>3) & 1 )
-#define D28  ( (NAV_WORD>>2) & 1 )
-#define D29  ( (NAV_WORD>>1) & 1 )
-#define D30  ( (NAV_WORD>>0) & 1 )
-
-// Previous word parity bits 29-30: bits 32 and 31 of ULONG NAV_WORD
-#define P29  ( (NAV_WORD>>31) & 1 )
-#define P30  ( (NAV_WORD>>30) & 1 )
+#ifndef NO_THREADS
+pthread_mutex_t NAME_LOCK=PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t CAPS_LOCK=PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 
 BYTE OK[3]= {1,1,1};
 BYTE RESET[30]= { 0,0,0,0,0, 0,0,0,0,0, 0,0,0,0,0, 0,0,0,0,0, 0,0,0,0,0, 0,0,0,0,0};
 
-BYTE frame[32][30];
-BOOLEAN check_frame[32][30];
+// Subframe data bits (10 words x 24 bits). The padding lets get_bits()
+// read any field with a single 64-bit load
+#define SUBFRAME_BYTES 30
+JOB_LOCAL BYTE frame[32][SUBFRAME_BYTES+8];
+JOB_LOCAL BOOLEAN check_frame[32][30];
 
 int pages[64] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,
                  16,17,18,19,20,21,22,23,24, 2, 3, 4, 5, 7, 8, 9,
@@ -236,7 +313,7 @@ type_rec0x36;
 typedef struct
 {
     ULONG c_phase;
-    long int tracked;   //BYTE  tracked; UINT cc2; BYTE flag;
+    int tracked;        //BYTE  tracked; UINT cc2; BYTE flag;
     UINT  delta_f;
     ULONG  int_phase;
     double pr;
@@ -248,36 +325,47 @@ typedef struct
 type_rec0x38;
 
 
+// Observations of an epoch, one array per field. Slot k is PRN k+1.
+// What each satellite is used for (NEVER_USED, NO_DUMP, DUMP or
+// DUMP_PHASE_ONLY) is kept in bit masks, so the satellites that go into
+// the epoch are found with a bit scan.
+
+#define MAX_SATS 32
+#define SAT_WORDS ((MAX_SATS+31)/32)
+
 typedef struct
 {
-    BYTE used;
-    UINT db;
-    double prange;
-    double phase;
-    float doppler;
-    BYTE elev;
-    long int tracked;
-    ULONG c511;
-    float last36;
+    UINT32 seen[SAT_WORDS];         // Not NEVER_USED
+    UINT32 dump[SAT_WORDS];         // DUMP or DUMP_PHASE_ONLY
+    UINT32 phase_only[SAT_WORDS];   // DUMP_PHASE_ONLY
+    UINT db[MAX_SATS];
+    double prange[MAX_SATS];
+    double phase[MAX_SATS];
+    float doppler[MAX_SATS];
+    BYTE elev[MAX_SATS];
+    long int tracked[MAX_SATS];
+    ULONG c511[MAX_SATS];
+    float last36[MAX_SATS];
 }
-rinex_obs;
+rinex_epoch;
 
 
 // Global variables used to study rates of change, etc.
 
-type_rec0x38 rec38,last38;
-float mean,sigma,mean_q;
-float phase_rate;
-float mean2=0;
-float sigma2=0;
-int n;
-int n2=0;
+JOB_LOCAL type_rec0x38 rec38,last38;
+JOB_LOCAL float mean,sigma,mean_q;
+JOB_LOCAL float phase_rate;
+JOB_LOCAL float mean2=0;
+JOB_LOCAL float sigma2=0;
+JOB_LOCAL int n;
+JOB_LOCAL int n2=0;
 
 
 // function declarations
 void llh2xyz(double*,double*);
 int get_messages(char h[32][32]);
 int show_alm();
+BOOLEAN parse_options(int argc, char **argv);
 
 
 type_rec0x11 process_0x11(BYTE *record) // Position
@@ -407,7 +495,8 @@ type_rec0x36 process_0x36(BYTE *record)
     type_rec0x36 rec;
     int i;
 
-    rec.c50=*((ULONG*)(record));
+    rec.c50=0;
+    memcpy(&rec.c50,record,4);
     for(i=0; i<4; i++) rec.uk[i]=record[4+i];
     rec.sv=record[8];
 
@@ -421,7 +510,7 @@ type_rec0x36 process_0x36(BYTE *record)
     if(VERBOSE)
     {
         printf("0x36 ----------------------------------------------------------------\n");
-        printf("PRN %02d: C (50 Hz) %8lu = TOW %8.1f ",rec.sv+1,rec.c50,rec.c50/50.0);
+        printf("PRN %02d: C (50 Hz) %8lu = TOW %8.1f ",rec.sv+1,(unsigned long)rec.c50,rec.c50/50.0);
         for(i=0; i<4; i++) printf("%02x ",rec.uk[i]);
         printf("\n");
     }
@@ -460,7 +549,7 @@ type_rec0x33 process_0x33(BYTE *record)
         printf("Pos:  (N,E,H )  (%f %f %f)  H_ellip=%.0f  FIX %dD\n",rec.pos[0]*180/WGS84_PI,rec.pos[1]*180/WGS84_PI,rec.altitud,rec.h_ellip,rec.fix);
         printf("Vel:  (N,E,Up)  (%f %f %f)  ",rec.vel[0],rec.vel[1],rec.vel[2]);
         printf("Epe  (dX,dY,dH) (%.1f %.1f %.1f)\n",rec.epe[0],rec.epe[1],rec.epe[2]);
-        printf("Wdays %ld  TOW %13.6f  Leap %d\n",rec.wdays,rec.tow,rec.leap);
+        printf("Wdays %lu  TOW %13.6f  Leap %d\n",(unsigned long)rec.wdays,rec.tow,rec.leap);
     }
 
     return rec;
@@ -491,7 +580,7 @@ void process_0x37(BYTE *record)
     if(ONE_SAT && svid!=SELECTED_SV) return;
 
     printf("0x37 ----------------------------------------------------------------\n");
-    printf("PRN %02d: PR %10.1f TOW %10.3f (c511 %10lu) CC %5d\n",svid+1,pr,tow,c511,cc);
+    printf("PRN %02d: PR %10.1f TOW %10.3f (c511 %10lu) CC %5d\n",svid+1,pr,tow,(unsigned long)c511,cc);
     printf("       Countdown %5d (%2.0f'') C1 %04x C2 %04x\n",countdown,TR,c1,c2);
     printf("       UNKNOWN: ");
     printf("%02x %02x | %02x %02x\n",unknown[0],unknown[1],unknown[2],unknown[3]);
@@ -670,7 +759,7 @@ ULONG tobin(BYTE b)
 
 type_rec0x38 process_0x38(BYTE* record)
 {
-    int nsec,doppler;
+    int nsec;
     double dt,slip,d_pr,drift,d_phase,phase;
     ULONG d_cphase,d_intphase,d_c511;
     type_rec0x38 rec;
@@ -719,7 +808,7 @@ type_rec0x38 process_0x38(BYTE* record)
 //rec38.tow=*((double*)(record+28));
 //rec38.sv=record[36];
 
-    doppler=rec38.delta_f-32768;
+    //doppler=rec38.delta_f-32768;
     phase=rec38.int_phase+(rec38.c_phase & 2047)/2048.0;
 
 
@@ -734,7 +823,7 @@ type_rec0x38 process_0x38(BYTE* record)
             printf("0x38 ----------------------------------------------------------------\n");
             printf("PRN %02d: Sgn Q %5d ",rec38.sv+1,rec38.db);
             printf("TRACKED %08x %010d -> %.3f\n",rec38.tracked,(int)rec38.tracked,(float)rec38.tracked/256.0);
-            printf("\tTOW %14.7f (Counter 0.5 Mhz = %8lu).\n",rec38.tow,rec38.c511);
+            printf("\tTOW %14.7f (Counter 0.5 Mhz = %8lu).\n",rec38.tow,(unsigned long)rec38.c511);
             printf("\tPseudoRange  %14.3f  Integrated Phase %14.3f\n",rec38.pr,phase);
 
             printf("\tDoppler(\?): %5d Hz -> %.2f m/s\n",rec38.delta_f,rec38.delta_f*lambda);
@@ -764,8 +853,8 @@ type_rec0x38 process_0x38(BYTE* record)
         if(VERBOSE)
         {
             printf("Deltas:");
-            printf(" 0.5Mhz %7ld  Clk drift: %.1f musec/sec -> (m/s) %.1f\n",d_c511,drift*1e6,drift*c);
-            printf("\tdTracked %8d\n",dtracked);
+            printf(" 0.5Mhz %7ld  Clk drift: %.1f musec/sec -> (m/s) %.1f\n",(long)(int)d_c511,drift*1e6,drift*c);
+            printf("\tdTracked %8ld\n",dtracked);
             printf("\tdPR(m) %.1f dintPhase %u  dPhase %.3f dPR(m/s) %.1f\n",d_pr,d_intphase,d_phase,d_pr/dt);
             printf("\td_PR-d_PHASE %.0f cm ",slip);
             printf("(mean %.1f, std %.1f) ",mean/n,sqrt((sigma-mean*mean/n)/n));
@@ -778,328 +867,1863 @@ type_rec0x38 process_0x38(BYTE* record)
 
 
 
-void collect_stats(FILE *org)
+//////////////////////////////////////////////////////////////////////////
+// G12 record reader. Regular files are memory mapped (POSIX) and records
+// are handed out as pointers into the mapping. stdin, pipes and Windows
+// builds read the data in big chunks instead of three freads per record.
+// Compressed (G12Z) files are decoded a block at a time into the read
+// buffer, and offsets are those of the uncompressed G12 data.
+// A record pointer is only valid until the next call to next_record().
+//////////////////////////////////////////////////////////////////////////
+
+#define MAX_RECORD 258      // id + length + 255 bytes of payload
+#define READ_CHUNK 65536L
+
+typedef struct type_g12z type_g12z;
+
+typedef struct
 {
-    BYTE id,L,record[256];
-    int k;
-    BYTE lengths[256];
-    ULONG cont[256];
-    BYTE var[256];
+    FILE *fd;
+    BYTE *data;         // mapped file or read buffer
+    size_t size;        // valid bytes in data
+    size_t pos;         // start of next record
+    INT64 base;         // file offset of data[0]
+    INT64 limit;        // stop at this file offset (0 = end of file)
+    INT64 file_size;    // -1 if unknown (stdin, pipes)
+    BOOLEAN mapped;
+    BOOLEAN eof;
+    size_t truncated;   // bytes of an incomplete trailing record
+    type_g12z *z;       // NULL unless the file is compressed
+    BYTE tail[MAX_RECORD+256];
+}
+type_reader;
 
-    for(k=0; k<256; k++) cont[k]=var[k]=0;
+void fill_reader(type_reader *rd);
+BOOLEAN open_g12z(type_reader *rd, BYTE *file, size_t size, BOOLEAN mapped);
+void fill_g12z(type_reader *rd);
+BOOLEAN seek_g12z(type_reader *rd, INT64 offset);
+void close_g12z(type_reader *rd);
+BOOLEAN is_g12z(BYTE *data, size_t size);
 
-    do
-    {
-        fread(&id,1,1,org);
-        fread(&L,1,1,org);
-        fread(record,1,L,org); //fseek(org,L,SEEK_CUR);
 
-        if((cont[id])  && (lengths[id]!=L)) var[id]=1;
-        cont[id]++;
-        lengths[id]=L;
-    }
-    while(feof(org)==0);
+BOOLEAN open_reader(type_reader *rd, FILE *fd)
+{
+#ifndef _WIN32
+    struct stat st;
+    void *map;
+#endif
 
-    if(STDIN==0) fclose(org);
+    memset(rd,0,sizeof(type_reader));
+    rd->fd=fd;
+    rd->file_size=-1;
 
+#ifndef _WIN32
+    // Not mapped if the address space can't hold it (32-bit systems)
+    if((fstat(fileno(fd),&st)==0) && S_ISREG(st.st_mode) && (st.st_size>0) && \
+            ((UINT64)st.st_size==(UINT64)(size_t)st.st_size))
+    {
+        map=mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fileno(fd),0);
+        if(map!=MAP_FAILED)
+        {
+            if(is_g12z((BYTE*)map,(size_t)st.st_size))
+                return open_g12z(rd,(BYTE*)map,(size_t)st.st_size,1);
+
+            rd->data=(BYTE*)map;
+            rd->size=(size_t)st.st_size;
+            rd->mapped=1;
+            rd->eof=1;
+            rd->file_size=(INT64)st.st_size;
+            return 1;
+        }
+    }
+#endif
 
-    for(k=0; k<256; k++)
+    if((STDIN==0) && (FSEEK64(fd,0,SEEK_END)==0))
     {
-        if(cont[k]==0) continue;
-        printf("Record 0x%02x  (%5ld) L=%3d bytes ",k,cont[k],lengths[k]);
-        if(var[k]) printf("(VAR)");
-        printf("\n");
+        rd->file_size=FTELL64(fd);
+        FSEEK64(fd,0,SEEK_SET);
     }
 
-    exit(0);
-    return;
+    // Records are read in place, so leave room for readers that look
+    // past the end of a record (zeroed bytes, never stale data)
+    rd->data=(BYTE*)calloc(READ_CHUNK+256,1);
+    if(rd->data==NULL) return 0;
+
+    // A compressed file is read whole and decoded from memory
+    fill_reader(rd);
+    if(is_g12z(rd->data,rd->size))
+    {
+        BYTE *file,*bigger;
+        size_t size,max_size,n;
+
+        size=rd->size;
+        max_size=4*READ_CHUNK;
+        file=(BYTE*)malloc(max_size);
+        if(file==NULL) return 0;
+        memcpy(file,rd->data,size);
+        while((n=fread(file+size,1,max_size-size,fd))>0)
+        {
+            size+=n;
+            if(size<max_size) continue;
+            max_size*=2;
+            bigger=(BYTE*)realloc(file,max_size);
+            if(bigger==NULL)
+            {
+                free(file);
+                return 0;
+            }
+            file=bigger;
+        }
+
+        free(rd->data);
+        rd->data=NULL;
+        rd->size=rd->pos=rd->base=0;
+        rd->eof=0;
+        return open_g12z(rd,file,size,0);
+    }
+    return 1;
 }
 
 
-void check(BYTE *record,BYTE L,BYTE type)
+// Keep at least one full record in the read buffer
+void fill_reader(type_reader *rd)
 {
-    int k,size;
+    size_t left,n;
 
+    if(rd->z)
+    {
+        fill_g12z(rd);
+        return;
+    }
 
-    switch(type)
+    left=rd->size-rd->pos;
+    if(rd->eof || (left>=MAX_RECORD)) return;
+
+    memmove(rd->data,rd->data+rd->pos,left);
+    rd->base+=rd->pos;
+    rd->pos=0;
+    do
     {
-    case AS_BYTE:
-        for(k=0; k<L; k++) printf("%02x ",record[k]);
-        printf("\n");
-        break;
-    case AS_CHAR:
-        for(k=0; k<L; k++) printf("%c",record[k]);
-        printf("\n");
-        break;
-    case AS_DOUBLE:
-        size=sizeof(double);
-        if(L<size) return;
-        for(k=0; k<=L-size; k++) printf("%3d %f\n",k,*((double*)(record+k)));
-        break;
-    case AS_FLOAT:
-        size=sizeof(float);
-        if(L<size) return;
-        for(k=0; k<=L-size; k++) printf("%3d %f\n",k,*((float*)(record+k)));
-        break;
-    case AS_ULONG:
-        size=sizeof(ULONG);
-        if(L<size) return;
-        for(k=0; k<=L-size; k++) printf("%3d %lu\n",k,*((ULONG*)(record+k)));
-        break;
-    case AS_UINT:
-        size=sizeof(UINT);
-        if(L<size) return;
-        for(k=0; k<=L-size; k++) printf("%3d %u\n",k,*((UINT*)(record+k)));
-        break;
-    default:
-        break;
+        n=fread(rd->data+left,1,READ_CHUNK-left,rd->fd);
+        left+=n;
     }
-    printf("------------------------------------------------------------------------------\n");
+    while(n && (left<MAX_RECORD));
 
+    if(n==0) rd->eof=1;
+    memset(rd->data+left,0,READ_CHUNK+256-left);
+    rd->size=left;
 }
 
 
-int found_in_list(int lista[], BYTE id)
+BOOLEAN next_record(type_reader *rd, BYTE *id, BYTE *L, BYTE **record)
 {
-    int k=0;
-    int found=0;
+    size_t left;
+    BYTE *ptr;
 
-    while(lista[k]!=-1)
+    if(!rd->mapped) fill_reader(rd);
+
+    left=rd->size-rd->pos;
+    if(left==0) return 0;
+    if(rd->limit && (rd->base+(INT64)rd->pos>=rd->limit)) return 0;
+
+    ptr=rd->data+rd->pos;
+    if((left<2) || (left<(size_t)(2+ptr[1])))
     {
-        if(lista[k]==id) found=1;
-        k++;
+        rd->truncated=left;
+        rd->pos=rd->size;
+        return 0;
     }
 
-    return found;
+    *id=ptr[0];
+    *L=ptr[1];
+    *record=ptr+2;
+
+    // Near the end of the mapping use a zero padded copy
+    if(rd->mapped && (left<MAX_RECORD+256))
+    {
+        memset(rd->tail,0,sizeof(rd->tail));
+        memcpy(rd->tail,ptr,2+ptr[1]);
+        *record=rd->tail+2;
+    }
+
+    rd->pos+=2+ptr[1];
+    return 1;
 }
 
 
-void reset_epoch(rinex_obs list[])
+// File offset of the next record
+INT64 reader_offset(type_reader *rd)
 {
-    int k;
+    return rd->base+(INT64)rd->pos;
+}
 
-    for(k=0; k<32; k++)
+
+// Continue reading at a given file offset (only for regular files)
+BOOLEAN seek_reader(type_reader *rd, INT64 offset)
+{
+    if(rd->z) return seek_g12z(rd,offset);
+
+    if(rd->mapped)
     {
-        if(list[k].used!=NEVER_USED) list[k].used=NO_DUMP;
-        list[k].doppler=-1;
+        if((offset<0) || ((UINT64)offset>rd->size)) return 0;
+        rd->pos=(size_t)offset;
+        return 1;
     }
 
+    if((STDIN==1) || (FSEEK64(rd->fd,offset,SEEK_SET)!=0)) return 0;
+    rd->base=offset;
+    rd->pos=rd->size=0;
+    rd->eof=0;
+    return 1;
 }
 
-BYTE get_q_code(UINT sgn)
+
+void close_reader(type_reader *rd)
 {
-//float temp;
-//temp=(float)sgn/2000.0 + 3.0; if (temp>9) temp=9;
-//return (BYTE)floor(temp);
+    if(rd->truncated)
+        fprintf(stderr,"Warning: %s ends with a truncated record (%lu bytes ignored)\n",\
+                DATAFILE,(unsigned long)rd->truncated);
 
-    if(sgn>=9000) return 9;
-    if(sgn>=6000) return 8;
-    if(sgn>=4000) return 7;
-    if(sgn>=2500) return 6;
-    return 5;
+    if(rd->z) close_g12z(rd);
+#ifndef _WIN32
+    else if(rd->mapped) munmap(rd->data,rd->size);
+#endif
+    else free(rd->data);
+    rd->data=NULL;
+
+    if(STDIN==0) fclose(rd->fd);
 }
 
 
 
-UINT get_uint(BYTE* ptr)
-{
-    UINT x;
+//////////////////////////////////////////////////////////////////////////
+// Compressed G12 (G12Z). "gar2rnx g12file -compress" writes g12filez,
+// which every mode reads as if it were g12file. Records are grouped in
+// blocks of G12Z_BLOCK records that can be decoded on their own, and an
+// index of the blocks (with the time tag of their first epoch) lets the
+// reader start anywhere, so -start/-stop/-time and -j N don't have to
+// decode the whole file.
+//
+// Within a block every record is id, length and payload, as in a G12
+// file, except for 0x38 and 0x36 records: their fields are stored as
+// the difference with the last record of the same satellite (or of any
+// satellite, for the fields shared by an epoch) in a variable length
+// integer. Pseudorange and integrated phase, which change smoothly, are
+// predicted from the last two records, and the pseudorange (a double)
+// as the integer of its bits, which is exact. It is lossless: the
+// decoded file is the same, byte by byte.
+//
+//   header | block 0 | block 1 | ... | block index
+//////////////////////////////////////////////////////////////////////////
 
-    x= (UINT)(*ptr++);
-    x+=256*(UINT)(*ptr);
+#define G12Z_MAGIC   "G12Z"
+#define G12Z_VERSION 2     // 1 had 32-bit offsets
+#define G12Z_BLOCK   4096   // records per block
+#define G12Z_NO_TOW  0xffffffff
 
-    return x;
+// How a field is coded
+#define ZF_RAW      0   // as is
+#define ZF_DELTA    1   // difference with the last record of the satellite
+#define ZF_DELTA2   2   // difference with the prediction from its last two
+#define ZF_EPOCH    3   // difference with the last record, any satellite
+#define ZF_XEPOCH   4   // bits changed since the last record, any satellite
+
+typedef struct
+{
+    BYTE offset;
+    BYTE size;
+    BYTE code;
 }
+type_zfield;
 
-void get_prod_id(org,description,prod,version)
-FILE *org;
-char *description;
-UINT *prod;
-float *version;
+// The satellite is the last byte of the record, and is stored first
+const type_zfield ZFIELDS_38[]=
 {
-    BYTE id,L,record[256];
-    UINT temp,k;
-    BOOLEAN bad;
+    {0,4,ZF_DELTA}, {4,4,ZF_DELTA}, {8,2,ZF_DELTA}, {10,4,ZF_DELTA2},
+    {14,8,ZF_DELTA2}, {22,4,ZF_EPOCH}, {26,2,ZF_DELTA}, {28,8,ZF_XEPOCH}, {0,0,0}
+};
+const type_zfield ZFIELDS_38_ETREX[]=
+{
+    {0,8,ZF_DELTA2}, {8,8,ZF_XEPOCH}, {16,4,ZF_DELTA}, {20,4,ZF_DELTA},
+    {24,4,ZF_DELTA2}, {28,4,ZF_EPOCH}, {32,2,ZF_DELTA}, {34,2,ZF_DELTA}, {0,0,0}
+};
+const type_zfield ZFIELDS_36[]=
+{
+    {0,4,ZF_DELTA}, {4,4,ZF_RAW}, {0,0,0}
+};
 
-    do
-    {
-        fread(&id,1,1,org);
-        fread(&L,1,1,org);
-        fread(record,1,L,org);
-        switch(id)
-        {
-        case 0xff:
-            bad=0;
-            k=4;   // Check if it is a good looking ID record
-            while(record[k++] && !bad) bad=(record[k]>=128);
-            if(!bad) // Probably  a good ff record
-            {
-                temp=get_uint(record);
-                *prod=temp;
-                temp=get_uint(record+2);
-                *version=(float)temp/100;
-                strcpy(description,record+4);
-                rewind(org);
-                return;
-            }
-            else break;
-        default  :
-            break;
-        }
-    }
-    while(feof(org)==0);
+// 64-bit fields at multiples of 8 bytes, so there is no padding that
+// depends on the compiler
+typedef struct
+{
+    char magic[4];
+    UINT32 version;
+    UINT32 etrex;       // 0x38 layout used for the fields and time tags
+    UINT32 max_block;   // bytes of the biggest decoded block
+    UINT32 n_blocks;
+    UINT32 reserved;    // 0
+    UINT64 raw_size;    // size of the G12 data
+    UINT64 index;       // file offset of the block index
+}
+type_g12z_header;
 
-    *prod=0;
-    *version=0.0;
-    strcpy(description,"Generic GPS12");
-    rewind(org);
-    return;
+typedef struct
+{
+    UINT64 offset;      // in the G12Z file
+    UINT64 raw_offset;  // in the G12 data
+    UINT32 tow;         // rounded time tag of its first epoch (G12Z_NO_TOW)
+    UINT32 check;       // FNV-1a of the decoded bytes
 }
+type_g12z_block;
 
+// Last records seen in the block, one coder per record type
+typedef struct
+{
+    BYTE length;
+    const type_zfield *fields;
+    BYTE prev[256][2][40];  // last two records of each satellite
+    BYTE newest[256];       // which of the two is the last one
+    BYTE n_prev[256];
+    int last_sv;            // satellite of the last record, -1 if none
+}
+type_zcoder;
 
-void llh2xyz(double llh[],double xyz[])
+struct type_g12z
 {
-    double a,f,a_WGS84,f_WGS84;
-    double e2,N,temp;
-    double lat,lon,h;
-    double ellip[2]= {0,0};
-//double ellip[2]={-251.0, -0.14192702};  Hayford (European)
+    BYTE *file;
+    size_t size;
+    BOOLEAN mapped;
+    type_g12z_header h;
+    type_g12z_block *block;
+    UINT32 next;            // block to decode next
+    type_zcoder c38,c36;
+};
 
-    a_WGS84=6378137;
-    f_WGS84=1/298.257223563;
-    a = a_WGS84 - ellip[0];
-    f = f_WGS84 - ellip[1]*1e-4;
 
-    e2=f*(2-f);
+BOOLEAN is_g12z(BYTE *data, size_t size)
+{
+    return (size>=sizeof(type_g12z_header)) && (memcmp(data,G12Z_MAGIC,4)==0);
+}
 
-    lat=WGS84_PI*llh[0]/180;
-    lon=WGS84_PI*llh[1]/180;
-    h=llh[2];
 
-    N=a/sqrt(1-e2*sin(lat)*sin(lat));
+void reset_zcoder(type_zcoder *zc, BYTE length, const type_zfield *fields)
+{
+    zc->length=length;
+    zc->fields=fields;
+    memset(zc->n_prev,0,sizeof(zc->n_prev));
+    zc->last_sv=-1;
+}
 
-    temp=(N+h)*cos(lat);
 
-    xyz[0]=temp*cos(lon);
-    xyz[1]=temp*sin(lon);
-    xyz[2]=(N*(1-e2)+h)*sin(lat);
+void reset_zcoders(type_g12z *z)
+{
+    reset_zcoder(&z->c38,37,(z->h.etrex)? ZFIELDS_38_ETREX:ZFIELDS_38);
+    reset_zcoder(&z->c36,9,ZFIELDS_36);
 }
 
 
-void get_wdays_and_tow_from_user_date(ULONG* wdays,ULONG* week_secs)
+type_zcoder* get_zcoder(type_g12z *z, BYTE id, BYTE L)
 {
-    UINT month,day,year,hour,min,sec;
-    int gps_week;
-    double jd,tow;
-
-    year=(UINT)USER_DATE[0];
-    month=(UINT)USER_DATE[1];
-    day=(UINT)USER_DATE[2];
-    hour=(UINT)12;
-    min=(UINT)0;
-    sec=(UINT)0;
+    if((id==0x38) && (L==z->c38.length)) return &z->c38;
+    if((id==0x36) && (L==z->c36.length)) return &z->c36;
+    return NULL;
+}
 
-    jd=julday(year,month,day,hour,min,(double)sec);
-    tow=(ULONG)gps_time(jd,&gps_week);
-    *week_secs=(ULONG)tow;
-    *wdays=(gps_week-521)*7;
 
+// Fields are 2, 4 or 8 bytes: fixed size copies, no memcpy calls
+UINT64 get_field(BYTE *record, const type_zfield *f)
+{
+    unsigned short v2;
+    UINT32 v4;
+    UINT64 v8;
 
-    if(VERBOSE)
+    switch(f->size)
     {
-        printf("%02u/%02u/%4d ",day,month,year);
-        printf("%02d:%02d:%02d -> JD %f :: ",hour,min,sec,jd);
-        printf("GPS Week %4d ToW %6.0f sec  Garmin Weekdays %d\n",gps_week,tow,*wdays);
+    case 2:
+        memcpy(&v2,record+f->offset,2);
+        return v2;
+    case 4:
+        memcpy(&v4,record+f->offset,4);
+        return v4;
     }
-
+    memcpy(&v8,record+f->offset,8);
+    return v8;
 }
 
 
-void get_aprox_location_and_wdays_and_tow(org,xyz,wdays,tow)
-FILE *org;
-double xyz[3];
-ULONG *wdays;
-ULONG *tow;
+void put_field(BYTE *record, const type_zfield *f, UINT64 v)
 {
-    BYTE id,L,record[256];
-    type_rec0x33 rec;
-    type_rec0x11 rec11;
-    type_rec0x0e rec0e;
-    int fix=0;
-    int k=0;
-    BYTE found_11,found_0e,found_33;
+    unsigned short v2=(unsigned short)v;
+    UINT32 v4=(UINT32)v;
+
+    switch(f->size)
+    {
+    case 2:
+        memcpy(record+f->offset,&v2,2);
+        return;
+    case 4:
+        memcpy(record+f->offset,&v4,4);
+        return;
+    }
+    memcpy(record+f->offset,&v,8);
+}
 
-    found_33=found_11=found_0e=0;
 
+// What the field is coded against
+UINT64 get_reference(type_zcoder *zc, BYTE sv, const type_zfield *f)
+{
+    BYTE k=zc->newest[sv];
 
-    do
+    switch(f->code)
     {
-        fread(&id,1,1,org);
-        fread(&L,1,1,org);
-        fread(record,1,L,org);
+    case ZF_EPOCH:
+    case ZF_XEPOCH:
+        if(zc->last_sv<0) return 0;
+        return get_field(zc->prev[zc->last_sv][zc->newest[zc->last_sv]],f);
+
+    case ZF_DELTA2:
+        if(zc->n_prev[sv]<2) break;
+        return 2*get_field(zc->prev[sv][k],f)-get_field(zc->prev[sv][k^1],f);
+    }
 
-        switch(id)
-        {
-        case 0x33:
-            rec=process_0x33(record);
-            k++;
-            if(k>GET_THIS) break;
-            fix=rec.fix;
+    return (zc->n_prev[sv])? get_field(zc->prev[sv][k],f):0;
+}
 
-            xyz[0]=180.0*rec.pos[0]/WGS84_PI;
-            xyz[1]=180.0*rec.pos[1]/WGS84_PI;
-            xyz[2]=rec.altitud-rec.h_ellip;
-            llh2xyz(xyz,xyz);
 
-            *wdays=rec.wdays;
-            *tow=(ULONG)floor(rec.tow+0.5);
+// The record replaces the older of the two kept for its satellite. The
+// readers leave room after every record, so 40 bytes can be copied
+void remember_record(type_zcoder *zc, BYTE *record)
+{
+    BYTE sv=record[zc->length-1];
+    BYTE k=zc->newest[sv]^1;
 
-            found_33=1;
-            break;
+    memcpy(zc->prev[sv][k],record,40);
+    zc->newest[sv]=k;
+    if(zc->n_prev[sv]<2) zc->n_prev[sv]++;
+    zc->last_sv=sv;
+}
 
-        case 0x0e:
-            rec0e=process_0x0e(record);
-            found_0e=1;
-            break;
 
-        case 0x11:
-            rec11=process_0x11(record);
-            found_11=1;
-            break;
+#define FNV_START 2166136261U
 
-        default  :
-            break;
-        }
-    }
-    while(feof(org)==0);
+UINT32 fnv_bytes(UINT32 h, BYTE *data, size_t n)
+{
+    while(n--) h=(h^*data++)*16777619U;
+    return h;
+}
 
 
-    rewind(org);
+// Variable length integers: 7 bits per byte, lowest first
+BYTE* put_varint(BYTE *ptr, UINT64 v)
+{
+    while(v>=0x80)
+    {
+        *ptr++=(BYTE)(v|0x80);
+        v>>=7;
+    }
+    *ptr++=(BYTE)v;
+    return ptr;
+}
+
 
+BYTE* get_varint(BYTE *ptr, BYTE *end, UINT64 *v)
+{
+    int shift;
 
-    if(found_33)   // Found 0x33 record
+    *v=0;
+    for(shift=0; (ptr<end) && (shift<70); shift+=7)
     {
-        //printf("Obtained date and position from 0x33 record.Fix = %d.\n",fix);
-        if(fix<3)
-        {
-            printf("Couldn't detect a 3D fix in this session\n");
-            printf("You probably won't get a useful RINEX file, but let's try it\n");
-        }
-        //return;
+        *v|=(UINT64)(*ptr&0x7f)<<shift;
+        if((*ptr++&0x80)==0) return ptr;
     }
-    else
+    return NULL;
+}
+
+
+// Codes a 0x38/0x36 record. Returns the end of the coded bytes
+BYTE* encode_zrecord(type_zcoder *zc, BYTE *record, BYTE *ptr)
+{
+    const type_zfield *f;
+    BYTE sv=record[zc->length-1];
+    UINT64 v,ref,mask;
+    long long d;
+    int bits;
+
+    *ptr++=sv;
+    for(f=zc->fields; f->size; f++)
     {
-        if(found_0e && found_11)    // Found 0x11 AND 0x0e records
+        v=get_field(record,f);
+        if(f->code==ZF_RAW)
         {
-            //printf("Using 0x0e and 0x11 records to get date & position\n");
-            for(k=0; k<3; k++) xyz[k]=rec11.llh[k];
-            llh2xyz(xyz,xyz);
-
-            *wdays=rec0e.garmin_wdays;
-            *tow=(ULONG)rec0e.tow;
-            //printf("[%f %f %f] :: %d %u\n",pos[0],pos[1],pos[2],*wdays,*tow);
+            memcpy(ptr,record+f->offset,f->size);
+            ptr+=f->size;
+            continue;
         }
-        else         // No pertinent records found
+
+        ref=get_reference(zc,sv,f);
+        if(f->code==ZF_XEPOCH)
+        {
+            ptr=put_varint(ptr,v^ref);
+            continue;
+        }
+
+        // Difference in the width of the field, then zigzag so small
+        // negative numbers are small too
+        bits=8*f->size;
+        mask= (bits==64)? ~(UINT64)0:((UINT64)1<<bits)-1;
+        d=(long long)(((v-ref)&mask)<<(64-bits))>>(64-bits);
+        ptr=put_varint(ptr,((UINT64)d<<1)^(UINT64)(d>>63));
+    }
+
+    remember_record(zc,record);
+    return ptr;
+}
+
+
+// Decodes a 0x38/0x36 record. Returns NULL if the data is damaged
+BYTE* decode_zrecord(type_zcoder *zc, BYTE *ptr, BYTE *end, BYTE *record)
+{
+    const type_zfield *f;
+    BYTE sv;
+    UINT64 v,ref,u;
+
+    if(ptr>=end) return NULL;
+    sv=*ptr++;
+    record[zc->length-1]=sv;
+
+    for(f=zc->fields; f->size; f++)
+    {
+        if(f->code==ZF_RAW)
+        {
+            if(ptr+f->size>end) return NULL;
+            memcpy(record+f->offset,ptr,f->size);
+            ptr+=f->size;
+            continue;
+        }
+
+        ptr=get_varint(ptr,end,&u);
+        if(ptr==NULL) return NULL;
+
+        ref=get_reference(zc,sv,f);
+        if(f->code==ZF_XEPOCH) v=u^ref;
+        else v=ref+((u>>1)^(~(u&1)+1));
+        put_field(record,f,v);
+    }
+
+    remember_record(zc,record);
+    return ptr;
+}
+
+
+// Decodes block k into the read buffer
+BOOLEAN decode_block(type_reader *rd, UINT32 k)
+{
+    type_g12z *z=rd->z;
+    type_zcoder *zc;
+    BYTE *ptr,*end,*out,*out_end;
+    UINT64 raw_end;
+
+    raw_end= (k+1<z->h.n_blocks)? z->block[k+1].raw_offset:z->h.raw_size;
+    ptr=z->file+z->block[k].offset;
+    end=z->file+((k+1<z->h.n_blocks)? z->block[k+1].offset:z->h.index);
+    out=rd->data;
+    out_end=out+(size_t)(raw_end-z->block[k].raw_offset);
+
+    reset_zcoders(z);
+    while((ptr+2<=end) && (out+2<=out_end))
+    {
+        out[0]=ptr[0];
+        out[1]=ptr[1];
+        if(out+2+out[1]>out_end) break;
+
+        zc=get_zcoder(z,ptr[0],ptr[1]);
+        if(zc) ptr=decode_zrecord(zc,ptr+2,end,out+2);
+        else if(ptr+2+ptr[1]<=end)
+        {
+            memcpy(out+2,ptr+2,ptr[1]);
+            ptr+=2+ptr[1];
+        }
+        else ptr=NULL;
+        if(ptr==NULL) break;
+
+        out+=2+out[1];
+    }
+
+    rd->base=z->block[k].raw_offset;
+    rd->pos=0;
+    rd->size=out-rd->data;
+    memset(rd->data+rd->size,0,256);
+    z->next=k+1;
+
+    if((ptr!=end) || (out!=out_end) || (fnv_bytes(FNV_START,rd->data,out-rd->data)!=z->block[k].check))
+    {
+        fprintf(stderr,"Warning: %s: block %lu is damaged, skipped\n",DATAFILE,(unsigned long)k);
+        rd->size=0;
+        return 0;
+    }
+    return 1;
+}
+
+
+BOOLEAN open_g12z(type_reader *rd, BYTE *file, size_t size, BOOLEAN mapped)
+{
+    type_g12z *z;
+    type_g12z_header *h;
+    UINT32 k;
+
+    z=(type_g12z*)calloc(1,sizeof(type_g12z));
+    if(z==NULL) return 0;
+    z->file=file;
+    z->size=size;
+    z->mapped=mapped;
+    rd->z=z;
+
+    h=&z->h;
+    memcpy(h,file,sizeof(type_g12z_header));
+    if(h->version==1)
+    {
+        fprintf(stderr,"%s was written by an older gar2rnx, compress the G12 file again\n",DATAFILE);
+        h->n_blocks=0;
+    }
+    else if((h->version!=G12Z_VERSION) || (h->index>size) || \
+            ((size-h->index)/sizeof(type_g12z_block)<h->n_blocks))
+    {
+        fprintf(stderr,"%s is not a valid G12Z file\n",DATAFILE);
+        h->n_blocks=0;
+    }
+    if(h->n_blocks==0) h->max_block=h->raw_size=h->index=0;
+
+    z->block=(type_g12z_block*)malloc((h->n_blocks+1)*sizeof(type_g12z_block));
+    rd->data=(BYTE*)calloc(h->max_block+256,1);
+    if((z->block==NULL) || (rd->data==NULL)) return 0;
+    memcpy(z->block,file+h->index,h->n_blocks*sizeof(type_g12z_block));
+
+    // Don't trust offsets that point outside the file
+    for(k=0; k<h->n_blocks; k++)
+        if((z->block[k].offset>h->index) || (z->block[k].raw_offset>h->raw_size) || \
+                ((k>0) && ((z->block[k].offset<z->block[k-1].offset) || \
+                           (z->block[k].raw_offset<z->block[k-1].raw_offset) || \
+                           (z->block[k].raw_offset-z->block[k-1].raw_offset>h->max_block))))
+        {
+            fprintf(stderr,"%s is not a valid G12Z file\n",DATAFILE);
+            h->n_blocks=0;
+        }
+
+    rd->file_size=(INT64)h->raw_size;
+    rd->size=rd->pos=rd->base=0;
+    rd->eof=(h->n_blocks==0);
+    rd->mapped=0;
+    return 1;
+}
+
+
+// Next block, when the current one has been read
+void fill_g12z(type_reader *rd)
+{
+    while(!rd->eof && (rd->pos==rd->size))
+    {
+        if(rd->z->next>=rd->z->h.n_blocks)
+        {
+            rd->base+=rd->size;
+            rd->pos=rd->size=0;
+            rd->eof=1;
+            return;
+        }
+        decode_block(rd,rd->z->next);
+    }
+}
+
+
+// Offsets are those of the G12 data, at a record boundary
+BOOLEAN seek_g12z(type_reader *rd, INT64 offset)
+{
+    type_g12z *z=rd->z;
+    UINT32 lo,hi,mid;
+
+    if((offset<0) || (offset>(INT64)z->h.raw_size)) return 0;
+
+    rd->eof=0;
+    if((z->h.n_blocks==0) || (offset==(INT64)z->h.raw_size))
+    {
+        rd->base=z->h.raw_size;
+        rd->pos=rd->size=0;
+        rd->eof=1;
+        return 1;
+    }
+
+    // Last block that starts at or before offset
+    lo=0;
+    hi=z->h.n_blocks-1;
+    while(lo<hi)
+    {
+        mid=(lo+hi+1)/2;
+        if(z->block[mid].raw_offset<=(UINT64)offset) lo=mid;
+        else hi=mid-1;
+    }
+
+    if(decode_block(rd,lo)==0) fill_g12z(rd);
+    else rd->pos=(size_t)(offset-rd->base);
+    return 1;
+}
+
+
+void close_g12z(type_reader *rd)
+{
+    type_g12z *z=rd->z;
+
+#ifndef _WIN32
+    if(z->mapped) munmap(z->file,z->size);
+    else
+#endif
+        free(z->file);
+    free(z->block);
+    free(z);
+    rd->z=NULL;
+    free(rd->data);
+}
+
+
+// Use the block index of a compressed file to skip the records before
+// the -start/-stop/-time window (when there is no g12file.idx)
+void seek_blocks(type_reader *rd, long warmup, long slack)
+{
+    type_g12z *z=rd->z;
+    long k,first,end,start_k,stop_k,tow;
+
+    if((z==NULL) || (z->h.etrex!=ETREX)) return;
+
+    first=START;
+    if(first==-1)
+        for(k=0; (k<(long)z->h.n_blocks) && (first==-1); k++)
+            if(z->block[k].tow!=G12Z_NO_TOW) first=(long)z->block[k].tow;
+    if(first==-1) return;
+    end= (first+ELAPSED<LAST)? first+ELAPSED:LAST;
+
+    // Start at the last block that begins before the warmup, and stop at
+    // the second block that begins after the window
+    start_k=0;
+    stop_k=-1;
+    for(k=0; k<(long)z->h.n_blocks; k++)
+    {
+        if(z->block[k].tow==G12Z_NO_TOW) continue;
+        tow=(long)z->block[k].tow;
+        if(tow<first-warmup) start_k=k;
+        if((tow>end+slack) && (stop_k==-1)) stop_k=k+1;
+    }
+
+    if((START!=-1) && ((INT64)z->block[start_k].raw_offset>reader_offset(rd)))
+        seek_reader(rd,(INT64)z->block[start_k].raw_offset);
+    if((stop_k!=-1) && (stop_k<(long)z->h.n_blocks)) rd->limit=(INT64)z->block[stop_k].raw_offset;
+}
+
+
+void get_compressed_name(char *name)
+{
+    sprintf(name,"%sz",DATAFILE);
+}
+
+
+// Writes g12filez, then reads it back and compares it with g12file
+void compress_g12(type_reader *rd)
+{
+    type_g12z z;
+    type_g12z_block *block;
+    BYTE id,L,*record,*buffer,*ptr,*raw,*back;
+    type_zcoder *zc;
+    type_reader zrd;
+    UINT32 n_records,n_blocks,max_blocks,check,k;
+    UINT64 zsize,raw_start,offset;
+    BOOLEAN more;
+    double tow;
+    FILE *fd;
+    char name[300];
+
+    if(rd->z)
+    {
+        printf("%s is already compressed\n",DATAFILE);
+        exit(0);
+    }
+    if(STDIN)
+    {
+        printf("Only a file can be compressed\n");
+        exit(0);
+    }
+
+    get_compressed_name(name);
+    fd=fopen(name,"wb+");
+    if(fd==NULL)
+    {
+        printf("Cannot create %s\n",name);
+        exit(0);
+    }
+
+    memset(&z,0,sizeof(type_g12z));
+    memcpy(z.h.magic,G12Z_MAGIC,4);
+    z.h.version=G12Z_VERSION;
+    z.h.etrex=ETREX;
+    fwrite(&z.h,sizeof(type_g12z_header),1,fd);
+    zsize=sizeof(type_g12z_header);
+
+    // A coded record is never longer than 2 bytes per byte of the original
+    buffer=(BYTE*)malloc(G12Z_BLOCK*2*MAX_RECORD);
+    block=NULL;
+    n_records=n_blocks=max_blocks=0;
+    raw_start=0;
+    ptr=buffer;
+
+    do
+    {
+        offset=(UINT64)reader_offset(rd);
+        more=next_record(rd,&id,&L,&record);
+
+        // Close the block
+        if((n_records==G12Z_BLOCK) || (!more && n_records))
+        {
+            fwrite(buffer,1,ptr-buffer,fd);
+            zsize+=(UINT64)(ptr-buffer);
+            if(offset-raw_start>z.h.max_block) z.h.max_block=(UINT32)(offset-raw_start);
+            n_records=0;
+            ptr=buffer;
+        }
+        if(!more) break;
+
+        // Open a new one
+        if(n_records==0)
+        {
+            if(n_blocks==max_blocks)
+            {
+                max_blocks= (max_blocks)? 2*max_blocks:256;
+                block=(type_g12z_block*)realloc(block,max_blocks*sizeof(type_g12z_block));
+            }
+            raw_start=offset;
+            block[n_blocks].offset=zsize;
+            block[n_blocks].raw_offset=raw_start;
+            block[n_blocks].tow=G12Z_NO_TOW;
+            block[n_blocks].check=FNV_START;
+            n_blocks++;
+            reset_zcoders(&z);
+        }
+
+        if((id==0x38) && (L==37) && (record[36]<32) && (block[n_blocks-1].tow==G12Z_NO_TOW))
+        {
+            memcpy(&tow,record+((ETREX)? 8:28),8);
+            if((tow>=0) && (tow<G12Z_NO_TOW)) block[n_blocks-1].tow=(UINT32)floor(tow+0.5);
+        }
+
+        check=fnv_bytes(block[n_blocks-1].check,&id,1);
+        check=fnv_bytes(check,&L,1);
+        block[n_blocks-1].check=fnv_bytes(check,record,L);
+
+        *ptr++=id;
+        *ptr++=L;
+        zc=get_zcoder(&z,id,L);
+        if(zc) ptr=encode_zrecord(zc,record,ptr);
+        else
+        {
+            memcpy(ptr,record,L);
+            ptr+=L;
+        }
+        n_records++;
+    }
+    while(more);
+
+    z.h.raw_size=offset;
+    z.h.n_blocks=n_blocks;
+    z.h.index=zsize;
+    fwrite(block,sizeof(type_g12z_block),n_blocks,fd);
+    fseek(fd,0,SEEK_SET);
+    fwrite(&z.h,sizeof(type_g12z_header),1,fd);
+    free(buffer);
+    free(block);
+    close_reader(rd);
+
+    if(ferror(fd) | fclose(fd))
+    {
+        printf("Cannot write %s\n",name);
+        remove(name);
+        exit(0);
+    }
+
+    // Read both back: every record must be the same
+    fd=fopen(DATAFILE,"rb");
+    if((fd==NULL) || (open_reader(rd,fd)==0))
+    {
+        printf("Cannot read %s again to check %s\n",DATAFILE,name);
+        exit(0);
+    }
+    fd=fopen(name,"rb");
+    if((fd==NULL) || (open_reader(&zrd,fd)==0) || (zrd.z==NULL))
+    {
+        printf("Cannot read %s to check it\n",name);
+        exit(0);
+    }
+
+    raw=back=NULL;
+    k=0;
+    while(next_record(rd,&id,&L,&raw))
+    {
+        BYTE id2,L2;
+
+        if(!next_record(&zrd,&id2,&L2,&back) || (id!=id2) || (L!=L2) || memcmp(raw,back,L))
+        {
+            printf("%s: record %lu differs from %s. Not compressed\n",name,(unsigned long)k,DATAFILE);
+            close_reader(&zrd);
+            remove(name);
+            exit(0);
+        }
+        k++;
+    }
+    if(next_record(&zrd,&id,&L,&back))
+    {
+        printf("%s has more records than %s. Not compressed\n",name,DATAFILE);
+        close_reader(&zrd);
+        remove(name);
+        exit(0);
+    }
+    close_reader(&zrd);
+    close_reader(rd);
+
+    printf("%s: %lu records in %lu blocks, %.0f bytes (%.1f%% of %.0f)\n",name,(unsigned long)k,\
+           (unsigned long)n_blocks,(double)(z.h.index+n_blocks*sizeof(type_g12z_block)),\
+           100.0*(z.h.index+n_blocks*sizeof(type_g12z_block))/((z.h.raw_size)? z.h.raw_size:1),\
+           (double)z.h.raw_size);
+    exit(0);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// G12 index. "gar2rnx g12file -index" writes the sidecar file g12file.idx
+// with the file offset of every epoch (first 0x38 record with a new time
+// tag) and the offset range of every record type. When it is present
+// (and matches the size, modification time and first bytes of g12file),
+// -start/-stop/-time jump straight to the requested window instead of
+// scanning the whole file.
+//////////////////////////////////////////////////////////////////////////
+
+#define INDEX_MAGIC   "G12X"
+#define INDEX_VERSION 2
+#define INDEX_CHECK   4096  // first bytes of g12file in the checksum
+#define INDEX_WARMUP  10    // seconds read before -start (last 0x36 per sat)
+#define NAV_WARMUP    30    // a whole frame is read before -start with -nav
+
+typedef struct
+{
+    UINT32 tow;         // rounded time tag of the epoch
+    UINT64 offset;      // file offset of its first 0x38 record
+}
+type_index_entry;
+
+typedef struct
+{
+    char magic[4];
+    UINT32 version;
+    UINT64 file_size;
+    UINT64 mtime;       // when g12file was last modified
+    UINT32 check;       // checksum of its first INDEX_CHECK bytes
+    UINT32 etrex;       // 0x38 layout used to read the time tags
+    UINT32 n_epochs;
+    UINT32 count[256];  // records of each type
+    UINT64 first[256];  // offset of the first and last record of each type
+    UINT64 last[256];
+    BYTE length[256];
+    BYTE var[256];      // length not constant
+}
+type_index_header;
+
+typedef struct
+{
+    type_index_header h;
+    type_index_entry *epoch;
+}
+type_index;
+
+
+void get_index_name(char *name)
+{
+    sprintf(name,"%s.idx",DATAFILE);
+}
+
+
+// What, besides the size, tells whether g12file changed since it was
+// indexed: a file logged again for as long has the same size.
+void get_index_stamp(UINT64 *mtime, UINT32 *check)
+{
+#ifdef _WIN32
+    struct _stati64 st;     // stat fails on files of 2 GB or more
+#else
+    struct stat st;
+#endif
+    BYTE buffer[INDEX_CHECK];
+    FILE *fd;
+    size_t n,k;
+    UINT32 h=2166136261U;   // FNV-1a
+
+#ifdef _WIN32
+    *mtime= (_stati64(DATAFILE,&st)==0)? (UINT64)st.st_mtime:0;
+#else
+    *mtime= (stat(DATAFILE,&st)==0)? (UINT64)st.st_mtime:0;
+#endif
+
+    n=0;
+    fd=fopen(DATAFILE,"rb");
+    if(fd!=NULL)
+    {
+        n=fread(buffer,1,sizeof(buffer),fd);
+        fclose(fd);
+    }
+    for(k=0; k<n; k++) h=(h^buffer[k])*16777619U;
+    *check=h;
+}
+
+
+void build_index(type_reader *rd)
+{
+    type_index ix;
+    BYTE id,L,*record;
+    type_rec0x38 rec;
+    double current_tow=0;
+    INT64 offset;
+    long max_epochs=0;
+    FILE *fd;
+    char name[300];
+
+    if(rd->file_size<0)
+    {
+        printf("An index can only be built for a regular file\n");
+        exit(0);
+    }
+
+    memset(&ix.h,0,sizeof(type_index_header));
+    memcpy(ix.h.magic,INDEX_MAGIC,4);
+    ix.h.version=INDEX_VERSION;
+    ix.h.file_size=(UINT64)rd->file_size;
+    get_index_stamp(&ix.h.mtime,&ix.h.check);
+    ix.h.etrex=ETREX;
+    ix.epoch=NULL;
+
+    while(offset=reader_offset(rd), next_record(rd,&id,&L,&record))
+    {
+        if((ix.h.count[id]) && (ix.h.length[id]!=L)) ix.h.var[id]=1;
+        if(ix.h.count[id]==0) ix.h.first[id]=(UINT64)offset;
+        ix.h.last[id]=(UINT64)offset;
+        ix.h.length[id]=L;
+        ix.h.count[id]++;
+
+        if(id!=0x38) continue;
+
+        // Same epoch boundaries as generate_rinex()
+        rec=process_0x38(record);
+        if(rec.sv>=32) continue;
+        if((ix.h.n_epochs) && (rec.tow==current_tow)) continue;
+        current_tow=rec.tow;
+
+        if((long)ix.h.n_epochs==max_epochs)
+        {
+            max_epochs=(max_epochs)? 2*max_epochs:4096;
+            ix.epoch=(type_index_entry*)realloc(ix.epoch,max_epochs*sizeof(type_index_entry));
+        }
+        memset(&ix.epoch[ix.h.n_epochs],0,sizeof(type_index_entry));
+        ix.epoch[ix.h.n_epochs].tow=(UINT32)floor(rec.tow+0.5);
+        ix.epoch[ix.h.n_epochs].offset=(UINT64)offset;
+        ix.h.n_epochs++;
+    }
+    close_reader(rd);
+
+    get_index_name(name);
+    fd=fopen(name,"wb");
+    if(fd==NULL)
+    {
+        printf("Cannot create %s\n",name);
+        exit(0);
+    }
+    fwrite(&ix.h,sizeof(type_index_header),1,fd);
+    fwrite(ix.epoch,sizeof(type_index_entry),ix.h.n_epochs,fd);
+    fclose(fd);
+
+    printf("%s: %lu epochs indexed\n",name,(unsigned long)ix.h.n_epochs);
+    free(ix.epoch);
+    exit(0);
+}
+
+
+// Load the index of the current file. Returns 0 if there is none
+// or it doesn't belong to this file.
+BOOLEAN load_index(type_index *ix, type_reader *rd)
+{
+    FILE *fd;
+    char name[300];
+    BOOLEAN ok;
+    UINT64 mtime;
+    UINT32 check;
+
+    ix->epoch=NULL;
+    if(rd->file_size<0) return 0;
+
+    get_index_name(name);
+    fd=fopen(name,"rb");
+    if(fd==NULL) return 0;
+
+    ok= (fread(&ix->h,sizeof(type_index_header),1,fd)==1) && \
+        (memcmp(ix->h.magic,INDEX_MAGIC,4)==0) && (ix->h.version==INDEX_VERSION) && \
+        (ix->h.file_size==(UINT64)rd->file_size) && (ix->h.etrex==ETREX);
+
+    if(ok)
+    {
+        get_index_stamp(&mtime,&check);
+        ok=(ix->h.mtime==mtime) && (ix->h.check==check);
+    }
+
+    if(ok)
+    {
+        ix->epoch=(type_index_entry*)malloc((ix->h.n_epochs+1)*sizeof(type_index_entry));
+        ok= (ix->epoch!=NULL) && \
+            (fread(ix->epoch,sizeof(type_index_entry),ix->h.n_epochs,fd)==ix->h.n_epochs);
+        if(!ok) free(ix->epoch);
+    }
+
+    fclose(fd);
+    return ok;
+}
+
+
+// Use the index (if any) to skip the records before the -start/-stop/-time
+// window. Reading starts "warmup" seconds before the window, and stops
+// after the epoch that closes the last one in the window ("slack" extra
+// seconds are kept for records logged later than their time tag).
+void seek_window(type_reader *rd, long warmup, long slack)
+{
+    type_index ix;
+    long k,first,end,start_k,last_k;
+
+    if((START==-1) && (LAST>604800) && (ELAPSED>604800)) return;
+    if(load_index(&ix,rd)==0)
+    {
+        seek_blocks(rd,warmup,slack);
+        return;
+    }
+    if(ix.h.n_epochs==0)
+    {
+        free(ix.epoch);
+        return;
+    }
+
+    first= (START==-1)? (long)ix.epoch[0].tow:START;
+    end= (first+ELAPSED<LAST)? first+ELAPSED:LAST;
+
+    start_k=-1;
+    last_k=-1;
+    for(k=0; k<(long)ix.h.n_epochs; k++)
+    {
+        if((start_k==-1) && ((long)ix.epoch[k].tow>=first-warmup)) start_k=k;
+        if(((long)ix.epoch[k].tow>=first-warmup) && ((long)ix.epoch[k].tow<=end+slack)) last_k=k;
+    }
+
+    if(start_k==-1) seek_reader(rd,rd->file_size);     // Nothing in the window
+    else
+    {
+        // Records before epoch start_k were logged before epoch start_k-1 ended
+        if((START!=-1) && (start_k>0) && ((INT64)ix.epoch[start_k].offset>reader_offset(rd)))
+            seek_reader(rd,(INT64)ix.epoch[start_k].offset);
+        if(last_k+2<(long)ix.h.n_epochs) rd->limit=(INT64)ix.epoch[last_k+2].offset;
+    }
+
+    free(ix.epoch);
+}
+
+
+
+// Writes the count and length of each record type to out. Returns the
+// number of records
+long collect_stats(type_reader *rd, FILE *out)
+{
+    BYTE id,L,*record;
+    int k;
+    long n;
+    BYTE lengths[256];
+    ULONG cont[256];
+    BYTE var[256];
+    type_index ix;
+
+    for(k=0; k<256; k++) cont[k]=var[k]=0;
+
+    if(load_index(&ix,rd))   // Already counted
+    {
+        for(k=0; k<256; k++)
+        {
+            cont[k]=ix.h.count[k];
+            lengths[k]=ix.h.length[k];
+            var[k]=ix.h.var[k];
+        }
+        free(ix.epoch);
+    }
+    else while(next_record(rd,&id,&L,&record))
+        {
+            if((cont[id])  && (lengths[id]!=L)) var[id]=1;
+            cont[id]++;
+            lengths[id]=L;
+        }
+
+    close_reader(rd);
+
+
+    n=0;
+    for(k=0; k<256; k++)
+    {
+        if(cont[k]==0) continue;
+        fprintf(out,"Record 0x%02x  (%5lu) L=%3d bytes ",k,(unsigned long)cont[k],lengths[k]);
+        if(var[k]) fprintf(out,"(VAR)");
+        fprintf(out,"\n");
+        n+=cont[k];
+    }
+
+    return n;
+}
+
+
+void check(BYTE *record,BYTE L,BYTE type)
+{
+    int k,size;
+
+
+    switch(type)
+    {
+    case AS_BYTE:
+        for(k=0; k<L; k++) printf("%02x ",record[k]);
+        printf("\n");
+        break;
+    case AS_CHAR:
+        for(k=0; k<L; k++) printf("%c",record[k]);
+        printf("\n");
+        break;
+    case AS_DOUBLE:
+        size=sizeof(double);
+        if(L<size) return;
+        for(k=0; k<=L-size; k++) printf("%3d %f\n",k,*((double*)(record+k)));
+        break;
+    case AS_FLOAT:
+        size=sizeof(float);
+        if(L<size) return;
+        for(k=0; k<=L-size; k++) printf("%3d %f\n",k,*((float*)(record+k)));
+        break;
+    case AS_ULONG:
+        size=sizeof(ULONG);
+        if(L<size) return;
+        for(k=0; k<=L-size; k++) printf("%3d %lu\n",k,(unsigned long)*((ULONG*)(record+k)));
+        break;
+    case AS_UINT:
+        size=sizeof(UINT);
+        if(L<size) return;
+        for(k=0; k<=L-size; k++) printf("%3d %u\n",k,*((UINT*)(record+k)));
+        break;
+    default:
+        break;
+    }
+    printf("------------------------------------------------------------------------------\n");
+
+}
+
+
+int found_in_list(int lista[], BYTE id)
+{
+    int k=0;
+    int found=0;
+
+    while(lista[k]!=-1)
+    {
+        if(lista[k]==id) found=1;
+        k++;
+    }
+
+    return found;
+}
+
+
+#define SAT_BIT(k) (1U<<((k)&31))
+#define SAT_WORD(k) ((k)>>5)
+
+
+// Index of the lowest bit set in mask (not 0)
+int lowest_bit(UINT32 mask)
+{
+#if defined(_MSC_VER)
+    unsigned long k;
+
+    _BitScanForward(&k,mask);
+    return (int)k;
+#elif defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int k;
+
+    for(k=0; (mask&1)==0; k++) mask>>=1;
+    return k;
+#endif
+}
+
+
+// First satellite from k on in the mask, -1 if none
+int next_sat(UINT32 mask[], int k)
+{
+    int w;
+    UINT32 m;
+
+    if(k>=MAX_SATS) return -1;
+    w=SAT_WORD(k);
+    m=mask[w]&~(SAT_BIT(k)-1);
+    while(m==0)
+    {
+        if(++w==SAT_WORDS) return -1;
+        m=mask[w];
+    }
+    return 32*w+lowest_bit(m);
+}
+
+
+int count_sats(UINT32 mask[])
+{
+    int w,n;
+    UINT32 m;
+
+    for(w=0,n=0; w<SAT_WORDS; w++)
+        for(m=mask[w]; m; m&=m-1) n++;
+    return n;
+}
+
+
+BYTE sat_used(rinex_epoch *epoch, int k)
+{
+    UINT32 bit=SAT_BIT(k);
+    int w=SAT_WORD(k);
+
+    if(epoch->phase_only[w]&bit) return DUMP_PHASE_ONLY;
+    if(epoch->dump[w]&bit) return DUMP;
+    return (epoch->seen[w]&bit)? NO_DUMP:NEVER_USED;
+}
+
+
+void set_sat_used(rinex_epoch *epoch, int k, int used)
+{
+    UINT32 bit=SAT_BIT(k);
+    int w=SAT_WORD(k);
+
+    epoch->seen[w]&=~bit;
+    epoch->dump[w]&=~bit;
+    epoch->phase_only[w]&=~bit;
+    if(used!=NEVER_USED) epoch->seen[w]|=bit;
+    if(used>=DUMP) epoch->dump[w]|=bit;
+    if(used==DUMP_PHASE_ONLY) epoch->phase_only[w]|=bit;
+}
+
+
+// Every satellite seen goes to NO_DUMP
+void reset_epoch(rinex_epoch *epoch)
+{
+    int k;
+
+    memset(epoch->dump,0,sizeof(epoch->dump));
+    memset(epoch->phase_only,0,sizeof(epoch->phase_only));
+    for(k=0; k<MAX_SATS; k++) epoch->doppler[k]=-1;
+}
+
+BYTE get_q_code(UINT sgn)
+{
+//float temp;
+//temp=(float)sgn/2000.0 + 3.0; if (temp>9) temp=9;
+//return (BYTE)floor(temp);
+
+    if(sgn>=9000) return 9;
+    if(sgn>=6000) return 8;
+    if(sgn>=4000) return 7;
+    if(sgn>=2500) return 6;
+    return 5;
+}
+
+
+
+UINT get_uint(BYTE* ptr)
+{
+    UINT x;
+
+    x= (UINT)(*ptr++);
+    x+=256*(UINT)(*ptr);
+
+    return x;
+}
+
+void llh2xyz(double llh[],double xyz[])
+{
+    double a,f,a_WGS84,f_WGS84;
+    double e2,N,temp;
+    double lat,lon,h;
+    double ellip[2]= {0,0};
+//double ellip[2]={-251.0, -0.14192702};  Hayford (European)
+
+    a_WGS84=6378137;
+    f_WGS84=1/298.257223563;
+    a = a_WGS84 - ellip[0];
+    f = f_WGS84 - ellip[1]*1e-4;
+
+    e2=f*(2-f);
+
+    lat=WGS84_PI*llh[0]/180;
+    lon=WGS84_PI*llh[1]/180;
+    h=llh[2];
+
+    N=a/sqrt(1-e2*sin(lat)*sin(lat));
+
+    temp=(N+h)*cos(lat);
+
+    xyz[0]=temp*cos(lon);
+    xyz[1]=temp*sin(lon);
+    xyz[2]=(N*(1-e2)+h)*sin(lat);
+}
+
+
+void get_wdays_and_tow_from_user_date(ULONG* wdays,ULONG* week_secs)
+{
+    UINT month,day,year,hour,min,sec;
+    int gps_week;
+    double jd,tow;
+
+    year=(UINT)USER_DATE[0];
+    month=(UINT)USER_DATE[1];
+    day=(UINT)USER_DATE[2];
+    hour=(UINT)12;
+    min=(UINT)0;
+    sec=(UINT)0;
+
+    jd=julday(year,month,day,hour,min,(double)sec);
+    tow=(ULONG)gps_time(jd,&gps_week);
+    *week_secs=(ULONG)tow;
+    *wdays=(gps_week-521)*7;
+
+
+    if(VERBOSE)
+    {
+        printf("%02u/%02u/%4d ",day,month,year);
+        printf("%02d:%02d:%02d -> JD %f :: ",hour,min,sec,jd);
+        printf("GPS Week %4d ToW %6.0f sec  Garmin Weekdays %d\n",gps_week,tow,*wdays);
+    }
+
+}
+
+
+// Receiver capability file (see gar2rnx.h)
+
+#define CAPS_TITLE "# Garmin receiver capabilities, see gar2rnx.h\n"\
+                   "# product version layout baud async quirks\n"
+
+void reset_caps(type_caps *caps, unsigned int prod, unsigned int version)
+{
+    memset(caps,0,sizeof(type_caps));
+    caps->prod=prod;
+    caps->version=version;
+    caps->layout='?';
+    strcpy(caps->quirks,"-");
+}
+
+
+// Returns 0 for comments and lines that don't make sense
+BOOLEAN parse_caps(char *line, type_caps *caps)
+{
+    char version[16],layout[8];
+
+    reset_caps(caps,0,0);
+    if(sscanf(line,"%u %15s %7s %lu %x %63s",&caps->prod,version,layout,\
+              &caps->baud,&caps->async,caps->quirks)!=6) return 0;
+
+    caps->version= (strcmp(version,"*")==0)? 0:(unsigned int)floor(atof(version)*100+0.5);
+    caps->layout= ((layout[0]=='E') || (layout[0]=='G'))? layout[0]:'?';
+    return 1;
+}
+
+
+void put_caps(FILE *fd, const type_caps *caps)
+{
+    char version[16];
+
+    if(caps->version) sprintf(version,"%u.%02u",caps->version/100,caps->version%100);
+    else strcpy(version,"*");
+
+    fprintf(fd,"%u %s %c %lu 0x%04X %s\n",caps->prod,version,caps->layout,\
+            caps->baud,caps->async,(caps->quirks[0])? caps->quirks:"-");
+}
+
+
+int caps_find(const char *file, unsigned int prod, unsigned int version, type_caps *caps)
+{
+    FILE *fd;
+    char line[256];
+    type_caps entry;
+    BOOLEAN found;
+
+    reset_caps(caps,prod,version);
+    fd=fopen(file,"r");
+    if(fd==NULL) return 0;
+
+    found=0;
+    while(fgets(line,sizeof(line),fd))
+    {
+        if((parse_caps(line,&entry)==0) || (entry.prod!=prod)) continue;
+        if((entry.version==version) || (entry.version==0))
+        {
+            *caps=entry;
+            found=1;
+            if(entry.version==version) break;
+        }
+    }
+    fclose(fd);
+
+    return found;
+}
+
+
+// Writers of the capability file take turns. On Windows a named mutex
+// also covers builds without threads (GarminBinary writes it from its
+// UI thread and from the conversion on its G12 writer thread) and the
+// other programs using the file.
+#ifdef _WIN32
+void *CAPS_MUTEX;
+#endif
+
+void caps_lock(void)
+{
+#ifdef _WIN32
+    if(CAPS_MUTEX==NULL) CAPS_MUTEX=CreateMutexA(NULL,0,"Local\\GarminCapsFile");
+    if(CAPS_MUTEX!=NULL) WaitForSingleObject(CAPS_MUTEX,INFINITE);
+#endif
+#ifndef NO_THREADS
+    pthread_mutex_lock(&CAPS_LOCK);
+#endif
+}
+
+
+void caps_unlock(void)
+{
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&CAPS_LOCK);
+#endif
+#ifdef _WIN32
+    if(CAPS_MUTEX!=NULL) ReleaseMutex(CAPS_MUTEX);
+#endif
+}
+
+
+// The file is written again under another name and then renamed over
+// it in one step, so a program reading it never sees half of it or none.
+// The line is read and merged under the lock, so the fields another
+// writer stored meanwhile are kept.
+int caps_store(const char *file, const type_caps *caps, unsigned int fields)
+{
+    FILE *in,*out;
+    char line[256],temp[300];
+    type_caps entry,other;
+    BOOLEAN done;
+    int ok;
+
+    if(strlen(file)+5>sizeof(temp)) return 0;
+    sprintf(temp,"%s.tmp",file);
+
+    caps_lock();
+
+    // The line of this version, else the one of any version, else a new one
+    caps_find(file,caps->prod,caps->version,&entry);
+    entry.version=caps->version;
+    if(fields&CAPS_LAYOUT) entry.layout=caps->layout;
+    if(fields&CAPS_BAUD) entry.baud=caps->baud;
+    if(fields&CAPS_ASYNC) entry.async=caps->async;
+    if(fields&CAPS_QUIRKS) strcpy(entry.quirks,caps->quirks);
+
+    done=0;
+    out=fopen(temp,"w");
+    if(out!=NULL)
+    {
+        in=fopen(file,"r");
+        if(in==NULL) fputs(CAPS_TITLE,out);
+        else
+        {
+            while(fgets(line,sizeof(line),in))
+            {
+                if(parse_caps(line,&other) && (other.prod==caps->prod) && (other.version==caps->version))
+                {
+                    if(!done) put_caps(out,&entry);
+                    done=1;
+                }
+                else fputs(line,out);
+            }
+            fclose(in);
+        }
+        if(!done) put_caps(out,&entry);
+    }
+
+    ok= (out!=NULL) && (ferror(out)==0);
+    if(out!=NULL) ok=(fclose(out)==0) && ok;
+    if(ok)
+    {
+#ifdef _WIN32
+        ok=(MoveFileExA(temp,file,MOVEFILE_REPLACE_EXISTING)!=0);
+#else
+        ok=(rename(temp,file)==0);
+#endif
+    }
+    if(!ok) remove(temp);
+    caps_unlock();
+
+    return ok;
+}
+
+
+// Header information (receiver ID, approximate position and date)
+// gathered from the records found at the start of a session
+
+#define LOOKAHEAD 1048576L   // Max bytes kept in memory while looking for it
+#define LAYOUT_RECORDS 64    // 0x38 records looked at to tell their layout
+#define LAYOUT_VOTES 3       // Records that must agree on it
+
+typedef struct
+{
+    BOOLEAN found_ff,found_33,found_0e,found_11;
+    int n_33,fix;
+    UINT prod,sw;
+    float version;
+    char layout;        // From the capability file, 0 if not there
+    int n_38,votes_e,votes_g;
+    char description[256];
+    double xyz[3];
+    ULONG wdays,tow;
+    type_rec0x11 rec11;
+    type_rec0x0e rec0e;
+}
+type_header_info;
+
+
+void reset_header_info(type_header_info *info)
+{
+    memset(info,0,sizeof(type_header_info));
+    strcpy(info->description,"Generic GPS12");
+}
+
+
+// A pseudorange and time of week that make sense
+BOOLEAN good_pr_tow(BYTE *pr, BYTE *tow)
+{
+    double range,t;
+
+    memcpy(&range,pr,8);
+    memcpy(&t,tow,8);
+
+    return (range>1.0e7) && (range<5.0e7) && (t>=0) && (t<604800.0);
+}
+
+
+// The pseudorange and time of week of a 0x38 record are doubles, at 0
+// and 8 (eTrex) or at 14 and 28 (GPS 12), and read at the wrong offsets
+// they don't make sense. Returns 'E', 'G' or 0 if it can't tell
+char guess_layout(BYTE *record)
+{
+    BOOLEAN e,g;
+
+    e=good_pr_tow(record,record+8);
+    g=good_pr_tow(record+14,record+28);
+
+    return (e==g)? 0:(e)? 'E':'G';
+}
+
+
+// Layout the 0x38 records looked at agree on, 0 if none yet
+char seen_layout(type_header_info *info)
+{
+    if((info->votes_e>=LAYOUT_VOTES) && (info->votes_g==0)) return 'E';
+    if((info->votes_g>=LAYOUT_VOTES) && (info->votes_e==0)) return 'G';
+    return 0;
+}
+
+
+// A layout given or from the capability file still waits for a few
+// records, so records that disagree with it are noticed
+BOOLEAN layout_known(type_header_info *info)
+{
+    return seen_layout(info) || (info->n_38>=LAYOUT_RECORDS) ||
+           ((LAYOUT_ARG || info->layout) && (info->n_38>=LAYOUT_VOTES));
+}
+
+
+// The receiver ID (and its layout in the capability file) and the
+// layout the 0x38 records look like
+void collect_layout_info(type_header_info *info, BYTE id, BYTE *record)
+{
+    type_caps caps;
+    UINT k;
+    BOOLEAN bad;
+
+    if((id==0xff) && (info->found_ff==0))
+    {
+        bad=0;
+        k=4;   // Check if it is a good looking ID record
+        while(record[k++] && !bad) bad=(record[k]>=128);
+        if(!bad) // Probably  a good ff record
+        {
+            info->prod=get_uint(record);
+            info->sw=get_uint(record+2);
+            info->version=(float)info->sw/100;
+            strcpy(info->description,(char*)record+4);
+            info->found_ff=1;
+
+            if(caps_find(CAPS_FILE,info->prod,info->sw,&caps) && (caps.layout!='?'))
+                info->layout=caps.layout;
+        }
+    }
+    else if((id==0x38) && (info->n_38<LAYOUT_RECORDS))
+    {
+        info->n_38++;
+        switch(guess_layout(record))
+        {
+        case 'E':
+            info->votes_e++;
+            break;
+        case 'G':
+            info->votes_g++;
+            break;
+        }
+    }
+}
+
+
+// Picks the 0x38 record layout: the one given in the command line, else
+// the one the records look like, else the one in the capability file for
+// this receiver (GPS 12 if none tells). Only a layout the records agree
+// on is saved in the capability file, for the next session of this
+// receiver, so a wrong -etrex or -gps12 is not kept. Only the
+// conversions save it (save), the other modes just read the file
+void resolve_layout(type_header_info *info, BOOLEAN save)
+{
+    type_caps caps;
+    char layout,seen;
+
+    seen=seen_layout(info);
+    layout= (LAYOUT_ARG)? LAYOUT_ARG:(seen)? seen:info->layout;
+    ETREX=(layout=='E');
+
+    if(LAYOUT_ARG && seen && (seen!=LAYOUT_ARG))
+        fprintf(stderr,"%s: the 0x38 records look like %s ones, not as given\n",\
+                DATAFILE,(seen=='E')? "eTrex":"GPS 12");
+
+    if((save==0) || (seen==0) || (seen==info->layout) || (info->found_ff==0)) return;
+
+    reset_caps(&caps,info->prod,info->sw);
+    caps.layout=seen;
+    if(caps_store(CAPS_FILE,&caps,CAPS_LAYOUT))
+        fprintf(stderr,"%s: %s record layout saved for product %u v%.2f\n",\
+                CAPS_FILE,(seen=='E')? "eTrex":"GPS 12",info->prod,info->version);
+}
+
+
+void collect_header_info(type_header_info *info, BYTE id, BYTE *record)
+{
+    type_rec0x33 rec;
+
+    collect_layout_info(info,id,record);
+
+    switch(id)
+    {
+    case 0x33:
+        rec=process_0x33(record);
+        info->n_33++;
+        if(info->n_33>GET_THIS) break;
+        info->fix=rec.fix;
+
+        info->xyz[0]=180.0*rec.pos[0]/WGS84_PI;
+        info->xyz[1]=180.0*rec.pos[1]/WGS84_PI;
+        info->xyz[2]=rec.altitud-rec.h_ellip;
+        llh2xyz(info->xyz,info->xyz);
+
+        info->wdays=rec.wdays;
+        info->tow=(ULONG)floor(rec.tow+0.5);
+
+        info->found_33=1;
+        break;
+
+    case 0x0e:
+        info->rec0e=process_0x0e(record);
+        info->found_0e=1;
+        break;
+
+    case 0x11:
+        info->rec11=process_0x11(record);
+        info->found_11=1;
+        break;
+
+    default  :
+        break;
+    }
+}
+
+
+// Nothing else to wait for: ID record and the selected 0x33 record seen,
+// and the record layout known
+BOOLEAN header_info_complete(type_header_info *info)
+{
+    return (info->found_ff && (info->n_33>=GET_THIS) && layout_known(info));
+}
+
+
+// For the modes that don't gather the header info: reads the first
+// records of a file to find the layout, then goes back to the start
+void find_layout(type_reader *rd)
+{
+    type_header_info info;
+    BYTE id,L,*record;
+    long used;
+
+    if((rd->z!=NULL) && (LAYOUT_ARG==0))
+    {
+        ETREX=rd->z->h.etrex;     // As it was compressed
+        return;
+    }
+    if(STDIN) return;
+
+    reset_header_info(&info);
+    used=0;
+    while(next_record(rd,&id,&L,&record) && ((used+=2+L)<=LOOKAHEAD))
+    {
+        collect_layout_info(&info,id,record);
+        if(info.found_ff && layout_known(&info)) break;
+    }
+
+    resolve_layout(&info,NAV_GENERATION);
+    rd->truncated=0;
+    seek_reader(rd,0);
+}
+
+
+BOOLEAN resolve_header_info(type_header_info *info)
+{
+    int k;
+
+    resolve_layout(info,1);
+
+    if(info->found_33)   // Found 0x33 record
+    {
+        //printf("Obtained date and position from 0x33 record.Fix = %d.\n",fix);
+        if(info->fix<3)
+        {
+            printf("Couldn't detect a 3D fix in this session\n");
+            printf("You probably won't get a useful RINEX file, but let's try it\n");
+        }
+    }
+    else
+    {
+        if(info->found_0e && info->found_11)    // Found 0x11 AND 0x0e records
+        {
+            //printf("Using 0x0e and 0x11 records to get date & position\n");
+            for(k=0; k<3; k++) info->xyz[k]=info->rec11.llh[k];
+            llh2xyz(info->xyz,info->xyz);
+
+            info->wdays=info->rec0e.garmin_wdays;
+            info->tow=(ULONG)info->rec0e.tow;
+        }
+        else         // No pertinent records found
         {
             if((GIVEN_DATE==0) || (GIVEN_XYZ==0))
             {
@@ -1109,22 +2733,20 @@ ULONG *tow;
                 printf("(using the -date DD MM YYYY option) AND your approximate position\n");
                 printf("(using the -llh or -xyz options) in the command line\n");
                 printf("-------------------------------------------------------------------------\n");
-                printf("Exiting now\n");
-                exit(0);
+                return 0;
             }
         }
     }
 
 
-
 // If position or date were provided in the command line
 // they are always used with preference to those found
 
-    if(GIVEN_XYZ) for(k=0; k<3; k++) xyz[k]=USER_XYZ[k];
-
-    if(GIVEN_DATE) get_wdays_and_tow_from_user_date(wdays,tow);
+    if(GIVEN_XYZ) for(k=0; k<3; k++) info->xyz[k]=USER_XYZ[k];
 
+    if(GIVEN_DATE) get_wdays_and_tow_from_user_date(&info->wdays,&info->tow);
 
+    return 1;
 }
 
 
@@ -1136,7 +2758,6 @@ void get_current_date(ULONG wdays,double tow,struct tm *gmt)
 {
     time_t week_start,current;
     ULONG seconds;
-    struct tm *qq;
 
     ULONG TIME_START=631065600L;  // Difference beetween GPS time and UNIX time
 
@@ -1144,8 +2765,11 @@ void get_current_date(ULONG wdays,double tow,struct tm *gmt)
 
     week_start=TIME_START+wdays*24*3600L;
     current=week_start+seconds;
-    qq=gmtime(&current);
-    *gmt=*qq;
+#ifdef _WIN32
+    *gmt=*gmtime(&current);     // Per thread buffer in the MS runtime
+#else
+    gmtime_r(&current,gmt);
+#endif
 
 }
 
@@ -1166,19 +2790,350 @@ char *padd(char *in, char *out, int maxL)
 
 
 
-void generate_rinex_header(xyz,wdays,first_obs,prod_id,version,description,fd)
+
+////////////////////////////////////////////////////
+// Compact RINEX (Hatanaka's CRINEX 1.0, as written by rnx2crx for
+// RINEX 2). The text of the observation file goes through crx_put() and
+// is encoded a line at a time, so crx2rnx gives back the same text:
+//  - Two CRINEX lines, then the RINEX header as it is.
+//  - Epoch line (without the padding of the satellite list): the
+//    characters that changed since the previous one (blank if the same,
+//    '&' for a new blank). The first one is written whole, starting '&'.
+//  - Receiver clock offset line: always empty.
+//  - One line per satellite: every observable as an integer (in 0.001)
+//    difference of order 3 along its arc. "3&value" starts an arc and an
+//    empty field means no data. Then the changes in the LLI/SSI flags.
+
+#define CRX_ORDER 3
+#define CRX_TYPES 9
+#define CRX_SATS 64
+
+typedef struct
+{
+    char id[4];
+    BOOLEAN seen;           // In the current epoch
+    int order[CRX_TYPES];   // Of the last difference written (0: no arc)
+    long long y[CRX_TYPES],d1[CRX_TYPES],d2[CRX_TYPES];
+    char flags[2*CRX_TYPES+1];
+}
+type_crx_sat;
+
+typedef struct
+{
+    BOOLEAN crinex,header,started;
+    int n_types;
+    char epoch[32+CRX_SATS*3+1];    // As crx2rnx keeps it
+    int epoch_len;
+    type_crx_sat sat[CRX_SATS];
+    int current[CRX_SATS];          // Satellites of the epoch, in order
+    int n_current,next;
+    char line[8192];                // Partial line
+    int used;
+    char out[32768];
+    int n_out;
+}
+type_crx;
+
+
+type_crx* crx_open(void)
+{
+    type_crx *crx;
+
+    crx=(type_crx*)calloc(1,sizeof(type_crx));
+    if(crx!=NULL) crx->header=1;
+    return crx;
+}
+
+
+// Characters of s (n) that differ from those of old: blank if the same,
+// '&' for a new blank. Returns the length without the trailing blanks
+int crx_diff(char *out, char *old, int n_old, char *s, int n)
+{
+    int k,L;
+
+    for(k=0,L=0; k<n; k++)
+    {
+        if((k<n_old) && (s[k]==old[k])) out[k]=' ';
+        else out[k]= (s[k]==' ')? '&':s[k];
+        if(out[k]!=' ') L=k+1;
+    }
+    return L;
+}
+
+
+char *crx_number(char *ptr, long long n)
+{
+    char digits[24];
+    unsigned long long u;
+    int k;
+
+    if(n<0) *ptr++='-';
+    u= (n<0)? 0-(unsigned long long)n:(unsigned long long)n;
+
+    k=0;
+    do
+    {
+        digits[k++]=(char)('0'+u%10);
+        u/=10;
+    }
+    while(u);
+    while(k>0) *ptr++=digits[--k];
+
+    return ptr;
+}
+
+
+// Epoch line: only "yy mm dd hh mm ss.sssssss  f nn" and the satellites
+// of the first line go in (gar2rnx never writes continuation lines)
+void crx_epoch(type_crx *crx, char *line, int L)
+{
+    char now[sizeof(crx->epoch)];
+    int k,i,n,n_sats;
+    char *id,*ptr;
+    type_crx_sat *sv;
+
+    n_sats= (L>=32)? atoi(line+29):0;
+    if(n_sats>CRX_SATS) n_sats=CRX_SATS;
+    if(L>32+3*n_sats) L=32+3*n_sats;
+    memcpy(now,line,L);
+    for(n=L; n<32+3*n_sats; n++) now[n]=' ';
+
+    // Arcs go on for the satellites of the previous epoch only
+    for(i=0; i<CRX_SATS; i++) crx->sat[i].seen=0;
+    for(k=0; k<n_sats; k++)
+    {
+        id=now+32+3*k;
+        for(i=0; i<CRX_SATS; i++)
+            if(!crx->sat[i].seen && (memcmp(crx->sat[i].id,id,3)==0)) break;
+        crx->current[k]=i;
+        if(i<CRX_SATS) crx->sat[i].seen=1;
+    }
+    for(i=0; i<CRX_SATS; i++) if(!crx->sat[i].seen)
+        {
+            memset(crx->sat[i].order,0,sizeof(crx->sat[i].order));
+            crx->sat[i].flags[0]=0;
+            crx->sat[i].id[0]=0;
+        }
+    for(k=0; k<n_sats; k++) if(crx->current[k]==CRX_SATS)
+        {
+            for(i=0; crx->sat[i].seen; i++);
+            sv=&crx->sat[i];
+            memcpy(sv->id,now+32+3*k,3);
+            sv->seen=1;
+            crx->current[k]=i;
+        }
+    crx->n_current=n_sats;
+    crx->next=0;
+
+    ptr=crx->out+crx->n_out;
+    if(crx->started)
+    {
+        ptr+=crx_diff(ptr,crx->epoch,crx->epoch_len,now,n);
+    }
+    else
+    {
+        *ptr++='&';
+        memcpy(ptr,now+1,n-1);
+        ptr+=n-1;
+        crx->started=1;
+    }
+    *ptr++='\n';
+    *ptr++='\n';    // No clock offset
+    crx->n_out=ptr-crx->out;
+
+    // What crx2rnx has after applying the changes
+    memcpy(crx->epoch,now,n);
+    if(n>crx->epoch_len) crx->epoch_len=n;
+}
+
+
+// Observation line of the next satellite in the epoch: "%14.3f%c%c" per
+// observable, blank or missing for no data
+void crx_obs(type_crx *crx, char *line, int L)
+{
+    type_crx_sat *sv;
+    char flags[2*CRX_TYPES],*ptr,*field;
+    long long v,d1,d2;
+    int j,k,minus;
+
+    sv=&crx->sat[crx->current[crx->next++]];
+    ptr=crx->out+crx->n_out;
+
+    for(j=0; j<crx->n_types; j++)
+    {
+        field=line+16*j;
+        for(k=0; (k<14) && (16*j+k<L) && (field[k]==' '); k++);
+        flags[2*j]= (16*j+14<L)? field[14]:' ';
+        flags[2*j+1]= (16*j+15<L)? field[15]:' ';
+
+        if((k==14) || (16*j+k>=L))  // No data: the arc ends
+        {
+            sv->order[j]=0;
+            *ptr++=' ';
+            continue;
+        }
+
+        v=0;
+        minus=0;
+        for(; (k<14) && (16*j+k<L); k++)
+        {
+            if((field[k]>='0') && (field[k]<='9')) v=10*v+(field[k]-'0');
+            else if(field[k]=='-') minus=1;
+        }
+        if(minus) v=-v;
+
+        switch(sv->order[j])
+        {
+        case 0:
+            *ptr++='0'+CRX_ORDER;
+            *ptr++='&';
+            ptr=crx_number(ptr,v);
+            break;
+        case 1:
+            d1=v-sv->y[j];
+            ptr=crx_number(ptr,d1);
+            sv->d1[j]=d1;
+            break;
+        case 2:
+            d1=v-sv->y[j];
+            ptr=crx_number(ptr,d1-sv->d1[j]);
+            sv->d2[j]=d1-sv->d1[j];
+            sv->d1[j]=d1;
+            break;
+        default:
+            d1=v-sv->y[j];
+            d2=d1-sv->d1[j];
+            ptr=crx_number(ptr,d2-sv->d2[j]);
+            sv->d2[j]=d2;
+            sv->d1[j]=d1;
+            break;
+        }
+        sv->y[j]=v;
+        if(sv->order[j]<CRX_ORDER) sv->order[j]++;
+        *ptr++=' ';
+    }
+
+    ptr+=crx_diff(ptr,sv->flags,(int)strlen(sv->flags),flags,2*crx->n_types);
+    memcpy(sv->flags,flags,2*crx->n_types);
+    sv->flags[2*crx->n_types]=0;
+
+    *ptr++='\n';
+    crx->n_out=ptr-crx->out;
+}
+
+
+void crx_line(type_crx *crx, char *line, int L)
+{
+    time_t tt;
+    struct tm gmt;
+    char date[32],prog[32];
+    int n;
+
+    if(crx->header)
+    {
+        if(!crx->crinex)
+        {
+            time(&tt);
+#ifdef _WIN32
+            gmt=*gmtime(&tt);
+#else
+            gmtime_r(&tt,&gmt);
+#endif
+            strftime(date,sizeof(date),"%d-%b-%y %H:%M",&gmt);
+            sprintf(prog,"gar2rnx %4.2f",VERSION);
+            crx->n_out+=sprintf(crx->out+crx->n_out,"%-20s%-40s%-20s\n",\
+                                "1.0","COMPACT RINEX FORMAT","CRINEX VERS   / TYPE");
+            crx->n_out+=sprintf(crx->out+crx->n_out,"%-40s%-20s%-20s\n",\
+                                prog,date,"CRINEX PROG / DATE");
+            crx->crinex=1;
+        }
+
+        memcpy(crx->out+crx->n_out,line,L);
+        crx->n_out+=L;
+        crx->out[crx->n_out++]='\n';
+
+        if((L>=79) && (strncmp(line+60,"# / TYPES OF OBSERV",19)==0))
+        {
+            n=atoi(line);
+            crx->n_types= (n<CRX_TYPES)? n:CRX_TYPES;
+        }
+        if((L>=73) && (strncmp(line+60,"END OF HEADER",13)==0)) crx->header=0;
+    }
+    else if(crx->next<crx->n_current) crx_obs(crx,line,L);
+    else crx_epoch(crx,line,L);
+}
+
+
+// Encodes the text (any number of lines, the last one may be partial)
+void crx_put(type_crx *crx, char *text, size_t n, FILE *fd)
+{
+    char *end,*nl;
+    int L;
+
+    for(end=text+n; text<end; text=nl+1)
+    {
+        nl=(char*)memchr(text,'\n',end-text);
+        if(nl==NULL)    // Waits for the rest of the line
+        {
+            L=end-text;
+            if(crx->used+L>(int)sizeof(crx->line)) L=sizeof(crx->line)-crx->used;
+            memcpy(crx->line+crx->used,text,L);
+            crx->used+=L;
+            break;
+        }
+
+        if(crx->used)
+        {
+            L=nl-text;
+            if(crx->used+L>(int)sizeof(crx->line)) L=sizeof(crx->line)-crx->used;
+            memcpy(crx->line+crx->used,text,L);
+            crx_line(crx,crx->line,crx->used+L);
+            crx->used=0;
+        }
+        else crx_line(crx,text,nl-text);
+
+        if(crx->n_out>(int)sizeof(crx->out)-4096)
+        {
+            fwrite(crx->out,1,crx->n_out,fd);
+            crx->n_out=0;
+        }
+    }
+
+    fwrite(crx->out,1,crx->n_out,fd);
+    crx->n_out=0;
+}
+
+
+void crx_close(type_crx *crx, FILE *fd)
+{
+    if(crx->used) crx_put(crx,"\n",1,fd);
+    free(crx);
+}
+
+
+// Observation file text, encoded if it is Compact RINEX
+void put_rinex(char *text, size_t n, FILE *fd, type_crx *crx)
+{
+    if(crx!=NULL) crx_put(crx,text,n,fd);
+    else fwrite(text,1,n,fd);
+}
+
+
+
+void generate_rinex_header(xyz,wdays,first_obs,prod_id,version,description,fd,crx)
 double xyz[],first_obs;
 float version;
 ULONG wdays;
 UINT prod_id;
 char *description;
 FILE *fd;
+type_crx *crx;
 {
     BYTE mask;
     int k,l,lines,written,max_lines,nchars;
     char *header,*ptr;
     time_t tt;
-    char *date,buffer[80];
+    char *date,buffer[81],now[32];
     struct tm gmt;
     double dt,secs;
     char obs[3][3]= {"C1", "L1", "D1"};
@@ -1205,7 +3160,11 @@ FILE *fd;
     written=sprintf(ptr,padd("Garmin Owner",buffer,20));
     ptr+=written;
     time(&tt);
+#ifdef _WIN32
     date=ctime(&tt);
+#else
+    date=ctime_r(&tt,now);
+#endif
     written=sprintf(ptr,padd(date,buffer,20));
     ptr+=written;
     written=sprintf(ptr,"PGM / RUN BY / DATE ");
@@ -1224,7 +3183,7 @@ FILE *fd;
     written=sprintf(ptr,"COMMENT             ");
     ptr+=written;
 
-    sprintf(buffer,"** Generated from G12 data file: %s ",DATAFILE);
+    sprintf(buffer,"** Generated from G12 data file: %.40s ",DATAFILE);
     padd(buffer,buffer,60);
     written=sprintf(ptr,"%s",buffer);
     ptr+=written;
@@ -1234,7 +3193,7 @@ FILE *fd;
 
     written=sprintf(ptr,"** Options: ");
     ptr+=written;
-    written=sprintf(ptr,padd(COMMAND_LINE,buffer,60-written));
+    written=sprintf(ptr,"%s",padd(COMMAND_LINE,buffer,60-written));
     ptr+=written;
     written=sprintf(ptr,"COMMENT             ");
     ptr+=written;
@@ -1347,8 +3306,12 @@ FILE *fd;
     lines=nchars/80;
 // printf("Number of chars %d -> lines %d\n",nchars,lines);
 
-    for(l=0; l<lines; l++,fprintf(fd,"\n"))
-        for(k=0; k<80; k++)  fprintf(fd,"%c",header[l*80+k]);
+    for(l=0; l<lines; l++)
+    {
+        memcpy(buffer,header+l*80,80);
+        buffer[80]='\n';
+        put_rinex(buffer,81,fd,crx);
+    }
 
     free((char*)header);
 }
@@ -1356,20 +3319,94 @@ FILE *fd;
 
 
 ////////////////////////////////////////////////////
+// Fixed width fields of the observation records, written straight into
+// the line being built. Same output as printf("%*.*f") / printf("%0*d"),
+// without going through the format parser for every number.
+
+double POW10[23]= {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,
+                   1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+                  };
+
+char *put_fixed(char *ptr,double a,int width,int decimals)
+{
+    char digits[24];
+    double x,err,d;
+    unsigned long long N;
+    int k,L;
+
+    // Rounds |a|*10^decimals to the nearest integer using its exact value
+    // (x+err). An exact tie (or a number too big) is left to the library,
+    // which is the one that knows how it breaks ties.
+    x=fabs(a)*POW10[decimals];
+    if(!(x<1e15)) return ptr+sprintf(ptr,"%*.*f",width,decimals,a);
+    err=fma(fabs(a),POW10[decimals],-x);
+    N=(unsigned long long)x;
+    d=((x-(double)N)-0.5)+err;
+    if(d==0) return ptr+sprintf(ptr,"%*.*f",width,decimals,a);
+    if(d>0) N++;
+
+    k=0;
+    do
+    {
+        digits[k++]=(char)('0'+N%10);
+        N/=10;
+    }
+    while(N || (k<=decimals));
+
+    L=k+(decimals>0)+(signbit(a)? 1:0);
+    for(; L<width; width--) *ptr++=' ';
+    if(signbit(a)) *ptr++='-';
+    while(k>decimals) *ptr++=digits[--k];
+    if(decimals) *ptr++='.';
+    while(k>0) *ptr++=digits[--k];
+
+    return ptr;
+}
+
+
+// Non negative integers only
+char *put_int(char *ptr,long n,int width,char fill)
+{
+    char digits[24];
+    int k;
+
+    if(n<0) return ptr+sprintf(ptr,(fill=='0')? "%0*ld":"%*ld",width,n);
+
+    k=0;
+    do
+    {
+        digits[k++]=(char)('0'+n%10);
+        n/=10;
+    }
+    while(n);
+
+    for(; k<width; width--) *ptr++=fill;
+    while(k>0) *ptr++=digits[--k];
+
+    return ptr;
+}
+
+
+char *put_chars(char *ptr,char ch,int n)
+{
+    for(; n>0; n--) *ptr++=ch;
+    return ptr;
+}
 
 
-void print_rinex_info(ULONG wdays, double tow,rinex_obs epoch[],FILE *fd)
+void print_rinex_info(ULONG wdays, double tow,rinex_epoch *epoch,FILE *fd,type_crx *crx)
 {
     int k,N_used;
     double frac,phase,pr;
     int snr;
     struct tm gmt;
+    char line[8192],*ptr;
 
     double dt;
 
 // printf("TOW %.0f Start %d Last %d\n",tow,START,START+ELAPSED);
 
-    for(k=0,N_used=0; k<32; k++) if(epoch[k].used>=DUMP) N_used++;
+    N_used=count_sats(epoch->dump);
 
     if(N_used)
     {
@@ -1382,62 +3419,99 @@ void print_rinex_info(ULONG wdays, double tow,rinex_obs epoch[],FILE *fd)
 
         get_current_date(wdays,tow-dt,&gmt);
         frac=(tow-dt)-floor(tow-dt);
-        fprintf(fd," %02d %02d",(1900+gmt.tm_year)%100,gmt.tm_mon+1);
-        fprintf(fd," %02d %02d %02d",gmt.tm_mday,gmt.tm_hour,gmt.tm_min);
-        fprintf(fd,"%11.7f",(double)gmt.tm_sec+frac);
-        //fprintf(fd,"%11.7f",(double)gmt.tm_sec+frac,32,32);
 
-        fprintf(fd,"%3d%3d",0,N_used);
-        for(k=0; k<32; k++) if(epoch[k].used>=DUMP) fprintf(fd,"G%02d",k+1);
-        for(k=0; k<12-N_used; k++) fprintf(fd,"%3c",32);
+        // " %02d %02d %02d %02d %02d%11.7f%3d%3d"
+        ptr=line;
+        *ptr++=' ';
+        ptr=put_int(ptr,(1900+gmt.tm_year)%100,2,'0');
+        *ptr++=' ';
+        ptr=put_int(ptr,gmt.tm_mon+1,2,'0');
+        *ptr++=' ';
+        ptr=put_int(ptr,gmt.tm_mday,2,'0');
+        *ptr++=' ';
+        ptr=put_int(ptr,gmt.tm_hour,2,'0');
+        *ptr++=' ';
+        ptr=put_int(ptr,gmt.tm_min,2,'0');
+        ptr=put_fixed(ptr,(double)gmt.tm_sec+frac,11,7);
+
+        ptr=put_int(ptr,0,3,' ');
+        ptr=put_int(ptr,N_used,3,' ');
+        for(k=next_sat(epoch->dump,0); k>=0; k=next_sat(epoch->dump,k+1))
+        {
+            *ptr++='G';
+            ptr=put_int(ptr,k+1,2,'0');
+        }
+        for(k=0; k<12-N_used; k++) ptr=put_chars(ptr,' ',3);
 
         //if(RESET_CLOCK) fprintf(fd,"%12.9f",dt);
-        fprintf(fd,"\n");
+        *ptr++='\n';
 
-        for(k=0; k<32; k++) if(epoch[k].used>=DUMP)
+        for(k=next_sat(epoch->dump,0); k>=0; k=next_sat(epoch->dump,k+1))
+        {
+            // Room for three fields of any size
+            if(ptr-line>(int)sizeof(line)-3*400)
             {
-                snr= (NO_SNR)? 0:get_q_code(epoch[k].db);
+                put_rinex(line,ptr-line,fd,crx);
+                ptr=line;
+            }
 
-                pr=epoch[k].prange-c*dt;
-                phase=epoch[k].phase-L1*dt;
+            snr= (NO_SNR)? 0:get_q_code(epoch->db[k]);
 
+            pr=epoch->prange[k]-c*dt;
+            phase=epoch->phase[k]-L1*dt;
 
-                /*
-                if(N_OBS>=1)
-                 {
-                  if(epoch[k].used==DUMP_PHASE_ONLY) fprintf(fd,"%16c",32);
-                  else fprintf(fd,"%14.3f%1c%1d",pr,32,snr);
-                 }
-                if(N_OBS>=2)  fprintf(fd,"%14.3f%1c%1d",phase,32,snr);
 
-                if( (N_OBS>=3) && (epoch[k].doppler!=-1))
-                   fprintf(fd,"%14.3f%1c%1d",-epoch[k].doppler,32,snr);
-                */
+            /*
+            if(N_OBS>=1)
+             {
+              if(sat_used(epoch,k)==DUMP_PHASE_ONLY) fprintf(fd,"%16c",32);
+              else fprintf(fd,"%14.3f%1c%1d",pr,32,snr);
+             }
+            if(N_OBS>=2)  fprintf(fd,"%14.3f%1c%1d",phase,32,snr);
+
+            if( (N_OBS>=3) && (epoch->doppler[k]!=-1))
+               fprintf(fd,"%14.3f%1c%1d",-epoch->doppler[k],32,snr);
+            */
 
-                if(OBS_MASK&1)  // Pseudoranges
+            // Every observable: "%14.3f%1c%1d"
+            if(OBS_MASK&1)  // Pseudoranges
+            {
+                if(epoch->phase_only[SAT_WORD(k)]&SAT_BIT(k)) ptr=put_chars(ptr,' ',16);
+                else
                 {
-                    if(epoch[k].used==DUMP_PHASE_ONLY) fprintf(fd,"%16c",32);
-                    else fprintf(fd,"%14.3f%1c%1d",pr,32,snr);
+                    ptr=put_fixed(ptr,pr,14,3);
+                    *ptr++=' ';
+                    ptr=put_int(ptr,snr,1,' ');
                 }
+            }
 
-                if(OBS_MASK&2)   // L1 Phase
-                    fprintf(fd,"%14.3f%1c%1d",phase,32,snr);
+            if(OBS_MASK&2)   // L1 Phase
+            {
+                ptr=put_fixed(ptr,phase,14,3);
+                *ptr++=' ';
+                ptr=put_int(ptr,snr,1,' ');
+            }
 
 
-                if((OBS_MASK&4) && (epoch[k].doppler!=-1))     //Doppler
-                    fprintf(fd,"%14.3f%1c%1d",-epoch[k].doppler,32,snr);
+            if((OBS_MASK&4) && (epoch->doppler[k]!=-1))     //Doppler
+            {
+                ptr=put_fixed(ptr,-epoch->doppler[k],14,3);
+                *ptr++=' ';
+                ptr=put_int(ptr,snr,1,' ');
+            }
 
 
-                fprintf(fd,"\n");
+            *ptr++='\n';
 
-            }
+        }
 
+        put_rinex(line,ptr-line,fd,crx);
     }
 
 }
 
 
-void add_0x1a_to_epoch(rinex_obs epoch[], type_rec0x1a chan[])
+void add_0x1a_to_epoch(rinex_epoch *epoch, type_rec0x1a chan[])
 {
     int k;
     BYTE sv;
@@ -1446,28 +3520,54 @@ void add_0x1a_to_epoch(rinex_obs epoch[], type_rec0x1a chan[])
     {
         sv=chan[k].sv;
         if(sv>=32) continue;
-        if(epoch[sv].db==chan[k].db)
-            epoch[sv].elev=chan[k].elev;
+        if(epoch->db[sv]==chan[k].db)
+            epoch->elev[sv]=chan[k].elev;
     }
 }
 
 
 
 
-void get_session_number(char *name, char *ext)
+// True if name+session.ext is taken. A batch job takes the number for
+// both its files, so it must be free for every type of them
+BOOLEAN session_used(char *name, int k, char *ext)
 {
-    int k;
     FILE *fd;
     char fich[64];
+    char types[4];
+    int t;
 
-    for(k=1; k<10; k++)
+    strcpy(types,(PAIRED)? "ODn":" ");
+    for(t=0; types[t]; t++)
     {
         sprintf(fich,"%s%1d.%s%c",name,k,ext,0);
+        if(PAIRED) fich[strlen(fich)-1]=types[t];
         fd=fopen(fich,"r");
-        if(fd==NULL) break;
-        fclose(fd);
+        if(fd!=NULL)
+        {
+            fclose(fd);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void get_session_number(char *name, char *ext)
+{
+    int k;
+    char fich[64];
+
+    // The second file of a batch job keeps the number of the first
+    if(PAIRED && SESSION) k=SESSION;
+    else
+    {
+        for(k=1; (k<9) && session_used(name,k,ext); k++);
+        if(PAIRED) SESSION=k;
     }
 
+    sprintf(fich,"%s%1d.%s%c",name,k,ext,0);
     strcpy(name,fich);
 
 }
@@ -1490,9 +3590,45 @@ ULONG week_days,week_secs;
 }
 
 
+// Names and creates a RINEX file. Batch jobs may ask for the same
+// name at the same time, so the session number is taken under a lock.
+// The files are created under it too, so the next job sees them taken.
+FILE* create_rinex_file(char *station,ULONG week_days,ULONG week_secs,char *filename,char type)
+{
+    FILE *fd;
+
+#ifndef NO_THREADS
+    pthread_mutex_lock(&NAME_LOCK);
+#endif
+    get_rinex_file_name(station,week_days,week_secs,filename,type);
+    fd=fopen(filename,"w");
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&NAME_LOCK);
+#endif
+
+    if(fd==NULL) printf("Cannot create %s\n",filename);
+    else setvbuf(fd,NULL,_IOFBF,RINEX_BUFFER);
+
+    return fd;
+}
+
+
+// Creates a RINEX file with the name given by the caller
+FILE* open_rinex_file(char *filename)
+{
+    FILE *fd;
+
+    fd=fopen(filename,"w");
+    if(fd==NULL) printf("Cannot create %s\n",filename);
+    else setvbuf(fd,NULL,_IOFBF,RINEX_BUFFER);
+
+    return fd;
+}
+
+
 
 
-void verify_tt(FILE *org)
+void verify_tt(type_reader *rd)
 {
     ULONG check[32][2],cc;
     BYTE flag[32],ff;
@@ -1501,7 +3637,7 @@ void verify_tt(FILE *org)
     float tow[32],current_tow;
 //BYTE flag38[32];
 
-    BYTE id,L,record[256],sv;
+    BYTE id,L,*record,sv;
     int k;
     type_rec0x38 rec;
     type_rec0x36 rec36;
@@ -1512,14 +3648,11 @@ void verify_tt(FILE *org)
     {
         flag[k]=0xff;
         tow[k]=-1;
+        check[k][0]=check[k][1]=0;
     }
 
-    do
+    while(next_record(rd,&id,&L,&record))
     {
-        fread(&id,1,1,org);
-        fread(&L,1,1,org);
-        fread(record,1,L,org);
-
         switch(id)
         {
         case 0x36:
@@ -1592,36 +3725,34 @@ void verify_tt(FILE *org)
             break;
         }
     }
-    while(feof(org)==0);
 
-    if(STDIN==0) fclose(org);
+    close_reader(rd);
     exit(0);
 }
 
-type_rec0x38 choose(type_rec0x38 rec[],int nn, rinex_obs last)
+// Records of the same satellite: the one closest to its last observation
+type_rec0x38 *choose(type_rec0x38 *rec[],int nn, rinex_epoch *last)
 {
-    int k;
-    type_rec0x38 best;
+    int k,sv;
+    type_rec0x38 *best;
     float dif[2],DIF,dif_min;
     long int dt;
 
 // Only one case
-    if(nn==1)
-    {
-        best=rec[0];
-        return best;
-    }
+    if(nn==1) return rec[0];
 
 // No previous references (any will do)
-    if(last.used==NEVER_USED)  best=rec[nn-1];
+    sv=rec[0]->sv;
+    if(sat_used(last,sv)==NEVER_USED)  best=rec[nn-1];
     else  // Choose between several
     {
+        best=rec[0];
         dif_min=(float)1e30;
         for(k=0; k<nn; k++)
         {
-            dt=rec[k].tracked-last.tracked;
+            dt=rec[k]->tracked-last->tracked[sv];
             dif[0]=(float)(dt/256.0);
-            dif[1]=(float)rec[k].delta_f-last.doppler;
+            dif[1]=(float)rec[k]->delta_f-last->doppler[sv];
             DIF=(float)(fabs(dif[0])+fabs(dif[1]));
             if(DIF<dif_min)
             {
@@ -1633,7 +3764,8 @@ type_rec0x38 choose(type_rec0x38 rec[],int nn, rinex_obs last)
     return best;
 }
 
-int verify_c511(type_rec0x38 allrec[],int N,double last_tow,ULONG next_c511)
+// Keeps (in list) the records with the c511 seen the most times
+int verify_c511(type_rec0x38 allrec[],int N,type_rec0x38 *list[],double last_tow,ULONG next_c511)
 {
     int k,j,nsat,nmax;
     int n_511,nn[40],test;
@@ -1673,7 +3805,7 @@ int verify_c511(type_rec0x38 allrec[],int N,double last_tow,ULONG next_c511)
     if(last_tow!=-1) if(abs((int)dif)>20) return 0;
 
     nsat=0;
-    for(k=0; k<N; k++) if(allrec[k].c511==c511_ok) allrec[nsat++]=allrec[k];
+    for(k=0; k<N; k++) if(allrec[k].c511==c511_ok) list[nsat++]=&allrec[k];
 
 
     //printf("Verifying c511: %2d records: Expecting %12u\n",N,next_c511);
@@ -1683,21 +3815,22 @@ int verify_c511(type_rec0x38 allrec[],int N,double last_tow,ULONG next_c511)
     return nsat;
 }
 
-int remove_duplicates(type_rec0x38 allrec[],int N,rinex_obs epoch[])
+// One record per satellite is left in list
+int remove_duplicates(type_rec0x38 *list[],int N,rinex_epoch *epoch)
 {
-    int k,j,nsat,sv,used[32],nn;
-    type_rec0x38 rec[20];
-    double tow,phase;
+    int k,j,nsat,sv,used[MAX_SATS],nn;
+    type_rec0x38 *rec[48];
+    double phase;
 
-    tow=allrec[0].tow;
+    //tow=list[0]->tow;
 
     // Find SVs in sight and possibly duplicated records
 
-    for(k=0; k<32; k++) used[k]=0;
-    for(k=0; k<N; k++) used[allrec[k].sv]++;
+    for(k=0; k<MAX_SATS; k++) used[k]=0;
+    for(k=0; k<N; k++) used[list[k]->sv]++;
 
     //printf("Remove: Tow %14.6f -> ",tow);
-    //printf("NREC %2d :: ",N); for(k=0;k<N;k++) printf("%2d ",allrec[k].sv+1);
+    //printf("NREC %2d :: ",N); for(k=0;k<N;k++) printf("%2d ",list[k]->sv+1);
     //printf("\n");
 
 
@@ -1705,37 +3838,37 @@ int remove_duplicates(type_rec0x38 allrec[],int N,rinex_obs epoch[])
     for(k=0; k<N; k++)
     {
         nn=0;
-        rec[nn++]=allrec[k];
-        sv=rec[0].sv;
+        rec[nn++]=list[k];
+        sv=rec[0]->sv;
         if(used[sv]<0) continue;         // This sv has already been processed
 
         if(used[sv]>1)
         {
             for(j=k+1; j<N; j++)
             {
-                if(allrec[j].sv==sv) rec[nn++]=allrec[j];
+                if(list[j]->sv==sv) rec[nn++]=list[j];
                 if(nn==used[sv]) break;
             }
             used[sv]=-1;
         }
-        allrec[nsat++]=choose(rec,nn,epoch[sv]);
+        list[nsat++]=choose(rec,nn,epoch);
     }
 
     return nsat;
 
-    //printf("N SV %2d :: ",nsat); for(k=0;k<nsat;k++) printf("%2d ",allrec[k].sv+1);
+    //printf("N SV %2d :: ",nsat); for(k=0;k<nsat;k++) printf("%2d ",list[k]->sv+1);
     //printf("\n");
 
     for(k=0; k<nsat; k++)
     {
-        if((allrec[k].sv+1)!=21) continue;
-        phase=allrec[k].int_phase+(allrec[k].c_phase & 2047)/2048.0;
+        if((list[k]->sv+1)!=21) continue;
+        phase=list[k]->int_phase+(list[k]->c_phase & 2047)/2048.0;
         printf("0x38 ----------------------------------------------------------------\n");
-        printf("PRN %02d: Sgn Q %5d ",allrec[k].sv+1,allrec[k].db);
-        printf("TRACKED %08x -> %8d\n",allrec[k].tracked,(int)allrec[k].tracked);
-        printf("\tTOW %12.5f (Counter 0.5 Mhz = %u).\n",allrec[k].tow,allrec[k].c511);
-        printf("\tPseudoRange  %14.3f  Integrated Phase %14.3f\n",allrec[k].pr,phase);
-        printf("\tDoppler(Hz): %5d \n",allrec[k].delta_f);
+        printf("PRN %02d: Sgn Q %5d ",list[k]->sv+1,list[k]->db);
+        printf("TRACKED %08x -> %8d\n",list[k]->tracked,(int)list[k]->tracked);
+        printf("\tTOW %12.5f (Counter 0.5 Mhz = %u).\n",list[k]->tow,list[k]->c511);
+        printf("\tPseudoRange  %14.3f  Integrated Phase %14.3f\n",list[k]->pr,phase);
+        printf("\tDoppler(Hz): %5d \n",list[k]->delta_f);
     }
 
     return nsat;
@@ -1743,31 +3876,31 @@ int remove_duplicates(type_rec0x38 allrec[],int N,rinex_obs epoch[])
 
 
 
-void add_0x16_to_epoch(rinex_obs epoch[], type_rec0x16 rec)
+void add_0x16_to_epoch(rinex_epoch *epoch, type_rec0x16 *rec)
 {
-    BYTE sv=rec.sv;
+    BYTE sv=rec->sv;
 
-//printf("%d %14.3f %14.3f %f\n",sv,epoch[sv].prange,rec.pr,epoch[sv].prange-rec.pr);
+//printf("%d %14.3f %14.3f %f\n",sv,epoch->prange[sv],rec->pr,epoch->prange[sv]-rec->pr);
 
-    if(epoch[sv].prange==rec.pr) epoch[sv].doppler=(float)(rec.delta_pr/lambda);
+    if(epoch->prange[sv]==rec->pr) epoch->doppler[sv]=(float)(rec->delta_pr/lambda);
 
 }
 
-void add_0x38_to_epoch(rinex_obs epoch[], type_rec0x38 rec)
+void add_0x38_to_epoch(rinex_epoch *epoch, type_rec0x38 *rec)
 {
     BYTE sv;
     int action;
     BYTE check;
     long  dtracked;
 
-    sv=rec.sv;
+    sv=rec->sv;
 
-    check=rec.tracked&0xff;
+    check=rec->tracked&0xff;
 
-    if(epoch[sv].used==NEVER_USED)  action= (check==0)? NO_DUMP:DUMP;
+    if(sat_used(epoch,sv)==NEVER_USED)  action= (check==0)? NO_DUMP:DUMP;
     else
     {
-        dtracked=(epoch[sv].tracked-rec.tracked);
+        dtracked=(epoch->tracked[sv]-rec->tracked);
         action = (abs(dtracked)<256)?  DUMP:NO_DUMP;
     }
 
@@ -1776,39 +3909,39 @@ void add_0x38_to_epoch(rinex_obs epoch[], type_rec0x38 rec)
 
 // Check if there have been a recent 0x36 record for that sat
 
-    if((rec.tow>(epoch[sv].last36+2.0)) && (action==DUMP))
+    if((rec->tow>(epoch->last36[sv]+2.0)) && (action==DUMP))
         action = (OPT1) ? DUMP_PHASE_ONLY:NO_DUMP;
 
-//printf("SV %2d -> %08x %08x : ",sv+1,epoch[sv].tracked,rec.tracked,dtracked);
+//printf("SV %2d -> %08x %08x : ",sv+1,epoch->tracked[sv],rec->tracked,dtracked);
 //printf("dTracked %8d :",dtracked);
 //printf("check %02x action %d\n",check,action);
 
 // Check for meaningless values
-    if((rec.pr<=10.0) || (rec.pr>=1e9)) return;
-//if (rec.db>15000)  return;
+    if((rec->pr<=10.0) || (rec->pr>=1e9)) return;
+//if (rec->db>15000)  return;
 
-//epoch[sv].doppler=rec.delta_f;
-    epoch[sv].prange=rec.pr;
-    epoch[sv].phase=(double)rec.int_phase+(rec.c_phase&2047)/2048.0;
-    epoch[sv].db=rec.db;
+//epoch->doppler[sv]=rec->delta_f;
+    epoch->prange[sv]=rec->pr;
+    epoch->phase[sv]=(double)rec->int_phase+(rec->c_phase&2047)/2048.0;
+    epoch->db[sv]=rec->db;
 
-    epoch[sv].tracked=rec.tracked;
-    epoch[sv].c511=rec.c511;
+    epoch->tracked[sv]=rec->tracked;
+    epoch->c511[sv]=rec->c511;
 
-    epoch[sv].used=action;
+    set_sat_used(epoch,sv,action);
 
 }
 
 
 int process_tow(rec,N,rec16,N16,epoch,last_tow)
-type_rec0x38 *rec;
+type_rec0x38 **rec;
 int N;
 type_rec0x16 *rec16;
 int N16;
-rinex_obs *epoch;
+rinex_epoch *epoch;
 double last_tow;
 {
-    double current_tow=rec[0].tow;
+    double current_tow=rec[0]->tow;
     int n_sat;
     int k;
 
@@ -1830,7 +3963,7 @@ double last_tow;
     for(k=0; k<n_sat; k++) add_0x38_to_epoch(epoch,rec[k]);
 
 // Add doppler data
-    for(k=0; k<N16; k++) add_0x16_to_epoch(epoch,rec16[k]);
+    for(k=0; k<N16; k++) add_0x16_to_epoch(epoch,&rec16[k]);
 
     return n_sat;
 }
@@ -1840,206 +3973,672 @@ double last_tow;
 
 
 
-void generate_rinex(FILE *org)
+// State kept between records while generating the observation file
+
+typedef struct
 {
-    BYTE id,L,record[256],sv;
-    int k,n_records,nr,n_16;
-    type_rec0x16 r16,rec16[48];
-    type_rec0x38 rec,allrec[48];
-    type_rec0x36 rec36;
-//type_rec0x1a chan[12];
+    int n_records,n_16;
+    type_rec0x16 rec16[48];
+    type_rec0x38 allrec[48];
     double current_tow,last_tow;
-    ULONG next_c511,last_c511=0;
-    rinex_obs epoch[32];
-    ULONG week_days,week_secs;
-    double aprox_xyz[3];
-    char description[256];
-    UINT prod_number;
+    ULONG last_c511;
+    rinex_epoch epoch;
+    type_header_info info;
+    FILE *dest;
+    type_crx *crx;      // Compact RINEX encoder of dest (NULL: plain RINEX)
+    long n_epochs;
+    UINT32 touched;     // Satellites with 0x38/0x16 records (chunks)
+    UINT32 touched36;   // Satellites with 0x36 records
+}
+type_rinex_state;
+
+
+void reset_rinex_state(type_rinex_state *st)
+{
+    int k;
+
+    st->n_records=0;
+    st->n_16=0;
+    st->last_tow=-1;
+    st->last_c511=0;
+    st->n_epochs=0;
+    st->touched=st->touched36=0;
+
+    memset(&st->epoch,0,sizeof(st->epoch));     // Every satellite NEVER_USED
+    reset_epoch(&st->epoch);
+    for(k=0; k<MAX_SATS; k++) st->epoch.last36[k]=-1.0;
+}
+
+
+// All the 0x38 records of an epoch have been collected: dump it
+void end_of_epoch(type_rinex_state *st)
+{
+    int nr;
     long itow,dtow;
-    float version;
+    ULONG next_c511;
+    type_rec0x38 *list[48];    // The records of allrec that are used
 
-    BOOLEAN found=0;
-    long fptr;
+    nr=st->n_records;
+    st->n_records=0;
 
-    FILE *dest;
-    char name[128];
+    //printf("End TOW:  0x38 records: %d  ",nr);
 
+    // Check that tow is within limits
+    itow=(long)floor(st->current_tow+0.5);
+    if(START==-1) START=itow;
+    dtow=itow-START;
+    if((itow<START) || (itow>LAST) || (dtow>ELAPSED))
+    {
+        st->n_16=0;
+        return;
+    }
 
-    get_prod_id(org,description,&prod_number,&version);
-    get_aprox_location_and_wdays_and_tow(org,aprox_xyz,&week_days,&week_secs);
+    // Verifies c511 fields
 
+    //printf("%10.3f (%2d) ->\n ",current_tow,nr);
 
-    if(RINEX_FILE)
+    next_c511 = st->last_c511 + (ULONG)floor((st->current_tow-st->last_tow)*511500.0 +0.5);
+    nr=verify_c511(st->allrec,nr,list,st->last_tow,next_c511);
+    if(nr==0)
     {
-        get_rinex_file_name(location,week_days,week_secs,name,'O');
-        dest=fopen(name,"w");
+        st->n_16=0;
+        return;
     }
-    else dest=stdout;
 
+    //printf("After c511 check = %2d. 0x16 records %d\n",nr,n_16);
 
-//printf("Week days %d TOW %d -> File %s\n",week_days,week_secs,name);
-//printf("Aprox location %f %f %f\n",aprox_llh[0],aprox_llh[1],aprox_llh[2]);
-//printf("Aprox XYZ  %f %f %f\n",aprox_xyz[0],aprox_xyz[1],aprox_xyz[2]);
-//printf("ID %d.\n Desc: %s .\n Soft %.2f\n",prod_number,description,version);
-//exit(0);
+    nr=process_tow(list,nr,st->rec16,st->n_16,&st->epoch,st->last_tow);
+
+
+    //printf("Final %2d:  ",nr);
+    //for(k=0;k<nr;k++) printf("%02d ",list[k]->sv+1); printf("\n");
+
+    if(nr==0)
+    {
+        st->n_16=0;
+        return;
+    }
+
+
+    // If first epoch, creates header (no dest: just rebuilding the state)
+    if((st->last_tow==-1) && (st->dest!=NULL))
+        generate_rinex_header(st->info.xyz,st->info.wdays,st->current_tow,\
+                              st->info.prod,st->info.version,st->info.description,st->dest,st->crx);
+
+    // If multiple of interval, dump to rinex file
+    if(((INTERVAL==1) || (itow%INTERVAL)==0) && (st->dest!=NULL))
+    {
+        print_rinex_info(st->info.wdays,st->current_tow,&st->epoch,st->dest,st->crx);
+        st->n_epochs++;
+    }
+
+    //for(k=0;k<n_16;k++) printf("%02d %14.3f\n",rec16[k].sv+1,rec16[k].pr);
+    //getchar();
+
+    st->n_16=0;  // Reset number of 0x16 records per epoch
+
+    st->last_c511=list[0]->c511;
+
+    //printf("Expected c511 %u -> seen %u\n",next_c511,last_c511);
+    st->last_tow=st->current_tow;
+    reset_epoch(&st->epoch);
+}
+
+
+void add_rinex_record(type_rinex_state *st, BYTE id, BYTE *record)
+{
+    BYTE sv;
+    type_rec0x16 r16;
+    type_rec0x38 rec;
+    type_rec0x36 rec36;
+
+    switch(id)
+    {
+    case 0x1a:
+        break;
+
+    case 0x16:
+
+        r16=process_0x16(record);
+        sv=r16.sv;
+        if(sv>=32) break;
+        st->touched|=1U<<sv;
+
+
+        // Option A: keep all of them and discard them later
+        if(st->n_16<48) st->rec16[st->n_16++]=r16;
+        //if (n_16>=12) {printf("N16 %d Tow %.0f\n",n_16,current_tow); getchar();}
+
+
+        // OPtion B: check to see if there is already a 0x16 record for that sv
+        //found=0; for (k=0;k<n_16;k++) if (sv==rec16[k].sv) {found=1; break;}
+        //if (found==0) rec16[n_16++]=r16;
+        //else { printf("Repeated 0x16 for SV %d, tow %.0f. Not added\n",sv,current_tow);}
+
+
+        break;
+
+    case 0x36:
+        rec36=process_0x36(record);
+        sv=rec36.sv;
+        if(sv>=32) break;
+        st->touched36|=1U<<sv;
+        st->epoch.last36[sv]=(float)(rec36.c50/50.0);
+        break;
+
+    case 0x38:
+
+        rec=process_0x38(record);
+        sv=rec.sv;
+        if(sv>=32) break;
+        st->touched|=1U<<sv;
 
-    rewind(org);
+        // A different time tag closes the epoch and starts the next one
+        if((st->n_records) && (rec.tow!=st->current_tow)) end_of_epoch(st);
 
-    n_records=0;
-    n_16=0;
-    last_tow=-1;
+        if(st->n_records==0) st->current_tow=rec.tow;
+        if(st->n_records<48) st->allrec[st->n_records++]=rec;
+
+        break;
+
+    default  :
+        break;
+    }
+}
+
+
+#ifndef NO_THREADS
+//////////////////////////////////////////////////////////////////////////
+// Chunked RINEX generation (-j N). The rest of the file is split in N
+// chunks at epoch boundaries, each one converted by its own thread from
+// the state rebuilt with the CHUNK_WARMUP epochs before it (nothing is
+// written while warming up). A satellite last seen before the warm-up
+// can't be rebuilt that way, so the chunks are then checked in order:
+// starting from the state the previous chunk really ended with, the
+// chunk is converted again until its state matches the one saved at one
+// of its marks (every MARK_RECORDS records). From there on the output of
+// the thread is good. Usually the first mark (the start) matches, and
+// the result is always the same as converting the file in one go.
+//////////////////////////////////////////////////////////////////////////
+
+#define CHUNK_WARMUP 120    // epochs
+#define MAX_CHUNKS   64
+#define MARK_RECORDS 2000
+
+typedef struct
+{
+    INT64 offset;               // File offset of the next record
+    INT64 out_pos;              // Output written so far
+    long n_epochs;
+    UINT32 after,after36;       // Satellites with records from here on
+    type_rinex_state st;
+}
+type_mark;
+
+typedef struct
+{
+    INT64 warm,start,end;       // File offsets
+    long start_tow;             // START, DATAFILE and ETREX for this thread
+    char *file;
+    BOOLEAN etrex;
+    type_rinex_state first,last;
+    FILE *out;
+    type_mark *mark;
+    int n_marks;
+}
+type_chunk;
+
+
+BOOLEAN same_rec0x38(type_rec0x38 *a, type_rec0x38 *b)
+{
+    return (a->c_phase==b->c_phase) && (a->tracked==b->tracked) && (a->delta_f==b->delta_f) \
+           && (a->int_phase==b->int_phase) && (a->pr==b->pr) && (a->c511==b->c511) \
+           && (a->db==b->db) && (a->tow==b->tow) && (a->sv==b->sv);
+}
+
+
+BOOLEAN same_obs(rinex_epoch *a, rinex_epoch *b, int k)
+{
+    return (sat_used(a,k)==sat_used(b,k)) && (a->db[k]==b->db[k]) && (a->prange[k]==b->prange[k]) \
+           && (a->phase[k]==b->phase[k]) && (a->doppler[k]==b->doppler[k]) && (a->elev[k]==b->elev[k]) \
+           && (a->tracked[k]==b->tracked[k]) && (a->c511[k]==b->c511[k]) && (a->last36[k]==b->last36[k]);
+}
+
+
+// Satellite k of b copied to a
+void copy_obs(rinex_epoch *a, rinex_epoch *b, int k)
+{
+    set_sat_used(a,k,sat_used(b,k));
+    a->db[k]=b->db[k];
+    a->prange[k]=b->prange[k];
+    a->phase[k]=b->phase[k];
+    a->doppler[k]=b->doppler[k];
+    a->elev[k]=b->elev[k];
+    a->tracked[k]=b->tracked[k];
+    a->c511[k]=b->c511[k];
+    a->last36[k]=b->last36[k];
+}
+
+
+// Checks that converting the rest of a chunk from state "guess" gives the
+// same output as from "right". Satellites without 0x38/0x16 records from
+// there on may differ while they are not going into the file: their
+// values are never read (0x36 records only overwrite last36).
+BOOLEAN chunk_state_ok(type_rinex_state *right, type_rinex_state *guess, UINT32 touched)
+{
+    int k;
+    type_rec0x16 *a,*b;
+
+    if((right->n_records!=guess->n_records) || (right->n_16!=guess->n_16) \
+            || (right->last_tow!=guess->last_tow) || (right->last_c511!=guess->last_c511))
+        return 0;
+
+    if(right->n_records && (right->current_tow!=guess->current_tow)) return 0;
+    for(k=0; k<right->n_records; k++)
+        if(!same_rec0x38(&right->allrec[k],&guess->allrec[k])) return 0;
+
+    for(k=0; k<right->n_16; k++)
+    {
+        a=&right->rec16[k];
+        b=&guess->rec16[k];
+        if((a->delta_pr!=b->delta_pr) || (a->f1!=b->f1) || (a->pr!=b->pr) \
+                || (a->f2!=b->f2) || (a->sv!=b->sv)) return 0;
+    }
+
+    // Pending records are added to the epoch later on
+    for(k=0; k<guess->n_records; k++) touched|=1U<<guess->allrec[k].sv;
+    for(k=0; k<guess->n_16; k++) touched|=1U<<guess->rec16[k].sv;
 
-    reset_epoch(epoch);
     for(k=0; k<32; k++)
     {
-        epoch[k].used=NEVER_USED;
-        epoch[k].last36=-1.0;
+        if(same_obs(&right->epoch,&guess->epoch,k)) continue;
+        if(touched&(1U<<k)) return 0;
+        if((sat_used(&right->epoch,k)>=DUMP) || (sat_used(&guess->epoch,k)>=DUMP)) return 0;
+        if(right->epoch.doppler[k]!=guess->epoch.doppler[k]) return 0;
     }
 
-    do
+    return 1;
+}
+
+
+// The satellites that differed when chunk_state_ok() was checked keep the
+// right values to the end of the chunk (but last36, if they had 0x36
+// records, and doppler, reset every epoch)
+void fix_chunk_state(type_rinex_state *end, type_rinex_state *right, type_rinex_state *guess,
+                     UINT32 touched36)
+{
+    int k;
+    float doppler,last36;
+
+    for(k=0; k<32; k++)
     {
-        fptr=ftell(org);
-        fread(&id,1,1,org);
-        fread(&L,1,1,org);
-        fread(record,1,L,org);
-        fptr-=ftell(org);
+        if(same_obs(&right->epoch,&guess->epoch,k)) continue;
+        doppler=end->epoch.doppler[k];
+        last36=end->epoch.last36[k];
+        copy_obs(&end->epoch,&right->epoch,k);
+        end->epoch.doppler[k]=doppler;
+        if(touched36&(1U<<k)) end->epoch.last36[k]=last36;
+    }
+}
 
-        switch(id)
+
+BOOLEAN open_range(type_reader *rd, INT64 from, INT64 to)
+{
+    FILE *fd;
+
+    fd=fopen(DATAFILE,"rb");
+    if(fd==NULL) return 0;
+    if(open_reader(rd,fd)==0)
+    {
+        fclose(fd);
+        return 0;
+    }
+
+    seek_reader(rd,from);
+    rd->limit=to;
+    return 1;
+}
+
+
+void close_range(type_reader *rd)
+{
+    rd->truncated=0;        // Already reported by the main reader
+    close_reader(rd);
+}
+
+
+void* chunk_thread(void *arg)
+{
+    type_chunk *ch=(type_chunk*)arg;
+    type_reader rd;
+    type_mark *mk;
+    BYTE id,L,*record;
+    long n,max_marks;
+    int k;
+
+    // The JOB_LOCAL values the conversion needs, from the thread that
+    // split the file. The rest are rebuilt by the warm-up.
+    START=ch->start_tow;
+    if(ch->file!=DATAFILE) strcpy(DATAFILE,ch->file);
+    ETREX=ch->etrex;
+
+    if(ch->warm<ch->start)
+    {
+        ch->first.dest=NULL;
+        reset_rinex_state(&ch->first);
+        if(open_range(&rd,ch->warm,ch->start))
         {
-        case 0x1a:
-            break;
+            while(next_record(&rd,&id,&L,&record)) add_rinex_record(&ch->first,id,record);
+            close_range(&rd);
+        }
+    }
+
+    ch->last=ch->first;
+    ch->last.dest=ch->out;
+    ch->last.n_epochs=0;
+    ch->last.touched=ch->last.touched36=0;
+
+    ch->mark=NULL;
+    ch->n_marks=0;
+    max_marks=0;
+    if(open_range(&rd,ch->start,ch->end))
+    {
+        for(n=0; ; n++)
+        {
+            if((n%MARK_RECORDS)==0)
+            {
+                if(ch->n_marks==max_marks)
+                {
+                    max_marks= (max_marks)? 2*max_marks:16;
+                    ch->mark=(type_mark*)realloc(ch->mark,max_marks*sizeof(type_mark));
+                }
+                mk=&ch->mark[ch->n_marks++];
+                mk->offset=reader_offset(&rd);
+                mk->out_pos=FTELL64(ch->out);
+                mk->n_epochs=ch->last.n_epochs;
+                mk->st=ch->last;
+
+                // Satellites seen since the previous mark
+                if(ch->n_marks>1)
+                {
+                    mk[-1].after=ch->last.touched;
+                    mk[-1].after36=ch->last.touched36;
+                }
+                ch->last.touched=ch->last.touched36=0;
+            }
+            if(!next_record(&rd,&id,&L,&record)) break;
+            add_rinex_record(&ch->last,id,record);
+        }
+        close_range(&rd);
+    }
+
+    // From every mark to the end
+    if(ch->n_marks)
+    {
+        ch->mark[ch->n_marks-1].after=ch->last.touched;
+        ch->mark[ch->n_marks-1].after36=ch->last.touched36;
+    }
+    for(k=ch->n_marks-2; k>=0; k--)
+    {
+        ch->mark[k].after|=ch->mark[k+1].after;
+        ch->mark[k].after36|=ch->mark[k+1].after36;
+    }
+
+    return arg;
+}
 
-        case 0x16:
 
-            r16=process_0x16(record);
-            sv=r16.sv;
-            if(sv>=32) break;
+// Writes chunk ch to dest, knowing the state the previous chunk ended with
+void append_chunk(type_chunk *ch, type_rinex_state *right, FILE *dest, type_crx *crx, BYTE *buffer)
+{
+    type_rinex_state st;
+    type_reader rd;
+    BYTE id,L,*record;
+    INT64 from;
+    long n_epochs;
+    size_t size;
+    int m;
+
+    // Convert it again until a mark with a good state is found
+    st=*right;
+    st.dest=dest;
+    st.crx=crx;
+    st.n_epochs=0;
+    m=0;
+    if(open_range(&rd,ch->start,ch->end))
+    {
+        for(;;)
+        {
+            if((m<ch->n_marks) && (reader_offset(&rd)==ch->mark[m].offset))
+            {
+                if(chunk_state_ok(&st,&ch->mark[m].st,ch->mark[m].after)) break;
+                m++;
+            }
+            if(!next_record(&rd,&id,&L,&record))
+            {
+                m=ch->n_marks;
+                break;
+            }
+            add_rinex_record(&st,id,record);
+        }
+        close_range(&rd);
+    }
+    else m=ch->n_marks;
 
+    if(m==ch->n_marks)      // No good mark: it has been converted again
+    {
+        ch->last=st;
+        return;
+    }
 
-            // Option A: keep all of them and discard them later
-            if(n_16<48) rec16[n_16++]=r16;
-            //if (n_16>=12) {printf("N16 %d Tow %.0f\n",n_16,current_tow); getchar();}
+    // The rest of the output of the thread is good
+    n_epochs=st.n_epochs+ch->last.n_epochs-ch->mark[m].n_epochs;
+    fix_chunk_state(&ch->last,&st,&ch->mark[m].st,ch->mark[m].after36);
+    ch->last.n_epochs=n_epochs;
 
+    from=ch->mark[m].out_pos;
+    FSEEK64(ch->out,from,SEEK_SET);
+    while((size=fread(buffer,1,READ_CHUNK,ch->out))>0) put_rinex((char*)buffer,size,dest,crx);
+}
 
-            // OPtion B: check to see if there is already a 0x16 record for that sv
-            //found=0; for (k=0;k<n_16;k++) if (sv==rec16[k].sv) {found=1; break;}
-            //if (found==0) rec16[n_16++]=r16;
-            //else { printf("Repeated 0x16 for SV %d, tow %.0f. Not added\n",sv,current_tow);}
 
+// Converts the rest of the file (from the current position of rd) in
+// chunks. Returns 0 (and leaves rd where it was) if it can't be done.
+BOOLEAN generate_rinex_chunks(type_reader *rd, type_rinex_state *st)
+{
+    BYTE id,L,*record;
+    INT64 from,*epochs;
+    long n_epochs,max_epochs,k;
+    double tow,first_tow,last_tow;
+    int n,i;
+    type_chunk *ch;
+    pthread_t threads[MAX_CHUNKS];
+    BOOLEAN ok,started[MAX_CHUNKS];
+    BYTE *buffer;
+
+    from=reader_offset(rd);
+
+    // Epoch boundaries: first 0x38 record with a new time tag
+    epochs=NULL;
+    n_epochs=max_epochs=0;
+    first_tow=last_tow=-1;
+    while(next_record(rd,&id,&L,&record))
+    {
+        if((id!=0x38) || (record[36]>=32)) continue;
+        memcpy(&tow,record+((ETREX)? 8:28),8);
+        if(tow==last_tow) continue;
+        if(last_tow==-1) first_tow=tow;
+        last_tow=tow;
 
-            break;
+        if(n_epochs==max_epochs)
+        {
+            max_epochs= (max_epochs)? 2*max_epochs:4096;
+            epochs=(INT64*)realloc(epochs,max_epochs*sizeof(INT64));
+        }
+        epochs[n_epochs++]=reader_offset(rd)-2-L;
+    }
 
-        case 0x36:
-            rec36=process_0x36(record);
-            sv=rec36.sv;
-            if(sv>=32) break;
-            epoch[sv].last36=(float)(rec36.c50/50.0);
-            break;
+    n= (N_THREADS<MAX_CHUNKS)? N_THREADS:MAX_CHUNKS;
+    if(n_epochs<(long)n*4*CHUNK_WARMUP)    // Not worth it
+    {
+        free(epochs);
+        seek_reader(rd,from);
+        return 0;
+    }
 
-        case 0x38:
+    // Every thread needs the same START: that of the next epoch closed
+    if(START==-1)
+    {
+        tow= (st->n_records)? st->current_tow:first_tow;
+        START=(long)floor(tow+0.5);
+    }
 
-            rec=process_0x38(record);
-            sv=rec.sv;
-            if(sv>=32) break;
+    ch=(type_chunk*)malloc(n*sizeof(type_chunk));
+    ok=1;
+    for(i=0; i<n; i++)
+    {
+        k=(i*n_epochs)/n;
+        ch[i].start= (i)? epochs[k]:from;
+        ch[i].warm= (i)? epochs[(k>CHUNK_WARMUP)? k-CHUNK_WARMUP:0]:from;
+        ch[i].end= (i<n-1)? epochs[((i+1)*n_epochs)/n]:rd->limit;
+        ch[i].start_tow=START;
+        ch[i].file=DATAFILE;
+        ch[i].etrex=ETREX;
+        ch[i].first=*st;
+        ch[i].first.crx=NULL;   // Threads write plain RINEX, encoded when appended
+        ch[i].out=tmpfile();
+        if(ch[i].out==NULL) ok=0;
+        else setvbuf(ch[i].out,NULL,_IOFBF,RINEX_BUFFER);
+    }
+    free(epochs);
 
-            if(n_records==0) current_tow=rec.tow;
+    if(!ok)     // No room for temporary files
+    {
+        for(i=0; i<n; i++) if(ch[i].out!=NULL) fclose(ch[i].out);
+        free(ch);
+        seek_reader(rd,from);
+        return 0;
+    }
 
-            if(rec.tow==current_tow) allrec[n_records++]=rec;
-            else                             // End of epoch detected
-            {
-                fseek(org,fptr,SEEK_CUR);      // Reset file pointer for next epoch
-                nr=n_records;
-                n_records=0;
+    for(i=0; i<n; i++)
+    {
+        started[i]=(pthread_create(&threads[i],NULL,chunk_thread,&ch[i])==0);
+        if(!started[i]) chunk_thread(&ch[i]);
+    }
+    for(i=0; i<n; i++) if(started[i]) pthread_join(threads[i],NULL);
 
-                //printf("End TOW:  0x38 records: %d  ",nr);
+    buffer=(BYTE*)malloc(READ_CHUNK);
+    for(i=0; i<n; i++)
+    {
+        append_chunk(&ch[i],(i)? &ch[i-1].last:st,st->dest,st->crx,buffer);
+        st->n_epochs+=ch[i].last.n_epochs;
+        free(ch[i].mark);
+        fclose(ch[i].out);
+    }
 
-                // Check that tow is within limits
-                itow=(long)floor(current_tow+0.5);
-                if(START==-1) START=itow;
-                dtow=itow-START;
-                if((itow<START) || (itow>LAST) || (dtow>ELAPSED))
-                {
-                    n_16=0;
-                    break;
-                }
+    free(buffer);
+    free(ch);
+    return 1;
+}
+#endif
 
-                // Verifies c511 fields
 
-                //printf("%10.3f (%2d) ->\n ",current_tow,nr);
+// Keeps a record in the window used while looking for the header info.
+// Returns 0 once the info is complete or the window is full
+BOOLEAN keep_header_record(type_rinex_state *st, BYTE *window, long *used, BYTE id, BYTE L, BYTE *record)
+{
+    collect_header_info(&st->info,id,record);
+    window[(*used)++]=id;
+    window[(*used)++]=L;
+    memcpy(window+*used,record,L);
+    *used+=L;
 
-                next_c511 = last_c511 + (ULONG)floor((current_tow-last_tow)*511500.0 +0.5);
-                nr=verify_c511(allrec,nr,last_tow,next_c511);
-                if(nr==0)
-                {
-                    n_16=0;
-                    break;
-                }
+    return (header_info_complete(&st->info)==0) && (*used+258<=LOOKAHEAD);
+}
 
-                //printf("After c511 check = %2d. 0x16 records %d\n",nr,n_16);
 
-                nr=process_tow(allrec,nr,rec16,n_16,epoch,last_tow);
+// Once the header info is known: creates the observation file (file, or
+// named after the data if NULL) and converts the records in the window.
+// Returns 0 if there is no RINEX file
+BOOLEAN start_rinex(type_rinex_state *st, BYTE *window, long used, char *file)
+{
+    BYTE *ptr;
+    char name[128];
 
+    if(resolve_header_info(&st->info)==0) st->dest=NULL;
+    else if(file!=NULL) st->dest=open_rinex_file(file);
+    else st->dest= (RINEX_FILE)? \
+                       create_rinex_file(location,st->info.wdays,st->info.tow,name,(CRX)? 'D':'O'):stdout;
 
-                //printf("Final %2d:  ",nr);
-                //for(k=0;k<nr;k++) printf("%02d ",allrec[k].sv+1); printf("\n");
+    st->crx=NULL;
+    if(st->dest==NULL) return 0;
+    if(CRX) st->crx=crx_open();
 
-                if(nr==0)
-                {
-                    n_16=0;
-                    break;
-                }
+//printf("Week days %d TOW %d -> File %s\n",week_days,week_secs,name);
+//printf("Aprox XYZ  %f %f %f\n",aprox_xyz[0],aprox_xyz[1],aprox_xyz[2]);
+//printf("ID %d.\n Desc: %s .\n Soft %.2f\n",prod_number,description,version);
 
+    reset_rinex_state(st);
 
-                // If first epoch, creates header
-                if(last_tow==-1)
-                    generate_rinex_header(aprox_xyz,week_days,current_tow,\
-                                          prod_number,version,description,dest);
+    for(ptr=window; ptr<window+used; ptr+=2+ptr[1])
+        add_rinex_record(st,ptr[0],ptr+2);
 
-                // If multiple of interval, dump to rinex file
-                if((INTERVAL==1) || (itow%INTERVAL)==0)
-                    print_rinex_info(week_days,current_tow,epoch,dest);
+    return 1;
+}
 
-                //for(k=0;k<n_16;k++) printf("%02d %14.3f\n",rec16[k].sv+1,rec16[k].pr);
-                //getchar();
 
-                n_16=0;  // Reset number of 0x16 records per epoch
+// Single pass over the input, so it also works when reading from a pipe.
+// The first records are kept in memory until the header info is known.
+// Written to file if not NULL, else as the options say.
+// Returns the number of epochs written, -1 if no RINEX file was created
+long generate_rinex(type_reader *rd, char *file)
+{
+    BYTE id,L,*record;
+    BYTE *window;
+    long used;
+    type_rinex_state st;
+    BOOLEAN done;
 
-                last_c511=allrec[0].c511;
 
-                //printf("Expected c511 %u -> seen %u\n",next_c511,last_c511);
-                last_tow=current_tow;
-                reset_epoch(epoch);
-            }
+    reset_header_info(&st.info);
 
-            break;
+    window=(BYTE*)malloc(LOOKAHEAD);
+    used=0;
+    while(next_record(rd,&id,&L,&record) && keep_header_record(&st,window,&used,id,L,record));
 
-        default  :
-            break;
-        }
+    if(start_rinex(&st,window,used,file)==0)
+    {
+        free(window);
+        close_reader(rd);
+        return -1;
     }
-    while(feof(org)==0);
+    free(window);
 
-    if(STDIN==0) fclose(org);
-    if(RINEX_FILE) fclose(dest);
+    seek_window(rd,INDEX_WARMUP,0);
 
-    exit(0);
-}
+    done=0;
+#ifndef NO_THREADS
+    if((N_THREADS>1) && (BATCH==0) && (STDIN==0) && (ONE_SAT==0))
+        done=generate_rinex_chunks(rd,&st);
+#endif
+    if(!done) while(next_record(rd,&id,&L,&record)) add_rinex_record(&st,id,record);
 
+    close_reader(rd);
+    if(st.crx!=NULL) crx_close(st.crx,st.dest);
+    if(RINEX_FILE || (file!=NULL)) fclose(st.dest);
 
+    return st.n_epochs;
+}
 
 
 
 
 
 
-void parse_records(FILE *org)
-{
-    BYTE record[256],id,L;
 
-    fread(&id,1,1,org);
-    fread(&L,1,1,org);
-    fread(record,1,L,org);
 
+void parse_records(BYTE id, BYTE L, BYTE *record)
+{
     if(!found_in_list(SELECTED_RECORDS,id)) return;
 
     switch(id)
@@ -2088,10 +4687,11 @@ void parse_records(FILE *org)
 }
 
 
-void original_parsing(FILE *fd)
+void original_parsing(type_reader *rd)
 {
-    do parse_records(fd);
-    while(feof(fd)==0);
+    BYTE id,L,*record;
+
+    while(next_record(rd,&id,&L,&record)) parse_records(id,L,record);
 
     if(DIF_RECORDS)
     {
@@ -2099,7 +4699,7 @@ void original_parsing(FILE *fd)
         printf("%4.1f  %5.1f   ",mean/n,sqrt((sigma-mean*mean/n)/n));
         printf("%4.1f  %5.1f\n",mean2/n2,sqrt((sigma2-mean2*mean2/n2)/n2));
     }
-    if(STDIN==0) fclose(fd);
+    close_reader(rd);
     exit(0);
 }
 
@@ -2107,7 +4707,7 @@ void original_parsing(FILE *fd)
 
 //////////////////PARSE NAV RELATED FUNCTIONS ///////////////////////////
 
-BYTE current_sat;
+JOB_LOCAL BYTE current_sat;
 
 typedef struct
 {
@@ -2153,7 +4753,7 @@ typedef struct
     \
 } EPHEM;
 
-EPHEM eph[32];
+JOB_LOCAL EPHEM eph[32];
 
 double URA_TABLE[16]= {2,2.8,4,5.7,8,11.3,16,32,64,128,256,512,1024,2048,4096,-1};
 
@@ -2231,7 +4831,7 @@ void dump_eph_ok(FILE* fd)
     {
         out=0;
         k=0;
-        while(ch=msg[k])
+        while((ch=msg[k]))
         {
             if(ch=='e')
             {
@@ -2307,7 +4907,7 @@ int format_double_old(char *dest,double a)
 
 
 
-int format_double(char *dest,double a)
+int format_double_printf(char *dest,double a)
 {
     char ptr[32];
     int ND,k,exp,index;
@@ -2358,17 +4958,83 @@ int format_double(char *dest,double a)
 
 
 
+// Multiplies by 10^n (|n|<=66) in three roundings at most
+double scale10(double x,int n)
+{
+    double P22=1e22;
+
+    for(; n>22; n-=22) x*=P22;
+    for(; n<-22; n+=22) x/=P22;
+
+    return (n>=0)? x*POW10[n]:x/POW10[-n];
+}
+
+
+// Same output as format_double_printf(), without sprintf and sscanf:
+// |a| is scaled to 12 digits and rounded. The scaled value is off by
+// less than 4e-4, so when its fraction is within 1e-3 of 0.5 (or a is
+// 0, not finite or out of range) the sprintf version decides instead.
+int format_double(char *dest,double a)
+{
+    double x,m,f;
+    unsigned long long N;
+    int e10,k,index,exp;
+
+    x=fabs(a);
+    if(!((x>1e-50) && (x<1e70))) return format_double_printf(dest,a);
+
+    e10=(int)floor(log10(x));
+    m=scale10(x,11-e10);
+    if(m<1e11) m=scale10(x,11-(--e10));
+    else if(m>=1e12) m=scale10(x,11-(++e10));
+    if((m<1e11) || (m>=1e12)) return format_double_printf(dest,a);
+
+    N=(unsigned long long)m;
+    f=m-(double)N;
+    if(fabs(f-0.5)<1e-3) return format_double_printf(dest,a);
+    if(f>0.5) N++;
+    if(N==1000000000000ULL)
+    {
+        N/=10;
+        e10++;
+    }
+
+    index=0;
+    dest[index++]= (signbit(a))? '-':' ';
+    dest[index++]='0';
+    dest[index++]='.';
+    for(k=11; k>=0; k--, N/=10) dest[index+k]=(char)('0'+N%10);
+    index+=12;
+
+    // "D%+03d"
+    exp=e10+1;
+    dest[index++]='D';
+    dest[index++]= (exp<0)? '-':'+';
+    if(exp<0) exp=-exp;
+    if(exp>=100) dest[index++]=(char)('0'+exp/100);
+    dest[index++]=(char)('0'+(exp/10)%10);
+    dest[index++]=(char)('0'+exp%10);
+    dest[index]=0;
+
+    return index;
+}
+
+
+
 int write_four(char* ptr,double one,double two,double three,double four)
 {
     int index=0;
 
-    index+=sprintf(ptr+index,"   ");
+    ptr[index++]=' ';
+    ptr[index++]=' ';
+    ptr[index++]=' ';
     index+=format_double(ptr+index,one);
     index+=format_double(ptr+index,two);
     index+=format_double(ptr+index,three);
     index+=format_double(ptr+index,four);
 
-    index+=sprintf(ptr+index,"\n");
+    ptr[index++]='\n';
+    ptr[index]=0;
 
     return index;
 }
@@ -2453,127 +5119,139 @@ void p_nbits(BYTE b,int n)
 void strip_parity(BYTE* org,ULONG word)
 {
     BYTE *dest;
-    int k,index;
-    BYTE d30;
-
-    d30 = (org[3] >> 6) & 0x01;
+    UINT32 w,data;
+    int index;
 
+    memcpy(&w,org,4);
+    data=(w>>6)&0x00ffffff;
+    data^=(0-((w>>30)&1))&0x00ffffff;    // D30* set: data bits complemented
 
     index=word*3;
     dest=frame[current_sat] + index;
+    dest[0]=(BYTE)(data>>16);
+    dest[1]=(BYTE)(data>>8);
+    dest[2]=(BYTE)data;
+    memset(check_frame[current_sat]+index,1,3);
 
-
-    for(k=0; k<3; k++)
+#ifdef TRACE
     {
-        dest[k] = ((org[3-k] & 0x3f)<<2) + ((org[2-k] & 0xc0)>>6);
-        if(d30==1) dest[k]= dest[k]^0xff;
-        check_frame[current_sat][index+k]=1;
+        int k;
+        printf("D30 %d\n",(w>>30)&1);
+        for(k=3; k>=0; k--) printf("%02x ",org[k]);
+        printf("\n");
+        for(k=3; k>=0; k--) p_bits(org[k]);
+        printf("\n");
+        printf("  ");
+        for(k=0; k<3; k++) p_bits(dest[k]);
+        printf("\n");
     }
-
-
-
-// memcpy(check+index,OK,3);
-
-#ifdef TRACE
-    printf("D30 %d\n",d30);
-    for(k=3; k>=0; k--) printf("%02x ",org[k]);
-    printf("\n");
-    for(k=3; k>=0; k--) p_bits(org[k]);
-    printf("\n");
-    printf("  ");
-    for(k=0; k<3; k++) p_bits(dest[k]);
-    printf("\n");
 #endif
-
-
 }
 
 
 
-// Extract bit number nbit from byte stream ptr
-BYTE peak_bit(int nbit,BYTE *ptr)
-{
-    int byte_pos=(nbit>>3);
-    int bit_pos=7-(nbit&0x07);
-    BYTE res = (ptr[byte_pos]&(1<<bit_pos)) >>bit_pos;
-    return res;
-}
-
-// Place bit (0/1) in position nbit of byte stream dest
-void poke_bit(BYTE bit,int nbit,BYTE *dest)
+// Extract L bits (1 to 32) starting at bit ini (1 = MSB of sf[0]).
+// The 8 bytes holding the field are loaded big endian and shifted into
+// place, sf must have 7 readable bytes past the last one used
+ULONG get_bits(const BYTE *sf,int ini,int L)
 {
-    int byte_pos=(nbit>>3);
-    int bit_pos=(nbit&0x07);
-    BYTE mask;
-    BYTE org=dest[byte_pos];
+    const BYTE *p;
+    UINT64 w;
 
-// printf("ORG %d  byte %d bit %d\n",org,byte_pos,bit_pos);
+    ini=ini-1;
+    p=sf+(ini>>3);
+    w = ((UINT64)p[0]<<56) | ((UINT64)p[1]<<48) | ((UINT64)p[2]<<40) | ((UINT64)p[3]<<32)
+        | ((UINT64)p[4]<<24) | ((UINT64)p[5]<<16) | ((UINT64)p[6]<<8) | (UINT64)p[7];
+    return (ULONG)((w<<(ini&7))>>(64-L));
+}
 
 
-    bit_pos=7-bit_pos;
+//Extract L bits starting from frame[ini-1] as unsigned long int (32 bits max)
+ULONG extrae_ulong(int ini, int L)
+{
+    return get_bits(frame[current_sat],ini,L);
+}
 
 
-    mask=0xff-(1<<bit_pos);
-    org &= mask;
 
-    //p_bits(org); printf("\n");
-    //p_bits(mask); printf("\n");
+double  get_real(ULONG data,int L, BYTE signo, int scale)
+{
+    long long v,m;
 
-    bit&=0x01;
-    org = org | (bit<<bit_pos);
+    // Two's complement of L bits: (v^m)-m with m the sign bit, 0 if unsigned
+    v=(long long)(data&(0xffffffffUL>>(32-L)));
+    m=(long long)(signo!=0)<<(L-1);
+    return ldexp((double)((v^m)-m),scale);
+}
 
-    //p_bits(org); printf("\n");
 
 
-    dest[byte_pos]=org;
-}
+// Scaled ephemeris parameters of subframes 1 to 3 (ICD-GPS-200 20.3.3)
+typedef struct
+{
+    BYTE ini;               // first bit in the subframe data (1-240)
+    BYTE L;                 // number of bits
+    BYTE signo;             // two's complement
+    signed char scale;      // power of 2 of the LSB
+    BYTE semicircles;       // multiplied by pi
+    size_t offset;          // double in EPHEM
+} type_nav_field;
 
+#define NAV_FIELD(ini,L,signo,scale,semi,name) {ini,L,signo,scale,semi,offsetof(EPHEM,name)}
 
-//Extract L bits starting from frame[ini-1] as unsigned long int (32 bits max)
-ULONG extrae_ulong(int ini, int L)
+const type_nav_field SF1_FIELDS[]=
 {
-    ULONG res=0;
-    BYTE *dest=(BYTE*)&res;
-    int k,pos_lsb;
-    BYTE data;
+    NAV_FIELD(161, 8,1,-31,0,tgd),
+    NAV_FIELD(217,22,1,-31,0,af[0]),
+    NAV_FIELD(201,16,1,-43,0,af[1]),
+    NAV_FIELD(193, 8,1,-55,0,af[2])
+};
 
-    ini=ini-1;
-    pos_lsb = ini+L-1;
-    for(k=0,pos_lsb=ini+L-1; k<L; k++,pos_lsb--)
-    {
-        data=peak_bit(pos_lsb,frame[current_sat]);
-        poke_bit(data,LSB[k],dest);
-    }
-    return res;
-}
+const type_nav_field SF2_FIELDS[]=
+{
+    NAV_FIELD( 57,16,1, -5,0,crs),
+    NAV_FIELD( 73,16,1,-43,1,dn),
+    NAV_FIELD( 89,32,1,-31,1,M0),
+    NAV_FIELD(121,16,1,-29,0,cuc),
+    NAV_FIELD(137,32,0,-33,0,ecc),
+    NAV_FIELD(169,16,1,-29,0,cus),
+    NAV_FIELD(185,32,0,-19,0,roota)
+};
+
+const type_nav_field SF3_FIELDS[]=
+{
+    NAV_FIELD( 49,16,1,-29,0,cic),
+    NAV_FIELD( 65,32,1,-31,1,W0),
+    NAV_FIELD( 97,16,1,-29,0,cis),
+    NAV_FIELD(113,32,1,-31,1,i0),
+    NAV_FIELD(145,16,1, -5,0,crc),
+    NAV_FIELD(161,32,1,-31,1,w),
+    NAV_FIELD(193,24,1,-43,1,Wdot),
+    NAV_FIELD(225,14,1,-43,1,idot)
+};
 
+#define N_FIELDS(t) (int)(sizeof(t)/sizeof(t[0]))
 
 
-double  get_real(ULONG data,int L, BYTE signo, int scale)
+// Decode the fields of table t from the current subframe into ep
+void fill_fields(const type_nav_field *t,int n,EPHEM *ep)
 {
-    double res,factor;
-    ULONG limit;
+    int k;
+    double d;
 
-    res=(double)data;
-    if(signo)
+    for(k=0; k<n; k++,t++)
     {
-        limit=1<<(L-1);
-        if(data>=limit)
-            res = res-pow((double)2.0,(double)L);
+        d=get_real(extrae_ulong(t->ini,t->L),t->L,t->signo,t->scale);
+        if(t->semicircles) d*=WGS84_PI;
+        *(double*)((BYTE*)ep+t->offset)=d;
     }
-
-    factor = pow(2.0,(double)scale);
-    res=res*factor;
+}
 
 
-    return res;
-}
 
 void fill_subframe1()
 {
     ULONG temp;
-    double d;
-    int L;
     BYTE alert,antispoof;
     char on_off[2][4];
     char *tab="        ";
@@ -2603,28 +5281,11 @@ void fill_subframe1()
     temp = extrae_ulong(65,6);
     eph[current_sat].health=(BYTE)temp;
 
-    L=8;
-    temp = extrae_ulong(161,L);
-    d=get_real(temp,L,1,-31);
-    eph[current_sat].tgd=d;
-
     temp = extrae_ulong(177,16);
     temp<<=4;
     eph[current_sat].toc=temp;
 
-    L=22;
-    temp = extrae_ulong(217,L);
-    d=get_real(temp,L,1,-31);
-    eph[current_sat].af[0]=d;
-    L=16;
-    temp = extrae_ulong(201,L);
-    d=get_real(temp,L,1,-43);
-    eph[current_sat].af[1]=d;
-    L=8;
-    temp = extrae_ulong(193,8);
-    d=get_real(temp,L,1,-55);
-    eph[current_sat].af[2]=d;
-
+    fill_fields(SF1_FIELDS,N_FIELDS(SF1_FIELDS),&eph[current_sat]);
 
 
     if(VERBOSE_NAV==0) return;
@@ -2634,7 +5295,7 @@ void fill_subframe1()
 // printf("------------------------------------------------------------------\n");
     printf("\nPRN %02d: ",eph[current_sat].prn);
     printf("Issue Of Data Clock (IODC) %04u -> IODE %3d. ",eph[current_sat].iodc,eph[current_sat].iodc&0xff);
-    printf("Week GPS %lu.\n",eph[current_sat].week);
+    printf("Week GPS %d.\n",eph[current_sat].week);
 
     printf("%s",tab);
     switch(eph[current_sat].L2_code)
@@ -2687,7 +5348,6 @@ void fill_subframe1()
 void fill_subframe2()
 {
     ULONG temp;
-    double d;
     int L;
     char *tab="        ";
 
@@ -2698,36 +5358,7 @@ void fill_subframe2()
     eph[current_sat].iode2=temp;
 
 
-    L=16;
-    temp = extrae_ulong(169,L);
-    d=get_real(temp,L,1,-29);
-    eph[current_sat].cus=d;
-    L=16;
-    temp = extrae_ulong(121,L);
-    d=get_real(temp,L,1,-29);
-    eph[current_sat].cuc = d;
-    L=16;
-    temp=extrae_ulong(57,L);
-    d=get_real(temp,L,1,-5);
-    eph[current_sat].crs=d;
-
-    L=32;
-    temp = extrae_ulong(89,L);
-    d=get_real(temp,L,1,-31)*WGS84_PI;
-    eph[current_sat].M0 = d;
-    L=16;
-    temp = extrae_ulong(73,L);
-    d=get_real(temp,L,1,-43)*WGS84_PI;
-    eph[current_sat].dn = d;
-
-    L=32;
-    temp = extrae_ulong(137,L);
-    d=get_real(temp,L,0,-33);
-    eph[current_sat].ecc=d;
-    L=32;
-    temp = extrae_ulong(185,L);
-    d=get_real(temp,L,0,-19);
-    eph[current_sat].roota = d;
+    fill_fields(SF2_FIELDS,N_FIELDS(SF2_FIELDS),&eph[current_sat]);
 
     L=16;
     temp = extrae_ulong(217,L)<<4;
@@ -2746,7 +5377,7 @@ void fill_subframe2()
 
 //printf("------------------------------------------------------------------\n");
     printf("\nPRN %02d: ",current_sat+1);
-    printf("Issue Of Data Ephemeris (IODE) %lu\n",eph[current_sat].iode2);
+    printf("Issue Of Data Ephemeris (IODE) %d\n",eph[current_sat].iode2);
 
     printf("%s",tab);
     printf("Reference Time for Ephemeris (TOE): %6.0f sec\n",eph[current_sat].toe);
@@ -2784,62 +5415,24 @@ void fill_subframe2()
 void fill_subframe3()
 {
     ULONG temp;
-    double d;
     int L;
     char *tab="        ";
 
 //eph[current_sat].tom=(N_FRAME-1)*6;
 
-    L=16;
-    temp = extrae_ulong(49,L);
-    d=get_real(temp,L,1,-29);
-    eph[current_sat].cic = d;
-
-    L=32;
-    temp = extrae_ulong(65,L);
-    d=get_real(temp,L,1,-31)*WGS84_PI;
-    eph[current_sat].W0=d;
-
-    L=16;
-    temp = extrae_ulong(97,L);
-    d=get_real(temp,L,1,-29);
-    eph[current_sat].cis = d;
-
-    L=32;
-    temp = extrae_ulong(113,L);
-    d=get_real(temp,L,1,-31)*WGS84_PI;
-    eph[current_sat].i0 = d;
-
-    L=16;
-    temp = extrae_ulong(145,L);
-    d=get_real(temp,L,1,-5);
-    eph[current_sat].crc= d;
-
-    L=32;
-    temp = extrae_ulong(161,L);
-    d=get_real(temp,L,1,-31)*WGS84_PI;
-    eph[current_sat].w = d;
-
-    L=24;
-    temp = extrae_ulong(193,L);
-    d=get_real(temp,L,1,-43)*WGS84_PI;
-    eph[current_sat].Wdot = d;
+    fill_fields(SF3_FIELDS,N_FIELDS(SF3_FIELDS),&eph[current_sat]);
 
     L=8;
     temp = extrae_ulong(217,L);
     eph[current_sat].iode3=temp;
 
-    L=14;
-    temp = extrae_ulong(225,L);
-    d=get_real(temp,L,1,-43)*WGS84_PI;
-    eph[current_sat].idot = d;
 
 
     if(VERBOSE_NAV==0) return;
     if((SELECTED_SF!=-1) && (SELECTED_SF!=3)) return;
 
     printf("\nPRN %02d: ",current_sat+1);
-    printf("Issue of Data Ephemeris (IODE) %lu .\n",eph[current_sat].iode3);
+    printf("Issue of Data Ephemeris (IODE) %d .\n",eph[current_sat].iode3);
 
     printf("%s",tab);
     printf("Inclination angle (i0) : %.4g deg. ",eph[current_sat].i0*180/WGS84_PI);
@@ -3076,7 +5669,7 @@ void fill_subframe4()
         }
 
         else
-            printf("d SV_ID %d. Almanac page devoted to other function\n",page,sv_id);
+            printf("Page %d SV_ID %d. Almanac page devoted to other function\n",page,sv_id);
         break;
     }
 
@@ -3188,7 +5781,7 @@ int show_alm()
     af1=get_real(temp,L,1,-38);
 
     printf("%s",tab);
-    printf("Almanac Reference Time (toa) %lu sec. ",toa);
+    printf("Almanac Reference Time (toa) %lu sec. ",(unsigned long)toa);
     printf("Health ");
     p_bits(health);
     printf("\n");
@@ -3223,7 +5816,6 @@ void fill_subframe5()
     ULONG wna,toa;
     BYTE sv_health[24],detail;
     int k,bad;
-    char *tab="             ";
 
     sv_id=(BYTE)extrae_ulong(51,6);
     page=pages[sv_id];
@@ -3247,7 +5839,7 @@ void fill_subframe5()
 
         toa=extrae_ulong(57,8)<<12;
         wna=extrae_ulong(65,8);
-        printf("   Time of Almanac (toa) %lu sec.  Almanac Week (mod 256) %d\n",toa,wna);
+        printf("   Time of Almanac (toa) %lu sec.  Almanac Week (mod 256) %d\n",(unsigned long)toa,wna);
 
         printf("   Health report for SVs 1-24: ");
         for(k=0; k<24; k++) sv_health[k]=(BYTE)extrae_ulong(73+k*6,6);
@@ -3619,10 +6211,10 @@ int detect_new_ephemeris()
 
 void generate_nav_header(FILE* fd)
 {
-    int k,l,lines,written,max_lines,nchars;
+    int l,lines,written,max_lines,nchars;
     char *header,*ptr;
     time_t tt;
-    char *date,buffer[80];
+    char *date,buffer[80],now[32];
 //struct tm gmt;
 //double dt,secs;
 
@@ -3643,7 +6235,11 @@ void generate_nav_header(FILE* fd)
     ptr+=sprintf(ptr,padd(buffer,buffer,20));
     ptr+=sprintf(ptr,padd("Any GPS12 Owner",buffer,20));
     time(&tt);
+#ifdef _WIN32
     date=ctime(&tt);
+#else
+    date=ctime_r(&tt,now);
+#endif
     ptr+=sprintf(ptr,padd(date,buffer,20));
     ptr+=sprintf(ptr,"PGM / RUN BY / DATE ");
 
@@ -3656,177 +6252,441 @@ void generate_nav_header(FILE* fd)
     ptr+=sprintf(ptr,"COMMENT             ");
 
 
-    sprintf(buffer,"** Generated from G12 data file: %s ",DATAFILE);
-    padd(buffer,buffer,60);
-    ptr+=sprintf(ptr,"%s",buffer);
-    ptr+=sprintf(ptr,"%s",padd("COMMENT",buffer,20));
+    sprintf(buffer,"** Generated from G12 data file: %.40s ",DATAFILE);
+    padd(buffer,buffer,60);
+    ptr+=sprintf(ptr,"%s",buffer);
+    ptr+=sprintf(ptr,"%s",padd("COMMENT",buffer,20));
+
+    written=sprintf(ptr,"** Options: ");
+    ptr+=written;
+    ptr+=sprintf(ptr,"%s",padd(COMMAND_LINE,buffer,60-written));
+    ptr+=sprintf(ptr,"COMMENT             ");
+
+// ptr+=sprintf(ptr,"  %12.4E%12.4E%12.4E%12.4E%10c",0.0,0.0,0.0,0.0,32);
+// ptr+=sprintf(ptr,padd("ION ALFA",buffer,20));
+// ptr+=sprintf(ptr,"  %12.4E%12.4E%12.4E%12.4E%10c",0.0,0.0,0.0,0.0,32);
+// ptr+=sprintf(ptr,padd("ION BETA",buffer,20));
+// ptr+=sprintf(ptr,"%60cDELTA-UTC: A0,A1,T,W",32);
+// ptr+=sprintf(ptr,"%60cLEAP SECONDS        ",32);
+
+    ptr+=sprintf(ptr,"%60cEND OF HEADER       ",32);
+
+    nchars=(ptr-header);
+    lines=nchars/80;
+//printf("Number of chars %d -> lines %d\n",nchars,lines);
+
+    for(l=0; l<lines; l++)
+    {
+        fwrite(header+l*80,1,80,fd);
+        fputc('\n',fd);
+    }
+
+    free((char*)header);
+
+
+}
+
+
+
+void check_VC_format()
+{
+    double a=0.12345678901234;
+    char msg[32];
+    int k;
+
+    sprintf(msg,"%11.3le",a);
+
+    k=0;
+    while(msg[k]!='e') k++;
+    //printf("%s. Posicion %d\n",msg,k);
+
+    if(k==7) VC_format=0;
+}
+
+
+// GPS navigation words as logged (0x36 records), 32 bits little endian:
+//   bits 31,30: D29,D30 of the previous word
+//   bits 29-6 : data bits d1..d24 (complemented when D30 of the previous
+//               word is 1)
+//   bits 5-0  : parity bits D25..D30
+// Every parity bit is the XOR of the bits of the (decoded) word selected
+// by its mask, so a whole word is checked with six parities of 32 bits.
+
+#define MASK_DATA   0x3fffffc0
+#define MASK_PARITY 0x0000003f
+#define MASK_D30    0x40000000
+
+UINT32 PARITY_MASK[6]=
+{
+    0xbb1f3480,     // D25 = D29*^d1^d2^d3^d5^d6^d10^d11^d12^d13^d14^d17^d18^d20^d23
+    0x5d8f9a40,     // D26 = D30*^d2^d3^d4^d6^d7^d11^d12^d13^d14^d15^d18^d19^d21^d24
+    0xaec7cd00,     // D27 = D29*^d1^d3^d4^d5^d7^d8^d12^d13^d14^d15^d16^d19^d20^d22
+    0x5763e680,     // D28 = D30*^d2^d4^d5^d6^d8^d9^d13^d14^d15^d16^d17^d20^d21^d23
+    0x6bb1f340,     // D29 = D30*^d1^d3^d5^d6^d7^d9^d10^d14^d15^d16^d17^d18^d21^d22^d24
+    0x8b7a89c0      // D30 = D29*^d3^d5^d6^d8^d9^d10^d11^d13^d15^d19^d22^d23^d24
+};
+
+
+// 1 if an odd number of bits are set
+UINT32 odd_bits(UINT32 x)
+{
+#ifdef __GNUC__
+    return (UINT32)__builtin_parity(x);
+#else
+    x^=x>>16;
+    x^=x>>8;
+    x^=x>>4;
+    return (0x6996>>(x&0x0f))&1;
+#endif
+}
+
+
+BOOLEAN parity_word(UINT32 w)
+{
+    UINT32 P;
+    int k;
+
+    if(w&MASK_D30) w^=MASK_DATA;   // source bits complement
+
+    P=0;
+    for(k=0; k<6; k++) P=(P<<1)|odd_bits(w&PARITY_MASK[k]);
+
+    return (P==(w&MASK_PARITY));
+}
+
+
+BOOLEAN parity(BYTE *ptr)
+{
+    UINT32 w;
+
+    memcpy(&w,ptr,4);
+    return parity_word(w);
+}
+
+
+// State kept between records while generating the navigation file
+
+typedef struct
+{
+    ULONG current_frame[32];
+    BOOLEAN all_par;
+    BOOLEAN window;     // only ephemeris inside -start/-stop/-time
+    BOOLEAN failed;     // the file could not be created
+    FILE *dest;
+    char *file;         // name given by the caller, NULL: named after the data
+    long n_eph;
+}
+type_nav_state;
+
+
+void reset_nav_state(type_nav_state *ns, char *file)
+{
+    check_VC_format();
+
+    // Ephemeris broadcast within -start/-stop/-time (and the frame before)
+    ns->window= (START!=-1) || (LAST<=604800) || (ELAPSED<=604800);
+    ns->all_par=1;
+    ns->failed=0;
+    ns->dest=NULL;
+    ns->file=file;
+    ns->n_eph=0;
+
+    reset_eph();
+    for(current_sat=0; current_sat<32; current_sat++)
+    {
+        reset_frame();
+        ns->current_frame[current_sat]=0xffffffff;
+    }
+}
+
+
+void add_nav_record(type_nav_state *ns, BYTE id, BYTE *record)
+{
+    type_rec0x36 rec;
+    ULONG N_frame,word;
+    ULONG week,garmin_wdays,tom;
+    char name[128];
+    long tow;
+
+    if((id!=0x36) || ns->failed) return;
+
+    rec=process_0x36(record);
+    current_sat=rec.sv;
+    if(current_sat>=32) return;
+
+    tow=(long)(rec.c50/50);
+    if(START==-1) START=tow;
+    if(ns->window && ((tow<START-NAV_WARMUP) || (tow>LAST) || (tow-START>ELAPSED)))
+        return;
+
+    N_frame = (rec.c50-30)/300;
+    if(ns->current_frame[current_sat]==0xffffffff)
+        ns->current_frame[current_sat]=N_frame;
+    if(N_frame!=ns->current_frame[current_sat])
+    {
+        //printf("N_frame %d  Parity %d\n",N_frame,all_par);
+        if(ns->all_par) procesa_frame(N_frame);
+        ns->all_par=1;
+
+        reset_frame();
+        if(detect_new_ephemeris() && (eph[current_sat].health==0))
+        {
+            tom=6*(N_frame-1);
+            //printf("New Ephemeris -> Frame %d (Tom %d): ",N_frame,tom);
+            //printf("PRN %d. IODE %d\n",current_sat+1,eph[current_sat].iode3);
+            eph[current_sat].tom=tom;
+            if(ns->dest==NULL)
+            {
+                // Convert toc time
+                week=(ULONG)eph[current_sat].week;
+                garmin_wdays=(week-521)*7; //tom=floor(tom);
+                if(ns->file!=NULL) ns->dest=open_rinex_file(ns->file);
+                else ns->dest= (RINEX_FILE)? \
+                                   create_rinex_file(nav_location,garmin_wdays,tom,name,'n'):stdout;
+                if(ns->dest==NULL)
+                {
+                    ns->failed=1;
+                    return;
+                }
+                generate_nav_header(ns->dest);
+            }
+            dump_eph(ns->dest);  //current_sat);
+            ns->n_eph++;
+        }
+        ns->current_frame[current_sat]=N_frame;
+    }
+
+    ns->all_par &= parity(rec.uk);
+    word=((rec.c50-30)%300)/30;
+    strip_parity(rec.uk,word);
+}
 
-    written=sprintf(ptr,"** Options: ");
-    ptr+=written;
-    ptr+=sprintf(ptr,padd(COMMAND_LINE,buffer,60-written));
-    ptr+=sprintf(ptr,"COMMENT             ");
 
-// ptr+=sprintf(ptr,"  %12.4E%12.4E%12.4E%12.4E%10c",0.0,0.0,0.0,0.0,32);
-// ptr+=sprintf(ptr,padd("ION ALFA",buffer,20));
-// ptr+=sprintf(ptr,"  %12.4E%12.4E%12.4E%12.4E%10c",0.0,0.0,0.0,0.0,32);
-// ptr+=sprintf(ptr,padd("ION BETA",buffer,20));
-// ptr+=sprintf(ptr,"%60cDELTA-UTC: A0,A1,T,W",32);
-// ptr+=sprintf(ptr,"%60cLEAP SECONDS        ",32);
+void close_nav(type_nav_state *ns)
+{
+    if((ns->dest!=NULL) && (ns->dest!=stdout)) fclose(ns->dest);
+    ns->dest=NULL;
+}
 
-    ptr+=sprintf(ptr,"%60cEND OF HEADER       ",32);
 
-    nchars=(ptr-header);
-    lines=nchars/80;
-//printf("Number of chars %d -> lines %d\n",nchars,lines);
+// Written to file if not NULL, else as the options say.
+// Returns the number of ephemerides written
+long generate_nav(type_reader *rd, char *file)
+{
+    BYTE *record,id,L;
+    type_nav_state ns;
 
-    for(l=0; l<lines; l++,fprintf(fd,"\n"))
-        for(k=0; k<80; k++)  fprintf(fd,"%c",header[l*80+k]);
+    reset_nav_state(&ns,file);
+    seek_window(rd,NAV_WARMUP+INDEX_WARMUP,INDEX_WARMUP);
 
-    free((char*)header);
+    while((ns.failed==0) && next_record(rd,&id,&L,&record))
+        add_nav_record(&ns,id,record);
 
+    close_nav(&ns);
+    close_reader(rd);
 
+    return ns.n_eph;
 }
 
 
+//////////////////////////////////////////////////////////////////////////
+// Streaming conversion (gar2rnx.h). The records are pushed one at a time
+// and go through the same code as a G12 file: the observation file waits
+// for the header info in a window, the navigation file is independent.
+// Each conversion sets START from its own first record, so START is
+// switched before calling them. convert_g12() is the whole file
+// conversion of the command line, for programs that time it.
+//////////////////////////////////////////////////////////////////////////
 
-void check_VC_format()
+struct type_stream
 {
-    double a=0.12345678901234;
-    char msg[32];
-    int k;
+    type_rinex_state st;
+    type_nav_state ns;
+    BYTE *window;           // records kept until the header info is known
+    long used;
+    long obs_start,nav_start;
+    char obs_file[256],nav_file[256];
+    BYTE record[MAX_RECORD+256];   // zero padded copy, see next_record
+};
+
+
+// Cuts the next argument off the options at *p, in place. As on a command
+// line, blanks between double quotes are kept and the quotes removed
+char *split_arg(char **p)
+{
+    char *from,*to,*arg;
+    BOOLEAN quoted;
 
-    sprintf(msg,"%11.3le",a);
+    from=*p;
+    while((*from==' ') || (*from=='\t')) from++;
+    if(*from==0) return NULL;
 
-    k=0;
-    while(msg[k]!='e') k++;
-    //printf("%s. Posicion %d\n",msg,k);
+    arg=to=from;
+    quoted=0;
+    while(*from && (quoted || ((*from!=' ') && (*from!='\t'))))
+    {
+        if(*from=='"') quoted=!quoted;
+        else *to++=*from;
+        from++;
+    }
+    if(*from) from++;
+    *to=0;
+    *p=from;
 
-    if(k==7) VC_format=0;
+    return arg;
 }
 
 
-#define MASK_DATA   0x3fffffc0
-#define MASK_PARITY 0x0000003f
+// Options parsed as the command line "gar2rnx g12_file options"
+BOOLEAN parse_option_line(char *g12_file, char *options)
+{
+    char line[1024],*argv[64],*arg,*p;
+    int argc;
+
+    memset(line,0,sizeof(line));
+    if(options!=NULL) strncpy(line,options,sizeof(line)-1);
+    argv[0]="gar2rnx";
+    argv[1]=g12_file;
+    argc=2;
+    p=line;
+    while((argc<63) && ((arg=split_arg(&p))!=NULL))
+        argv[argc++]=arg;
+    argv[argc]=NULL;
+
+    BATCH=0;
+    STDIN=0;
+    return parse_options(argc,argv);
+}
 
-BOOLEAN parity(BYTE *ptr)
+
+type_stream* stream_open(char *g12_file, char *options, char *obs_file, char *nav_file)
 {
-    BYTE P,T,*dest;
-    //int k;
+    type_stream *s;
+
+    if(parse_option_line(g12_file,options)==0) return NULL;
 
-    dest=(BYTE*)&NAV_WORD;
-    memcpy((void*)&NAV_WORD,(void*)ptr,4);
+    s=(type_stream*)calloc(1,sizeof(type_stream));
+    if(s==NULL) return NULL;
+    s->window=(BYTE*)malloc(LOOKAHEAD);
+    if(s->window==NULL)
+    {
+        free(s);
+        return NULL;
+    }
 
+    strncpy(DATAFILE,g12_file,sizeof(DATAFILE)-1);
+    strncpy(s->obs_file,obs_file,sizeof(s->obs_file)-1);
+    if(nav_file!=NULL) strncpy(s->nav_file,nav_file,sizeof(s->nav_file)-1);
 
-    //for(k=0;k<4;k++) { p_bits(dest[k]); printf("|"); } printf("\n");
+    START=START_ARG;
+    reset_header_info(&s->st.info);
+    s->st.dest=NULL;
+    reset_nav_state(&s->ns,s->nav_file);
+    if(nav_file==NULL) s->ns.failed=1;
+    s->obs_start=s->nav_start=START_ARG;
 
-    if(P30) NAV_WORD ^= MASK_DATA;   // source bits complement
+    return s;
+}
 
-    //for(k=0;k<4;k++) { p_bits(dest[k]); printf("|"); } printf("\n");
 
+// Header info found (or not before the end of the window)
+void start_stream_obs(type_stream *s)
+{
+    start_rinex(&s->st,s->window,s->used,s->obs_file);
+    free(s->window);
+    s->window=NULL;
+}
 
-    P = (BYTE)(P29^d1^d2^d3^d5^d6^d10^d11^d12^d13^d14^d17^d18^d20^d23);
-    P = (P<<1) + (BYTE)(P30^d2^d3^d4^d6^d7^d11^d12^d13^d14^d15^d18^d19^d21^d24);
-    P = (P<<1) + (BYTE)(P29^d1^d3^d4^d5^d7^d8^d12^d13^d14^d15^d16^d19^d20^d22);
-    P = (P<<1) + (BYTE)(P30^d2^d4^d5^d6^d8^d9^d13^d14^d15^d16^d17^d20^d21^d23);
-    P = (P<<1) + (BYTE)(P30^d1^d3^d5^d6^d7^d9^d10^d14^d15^d16^d17^d18^d21^d22^d24);
-    P = (P<<1) + (BYTE)(P29^d3^d5^d6^d8^d9^d10^d11^d13^d15^d19^d22^d23^d24);
 
-    //printf("D25-30%d%d%d%d%d%d\n
+void stream_record(type_stream *s, BYTE id, BYTE L, BYTE *record)
+{
+    // The decoders read their fields whatever L says
+    memset(s->record,0,sizeof(s->record));
+    memcpy(s->record,record,L);
+    record=s->record;
 
-    T=(BYTE)(NAV_WORD&MASK_PARITY);
-//printf("Comp Parity %02x  Transmitted %02x\n",P,T); //getchar();
+    START=s->nav_start;
+    add_nav_record(&s->ns,id,record);
+    s->nav_start=START;
 
-    return (P==T);
+    START=s->obs_start;
+    if(s->window!=NULL)
+    {
+        if(keep_header_record(&s->st,s->window,&s->used,id,L,record)==0)
+            start_stream_obs(s);
+    }
+    else if(s->st.dest!=NULL) add_rinex_record(&s->st,id,record);
+    s->obs_start=START;
 }
 
 
-void generate_nav(FILE *fd)
+long stream_close(type_stream *s, long *n_eph)
 {
-    BYTE record[256],id,L;
-    type_rec0x36 rec;
-    ULONG N_frame,word;
-    ULONG current_frame[32];
-    BOOLEAN first=1;
-    FILE *dest;
-    ULONG week,garmin_wdays,tom;
-    char name[128];
-    BOOLEAN all_par;
+    long n_epochs;
 
-    check_VC_format();
+    // Short session: the header info was still incomplete
+    START=s->obs_start;
+    if(s->window!=NULL) start_stream_obs(s);
 
-    reset_eph();
-    for(current_sat=0; current_sat<32; current_sat++)
+    n_epochs=-1;
+    if(s->st.dest!=NULL)
     {
-        reset_frame();
-        current_frame[current_sat]=0xffffffff;
+        if(s->st.crx!=NULL) crx_close(s->st.crx,s->st.dest);
+        fclose(s->st.dest);
+        n_epochs=s->st.n_epochs;
     }
 
-    all_par=1;
-    while(feof(fd)==0)
-    {
-        fread(&id,1,1,fd);
-        fread(&L,1,1,fd);
-        fread(record,1,L,fd);
+    close_nav(&s->ns);
+    if(n_eph!=NULL) *n_eph=s->ns.n_eph;
 
-        if(id==0x36)
-        {
-            rec=process_0x36(record);
-            current_sat=rec.sv;
-            if(current_sat<32)
-            {
-                N_frame = (rec.c50-30)/300;
-                if(current_frame[current_sat]==0xffffffff)
-                    current_frame[current_sat]=N_frame;
-                if(N_frame!=current_frame[current_sat])
-                {
-                    //printf("N_frame %d  Parity %d\n",N_frame,all_par);
-                    if(all_par) procesa_frame(N_frame);
-                    all_par=1;
+    free(s);
+    return n_epochs;
+}
 
-                    reset_frame();
-                    if(detect_new_ephemeris() && (eph[current_sat].health==0))
-                    {
-                        tom=6*(N_frame-1);
-                        //printf("New Ephemeris -> Frame %d (Tom %d): ",N_frame,tom);
-                        //printf("PRN %d. IODE %d\n",current_sat+1,eph[current_sat].iode3);
-                        eph[current_sat].tom=tom;
-                        if(first)
-                        {
-                            // Convert toc time
-                            week=(ULONG)eph[current_sat].week;
-                            garmin_wdays=(week-521)*7; //tom=floor(tom);
-                            if(RINEX_FILE)
-                            {
-                                get_rinex_file_name(location,garmin_wdays,tom,name,'n');
-                                dest=fopen(name,"w");
-                            }
-                            else dest=stdout;
-                            generate_nav_header(dest);
-                            first=0;
-                        }
-                        dump_eph(dest);  //current_sat);
-                    }
-                    current_frame[current_sat]=N_frame;
-                }
 
-                all_par &= parity(rec.uk);
-                word=((rec.c50-30)%300)/30;
-                strip_parity(rec.uk,word);
-            }
-        }
+// The same steps as main() for the observation and navigation files
+long convert_g12(char *g12_file, char *options, char *out_file)
+{
+    FILE *fd,*out;
+    type_reader rd;
+    long n;
+
+    if(parse_option_line(g12_file,options)==0) return -1;
+
+    strncpy(DATAFILE,g12_file,sizeof(DATAFILE)-1);
+    DATAFILE[sizeof(DATAFILE)-1]=0;
+
+    fd=fopen(g12_file,"rb");
+    if(fd==NULL) return -1;
+    if(open_reader(&rd,fd)==0)
+    {
+        fclose(fd);
+        return -1;
     }
 
-    if(RINEX_FILE) fclose(dest);
-    if(STDIN==0) fclose(fd);
+    if(RINEX_GENERATION==0) find_layout(&rd);
 
-    exit(0);
+    if(ONLY_STATS)
+    {
+        out=fopen(out_file,"w");
+        if(out==NULL)
+        {
+            close_reader(&rd);
+            return -1;
+        }
+        n=collect_stats(&rd,out);
+        fclose(out);
+        return n;
+    }
+    if(NAV_GENERATION) return generate_nav(&rd,out_file);
+    return generate_rinex(&rd,out_file);
 }
 
 
-void monitor_nav(FILE *fd)
+void monitor_nav(type_reader *rd)
 {
     BOOLEAN par,all_par;
-    BYTE record[256],id,L;
+    BYTE *record,id,L;
     type_rec0x36 rec;
     ULONG N_frame,word,last_word;
     ULONG current_frame[32];
@@ -3852,12 +6712,8 @@ void monitor_nav(FILE *fd)
     all_par=1;
     last_word=-1;
 
-    while(feof(fd)==0)
+    while(next_record(rd,&id,&L,&record))
     {
-        fread(&id,1,1,fd);
-        fread(&L,1,1,fd);
-        fread(record,1,L,fd);
-
         if(id==0x36)
         {
             rec=process_0x36(record);
@@ -3908,7 +6764,7 @@ void monitor_nav(FILE *fd)
     }
 
     printf("\n");
-    if(STDIN==0) fclose(fd);
+    close_reader(rd);
     exit(0);
 }
 
@@ -3917,9 +6773,159 @@ void monitor_nav(FILE *fd)
 //////////////////////////////////////////////////////////////////////////
 
 
+/////////////////////////////////////////////////
+// Batch mode
+/////////////////////////////////////////////////
+
+// Converts one G12 file into a RINEX observation and navigation file.
+// Everything a conversion modifies is JOB_LOCAL, so several files can
+// be converted at the same time, one per thread.
+void convert_file(char *file)
+{
+    FILE *fd;
+    type_reader rd;
+    long n_epochs,n_eph;
+    int k;
+
+    strncpy(DATAFILE,file,sizeof(DATAFILE)-1);
+    DATAFILE[sizeof(DATAFILE)-1]=0;
+
+    // Both files get the session number of the first one named
+    PAIRED=1;
+    SESSION=0;
+
+    n_epochs=n_eph=-1;
+    for(k=0; k<2; k++)
+    {
+        START=START_ARG;
+        fd=fopen(file,"rb");
+        if(fd==NULL)
+        {
+            printf("Cannot read data from %s (\?\')\n",file);
+            return;
+        }
+        if(open_reader(&rd,fd)==0)
+        {
+            printf("Not enough memory to read %s\n",file);
+            fclose(fd);
+            return;
+        }
+
+        if(k==0) n_epochs=generate_rinex(&rd,NULL);
+        else n_eph=generate_nav(&rd,NULL);
+    }
+
+    if(n_epochs<0) printf("%s: no RINEX observation file, %ld ephemerides\n",file,n_eph);
+    else printf("%s: %ld epochs, %ld ephemerides\n",file,n_epochs,n_eph);
+}
+
+
+// Number of threads used when -j is not given
+int default_threads()
+{
+    int n;
+#ifdef _WIN32
+    char *env;
+
+    env=getenv("NUMBER_OF_PROCESSORS");
+    n= (env!=NULL)? atoi(env):1;
+#else
+    n=(int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return (n<1)? 1:n;
+}
+
+
+#ifndef NO_THREADS
+int NEXT_BATCH;
+pthread_mutex_t BATCH_LOCK=PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread takes the next file of the list until none is left
+void* batch_thread(void *arg)
+{
+    int k;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&BATCH_LOCK);
+        k=NEXT_BATCH++;
+        pthread_mutex_unlock(&BATCH_LOCK);
+
+        if(k>=N_BATCH) break;
+        convert_file(BATCH_FILES[k]);
+    }
+
+    return arg;
+}
+#endif
+
+
+void run_batch()
+{
+    int k;
+#ifndef NO_THREADS
+    pthread_t *threads;
+    int n;
+
+    n= (N_THREADS>0)? N_THREADS:default_threads();
+    if(n>N_BATCH) n=N_BATCH;
+
+    threads=(pthread_t*)malloc(n*sizeof(pthread_t));
+    NEXT_BATCH=0;
+    for(k=0; k<n; k++)
+        if(pthread_create(&threads[k],NULL,batch_thread,NULL)!=0) break;
+
+    if(k==0) batch_thread(NULL);     // No threads at all: do it ourselves
+    n=k;
+    for(k=0; k<n; k++) pthread_join(threads[k],NULL);
+    free(threads);
+#else
+    for(k=0; k<N_BATCH; k++) convert_file(BATCH_FILES[k]);
+#endif
+}
+
+
+void add_batch_file(char *file)
+{
+    if(N_BATCH==MAX_BATCH)
+    {
+        MAX_BATCH= (MAX_BATCH)? 2*MAX_BATCH:64;
+        BATCH_FILES=(char**)realloc(BATCH_FILES,MAX_BATCH*sizeof(char*));
+    }
+    BATCH_FILES[N_BATCH]=(char*)malloc(strlen(file)+1);
+    strcpy(BATCH_FILES[N_BATCH++],file);
+}
+
+
+// One file name per line. Returns 0 if it can't be read
+BOOLEAN read_batch_list(char *list)
+{
+    FILE *fd;
+    char line[512];
+    int L;
+
+    fd=fopen(list,"r");
+    if(fd==NULL)
+    {
+        printf("Cannot read the list of files %s\n",list);
+        return 0;
+    }
+
+    while(fgets(line,sizeof(line),fd)!=NULL)
+    {
+        L=strlen(line);
+        while((L>0) && ((line[L-1]=='\n') || (line[L-1]=='\r') || (line[L-1]==' '))) line[--L]=0;
+        if(L) add_batch_file(line);
+    }
+    fclose(fd);
+    return 1;
+}
+
+
 void print_help(char **argv)
 {
-    char help[8192];
+    char help[10240];
 
     sprintf(help,
             "-----------------------------------------------------------------\n"\
@@ -3933,10 +6939,13 @@ void print_help(char **argv)
 
     strcat(help,"\n\
 USAGE: gar2rnx g12file [-stat]\n\
+                       [-index]\n\
+                       [-compress]\n\
                        [-parse options]\n\
                        [-rinex options]\n\
                        [-nav]\n\
                        [-monitor option]\n\
+       gar2rnx -batch g12file ... [-list file] [-j N] [-rinex options]\n\
 \n\
   g12file is a file generated using the async logger utility.\n\
           It's the only mandatory argument. If this argument is\n\
@@ -3947,7 +6956,15 @@ USAGE: gar2rnx g12file [-stat]\n\
 \n\n\
 ******************************************************************\n\n\
   -stat : shows statistics about the number, Identity byte and\n\
-          length of received packets\n\n");
+          length of received packets\n\n\
+  -index: writes g12file.idx with the position of every epoch in\n\
+          g12file. When this file exists, -start, -stop and -time\n\
+          go straight to the requested part of g12file. It is not\n\
+          used once g12file changes, until it is built again.\n\n\
+  -compress: writes g12filez, a lossless compressed copy of g12file.\n\
+          g12filez can be given instead of g12file to every mode,\n\
+          and -start/-stop/-time go straight to the requested part\n\
+          of it.\n\n");
 
 
     strcat(help,"******************************************************************\n\n\
@@ -3975,12 +6992,21 @@ USAGE: gar2rnx g12file [-stat]\n\
 \n\
    List of options that can be used along with -rinex:\n\
 \n\
-  -etrex    : when using an Etrex (or Emap) to log your data, you\n\
-               should use this option to obtain a proper Rinex file.\n\
+  -etrex    : the records have the Etrex (or Emap) layout. Without\n\
+               -etrex or -gps12 the layout is told from the 0x38\n\
+               records and saved in the capability file for next time,\n\
+               or else found there for the receiver of the 0xFF record\n\
+  -gps12    : the records have the GPS 12 layout\n\
+  -caps file: receiver capability file (default GarminCaps.txt in\n\
+               the folder of gar2rnx), shared with GarminBinary.\n\
+               -rinex, -nav and -batch save layouts to it\n\
   -reset    : reset the time-tags to the nearest full second\n\
                modifying the observables accordingly\n\
   -f        : Instead of sending the RINEX file to standard output\n\
                (default) it creates a file using the RINEX conventions\n\
+  -crx      : writes Compact RINEX (Hatanaka) instead, as rnx2crx\n\
+               would (ssssdddf.yyD with -f). crx2rnx gives back the\n\
+               RINEX file. Pipe it to gzip for a .yyD.gz file\n\
 \n------------------------------------------------------------------\n\n\
    -start tow: starts the generation of the RINEX file from tow\n\
                (week_seconds). By default, it starts from the first\n\
@@ -3990,6 +7016,7 @@ USAGE: gar2rnx g12file [-stat]\n\
    -time  tt : only tt seconds of observations go into the RINEX file\n\
    -int   tt : only those records from g12file that are time-tagged\n\
                with a multiple of tt seconds go into the RINEX file\n\
+   -j     N  : converts long files in N parts at the same time\n\
 \n------------------------------------------------------------------\n");
 
     strcat(help,"\n\
@@ -4043,7 +7070,20 @@ USAGE: gar2rnx g12file [-stat]\n\
         ephemeris file will be created, tipically brdcDDD1.YYN\n\
         We can change its name using the -area option:\n\n\
         gar2rnx g12bin -nav -f -area IUPM\n\n\
-        will create a Rinex navigation file named IUPMDDD1.YYN\n\n");
+        will create a Rinex navigation file named IUPMDDD1.YYN\n\n\
+        -start, -stop and -time can also be used with -nav. Words\n\
+        from 30 seconds before -start are used, to complete the\n\
+        ephemeris being broadcast at that time.\n\n");
+
+    strcat(help,"******************************************************************\n\n\
+  -batch: converts every g12file given after -batch (wildcards are\n\
+          fine) into a RINEX observation and a RINEX navigation file,\n\
+          named as with -f. Several files are converted at the same\n\
+          time, one per processor.\n\n\
+        gar2rnx -batch *.g12 -area IUPM\n\n\
+   -list file: also converts the g12 files listed in file (one per line)\n\
+   -j N      : uses N threads (default: number of processors)\n\
+   All -rinex options apply to every file.\n\n");
 
     strcat(help,"******************************************************************\n\n\
   -monitor prn : (new with version 1.45)  This option followed by \n\
@@ -4072,37 +7112,65 @@ USAGE: gar2rnx g12file [-stat]\n\
 }
 
 
-FILE* parse_arg(int argc, char **argv)
+// GarminCaps.txt next to the program, so every run finds the same file
+// whatever the working directory
+void default_caps_file()
 {
-    int arg_num,j;
-    FILE *fd;
-//BOOLEAN first_obs;
-
-    if(argc<2) print_help(argv);
+    char *p,*end;
+    int n;
 
+    n=0;
+#ifdef _WIN32
+    p=_pgmptr;
+    if((p!=NULL) && (strlen(p)<sizeof(CAPS_FILE)))
+    {
+        strcpy(CAPS_FILE,p);
+        n=(int)strlen(p);
+    }
+#else
+    n=(int)readlink("/proc/self/exe",CAPS_FILE,sizeof(CAPS_FILE)-1);
+    if(n<0) n=0;
+#endif
+    CAPS_FILE[n]=0;
+
+    // Keep the directory and its separator. In the working directory if
+    // it is not known
+    end=CAPS_FILE;
+    for(p=CAPS_FILE; *p; p++)
+        if((*p=='/') || (*p=='\\')) end=p+1;
+    if((end-CAPS_FILE)+sizeof("GarminCaps.txt")>sizeof(CAPS_FILE)) end=CAPS_FILE;
+    strcpy(end,"GarminCaps.txt");
+}
 
 
-//Check if stdin is desired
-    if(strcmp(argv[1],"stdin")==0) STDIN=1;
+// Options followed by a value
+BOOLEAN takes_value(char *option)
+{
+    static const char *with_value[]= {"-caps","-monitor","-sf","-page","-get33","-start",
+                                      "-stop","-time","-int","-area","-list","-j","-mark","-s",NULL
+                                     };
+    int k;
 
-    fd= (STDIN)? stdin:fopen(argv[1],"rb");
+    for(k=0; with_value[k]!=NULL; k++)
+        if(strcmp(option,with_value[k])==0) return 1;
+    return 0;
+}
 
-    strcpy(DATAFILE,argv[1]);
 
-    if(fd==NULL)
-    {
-        printf("Cannot read data from %s (\?\')\n",DATAFILE);
-        exit(0);
-    }
+// Options from argv[2] on. Returns 0 if they are wrong. Never exits, as
+// it also parses the options of the streaming interface
+BOOLEAN parse_options(int argc, char **argv)
+{
+    int arg_num,j;
 
-    if(argc>2)
+    // -crx left out: the header is that of the RINEX file it encodes.
+    // Only the start of very long options is kept, it shows 60 chars
+    COMMAND_LINE[0]=0;
+    for(j=2; j<argc; j++)
     {
-        strcpy(COMMAND_LINE,argv[2]);
-        for(j=3; j<argc; j++)
-        {
-            strcat(COMMAND_LINE," ");
-            strcat(COMMAND_LINE,argv[j]);
-        }
+        if(strcmp(argv[j],"-crx")==0) continue;
+        if(COMMAND_LINE[0]) strncat(COMMAND_LINE," ",sizeof(COMMAND_LINE)-1-strlen(COMMAND_LINE));
+        strncat(COMMAND_LINE,argv[j],sizeof(COMMAND_LINE)-1-strlen(COMMAND_LINE));
     }
 
 
@@ -4117,6 +7185,8 @@ FILE* parse_arg(int argc, char **argv)
     DIF_RECORDS=0;
 
     ETREX=0;
+    LAYOUT_ARG=0;
+    default_caps_file();
     RINEX_GENERATION=1;
     VERBOSE=0;
     VERBOSE_NAV=0;
@@ -4126,6 +7196,9 @@ FILE* parse_arg(int argc, char **argv)
     MONITOR_NAV=0;
     NAV_GENERATION=0;
     VERIFY_TIME_TAGS=0;
+    BUILD_INDEX=0;
+    COMPRESS=0;
+    CRX=0;
     NO_SNR=0;
 
 
@@ -4146,18 +7219,39 @@ FILE* parse_arg(int argc, char **argv)
     GIVEN_DATE=0;
 
 
+    N_THREADS=0;
+
     strcpy(location,"site");
+    strcpy(nav_location,"brdc");
     strcpy(marker,"Measured Point");
 
 // User provided arguments
     arg_num=2;
     while(arg_num<argc)
     {
+        if(takes_value(argv[arg_num]) && (arg_num+1>=argc))
+        {
+            printf("Option %s needs a value\n",argv[arg_num]);
+            return 0;
+        }
+
         if(strcmp(argv[arg_num],"-stat")==0)
         {
             ONLY_STATS=1;
             arg_num++;
         }
+        else if(strcmp(argv[arg_num],"-index")==0)
+        {
+            BUILD_INDEX=1;
+            RINEX_GENERATION=0;
+            arg_num++;
+        }
+        else if(strcmp(argv[arg_num],"-compress")==0)
+        {
+            COMPRESS=1;
+            RINEX_GENERATION=0;
+            arg_num++;
+        }
         else if(strcmp(argv[arg_num],"-all")==0)
         {
             ONE_SAT=0;
@@ -4176,8 +7270,21 @@ FILE* parse_arg(int argc, char **argv)
         else if(strcmp(argv[arg_num],"-etrex")==0)
         {
             ETREX=1;
+            LAYOUT_ARG='E';
+            arg_num++;
+        }
+        else if(strcmp(argv[arg_num],"-gps12")==0)
+        {
+            ETREX=0;
+            LAYOUT_ARG='G';
             arg_num++;
         }
+        else if(strcmp(argv[arg_num],"-caps")==0)
+        {
+            strncpy(CAPS_FILE,argv[arg_num+1],sizeof(CAPS_FILE)-1);
+            CAPS_FILE[sizeof(CAPS_FILE)-1]=0;
+            arg_num+=2;
+        }
         else if(strcmp(argv[arg_num],"-parse")==0)
         {
             PARSE_RECORDS=1;
@@ -4189,7 +7296,7 @@ FILE* parse_arg(int argc, char **argv)
         {
             MONITOR_NAV=0;
             NAV_GENERATION=1;
-            strcpy(location,"brdc");
+            strcpy(nav_location,"brdc");
             RINEX_GENERATION=0;
             VERBOSE=0;
             VERBOSE_NAV=0;
@@ -4251,6 +7358,11 @@ FILE* parse_arg(int argc, char **argv)
             RINEX_FILE=1;
             arg_num++;
         }
+        else if(strcmp(argv[arg_num],"-crx")==0)
+        {
+            CRX=1;
+            arg_num++;
+        }
         else if(strcmp(argv[arg_num],"-snroff")==0)
         {
             NO_SNR=1;
@@ -4315,11 +7427,23 @@ FILE* parse_arg(int argc, char **argv)
         else if(strcmp(argv[arg_num],"-area")==0)
         {
             strncpy(location,argv[arg_num+1],4);
+            strncpy(nav_location,argv[arg_num+1],4);
+            arg_num+=2;
+        }
+        else if(BATCH && (strcmp(argv[arg_num],"-list")==0))
+        {
+            if(read_batch_list(argv[arg_num+1])==0) return 0;
+            arg_num+=2;
+        }
+        else if(strcmp(argv[arg_num],"-j")==0)
+        {
+            N_THREADS=atoi(argv[arg_num+1]);
             arg_num+=2;
         }
         else if(strcmp(argv[arg_num],"-mark")==0)
         {
-            strcpy(marker,argv[arg_num+1]);
+            strncpy(marker,argv[arg_num+1],sizeof(marker)-1);
+            marker[sizeof(marker)-1]=0;
             arg_num+=2;
         }
         else if(strcmp(argv[arg_num],"-sats")==0)
@@ -4352,7 +7476,7 @@ FILE* parse_arg(int argc, char **argv)
                 if((arg_num==argc) || (argv[arg_num][0]==45))
                 {
                     printf("Correct usage of -date option: -date YYYY MM DD (date of observation)\n");
-                    exit(0);
+                    return 0;
                 }
                 else USER_DATE[j]=atoi(argv[arg_num++]);
             }
@@ -4366,7 +7490,7 @@ FILE* parse_arg(int argc, char **argv)
                 if((arg_num==argc))
                 {
                     printf("Correct usage of -xyz option: -xyz X Y Z (ECEF position in meters)\n");
-                    exit(0);
+                    return 0;
                 }
                 else USER_XYZ[j]=atof(argv[arg_num++]);
             }
@@ -4380,7 +7504,7 @@ FILE* parse_arg(int argc, char **argv)
                 if((arg_num==argc))
                 {
                     printf("Correct usage of -llh option: -llh lat long h [deg deg mt])\n");
-                    exit(0);
+                    return 0;
                 }
                 else USER_XYZ[j]=atof(argv[arg_num++]);
             }
@@ -4405,13 +7529,25 @@ FILE* parse_arg(int argc, char **argv)
     {
         printf("You have selected no observables for the RINEX file\n");
         printf("Exiting now\n");
-        exit(0);
+        return 0;
     }
 
 
     // If we just want code it doesnt make sense to allow phase_only output
     if(OBS_MASK==1) OPT1=0;
 
+    START_ARG=START;
+
+    if(BATCH)
+    {
+        if(N_BATCH==0)
+        {
+            printf("No g12 files to convert\n");
+            return 0;
+        }
+        RINEX_FILE=1;   // One pair of files per g12 file
+    }
+
 
     //printf("Mask %d. N_obs %d. Observables: ",OBS_MASK,N_OBS);
     //if (OBS_MASK & 1) printf("code ");
@@ -4420,15 +7556,61 @@ FILE* parse_arg(int argc, char **argv)
     //printf("\n");
     //exit(0);
 
-    return fd;
+    return 1;
 }
 
 
 
 
+FILE* parse_arg(int argc, char **argv)
+{
+    int j;
+    FILE *fd;
+//BOOLEAN first_obs;
+
+    if(argc<2) print_help(argv);
+
+
+// Batch mode: g12 files up to the first option
+    BATCH=(strcmp(argv[1],"-batch")==0);
+    if(BATCH)
+    {
+        for(j=2; (j<argc) && (argv[j][0]!='-') && (argv[j][0]!='+'); j++)
+            add_batch_file(argv[j]);
+        argv+=j-2;      // Options are parsed as usual from argv[2]
+        argc-=j-2;
+        fd=NULL;
+    }
+    else
+    {
+        //Check if stdin is desired
+        if(strcmp(argv[1],"stdin")==0) STDIN=1;
+
+        fd= (STDIN)? stdin:fopen(argv[1],"rb");
+#ifdef _WIN32
+        if(STDIN) _setmode(_fileno(stdin),_O_BINARY);   // G12 data is binary
+#endif
+
+        strncpy(DATAFILE,argv[1],sizeof(DATAFILE)-1);
+
+        if(fd==NULL)
+        {
+            printf("Cannot read data from %s (\?\')\n",DATAFILE);
+            exit(0);
+        }
+    }
+
+    if(parse_options(argc,argv)==0) exit(0);
+
+    return fd;
+}
+
+
+#ifndef GAR2RNX_LIBRARY
 int main(int argc,char**argv)
 {
     FILE *fd;
+    type_reader rd;
 
     /*
     char number[24];
@@ -4440,16 +7622,30 @@ int main(int argc,char**argv)
     */
 
     fd=parse_arg(argc,argv);
+    if(BATCH)
+    {
+        run_batch();
+        return 0;
+    }
+
+    if(open_reader(&rd,fd)==0)
+    {
+        printf("Not enough memory to read %s\n",DATAFILE);
+        exit(0);
+    }
 
-    if(ONLY_STATS) collect_stats(fd);
-    if(PARSE_RECORDS) original_parsing(fd);
-    if(VERIFY_TIME_TAGS) verify_tt(fd);
-    if(NAV_GENERATION) generate_nav(fd);
-    if(MONITOR_NAV) monitor_nav(fd);
+    // generate_rinex finds it along with the header info
+    if(RINEX_GENERATION==0) find_layout(&rd);
 
-    generate_rinex(fd);
+    if(BUILD_INDEX) build_index(&rd);
+    else if(COMPRESS) compress_g12(&rd);
+    else if(ONLY_STATS) collect_stats(&rd,stdout);
+    else if(PARSE_RECORDS) original_parsing(&rd);
+    else if(VERIFY_TIME_TAGS) verify_tt(&rd);
+    else if(NAV_GENERATION) generate_nav(&rd,NULL);
+    else if(MONITOR_NAV) monitor_nav(&rd);
+    else generate_rinex(&rd,NULL);
 
     return 0;
 }
-
-
+#endif
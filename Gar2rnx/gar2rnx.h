@@ -0,0 +1,110 @@
+/****************************************************************************
+GAR2RNX CONVERTER converts Garmin binary G12 files to Rinex
+
+Copyright (C) 2000-2002 Antonio Tabernero
+Copyright (C) 2016 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+
+// gar2rnx.h : streaming interface, for programs that build gar2rnx.c in
+// with GAR2RNX_LIBRARY defined (no main) instead of running gar2rnx.exe.
+//
+// G12 records (id, length, payload) are pushed as they arrive from the
+// receiver and the RINEX observation and navigation files are written on
+// the fly. Their contents are the same as converting the G12 file with
+// "gar2rnx g12_file options" and "gar2rnx g12_file options -nav".
+//
+// The conversion state is kept in global variables, one copy per thread,
+// so there can only be one stream at a time on a thread, and it has to
+// be opened, fed and closed on the same thread.
+
+#ifndef GAR2RNX_H
+#define GAR2RNX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct type_stream type_stream;
+
+// Starts a conversion. g12_file is only quoted in the file headers, the
+// options are the ones of the command line (-etrex, -int, +doppler ...).
+// nav_file may be NULL. Returns NULL if the options are wrong.
+type_stream* stream_open(char *g12_file, char *options, char *obs_file, char *nav_file);
+
+// Converts one record, as stored in the G12 file. Only the L bytes of
+// the record are read, a short one is taken as padded with zeros.
+void stream_record(type_stream *s, unsigned char id, unsigned char L, unsigned char *record);
+
+// Ends the conversion and closes the files. Returns the number of epochs
+// written, -1 if there is no observation file (no position/date found),
+// and the number of ephemerides in *n_eph (if not NULL).
+long stream_close(type_stream *s, long *n_eph);
+
+// Converts a whole G12 file, as "gar2rnx g12_file options" does, but into
+// out_file: the observation file, the navigation file with -nav, or the
+// record statistics with -stat. Returns the number of epochs (ephemerides
+// with -nav, records with -stat) written, -1 if the options are wrong or
+// there is no observation file.
+long convert_g12(char *g12_file, char *options, char *out_file);
+
+// Receiver capabilities, kept in a text file shared by gar2rnx (-caps,
+// GarminCaps.txt in the folder of the program by default) and the
+// capture program. The conversions save the record layout to it, the
+// capture program the receivers it meets and their baud rate. One line
+// per receiver, keyed by the product number and software version found
+// in the 0xFF record:
+//
+//   # product version layout baud async quirks
+//   77 4.60 G 9600 0x0020 -
+//
+// A version of 0 (written "*") matches any version of that product.
+// Quirks known to GarminBinary: no_id_ack (don't ACK the ID response).
+typedef struct
+{
+    unsigned int prod;          // Product number
+    unsigned int version;       // Software version x 100, 0 = any
+    char layout;                // 0x38 record layout: 'E' eTrex, 'G' GPS 12, '?'
+    unsigned long baud;         // Fastest reliable baud rate, 0 if not known
+    unsigned int async;         // Async mask for the logged records, 0 if not known
+    char quirks[64];            // Comma separated, "-" if none
+} type_caps;
+
+// Finds the receiver in the file, the exact version first. Returns 0 if
+// it is not there (caps is then reset, with this prod and version).
+int caps_find(const char *file, unsigned int prod, unsigned int version, type_caps *caps);
+
+// Which fields of caps caps_store writes
+#define CAPS_LAYOUT 0x01
+#define CAPS_BAUD   0x02
+#define CAPS_ASYNC  0x04
+#define CAPS_QUIRKS 0x08
+
+// An entry for this receiver with nothing known.
+void reset_caps(type_caps *caps, unsigned int prod, unsigned int version);
+
+// Sets the fields of caps given in fields (CAPS_LAYOUT ...) for the
+// receiver, adding its line if needed (from the line of any version, if
+// there is one). The other fields keep their value in the file, read
+// again while writers of the file take turns, so it is safe from any
+// thread. Returns 0 if the file can't be written.
+int caps_store(const char *file, const type_caps *caps, unsigned int fields);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
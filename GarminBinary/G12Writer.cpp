@@ -0,0 +1,282 @@
+/****************************************************************************
+GARMIN BINARY EXPLORER for Garmin GPS Receivers that support serial I/O.
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+// G12Writer.cpp: implementation of the CG12Writer class.
+
+#include "stdafx.h"
+#include "G12Writer.h"
+
+CG12Writer::CG12Writer() :
+    mThread(0),
+    mWake(0),
+    mStop(0),
+    mStarted(0),
+    mFlushBytes(0),
+    mFlushMsecs(0),
+    mCommitSecs(0),
+    mAccepting(false),
+    mFailed(false),
+    mRinex(false),
+    mStream(0),
+    mRinexDone(false),
+    mEpochs(0),
+    mEph(0)
+{
+    InitializeCriticalSection(&mLock);
+}
+
+CG12Writer::~CG12Writer()
+{
+    Close();
+    DeleteCriticalSection(&mLock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Convert the records of the next file to RINEX as well.</summary>
+void CG12Writer::SetRinex(LPCTSTR pszOptions, LPCTSTR pszObsFile, LPCTSTR pszNavFile)
+{
+    mRinexOpts = pszOptions;
+    mObsFile = pszObsFile;
+    mNavFile = pszNavFile;
+    mRinex = true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Create the file and start the writer thread.</summary>
+bool CG12Writer::Open(LPCTSTR pszFile, unsigned int nFlushBytes, unsigned int nFlushMsecs, unsigned int nCommitSecs)
+{
+    if(IsOpen() || !mFile.Open(pszFile, CFile::modeCreate | CFile::modeWrite | CFile::typeBinary))
+    {
+        mRinex = false;
+        return false;
+    }
+
+    mFlushBytes = nFlushBytes;
+    mFlushMsecs = nFlushMsecs ? nFlushMsecs : INFINITE;
+    mCommitSecs = nCommitSecs;
+    mFailed = false;
+    mStream = 0;
+    mRinexDone = false;
+
+    // Room for a flush worth of records, plus the one that crosses it.
+    mFront.clear();
+    mBack.clear();
+    mFront.reserve(nFlushBytes + 0x200);
+    mBack.reserve(nFlushBytes + 0x200);
+
+    mWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    mStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    mStarted = CreateEvent(NULL, TRUE, FALSE, NULL);
+    mAccepting = true;
+
+    // Not auto deleted, so Close can wait on it.
+    mThread = AfxBeginThread(WriterThread, this, THREAD_PRIORITY_NORMAL, 0, CREATE_SUSPENDED);
+    mThread->m_bAutoDelete = FALSE;
+    mThread->ResumeThread();
+
+    // So IsRinexOpen can tell at once whether the options were taken.
+    WaitForSingleObject(mStarted, INFINITE);
+
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Append bytes to the buffer, and wake the thread once it
+/// holds a flush worth. May be called from any thread; bytes written
+/// once Close has begun are dropped.</summary>
+void CG12Writer::Write(const void* pData, size_t nBytes)
+{
+    const uint8_t* p = (const uint8_t*)pData;
+
+    EnterCriticalSection(&mLock);
+    if(mAccepting)
+    {
+        mFront.insert(mFront.end(), p, p + nBytes);
+        if(mFront.size() >= mFlushBytes)
+        {
+            SetEvent(mWake);
+        }
+    }
+    LeaveCriticalSection(&mLock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Flush, commit and close the file.</summary>
+bool CG12Writer::Close()
+{
+    if(!IsOpen())
+    {
+        return true;
+    }
+
+    // No more bytes, then the thread writes what is left before it exits.
+    EnterCriticalSection(&mLock);
+    mAccepting = false;
+    LeaveCriticalSection(&mLock);
+
+    SetEvent(mStop);
+    WaitForSingleObject(mThread->m_hThread, INFINITE);
+    delete mThread;
+    mThread = 0;
+
+    CloseHandle(mWake);
+    CloseHandle(mStop);
+    CloseHandle(mStarted);
+    mWake = 0;
+    mStop = 0;
+    mStarted = 0;
+    mRinex = false;
+
+    try
+    {
+        mFile.Close();
+    }
+    catch(CFileException* e)
+    {
+        e->Delete();
+        mFailed = true;
+    }
+
+    return !mFailed;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Results of the RINEX conversion of the last file.</summary>
+bool CG12Writer::GetRinexResult(long* pEpochs, long* pEph) const
+{
+    *pEpochs = mEpochs;
+    *pEph = mEph;
+    return mRinexDone;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Writer thread entry point.</summary>
+UINT CG12Writer::WriterThread(LPVOID pParam)
+{
+    ((CG12Writer*)pParam)->WriterLoop();
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Writer thread body: write the buffer when woken or when the
+/// flush period ends, and commit on schedule.</summary>
+void CG12Writer::WriterLoop()
+{
+    HANDLE hWait[2] = { mStop, mWake };
+    DWORD dwLastCommit = GetTickCount();
+
+    if(mRinex)
+    {
+        CString strG12 = mFile.GetFilePath();
+        mStream = stream_open(strG12.GetBuffer(0), mRinexOpts.GetBuffer(0),
+                              mObsFile.GetBuffer(0), mNavFile.GetBuffer(0));
+    }
+    SetEvent(mStarted);
+
+    for(;;)
+    {
+        DWORD dwWait = WaitForMultipleObjects(2, hWait, FALSE, mFlushMsecs);
+
+        WriteOut();
+
+        if(dwWait == WAIT_OBJECT_0)
+        {
+            break;
+        }
+
+        if(mCommitSecs && GetTickCount() - dwLastCommit >= mCommitSecs * 1000)
+        {
+            Commit();
+            dwLastCommit = GetTickCount();
+        }
+    }
+
+    Commit();
+
+    if(mStream)
+    {
+        mEpochs = stream_close(mStream, &mEph);
+        mStream = 0;
+        mRinexDone = true;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Swap the buffers and write out everything queued.</summary>
+void CG12Writer::WriteOut()
+{
+    EnterCriticalSection(&mLock);
+    mFront.swap(mBack);
+    LeaveCriticalSection(&mLock);
+
+    if(!mBack.empty())
+    {
+        try
+        {
+            mFile.Write(&mBack[0], (UINT)mBack.size());
+        }
+        catch(CFileException* e)
+        {
+            e->Delete();
+            mFailed = true;
+        }
+
+        FeedRinex();
+        mBack.clear();
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Convert the records just written. Write is called a record
+/// at a time, so the buffer holds whole records.</summary>
+///<remarks>
+/// The records are passed in place: stream_record decodes a zero padded
+/// copy, so a short last record isn't read past the end of mBack.
+///</remarks>
+void CG12Writer::FeedRinex()
+{
+    if(!mStream)
+    {
+        return;
+    }
+
+    uint8_t* p = &mBack[0];
+    size_t nBytes = mBack.size();
+
+    // id, length, payload
+    for(size_t i = 0; i + 2 <= nBytes && i + 2 + p[i + 1] <= nBytes; i += 2 + p[i + 1])
+    {
+        stream_record(mStream, p[i], p[i + 1], p + i + 2);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Make what was written so far survive a crash or power loss.</summary>
+void CG12Writer::Commit()
+{
+    try
+    {
+        mFile.Flush();
+    }
+    catch(CFileException* e)
+    {
+        e->Delete();
+        mFailed = true;
+    }
+}
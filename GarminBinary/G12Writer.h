@@ -0,0 +1,108 @@
+/****************************************************************************
+GARMIN BINARY EXPLORER for Garmin GPS Receivers that support serial I/O.
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+// G12Writer.h: interface for the CG12Writer class.
+//
+// Writes the G12 log file from a background thread, so a slow disk
+// never holds up the GUI or serial reception. Records are appended to
+// a memory buffer, which the thread swaps out and writes in one call
+// when it holds enough bytes or enough time has passed.
+//
+// The same thread can also convert the records to RINEX with the built
+// in GAR2RNX, a buffer at a time after writing it, so the GUI thread
+// does no file I/O per frame. GAR2RNX keeps its options per thread, so
+// the stream is opened, fed and closed on the writer thread.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../Gar2rnx/gar2rnx.h"
+
+class CG12Writer
+{
+public:
+
+    // Ctor/dtor.
+    CG12Writer();
+    virtual ~CG12Writer();
+
+    // Also write RINEX observation and navigation files from the records,
+    // with these GAR2RNX options. For the next Open only.
+    void SetRinex(LPCTSTR pszOptions, LPCTSTR pszObsFile, LPCTSTR pszNavFile);
+
+    // Create the file and start the writer thread. The buffer is written
+    // once it holds nFlushBytes, or every nFlushMsecs, and the file is
+    // committed to disk every nCommitSecs (0 means only on Close).
+    bool Open(LPCTSTR pszFile, unsigned int nFlushBytes, unsigned int nFlushMsecs, unsigned int nCommitSecs);
+
+    // Queue bytes to write, from any thread. Never waits for the disk.
+    void Write(const void* pData, size_t nBytes);
+
+    // Write everything queued, commit, close and stop the thread.
+    // Returns false if any write to the file failed.
+    bool Close();
+
+    bool IsOpen() const { return mThread != 0; }
+
+    // After Open: false if GAR2RNX did not take the options.
+    bool IsRinexOpen() const { return mStream != 0; }
+
+    // After Close: the RINEX files were written. Epochs written, -1 with
+    // no observation file (no position/date found), and ephemerides.
+    bool GetRinexResult(long* pEpochs, long* pEph) const;
+
+private:
+
+    // Helper methods.
+    static UINT WriterThread(LPVOID pParam);
+    void WriterLoop();
+    void WriteOut();
+    void Commit();
+    void FeedRinex();
+
+    // Data members
+    CFile mFile;
+    CWinThread* mThread;
+    HANDLE mWake;
+    HANDLE mStop;
+    HANDLE mStarted;
+
+    // mFront is filled by Write, mBack is written by the thread.
+    CRITICAL_SECTION mLock;
+    std::vector<uint8_t> mFront;
+    std::vector<uint8_t> mBack;
+
+    unsigned int mFlushBytes;
+    unsigned int mFlushMsecs;
+    unsigned int mCommitSecs;
+    bool mAccepting;                // Write takes bytes, under mLock
+    volatile bool mFailed;
+
+    // RINEX conversion, only touched by the writer thread while it runs.
+    CString mRinexOpts;
+    CString mObsFile;
+    CString mNavFile;
+    bool mRinex;
+    type_stream* mStream;
+    bool mRinexDone;
+    long mEpochs;
+    long mEph;
+};
@@ -74,10 +74,9 @@ typedef enum
 {
     STATE_IDLE      = 0x00,
     STATE_START     = 0x03,
-    STATE_GET_ID    = 0x05,
-    STATE_GET_UTC   = 0x06,
-    STATE_GET_POS   = 0x09,
+    STATE_QUERY     = 0x05,  // Waiting for ID, UTC and position
     STATE_PVT_ON    = 0x0A,
+    STATE_GET_FIX   = 0x0B,  // Waiting for a 3D fix
     STATE_ASYNC_ON  = 0x0C,
     STATE_ASYNC_TIC = 0x0F,
     STATE_STOP_REC  = 0x11,
@@ -86,6 +85,31 @@ typedef enum
     STATE_NEXT      = 0xFF,
 } e_STATE_TYPE;
 
+typedef enum
+{
+    BAUD_IDLE       = 0x00,
+    BAUD_START      = 0x01,
+    BAUD_GET_ID     = 0x02,  // Waiting for ID
+    BAUD_FIRST      = 0x03,
+    BAUD_REQUEST    = 0x04,
+    BAUD_WAIT_NEW   = 0x05,  // Waiting for the GPS to change rate
+    BAUD_BURST      = 0x06,
+    BAUD_MEASURE    = 0x07,  // Counting frames at the new rate
+    BAUD_FALLBACK   = 0x08,
+    BAUD_WAIT_OLD   = 0x09,  // Waiting for the GPS to change back
+    BAUD_DONE       = 0x0A,
+    BAUD_NEXT       = 0xFF,
+} e_BAUD_STATE;
+
+typedef enum
+{
+    SYNC_IDLE       = 0x00,  // Port closed
+    SYNC_START      = 0x01,
+    SYNC_WATCH      = 0x02,  // Counting good frames
+    SYNC_CHECK      = 0x03,  // Waiting for good frames at another rate
+    SYNC_NEXT       = 0xFF,
+} e_SYNC_STATE;
+
 static const char MONTH[13][4] =
 {
     "---", "Jan", "Feb", "Mar", "Apr", "May", "Jun",
@@ -20,6 +20,33 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 /****************************************************************************
 
+1.13   RINEX observation and navigation files are written while
+       recording, by GAR2RNX built in (Gar2RnxInProcess, default 1),
+       on the thread writing the G12 file.
+       Link layer framing moved to CGarminFramer (GarminLink.cpp).
+       Serial input is read in blocks instead of a byte at a time.
+       Serial input is received by a thread waiting on port events,
+       instead of a 1 msec timer. Frames reach the GUI via a queue.
+       G12 file is written by a background thread in batches, and
+       committed to disk every G12CommitSecs (default 10).
+       Outgoing frames are DLE stuffed and sent with a single write.
+       Recording session steps advance when the GPS replies, with
+       timeouts and retries, instead of on a fixed 1 second tick. The
+       ID, UTC and position queries are sent together in one write.
+       Receiver capabilities (CapsFile, GarminCaps.txt next to the
+       profile) are looked up by the product and version of the ID
+       response, and shared with GAR2RNX, which finds the record layout
+       there. Gar2RnxOptions no longer defaults to -etrex, and -etrex is
+       removed from it.
+       Baud up finds the fastest baud rate with no frame errors, trying
+       38400, 57600 and 115200 with a burst of async messages at each,
+       and keeps it in the capability file. While recording, frame
+       errors step the link down to the next slower rate, for that
+       session only.
+       When bytes keep coming but no good frames, the local baud rate
+       is changed until the GPS is found again. Baud up and recording
+       wait until then.
+
 1.12   17 Jun 2017, General cleanup and conversion to VS2017.
 
 1.11   27 Jun 2016, Saves Garmin binary observation file in G12 format.
@@ -51,25 +78,81 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 static char THIS_FILE[] = __FILE__;
 #endif
 
-// This turns on only async messages 36, 37, 38
-#define _ASYNC_MASK 0x20;
+// This turns on only async messages 36, 37, 38, unless the
+// capability file has another mask for the receiver
+#define _ASYNC_MASK 0x20
 
-// Millisecond timer period for fetching serial bytes
-#define _RECV_SERIAL_TIMER_MSECS 1
+// Posted by the receive thread when frames are queued
+#define WM_RECV_FRAMES (WM_APP + 1)
 
-// Define an ID for the serial port timer
-#define _RECV_SERIAL_TIMER 1
+// Millisecond period the receive thread also polls at, in case
+// a port event is missed
+#define _RECV_POLL_MSECS 100
 
 // Define an ID for the state machine timer
 #define _STATE_TIMER 2
 
-// Millisecond timer period for commands and responses
+// Millisecond period the state machine checks its timeouts at
+#define _STATE_TIMER_POLL_MSECS 100
+
+// Millisecond spacing of the shutdown commands, which have no reply
 #define _STATE_TIMER_CMDS_MSECS 1000
 
+// Milliseconds to wait for a reply before asking again, and the number
+// of times to ask before going on without it
+#define _STATE_REPLY_MSECS 1000
+#define _STATE_TRIES 3
+
+// PVT records come once per second, so allow one more for the first
+#define _STATE_PVT_MSECS 2000
+
+// Longest wait for a 3D fix, after which recording starts anyway
+#define _STATE_FIX_MSECS 6000
+
+// Define an ID for the baud rate negotiation timer
+#define _BAUD_TIMER 3
+#define _BAUD_TIMER_MSECS 100
+
+// Milliseconds to wait for the GPS to answer a baud rate change
+#define _BAUD_REPLY_MSECS 2500
+
+// Milliseconds of async messages used to test a baud rate, and the
+// number of frames, none bad, they must bring
+#define _BAUD_BURST_MSECS 2000
+#define _BAUD_BURST_FRAMES 10
+
+// Bad frames in one second of recording that make the link step down
+#define _BAUD_ERR_LIMIT 2
+
+// Define an ID for the link sync timer
+#define _SYNC_TIMER 4
+#define _SYNC_TIMER_MSECS 250
+
+// Milliseconds per check of the received frames, and the number of
+// checks in a row with no good frame that make the link out of sync
+#define _SYNC_WINDOW_MSECS 1000
+#define _SYNC_WINDOWS 3
+
+// In a check with no good frame, the bytes or bad frames that show the
+// GPS is sending at another rate
+#define _SYNC_NOISE_BYTES 16
+#define _SYNC_BAD_FRAMES 2
+
+// Milliseconds to wait at each rate while finding the GPS again, and
+// the good frames needed there while recording
+#define _SYNC_TRY_MSECS 1500
+#define _SYNC_GOOD_FRAMES 3
+
 // Define the hi/lo baud rates supported
 static const CString s_StrLoBaud = "9600";
 static const CString s_StrHiBaud = "57600";
 
+// Baud rates tried by the negotiation, slowest first
+static const unsigned int s_TuneBauds[] = { 38400, 57600, 115200 };
+
+// Baud rates the GPS is looked for at when the link is out of sync
+static const unsigned int s_SyncBauds[] = { 9600, 19200, 38400, 57600, 115200 };
+
 // Serial driver
 CSerial m_Serial;
 
@@ -160,6 +243,26 @@ CGarminBinaryDlg::CGarminBinaryDlg(CWnd* pParent /*=NULL*/)
     : CDialog(CGarminBinaryDlg::IDD, pParent)
 {
     m_hIcon = AfxGetApp()->LoadIcon(IDR_MAINFRAME);
+
+    m_pRecvThread = NULL;
+    m_hRecvStop = NULL;
+    m_nLinkGen = 0;
+    m_nFramerGen = 0;
+    m_bFramesPosted = 0;
+    m_nRecvHighWater = 0;
+    m_nRecvBytes = 0;
+    m_nTxBytes = 0;
+    m_bTxBatch = false;
+    memset(&m_Caps, 0, sizeof(m_Caps));
+    mBaudState = BAUD_IDLE;
+    mBaudTuning = false;
+    mBaudDown = false;
+    mLinkFrames = 0;
+    mLinkErrs = 0;
+    mCheckFrames = 0;
+    mCheckErrs = 0;
+    mCheckStart = 0;
+    mSyncState = SYNC_IDLE;
 }
 
 void CGarminBinaryDlg::DoDataExchange(CDataExchange* pDX)
@@ -208,6 +311,7 @@ BEGIN_MESSAGE_MAP(CGarminBinaryDlg, CDialog)
     ON_WM_PAINT()
     ON_WM_QUERYDRAGICON()
     ON_WM_TIMER()
+    ON_MESSAGE(WM_RECV_FRAMES, OnRecvFrames)
     ON_CBN_DROPDOWN(IDC_CMBO_PORT, OnDropdownCmboPort)
     ON_CBN_CLOSEUP(IDC_CMBO_PORT, OnCloseupCmboPort)
     ON_BN_CLICKED(IDC_BTN_GET_ID, OnBtnGetId)
@@ -309,8 +413,16 @@ void CGarminBinaryDlg::OnOK()
 ///<summary>GUI button message handler.</summary>
 void CGarminBinaryDlg::OnCancel()
 {
-    // Before we go, undo the increased Windows timer resolution.
-    timeEndPeriod(1);
+    // Finish the G12 and RINEX files if closed while recording.
+    CloseG12File();
+    CloseRinexStream();
+
+    // No more frames may be posted to this window.
+    StopRecvThread();
+    m_Serial.Close();
+
+    // Settings are only written to the file here.
+    m_Profile.Flush();
 
     CDialog::OnCancel();
 }
@@ -357,7 +469,7 @@ BOOL CGarminBinaryDlg::OnInitDialog()
     if(m_ToolTip.Create(this))
     {
         // Add tool tips to certain controls.
-        m_ToolTip.AddTool(&m_btnBaudUp, "Go to high baud rate, both GPS and PC.");
+        m_ToolTip.AddTool(&m_btnBaudUp, "Find the fastest baud rate that works, both GPS and PC.");
         m_ToolTip.AddTool(&m_btnBaudDn, "Go to low baud rate, both GPS and PC.");
         m_ToolTip.AddTool(&m_btnBaudLocal, "Change only PC baud rate to resynch with GPS rate.");
 
@@ -398,17 +510,47 @@ BOOL CGarminBinaryDlg::OnInitDialog()
     m_Profile.WriteProfileStr("MainConfig", "Gar2RnxPath" , strRinexPath);
 
     // Get and set the options to GAR2RNX component, so this tag gets put in XML
-    CString strRinexOptions = m_Profile.GetProfileStr("MainConfig", "Gar2RnxOptions" , "-etrex");
+    CString strRinexOptions = m_Profile.GetProfileStr("MainConfig", "Gar2RnxOptions" , "");
+
+    // Older versions stored -etrex by default. GAR2RNX now tells the
+    // record layout itself, and -etrex would force it on a GPS 12.
+    strRinexOptions = " " + strRinexOptions + " ";
+    strRinexOptions.Replace(" -etrex ", " ");
+    strRinexOptions.Trim();
     m_Profile.WriteProfileStr("MainConfig", "Gar2RnxOptions" , strRinexOptions);
 
+    // Receiver capabilities file, shared with GAR2RNX. It is kept next to
+    // the profile, so it doesn't depend on the working folder. Older
+    // versions stored the bare name.
+    CString strCapsDefault = m_Profile.PrepareAppDataFilename("GarminCaps.txt");
+    m_strCapsFile = m_Profile.GetProfileStr("MainConfig", "CapsFile" , strCapsDefault);
+    if(m_strCapsFile == "GarminCaps.txt")
+    {
+        m_strCapsFile = strCapsDefault;
+    }
+    m_Profile.WriteProfileStr("MainConfig", "CapsFile" , m_strCapsFile);
+
+    // Convert to RINEX while recording (1) or run gar2rnx.exe at the end (0).
+    int nInProcess = m_Profile.GetProfileInt("MainConfig", "Gar2RnxInProcess" , 1);
+    m_Profile.WriteProfileInt("MainConfig", "Gar2RnxInProcess" , nInProcess);
+
+    // G12 file durability: write the buffer once it holds this many bytes,
+    // or after this many msecs, and commit to disk after this many secs.
+    int nFlushBytes = m_Profile.GetProfileInt("MainConfig", "G12FlushBytes" , 4096);
+    m_Profile.WriteProfileInt("MainConfig", "G12FlushBytes" , nFlushBytes);
+    int nFlushMsecs = m_Profile.GetProfileInt("MainConfig", "G12FlushMsecs" , 1000);
+    m_Profile.WriteProfileInt("MainConfig", "G12FlushMsecs" , nFlushMsecs);
+    int nCommitSecs = m_Profile.GetProfileInt("MainConfig", "G12CommitSecs" , 10);
+    m_Profile.WriteProfileInt("MainConfig", "G12CommitSecs" , nCommitSecs);
+
     // Use data from profile to set sticky fields.
     m_strSerialPort = m_Profile.GetProfileStr("MainConfig", "ComPort", "None");
     m_cmboPort.SelectString(-1, m_strSerialPort);
 
-    // Initialize the serial port.
-    SetupPort();
-    m_pRcv = (char*)&m_RecvMsg;
+    // Initialize the serial port, this also starts the receive thread.
+    m_Framer.SetHandler(OnFrame, this);
     m_lastRecv = 0;
+    SetupPort();
 
     // Set default recording time.
     CString str;
@@ -421,21 +563,13 @@ BOOL CGarminBinaryDlg::OnInitDialog()
                       DEFAULT_QUALITY, DEFAULT_PITCH | FF_DONTCARE, "Fixedsys");
     m_editMsgs.SetFont(&m_Font, TRUE);
 
-    // Attempt to increase the systemwide Windows timer resolution.
-    if(timeBeginPeriod(_RECV_SERIAL_TIMER_MSECS) != TIMERR_NOERROR)
-    {
-        AfxMessageBox("Failed to set a faster Windows timer.\r\n"\
-                      "You may see more framing errors.");
-    }
-
-    // Start the serial receive polling timer.
-    SetTimer(_RECV_SERIAL_TIMER, _RECV_SERIAL_TIMER_MSECS, NULL);
-
     memset(mMsgsSeen, 0, sizeof(mMsgsSeen));
     mErrFrames = 0;
     mHighWater = 0;
 
-    m_bIsLogging = false;
+    m_bIsLogging = 0;
+    m_bRinexStreamed = false;
+    mBandwidthStart = GetTickCount();
     G12State(STATE_IDLE);
 
     // Set a custom icon for the Baud Sync button
@@ -450,15 +584,20 @@ BOOL CGarminBinaryDlg::OnInitDialog()
 ///<summary>Event handler.</summary>
 void CGarminBinaryDlg::OnTimer(UINT nIDEvent)
 {
-    if(nIDEvent == _RECV_SERIAL_TIMER)
-    {
-        RecvMsg();
-    }
-    else if(nIDEvent == _STATE_TIMER)
+    if(nIDEvent == _STATE_TIMER)
     {
         UpdateBandwidth();
+        CheckLinkErrors();
         G12State(STATE_NEXT);
     }
+    else if(nIDEvent == _BAUD_TIMER)
+    {
+        BaudState(BAUD_NEXT);
+    }
+    else if(nIDEvent == _SYNC_TIMER)
+    {
+        SyncState(SYNC_NEXT);
+    }
 
     CDialog::OnTimer(nIDEvent);
 }
@@ -557,6 +696,7 @@ void CGarminBinaryDlg::OnBtnClear()
     mErrFrames = 0;
     UpdateErrSeen();
 
+    InterlockedExchange(&m_nRecvHighWater, 0);
     mHighWater = 0;
     UpdateHighWater();
 }
@@ -605,8 +745,9 @@ void CGarminBinaryDlg::AsyncMaskOn()
     m_SendMsg.Start      = 0x10;
     m_SendMsg.CmdId      = MSG_ASYNC_CMD;
     m_SendMsg.SizeBytes  = 0x02;
-    m_SendMsg.Payload[0] = _ASYNC_MASK;
-    m_SendMsg.Payload[1] = 0;
+    unsigned int mask    = m_Caps.async ? m_Caps.async : _ASYNC_MASK;
+    m_SendMsg.Payload[0] = mask;
+    m_SendMsg.Payload[1] = mask >> 8;
     m_SendMsg.ChkSum     = CalcChksum(&m_SendMsg);
     m_SendMsg.End1       = 0x10;
     m_SendMsg.End2       = 0x03;
@@ -690,6 +831,19 @@ void CGarminBinaryDlg::OnBtnPwrOff()
 ///<summary>GUI button message handler.</summary>
 void CGarminBinaryDlg::OnBtnRecOn()
 {
+    if(mBaudState != BAUD_IDLE)
+    {
+        AfxMessageBox("Wait for the baud rate negotiation to finish.");
+        return;
+    }
+
+    // The port is set to a rate on trial, maybe not the GPS one.
+    if(mSyncState == SYNC_CHECK)
+    {
+        AfxMessageBox("Wait for the GPS baud rate to be found.");
+        return;
+    }
+
     if(IsAtLoBaud())
     {
         CString str;
@@ -712,8 +866,8 @@ void CGarminBinaryDlg::OnBtnRecOn()
     // Update sticky setting for this.
     m_Profile.WriteProfileStr("MainConfig", "RecTime", strValue);
 
-    // Parse recording time, add a few seconds for state machine overhead.
-    mTickDown = (unsigned int)((atof(strValue) * 60) + 10); // min to sec
+    // Parse recording time. The countdown starts once the GPS is set up.
+    mTickDown = (unsigned int)(atof(strValue) * 60); // min to sec
     if(mTickDown == 0 || mTickDown > 86400)
     {
         mTickDown = 86400;
@@ -744,19 +898,40 @@ void CGarminBinaryDlg::OnBtnRecOn()
     {
         m_strFileNameG12 = dlg.GetPathName();
 
-        if(!m_OutFile.Open(m_strFileNameG12, CFile::modeCreate | CFile::modeWrite | CFile::typeBinary))
+        // Convert to RINEX as the records are written.
+        OpenRinexStream();
+
+        if(!m_G12Writer.Open(m_strFileNameG12,
+                             m_Profile.GetProfileInt("MainConfig", "G12FlushBytes" , 4096),
+                             m_Profile.GetProfileInt("MainConfig", "G12FlushMsecs" , 1000),
+                             m_Profile.GetProfileInt("MainConfig", "G12CommitSecs" , 10)))
         {
             CString str;
             str.Format("Cannot write file: %s", m_strFileNameG12.GetString());
             AfxMessageBox(str);
+            m_strRinexObs.Empty();
 
             // Cancel the process.
             return;
         }
 
+        if(!m_strRinexObs.IsEmpty())
+        {
+            if(m_G12Writer.IsRinexOpen())
+            {
+                AddToDisplay("GAR2RNX writing " + m_strRinexObs + " " + m_strRinexOpts, 0);
+            }
+            else
+            {
+                // Options not understood, leave it to gar2rnx.exe to complain.
+                AddToDisplay("GAR2RNX options not valid: " + m_strRinexOpts, 0);
+                m_strRinexObs.Empty();
+            }
+        }
+
         // Set the state machine to start the process.
         G12State(STATE_START);
-        m_bIsLogging = true;
+        InterlockedExchange(&m_bIsLogging, 1);
 
         CString strValue;
         strValue.Format("%d", mTickDown);
@@ -785,8 +960,15 @@ void CGarminBinaryDlg::OnBtnRecOff()
 ///and if detect reaching zero, stop the state machine.</summary>
 void CGarminBinaryDlg::TickDown()
 {
-    // Subtract the number of seconds represented by each tick.
-    mTickDown -= (_STATE_TIMER_CMDS_MSECS / 1000);
+    // Seconds left, from the clock rather than by counting ticks.
+    unsigned int secs = (GetTickCount() - mRecStart) / 1000;
+    secs = (secs < mRecSecs) ? mRecSecs - secs : 0;
+
+    if(secs == mTickDown)
+    {
+        return;
+    }
+    mTickDown = secs;
 
     CString strValue;
     strValue.Format("%d", mTickDown);
@@ -862,6 +1044,8 @@ void CGarminBinaryDlg::SetupPort()
 {
     // First make sure the port starts off as closed.
     // This does no harm if it was already closed.
+    SyncState(SYNC_IDLE);
+    StopRecvThread();
     m_Serial.Close();
 
     // Get user selected port string value. E.g. "COM1"
@@ -877,7 +1061,9 @@ void CGarminBinaryDlg::SetupPort()
 
         // Open the port and suggest to the driver to use large buffers.
         // But the actual buffer size is constrained by the hardware.
-        if(0 != m_Serial.Open(str, 4096, 4096))
+        // Overlapped, so the receive thread can wait on it while the
+        // GUI thread writes.
+        if(0 != m_Serial.Open(str, RECV_BLOCK_BYTES, 4096, true))
         {
             // Report the error to the user.
             str = "Unable to open port " + m_strSerialPort;
@@ -890,105 +1076,226 @@ void CGarminBinaryDlg::SetupPort()
             m_Serial.SetupHandshaking(CSerial::EHandshakeOff);
             m_Serial.SetupReadTimeouts(CSerial::EReadTimeoutNonblocking);
 
-            // Clear out any garbage that might be in the buffer.
-            m_Serial.Purge();
+            // Clear out any garbage that might be in the buffer,
+            // and any frames still queued from before.
+            PurgePort();
+
+            StartRecvThread();
+
+            // Watch for a GPS at another baud rate.
+            SyncState(SYNC_START);
         }
     }
 }
 
 /////////////////////////////////////////////////////////////////////////////
-///<summary>Sends an outgoing message to GPS.</summary>
-void CGarminBinaryDlg::SendMsg()
+///<summary>Clear the serial buffers, and drop any received bytes and
+/// queued frames that came before.</summary>
+void CGarminBinaryDlg::PurgePort()
 {
-    AddToDisplay("TX: ", &m_SendMsg);
+    m_Serial.Purge();
+
+    // The receive thread resets its framer when it sees the new value,
+    // and OnRecvFrames drops frames tagged with an older one.
+    InterlockedIncrement(&m_nLinkGen);
+}
 
-    // This does not do DLE stuffing because none of the commands
-    // we send need doubled DLEs.
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Start the thread that receives from the open port.</summary>
+void CGarminBinaryDlg::StartRecvThread()
+{
+    m_hRecvStop = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-    // Send header bytes.
-    m_Serial.Write(&m_SendMsg.Start, 1);
-    m_Serial.Write(&m_SendMsg.CmdId, 1);
-    m_Serial.Write(&m_SendMsg.SizeBytes, 1);
+    // Not auto deleted, so StopRecvThread can wait on it.
+    m_pRecvThread = AfxBeginThread(RecvThread, this, THREAD_PRIORITY_ABOVE_NORMAL, 0, CREATE_SUSPENDED);
+    m_pRecvThread->m_bAutoDelete = FALSE;
+    m_pRecvThread->ResumeThread();
+}
 
-    // Send variable length payload bytes.
-    for(int i = 0; i < m_SendMsg.SizeBytes; ++i)
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Stop the receive thread and wait for it to exit.</summary>
+void CGarminBinaryDlg::StopRecvThread()
+{
+    if(m_pRecvThread)
     {
-        m_Serial.Write(&m_SendMsg.Payload[i], 1);
+        SetEvent(m_hRecvStop);
+        WaitForSingleObject(m_pRecvThread->m_hThread, INFINITE);
+        delete m_pRecvThread;
+        m_pRecvThread = NULL;
     }
 
-    // Send trailer bytes.
-    m_Serial.Write(&m_SendMsg.ChkSum, 1);
-    m_Serial.Write(&m_SendMsg.End1, 1);
-    m_Serial.Write(&m_SendMsg.End2, 1);
+    if(m_hRecvStop)
+    {
+        CloseHandle(m_hRecvStop);
+        m_hRecvStop = NULL;
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////////
-///<summary>Reads all available input bytes from GPS,
-/// generally just a partial message.</summary>
-void CGarminBinaryDlg::RecvMsg()
+///<summary>Receive thread entry point.</summary>
+UINT CGarminBinaryDlg::RecvThread(LPVOID pParam)
 {
-    DWORD bytesRead = 0;
-    uint8_t byte = 0;
-    int nTime = 0;
-    static uint8_t sLastbyte = 0;
-    unsigned int nNum = 0;
+    ((CGarminBinaryDlg*)pParam)->RecvLoop();
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Receive thread body: wait for the port to have input, then
+/// read it all, until told to stop.</summary>
+///<remarks>
+/// The thread uses its own OVERLAPPED structures. The CSerial internal
+/// one is left to Write, which is called from the GUI thread.
+///</remarks>
+void CGarminBinaryDlg::RecvLoop()
+{
+    OVERLAPPED ovWait;
+    OVERLAPPED ovRead;
+    memset(&ovWait, 0, sizeof(ovWait));
+    memset(&ovRead, 0, sizeof(ovRead));
+    ovWait.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ovRead.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-    // See if there is a byte to read.
-    m_Serial.Read(&byte, 1, &bytesRead);
+    HANDLE hWait[2] = { m_hRecvStop, ovWait.hEvent };
+    bool bWaiting = false;
 
-    // If we read any bytes, keep reading until buffer is empty.
-    while(bytesRead)
+    for(;;)
     {
-        // incr number bytes seen in this grouping
-        ++nNum;
+        // Take everything that is queued in the driver.
+        RecvMsg(&ovRead);
 
-        // This part finds DLEs and end of frames.
-        if(sLastbyte == 0x10 && byte == 0x10)
+        // Ask to be signalled when the next bytes arrive.
+        if(!bWaiting)
         {
-            // A second DLE was found.
+            ResetEvent(ovWait.hEvent);
+            bWaiting = (m_Serial.WaitEvent(&ovWait) == ERROR_SUCCESS);
+        }
 
-            // Set sLastbyte to some neutral value.
-            sLastbyte = 0;
+        // Also wake up now and then, in case bytes arrived between
+        // the read and the wait, or the wait could not be started.
+        DWORD dwWait = WaitForMultipleObjects(2, hWait, FALSE, _RECV_POLL_MSECS);
+
+        if(dwWait == WAIT_OBJECT_0)
+        {
+            break;
         }
-        else if(sLastbyte == 0x10 && byte == 0x03)
+        else if(dwWait == WAIT_OBJECT_0 + 1)
         {
-            // It is the end of frame.
+            bWaiting = false;
+        }
+    }
+
+    // Don't leave a wait pending on the event about to be closed.
+    if(bWaiting)
+    {
+        DWORD dwDummy;
+        CancelIo(m_Serial.GetCommHandle());
+        GetOverlappedResult(m_Serial.GetCommHandle(), &ovWait, &dwDummy, TRUE);
+    }
 
-            // Call helper function.
-            ProcessFrame();
+    CloseHandle(ovWait.hEvent);
+    CloseHandle(ovRead.hEvent);
+}
 
-            // Remember sLastbyte.
-            sLastbyte = byte;
-        }
-        else
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Sends an outgoing message to GPS, along with any
+/// already queued.</summary>
+void CGarminBinaryDlg::SendMsg()
+{
+    QueueMsg();
+
+    // While batching, the caller sends them all with SendQueued.
+    if(!m_bTxBatch)
+    {
+        SendQueued();
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Adds the outgoing message to the transmit queue, to be sent
+/// by SendQueued together with the others.</summary>
+void CGarminBinaryDlg::QueueMsg()
+{
+    AddToDisplay("TX: ", &m_SendMsg);
+
+    // Make room if the queue is full.
+    if(m_nTxBytes + CGarminFramer::MAX_STUFFED_BYTES > sizeof(m_TxQueue))
+    {
+        SendQueued();
+    }
+
+    // Whole frame with DLE stuffing, checksum and trailer.
+    m_nTxBytes += CGarminFramer::BuildFrame(m_SendMsg.CmdId, m_SendMsg.SizeBytes,
+                                            m_SendMsg.Payload, m_TxQueue + m_nTxBytes);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Sends all queued messages in one write.</summary>
+void CGarminBinaryDlg::SendQueued()
+{
+    if(m_nTxBytes)
+    {
+        m_Serial.Write(m_TxQueue, m_nTxBytes);
+        m_nTxBytes = 0;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Reads all available input bytes from GPS,
+/// generally just a partial message. Runs in the receive thread.</summary>
+void CGarminBinaryDlg::RecvMsg(LPOVERLAPPED pOvRead)
+{
+    DWORD bytesRead = 0;
+    unsigned int nNum = 0;
+    HANDLE hComm = m_Serial.GetCommHandle();
+
+    // Reads are non-blocking, so each one returns whatever is queued,
+    // up to a full block. Keep reading until the queue is empty.
+    for(;;)
+    {
+        // Drop any partial frame from before a purge. Checked for every
+        // block, as the GUI thread may purge at any time.
+        uint32_t nGen = (uint32_t)m_nLinkGen;
+        if(nGen != m_nFramerGen)
         {
-            // It is a normal mid-frame byte.
+            m_Framer.Reset();
+            m_nFramerGen = nGen;
+        }
 
-            // Add byte, then advance pointer.
-            *m_pRcv++ = byte;
+        ResetEvent(pOvRead->hEvent);
+        if(m_Serial.Read(m_RecvBlock, sizeof(m_RecvBlock), &bytesRead, pOvRead) != ERROR_SUCCESS ||
+           !GetOverlappedResult(hComm, pOvRead, &bytesRead, TRUE) ||
+           bytesRead == 0)
+        {
+            break;
+        }
 
-            // Do not allow the pointer to overrun buffer size
-            if(m_pRcv >= ((char*)&m_RecvMsg) + sizeof(m_RecvMsg))
-            {
-                // This message has an error; no end of frame was seen.
-                // Reset the pointer to the start of the buffer.
-                // This packet won't be valid, but the error will be
-                // handled as usual in the ProcessFrame function.
-                m_pRcv = (char*)&m_RecvMsg;
-            }
+        // incr number bytes seen in this grouping
+        nNum += bytesRead;
+        InterlockedExchangeAdd(&m_nRecvBytes, bytesRead);
 
-            // Remember sLastbyte.
-            sLastbyte = byte;
+        // Purged during the read, so the block may hold bytes from
+        // before. Drop it and read again with a reset framer.
+        if((uint32_t)m_nLinkGen != nGen)
+        {
+            continue;
         }
 
-        m_Serial.Read(&byte, 1, &bytesRead);
+        // The framer finds DLEs and end of frames, and calls OnFrame.
+        // Frames of a purge from now on carry the old generation, and
+        // OnRecvFrames drops them.
+        m_Framer.Consume(m_RecvBlock, bytesRead);
+
+        // A short read means the queue was drained.
+        if(bytesRead < sizeof(m_RecvBlock))
+        {
+            break;
+        }
     }
 
     // Check if we reached a new high water mark.
-    if(nNum > mHighWater)
+    if(nNum > (unsigned int)m_nRecvHighWater)
     {
-        mHighWater = nNum;
-        UpdateHighWater();
+        InterlockedExchange(&m_nRecvHighWater, nNum);
     }
 }
 
@@ -997,20 +1304,7 @@ void CGarminBinaryDlg::RecvMsg()
 /// for the current message.</summary>
 uint8_t CGarminBinaryDlg::CalcChksum(t_MSG_FORMAT *pMsg)
 {
-    // Chksum calculated over CmdId, Size, and payload only.
-
-    // Sum up the byte values.
-    uint8_t val = pMsg->CmdId;
-    val += pMsg->SizeBytes;
-
-    // Add sum of payload bytes, if any.
-    for(int i = 0; i < pMsg->SizeBytes; ++i)
-    {
-        val += pMsg->Payload[i];
-    }
-
-    // The chksum is the arithmetic negative.
-    return -(val);
+    return CGarminFramer::Checksum(pMsg->CmdId, pMsg->SizeBytes, pMsg->Payload);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -1240,13 +1534,91 @@ void CGarminBinaryDlg::DecodePVT()
     m_statUTC.SetWindowText(strValue);
 }
 
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Framer callback, in the receive thread: log the frame,
+/// queue it and tell the GUI thread.</summary>
+///<remarks>
+/// Logged here, so a busy GUI thread, or a full queue, doesn't cost the
+/// G12 file any record. The queue is for display and state handling.
+///</remarks>
+void CGarminBinaryDlg::OnFrame(void* pContext, const uint8_t* pFrame, size_t nBytes, bool bValid)
+{
+    CGarminBinaryDlg* pDlg = (CGarminBinaryDlg*)pContext;
+
+    // Not the frames received before the last purge.
+    if(bValid && pDlg->m_nFramerGen == (uint32_t)pDlg->m_nLinkGen)
+    {
+        pDlg->AddToLogFile(pFrame, nBytes);
+    }
+
+    pDlg->m_RecvQueue.Push(pFrame, nBytes, bValid, pDlg->m_nFramerGen);
+
+    // One message is enough until the GUI thread has drained the queue.
+    if(InterlockedExchange(&pDlg->m_bFramesPosted, 1) == 0)
+    {
+        pDlg->PostMessage(WM_RECV_FRAMES);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Message handler: process the frames queued by the receive
+/// thread.</summary>
+LRESULT CGarminBinaryDlg::OnRecvFrames(WPARAM wParam, LPARAM lParam)
+{
+    // Cleared first, so frames queued from now on post again.
+    InterlockedExchange(&m_bFramesPosted, 0);
+
+    const CFrameQueue::t_Frame* pFrame;
+    while((pFrame = m_RecvQueue.Front()) != NULL)
+    {
+        // Skip frames received before the last purge.
+        bool bCurrent = (pFrame->nGen == (uint32_t)m_nLinkGen);
+        bool bValid = pFrame->bValid;
+
+        if(bCurrent)
+        {
+            // Frame layout matches the message buffer up to the checksum.
+            ClearMsgBuff(&m_RecvMsg);
+            size_t nBytes = pFrame->nBytes;
+            if(nBytes > sizeof(m_RecvMsg)) nBytes = sizeof(m_RecvMsg);
+            memcpy(&m_RecvMsg, pFrame->data, nBytes);
+        }
+
+        // Release the slot before processing, which may pump messages
+        // (e.g. a message box) and so come back here.
+        m_RecvQueue.Pop();
+
+        if(bCurrent)
+        {
+            ProcessFrame(bValid);
+        }
+    }
+
+    // Frames lost because the queue was full count as errors.
+    unsigned int nDropped = m_RecvQueue.TakeDropped();
+    if(nDropped)
+    {
+        mErrFrames += nDropped;
+        mLinkErrs += nDropped;
+        UpdateErrSeen();
+    }
+
+    // Check if we reached a new high water mark.
+    if((unsigned int)m_nRecvHighWater > mHighWater)
+    {
+        mHighWater = m_nRecvHighWater;
+        UpdateHighWater();
+    }
+
+    return 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 ///<summary>A completed message frame has arrived, so process it.</summary>
-void CGarminBinaryDlg::ProcessFrame()
+void CGarminBinaryDlg::ProcessFrame(bool bValid)
 {
     CString str;
 
-    // Verify received checksum.
     uint8_t size = m_RecvMsg.SizeBytes;
 
     // Copy checksum byte into checksum field.
@@ -1256,14 +1628,16 @@ void CGarminBinaryDlg::ProcessFrame()
     m_RecvMsg.End1 = 0x10;
     m_RecvMsg.End2 = 0x03;
 
-    // Verify start flag and checksum in the received message.
-    if((m_RecvMsg.Start == 0x10) && (CalcChksum(&m_RecvMsg) - m_RecvMsg.ChkSum == 0))
+    // Start flag, length and checksum were verified by the framer.
+    if(bValid)
     {
         // A valid message has been parsed. Prepare to display it.
 
         // Save last command for possible ACK.
         m_lastRecv = m_RecvMsg.CmdId;
 
+        ++mLinkFrames;
+
         UpdateMsgSeen();
 
         // Detect GPS ID response.
@@ -1273,8 +1647,20 @@ void CGarminBinaryDlg::ProcessFrame()
             str.Format("%s", &m_RecvMsg.Payload[4]);
             m_statGpsId.SetWindowText(str);
 
+            // What is known about this receiver model.
+            LoadCaps();
+
+            // The baud rate negotiation waits for it.
+            if(mBaudState == BAUD_GET_ID)
+            {
+                BaudState(BAUD_FIRST);
+            }
+
             // Sending ACK for some receivers causes additional data to be received.
-            SendAck();
+            if(!HasQuirk("no_id_ack"))
+            {
+                SendAck();
+            }
         }
 
         // Detect Baud rate change response.
@@ -1302,20 +1688,14 @@ void CGarminBinaryDlg::ProcessFrame()
             DecodePVT();
         }
 
-        // Display the received hex string.
+        // Display the received hex string. It was logged, if at all,
+        // by the receive thread.
         AddToDisplay("", &m_RecvMsg);
 
-        // See if msg should be logged.
-        if(m_bIsLogging && (
-                    m_RecvMsg.CmdId == 0xFF ||
-                    m_RecvMsg.CmdId == 0x11 ||
-                    m_RecvMsg.CmdId == 0x0E ||
-                    m_RecvMsg.CmdId == 0x33 ||
-                    m_RecvMsg.CmdId == 0x36 ||
-                    m_RecvMsg.CmdId == 0x37 ||
-                    m_RecvMsg.CmdId == 0x38))
+        // A recording session may be waiting for this reply.
+        if(mG12State != STATE_IDLE)
         {
-            AddToLogFile();
+            G12Reply();
         }
     }
     else
@@ -1327,27 +1707,49 @@ void CGarminBinaryDlg::ProcessFrame()
         AddToDisplay(str, 0);
 
         ++mErrFrames;
+        ++mLinkErrs;
         UpdateErrSeen();
     }
 
     // Reset message buffer.
     ClearMsgBuff(&m_RecvMsg);
-    m_pRcv = (char*)&m_RecvMsg;
 }
 
 /////////////////////////////////////////////////////////////////////////////
-///<summary>Send received message bytes to G12 formatted file.</summary>
-void CGarminBinaryDlg::AddToLogFile()
+///<summary>Send a received frame to G12 formatted file, in the receive
+/// thread.</summary>
+void CGarminBinaryDlg::AddToLogFile(const uint8_t* pFrame, size_t nBytes)
 {
-    if(m_bIsLogging)
+    if(!m_bIsLogging || nBytes < 3 || nBytes < 3u + pFrame[2])
+    {
+        return;
+    }
+
+    // See if msg should be logged.
+    uint8_t id = pFrame[1];
+    if(id == 0xFF ||
+            id == 0x11 ||
+            id == 0x0E ||
+            id == 0x33 ||
+            id == 0x36 ||
+            id == 0x37 ||
+            id == 0x38)
     {
-        m_OutFile.Write(&m_RecvMsg.CmdId, 1);
-        m_OutFile.Write(&m_RecvMsg.SizeBytes, 1);
+        // CmdId, SizeBytes and Payload are contiguous, as in the file.
+        // The writer thread also converts them to RINEX.
+        m_G12Writer.Write(pFrame + 1, 2 + pFrame[2]);
+    }
+}
 
-        for(int i = 0; i < m_RecvMsg.SizeBytes; ++i)
-        {
-            m_OutFile.Write(&m_RecvMsg.Payload[i], 1);
-        }
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Write out whatever is still buffered and close the G12 file.</summary>
+void CGarminBinaryDlg::CloseG12File()
+{
+    if(m_G12Writer.IsOpen() && !m_G12Writer.Close())
+    {
+        CString str;
+        str.Format("Error writing file: %s", m_strFileNameG12.GetString());
+        AfxMessageBox(str);
     }
 }
 
@@ -1431,10 +1833,16 @@ void CGarminBinaryDlg::UpdateHighWater()
 ///<summary>Update the GUI field that displays the current bandwidth.</summary>
 void CGarminBinaryDlg::UpdateBandwidth()
 {
-    CString strValue;
+    // The timer runs faster than this, so measure over about a second.
+    DWORD msecs = GetTickCount() - mBandwidthStart;
+    if(msecs < 1000)
+    {
+        return;
+    }
+    mBandwidthStart += msecs;
 
-    // This function is called once every second, so period argument is 1.0
-    strValue.Format("%5.1f bps", m_Serial.CalcBandwidth(1.0));
+    CString strValue;
+    strValue.Format("%5.1f bps", m_Serial.CalcBandwidth(msecs / (float)1000.0));
     m_statBandwidth.SetWindowText(strValue);
 }
 
@@ -1446,48 +1854,20 @@ void CGarminBinaryDlg::UpdateBandwidth()
 ///<summary>GUI button message handler.</summary>
 void CGarminBinaryDlg::OnBtnBaudUp()
 {
-    ClearMsgBuff(&m_SendMsg);
-
-    m_SendMsg.Start      = 0x10;
-    m_SendMsg.CmdId      = MSG_BAUD_CMD;
-    m_SendMsg.SizeBytes  = 0x04;
-    unsigned int baud    = 57600;
-
-    // Little endien
-    m_SendMsg.Payload[0] = baud;
-    m_SendMsg.Payload[1] = baud >> 8;
-    m_SendMsg.Payload[2] = baud >> 16;
-    m_SendMsg.Payload[3] = baud >> 24;
-
-    m_SendMsg.ChkSum     = CalcChksum(&m_SendMsg);
-    m_SendMsg.End1       = 0x10;
-    m_SendMsg.End2       = 0x03;
+    // Not while recording, already at it, or looking for the GPS rate.
+    if(mG12State != STATE_IDLE || mBaudState != BAUD_IDLE || mSyncState == SYNC_CHECK)
+    {
+        return;
+    }
 
-    SendMsg();
+    BaudState(BAUD_START);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 ///<summary>GUI button message handler.</summary>
 void CGarminBinaryDlg::OnBtnBaudDn()
 {
-    ClearMsgBuff(&m_SendMsg);
-
-    m_SendMsg.Start      = 0x10;
-    m_SendMsg.CmdId      = MSG_BAUD_CMD;
-    m_SendMsg.SizeBytes  = 0x04;
-    unsigned int baud    = 9600;
-
-    // Little endien
-    m_SendMsg.Payload[0] = baud;
-    m_SendMsg.Payload[1] = baud >> 8;
-    m_SendMsg.Payload[2] = baud >> 16;
-    m_SendMsg.Payload[3] = baud >> 24;
-
-    m_SendMsg.ChkSum     = CalcChksum(&m_SendMsg);
-    m_SendMsg.End1       = 0x10;
-    m_SendMsg.End2       = 0x03;
-
-    SendMsg();
+    RequestBaud(atoi(s_StrLoBaud));
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -1537,6 +1917,12 @@ void CGarminBinaryDlg::ConfirmNewBaud()
     {
         baud = 115200;
     }
+    else if(mBaudState != BAUD_IDLE)
+    {
+        // The negotiation times out and carries on at the old rate.
+        AddToDisplay("Baud change did not work!", 0);
+        return;
+    }
     else
     {
         AfxMessageBox("Baud change did not work!");
@@ -1547,19 +1933,15 @@ void CGarminBinaryDlg::ConfirmNewBaud()
         return;
     }
 
-    // Display the "standard" baud, not the confirmed number.
-    strBaud.Format("%d", baud);
-    m_statBaud.SetWindowText(strBaud);
-
     // Send ACK of baud change msg, at old baud.
     SendAck();
 
     // Garmin says to wait at least 100 mSec here.
     Sleep(150);
 
-    // Now change our local baud rate to the new baud.
-    m_Serial.Setup((CSerial::EBaudrate)baud, CSerial::EData8, CSerial::EParNone, CSerial::EStop1);
-    m_Serial.Purge();
+    // Now change our local baud rate to the new baud. Display the
+    // "standard" baud, not the confirmed number.
+    SetLocalBaud(baud);
 
     // Transmit a confirmation at the new baud rate.
     ClearMsgBuff(&m_SendMsg);
@@ -1595,6 +1977,16 @@ void CGarminBinaryDlg::ConfirmNewBaud()
 
     // This whole process must complete in less than 2 seconds
     // or the GPS will revert to the old baud rate.
+
+    // The baud rate negotiation goes on from here.
+    if(mBaudState == BAUD_WAIT_NEW)
+    {
+        BaudState(BAUD_BURST);
+    }
+    else if(mBaudState == BAUD_WAIT_OLD)
+    {
+        BaudState(BAUD_DONE);
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -1614,84 +2006,631 @@ void CGarminBinaryDlg::OnBtnBaudLocal()
 }
 
 /////////////////////////////////////////////////////////////////////////////
-///<summary>Change the state machine to control a G12 file capture.</summary>
-void CGarminBinaryDlg::G12State(e_STATE_TYPE state)
+///<summary>Ask the GPS to change to a new baud rate. The change is made
+/// by ConfirmNewBaud when the GPS answers.</summary>
+void CGarminBinaryDlg::RequestBaud(unsigned int baud)
 {
-    // Determine if a specific state should be set.
-    if(state != STATE_NEXT)
-    {
-        mG12State = state;
-    }
+    ClearMsgBuff(&m_SendMsg);
+
+    m_SendMsg.Start      = 0x10;
+    m_SendMsg.CmdId      = MSG_BAUD_CMD;
+    m_SendMsg.SizeBytes  = 0x04;
+
+    // Little endien
+    m_SendMsg.Payload[0] = baud;
+    m_SendMsg.Payload[1] = baud >> 8;
+    m_SendMsg.Payload[2] = baud >> 16;
+    m_SendMsg.Payload[3] = baud >> 24;
+
+    m_SendMsg.ChkSum     = CalcChksum(&m_SendMsg);
+    m_SendMsg.End1       = 0x10;
+    m_SendMsg.End2       = 0x03;
+
+    SendMsg();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Change only the PC baud rate.</summary>
+void CGarminBinaryDlg::SetLocalBaud(unsigned int baud)
+{
+    CString strBaud;
+    strBaud.Format("%d", baud);
+    m_statBaud.SetWindowText(strBaud);
+
+    m_Serial.Setup((CSerial::EBaudrate)baud, CSerial::EData8, CSerial::EParNone, CSerial::EStop1);
+    PurgePort();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>The baud rate both GPS and PC are set to.</summary>
+unsigned int CGarminBinaryDlg::CurrentBaud()
+{
+    CString str;
+    m_statBaud.GetWindowText(str);
+
+    return atoi(str);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>While recording, called once a second to step down to a
+/// slower baud rate if frames are getting corrupted.</summary>
+void CGarminBinaryDlg::CheckLinkErrors()
+{
+    DWORD now = GetTickCount();
+    if(now - mCheckStart < 1000)
+    {
+        return;
+    }
+    mCheckStart = now;
+
+    unsigned int nFrames = mLinkFrames - mCheckFrames;
+    unsigned int nErrs = mLinkErrs - mCheckErrs;
+    mCheckFrames = mLinkFrames;
+    mCheckErrs = mLinkErrs;
+
+    // With no good frames at all the link is lost, not noisy, and
+    // SyncState finds the GPS again.
+    if(mG12State != STATE_ASYNC_TIC || mBaudState != BAUD_IDLE ||
+            nErrs < _BAUD_ERR_LIMIT || nFrames == 0)
+    {
+        return;
+    }
+
+    // The next slower rate, down to the low baud.
+    unsigned int baud = CurrentBaud();
+    mBaudGood = atoi(s_StrLoBaud);
+    for(unsigned int i = 0; i < _countof(s_TuneBauds) && s_TuneBauds[i] < baud; ++i)
+    {
+        mBaudGood = s_TuneBauds[i];
+    }
+
+    if(mBaudGood < baud)
+    {
+        CString str;
+        str.Format("%u bad frames in 1 second, stepping down to %u baud", nErrs, mBaudGood);
+        AddToDisplay(str, 0);
+
+        // A noisy moment, not a measure of the receiver: not kept in the
+        // capability file.
+        mBaudTuning = false;
+        BaudState(BAUD_FALLBACK);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Change the state machine that finds the fastest baud rate
+/// the GPS and PC can use without errors.</summary>
+///<remarks>
+/// Each rate of s_TuneBauds is tried in turn, slowest first: the GPS is
+/// asked to change to it, and then sends all its async messages for
+/// _BAUD_BURST_MSECS. The rate passes if enough frames come, none of
+/// them bad, and the receive buffer never gets half full. The first
+/// rate that fails sends both sides back to the last one that passed.
+/// A rate found before for this receiver, in the capability file, is
+/// tried first, and the faster ones after it. If that rate fails, the
+/// slower ones are tried in turn until one passes, and only below the
+/// slowest both sides go back to the rate they started at. Only a rate
+/// that passed in baud up is kept in the capability file, not a
+/// fallback nor a step down while recording.
+///</remarks>
+void CGarminBinaryDlg::BaudState(e_BAUD_STATE state)
+{
+    DWORD now = GetTickCount();
+
+    // Determine if a specific state should be set.
+    if(state != BAUD_NEXT)
+    {
+        mBaudState = state;
+    }
 
     // Process the current state.
-    if(mG12State == STATE_START)
+    if(mBaudState == BAUD_START)
     {
-        AddToDisplay("STATE_START", 0);
+        AddToDisplay("BAUD_START", 0);
 
-        // Make sure all periodic messages are off.
-        OnBtnAsyncOff();
+        // The rate both sides are at now is known to work.
+        mBaudGood = CurrentBaud();
+        mBaudTuning = false;
+        mBaudDown = false;
+
+        // Find out which receiver this is, for the capability file.
+        OnBtnGetId();
 
-        // Start the state transition timer.
-        SetTimer(_STATE_TIMER, _STATE_TIMER_CMDS_MSECS, NULL);
+        mBaudStart = now;
+        SetTimer(_BAUD_TIMER, _BAUD_TIMER_MSECS, NULL);
 
         // Next state.
-        mG12State = STATE_GET_ID;
+        mBaudState = BAUD_GET_ID;
     }
-    else if(mG12State == STATE_GET_ID)
+    else if(mBaudState == BAUD_GET_ID)
     {
-        AddToDisplay("STATE_GET_ID", 0);
+        // The ID response moves on, see ProcessFrame.
+        if(now - mBaudStart >= _STATE_REPLY_MSECS)
+        {
+            BaudState(BAUD_FIRST);
+        }
+    }
+    else if(mBaudState == BAUD_FIRST)
+    {
+        // Start with the rate found last time, if any.
+        mBaudTry = 0;
+        for(unsigned int i = 0; i < _countof(s_TuneBauds); ++i)
+        {
+            if(s_TuneBauds[i] == m_Caps.baud)
+            {
+                mBaudTry = i;
+            }
+        }
 
-        // Request GPS ID String.
-        OnBtnGetId();
+        BaudState(BAUD_REQUEST);
+    }
+    else if(mBaudState == BAUD_REQUEST)
+    {
+        CString str;
+        str.Format("BAUD_REQUEST %u", s_TuneBauds[mBaudTry]);
+        AddToDisplay(str, 0);
+
+        RequestBaud(s_TuneBauds[mBaudTry]);
+        mBaudStart = now;
+
+        // Next state, moved on by ConfirmNewBaud.
+        mBaudState = BAUD_WAIT_NEW;
+    }
+    else if(mBaudState == BAUD_WAIT_NEW)
+    {
+        if(now - mBaudStart >= _BAUD_REPLY_MSECS)
+        {
+            // The GPS doesn't do this rate, and stays at the last one.
+            // Stepping down, that is the rate that failed.
+            AddToDisplay("BAUD_WAIT_NEW: no reply", 0);
+            BaudState(mBaudDown ? BAUD_FALLBACK : BAUD_DONE);
+        }
+    }
+    else if(mBaudState == BAUD_BURST)
+    {
+        // Count from here, with all async messages on.
+        mBurstFrames = mLinkFrames;
+        mBurstErrs = mLinkErrs;
+        InterlockedExchange(&m_nRecvHighWater, 0);
+
+        OnBtnAsyncOn();
+        mBaudStart = now;
 
         // Next state.
-        mG12State = STATE_GET_UTC;
+        mBaudState = BAUD_MEASURE;
     }
-    else if(mG12State == STATE_GET_UTC)
+    else if(mBaudState == BAUD_MEASURE)
     {
-        AddToDisplay("STATE_GET_UTC", 0);
+        if(now - mBaudStart < _BAUD_BURST_MSECS)
+        {
+            return;
+        }
 
-        // Request UTC Time from GPS.
-        OnBtnGetUTC();
+        OnBtnAsyncOff();
+
+        unsigned int nFrames = mLinkFrames - mBurstFrames;
+        unsigned int nErrs = mLinkErrs - mBurstErrs;
+        unsigned int nHighWater = m_nRecvHighWater;
+
+        CString str;
+        str.Format("BAUD_MEASURE %u: %u frames, %u bad, high water %u",
+                   s_TuneBauds[mBaudTry], nFrames, nErrs, nHighWater);
+        AddToDisplay(str, 0);
+
+        if(nErrs == 0 && nFrames >= _BAUD_BURST_FRAMES && nHighWater < RECV_BLOCK_BYTES / 2)
+        {
+            mBaudGood = s_TuneBauds[mBaudTry];
+            mBaudTuning = true;
+
+            // Go on to the next faster rate, also after the one from the
+            // capability file: the cable or the PC may be better now.
+            // Stepping down, the faster ones have failed already.
+            if(!mBaudDown && mBaudTry + 1 < _countof(s_TuneBauds))
+            {
+                ++mBaudTry;
+                BaudState(BAUD_REQUEST);
+            }
+            else
+            {
+                BaudState(BAUD_DONE);
+            }
+        }
+        else if(!mBaudTuning && mBaudTry > 0 && s_TuneBauds[mBaudTry - 1] > mBaudGood)
+        {
+            // Nothing passed yet: try the next slower rate, still faster
+            // than the one both sides started at. Sent at the failing
+            // rate, as for BAUD_FALLBACK.
+            mBaudDown = true;
+            --mBaudTry;
+            BaudState(BAUD_REQUEST);
+        }
+        else
+        {
+            BaudState(BAUD_FALLBACK);
+        }
+    }
+    else if(mBaudState == BAUD_FALLBACK)
+    {
+        CString str;
+        str.Format("BAUD_FALLBACK %u", mBaudGood);
+        AddToDisplay(str, 0);
+
+        // Sent at the failing rate. Errors are seen on the way in,
+        // so the GPS generally gets it.
+        RequestBaud(mBaudGood);
+        mBaudStart = now;
+        SetTimer(_BAUD_TIMER, _BAUD_TIMER_MSECS, NULL);
+
+        // Next state, moved on by ConfirmNewBaud.
+        mBaudState = BAUD_WAIT_OLD;
+    }
+    else if(mBaudState == BAUD_WAIT_OLD)
+    {
+        if(now - mBaudStart >= _BAUD_REPLY_MSECS)
+        {
+            // The GPS didn't get it, or its answer was lost and it went
+            // back on its own: it is at the good rate either way.
+            AddToDisplay("BAUD_WAIT_OLD: no reply", 0);
+            SetLocalBaud(mBaudGood);
+            BaudState(BAUD_DONE);
+        }
+    }
+    else if(mBaudState == BAUD_DONE)
+    {
+        KillTimer(_BAUD_TIMER);
+
+        CString str;
+        str.Format("BAUD_DONE %u", mBaudGood);
+        AddToDisplay(str, 0);
+
+        // Keep it for the next session with this receiver.
+        if(mBaudTuning && m_Caps.prod && m_Caps.baud != mBaudGood)
+        {
+            type_caps caps;
+
+            reset_caps(&caps, m_Caps.prod, m_Caps.version);
+            caps.baud = m_Caps.baud = mBaudGood;
+            caps_store(m_strCapsFile, &caps, CAPS_BAUD);
+        }
+
+        mBaudState = BAUD_IDLE;
+    }
+    else // IDLE state is the end. Once in Idle, stay in Idle.
+    {
+        mBaudState = BAUD_IDLE;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Change the state machine that watches the received frames,
+/// and finds the GPS baud rate again if it is lost.</summary>
+///<remarks>
+/// The link is out of sync when bytes keep coming but no good frame
+/// does, e.g. after the program was restarted with the GPS still at a
+/// high baud rate. Each rate of s_SyncBauds is then set locally in
+/// turn, until a few good frames come. When not recording, the GPS is
+/// asked for its ID at each rate, so there is something to receive.
+/// The timer only switches the port and looks at counters, so the GUI
+/// and the recording carry on meanwhile.
+///</remarks>
+void CGarminBinaryDlg::SyncState(e_SYNC_STATE state)
+{
+    DWORD now = GetTickCount();
+
+    // Determine if a specific state should be set.
+    if(state != SYNC_NEXT)
+    {
+        mSyncState = state;
+    }
+
+    // Counters since the last window.
+    unsigned int nFrames = mLinkFrames - mSyncFrames;
+    unsigned int nErrs = mLinkErrs - mSyncErrs;
+    unsigned int nBytes = (unsigned int)m_nRecvBytes - mSyncBytes;
+
+    // Process the current state.
+    if(mSyncState == SYNC_START)
+    {
+        mSyncBadWindows = 0;
+        mSyncStart = now;
+        mSyncFrames = mLinkFrames;
+        mSyncErrs = mLinkErrs;
+        mSyncBytes = m_nRecvBytes;
+        SetTimer(_SYNC_TIMER, _SYNC_TIMER_MSECS, NULL);
 
         // Next state.
-        mG12State = STATE_GET_POS;
+        mSyncState = SYNC_WATCH;
+    }
+    else if(mSyncState == SYNC_WATCH)
+    {
+        if(now - mSyncStart < _SYNC_WINDOW_MSECS)
+        {
+            return;
+        }
+
+        mSyncStart = now;
+        mSyncFrames = mLinkFrames;
+        mSyncErrs = mLinkErrs;
+        mSyncBytes = m_nRecvBytes;
+
+        // The baud rate negotiation expects bad frames, and deals with them.
+        if(mBaudState != BAUD_IDLE || nFrames ||
+                (nErrs < _SYNC_BAD_FRAMES && nBytes < _SYNC_NOISE_BYTES))
+        {
+            mSyncBadWindows = 0;
+            return;
+        }
+
+        if(++mSyncBadWindows < _SYNC_WINDOWS)
+        {
+            return;
+        }
+
+        // Start from the rate in use, and try all the others once.
+        mSyncFrom = CurrentBaud();
+        mSyncTry = 0;
+        for(unsigned int i = 0; i < _countof(s_SyncBauds); ++i)
+        {
+            if(s_SyncBauds[i] == mSyncFrom)
+            {
+                mSyncTry = i;
+            }
+        }
+        mSyncLeft = _countof(s_SyncBauds) - 1;
+
+        CString str;
+        str.Format("No good frames at %u baud, %u bytes and %u bad frames in 1 second",
+                   mSyncFrom, nBytes, nErrs);
+        AddToDisplay(str, 0);
+
+        SyncTry();
+    }
+    else if(mSyncState == SYNC_CHECK)
+    {
+        // The first frame at a new rate may be cut short by the switch.
+        unsigned int nNeeded = (mG12State == STATE_IDLE) ? 1 : _SYNC_GOOD_FRAMES;
+
+        if(nFrames >= nNeeded && nErrs <= 1)
+        {
+            CString str;
+            str.Format("Link in sync at %u baud", CurrentBaud());
+            AddToDisplay(str, 0);
+
+            SyncState(SYNC_START);
+        }
+        else if(now - mSyncStart >= _SYNC_TRY_MSECS)
+        {
+            SyncTry();
+        }
+    }
+    else // IDLE state is the end, while the port is closed.
+    {
+        KillTimer(_SYNC_TIMER);
+        mSyncState = SYNC_IDLE;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Set the next rate to look for the GPS at.</summary>
+void CGarminBinaryDlg::SyncTry()
+{
+    if(mSyncLeft == 0)
+    {
+        // None worked, the GPS may have gone quiet. Watch again.
+        CString str;
+        str.Format("No baud rate in sync, back to %u", mSyncFrom);
+        AddToDisplay(str, 0);
+
+        SetLocalBaud(mSyncFrom);
+        SyncState(SYNC_START);
+        return;
+    }
+
+    --mSyncLeft;
+    mSyncTry = (mSyncTry + 1) % _countof(s_SyncBauds);
+
+    CString str;
+    str.Format("Trying %u baud", s_SyncBauds[mSyncTry]);
+    AddToDisplay(str, 0);
+
+    // Frames from before the switch are dropped by the purge.
+    SetLocalBaud(s_SyncBauds[mSyncTry]);
+
+    mSyncStart = GetTickCount();
+    mSyncFrames = mLinkFrames;
+    mSyncErrs = mLinkErrs;
+    mSyncBytes = m_nRecvBytes;
+
+    // Nothing is sent while recording, so as not to change the log.
+    if(mG12State == STATE_IDLE)
+    {
+        OnBtnGetId();
+    }
+
+    // Next state.
+    mSyncState = SYNC_CHECK;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>A reply was received while recording, see if the state
+/// machine was waiting for it.</summary>
+void CGarminBinaryDlg::G12Reply()
+{
+    // Offset of the fix field in the PVT record.
+    enum { PVT_FIX = 16 };
+
+    if(m_RecvMsg.CmdId == MSG_ID_RSP)
+    {
+        mG12Pending &= ~REPLY_ID;
+    }
+    else if(m_RecvMsg.CmdId == MSG_UTC_RSP)
+    {
+        mG12Pending &= ~REPLY_UTC;
+    }
+    else if(m_RecvMsg.CmdId == MSG_LATLON_RSP)
+    {
+        mG12Pending &= ~REPLY_POS;
+    }
+    else if(m_RecvMsg.CmdId == MSG_PVT_RSP)
+    {
+        mG12Pending &= ~REPLY_PVT;
+
+        uint16_t fix = 0;
+        if(m_RecvMsg.SizeBytes >= PVT_FIX + sizeof(fix))
+        {
+            memcpy(&fix, &m_RecvMsg.Payload[PVT_FIX], sizeof(fix));
+        }
+
+        // 3D, 2D WAAS or 3D WAAS, as gar2rnx counts a 3D fix.
+        if(fix >= 3)
+        {
+            mG12Pending &= ~REPLY_FIX;
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    // Move on now, rather than at the next timer tick.
+    if(mG12State == STATE_QUERY || mG12State == STATE_GET_FIX)
+    {
+        G12State(STATE_NEXT);
     }
-    else if(mG12State == STATE_GET_POS)
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Change the state machine to control a G12 file capture.</summary>
+///<remarks>
+/// Called with a state to enter it, and with STATE_NEXT by the timer and
+/// by G12Reply. The setup steps advance as soon as the replies they wait
+/// for are in, so setup takes as long as the GPS takes to answer. A
+/// query not answered in _STATE_REPLY_MSECS is sent again, and after
+/// _STATE_TRIES the session goes on without it, as gar2rnx can still
+/// make a RINEX file from the observations.
+///</remarks>
+void CGarminBinaryDlg::G12State(e_STATE_TYPE state)
+{
+    DWORD now = GetTickCount();
+
+    // Determine if a specific state should be set.
+    if(state != STATE_NEXT)
+    {
+        mG12State = state;
+    }
+
+    // Process the current state.
+    if(mG12State == STATE_START)
     {
-        AddToDisplay("STATE_GET_POS", 0);
+        AddToDisplay("STATE_START", 0);
 
-        // Request position from GPS.
+        // Make sure all periodic messages are off, and ask for the GPS ID
+        // string, UTC time and position. They don't depend on each other,
+        // so all go out in one write and the replies come in any order.
+        m_bTxBatch = true;
+        OnBtnAsyncOff();
+        OnBtnGetId();
+        OnBtnGetUTC();
         OnBtnGetLatLon();
+        m_bTxBatch = false;
+        SendQueued();
+
+        mG12Pending = REPLY_ID | REPLY_UTC | REPLY_POS;
+        mStepStart = now;
+        mStepTries = 1;
+
+        // Start the timer that checks for timeouts.
+        mBandwidthStart = now;
+        SetTimer(_STATE_TIMER, _STATE_TIMER_POLL_MSECS, NULL);
 
         // Next state.
-        mG12State = STATE_PVT_ON;
+        mG12State = STATE_QUERY;
+    }
+    else if(mG12State == STATE_QUERY)
+    {
+        if(mG12Pending && now - mStepStart >= _STATE_REPLY_MSECS)
+        {
+            if(mStepTries < _STATE_TRIES)
+            {
+                AddToDisplay("STATE_QUERY: retry", 0);
+
+                // Ask again for whatever is still missing.
+                m_bTxBatch = true;
+                if(mG12Pending & REPLY_ID) OnBtnGetId();
+                if(mG12Pending & REPLY_UTC) OnBtnGetUTC();
+                if(mG12Pending & REPLY_POS) OnBtnGetLatLon();
+                m_bTxBatch = false;
+                SendQueued();
+
+                mStepStart = now;
+                ++mStepTries;
+            }
+            else
+            {
+                AddToDisplay("STATE_QUERY: no reply", 0);
+                mG12Pending = 0;
+            }
+        }
+
+        if(mG12Pending == 0)
+        {
+            G12State(STATE_PVT_ON);
+        }
     }
     else if(mG12State == STATE_PVT_ON)
     {
         AddToDisplay("STATE_PVT_ON", 0);
 
-        // Set longer state timer for this state.
-        SetTimer(_STATE_TIMER, _STATE_TIMER_CMDS_MSECS * 6, NULL);
-
-        // Turn on once per second PVT messages from GPS.
+        // Turn on once per second PVT messages from GPS, and
+        // wait for one showing a 3D fix.
         OnBtnPvtOn();
 
+        mG12Pending = REPLY_PVT | REPLY_FIX;
+        mStepStart = now;
+        mStepTries = 1;
+        mFixStart = now;
+
         // Next state.
-        mG12State = STATE_ASYNC_ON;
+        mG12State = STATE_GET_FIX;
     }
-    else if(mG12State == STATE_ASYNC_ON)
+    else if(mG12State == STATE_GET_FIX)
     {
-        // Resume normal period for state timer.
-        SetTimer(_STATE_TIMER, _STATE_TIMER_CMDS_MSECS, NULL);
+        // Ask again only if no PVT message came at all.
+        if((mG12Pending & REPLY_PVT) && now - mStepStart >= _STATE_PVT_MSECS &&
+                mStepTries < _STATE_TRIES)
+        {
+            AddToDisplay("STATE_GET_FIX: retry", 0);
+            OnBtnPvtOn();
 
-        // Turn off PVT messages.
-        OnBtnPvtOff();
+            mStepStart = now;
+            ++mStepTries;
+        }
 
+        if(!(mG12Pending & REPLY_FIX))
+        {
+            G12State(STATE_ASYNC_ON);
+        }
+        else if(now - mFixStart >= _STATE_FIX_MSECS)
+        {
+            AddToDisplay("STATE_GET_FIX: no 3D fix", 0);
+            G12State(STATE_ASYNC_ON);
+        }
+    }
+    else if(mG12State == STATE_ASYNC_ON)
+    {
         AddToDisplay("STATE_ASYNC_ON", 0);
 
-        // Start asyncronous output of specific messages from GPS.
+        // Turn off PVT messages, and start asyncronous output of
+        // specific messages from GPS.
+        m_bTxBatch = true;
+        OnBtnPvtOff();
         AsyncMaskOn();
+        m_bTxBatch = false;
+        SendQueued();
+
+        // The recording time counts from here.
+        mRecStart = now;
+        mRecSecs = mTickDown;
 
         CString strValue;
         strValue.Format("%d", mTickDown);
@@ -1714,16 +2653,26 @@ void CGarminBinaryDlg::G12State(e_STATE_TYPE state)
         AddToDisplay("STATE_STOP_REC", 0);
         m_statTick.SetWindowText("0");
 
-        m_bIsLogging = false;
-        if(m_OutFile.m_hFile != CFile::hFileNull) m_OutFile.Close();
+        InterlockedExchange(&m_bIsLogging, 0);
+        CloseG12File();
+
+        // The RINEX files are complete as soon as recording stops.
+        CloseRinexStream();
 
         OnBtnAsyncOff();
 
         // Next state.
+        mStepStart = now;
         mG12State = STATE_GPS_OFF;
     }
     else if(mG12State == STATE_GPS_OFF)
     {
+        if(now - mStepStart < _STATE_TIMER_CMDS_MSECS)
+        {
+            return;
+        }
+        mStepStart = now;
+
         if(m_chkPwrOff.GetCheck() == BST_CHECKED)
         {
             AddToDisplay("STATE_GPS_OFF", 0);
@@ -1735,6 +2684,11 @@ void CGarminBinaryDlg::G12State(e_STATE_TYPE state)
     }
     else if(mG12State == STATE_FINISH)
     {
+        if(now - mStepStart < _STATE_TIMER_CMDS_MSECS)
+        {
+            return;
+        }
+
         AddToDisplay("STATE_FINISH", 0);
 
         // Stop the state transition timer.
@@ -1743,8 +2697,12 @@ void CGarminBinaryDlg::G12State(e_STATE_TYPE state)
         // The bandwidth is not measured unless recording file.
         m_statBandwidth.SetWindowText("");
 
-        // Spawn process to convert to Rinex.
-        CallGar2rnx();
+        // Spawn process to convert to Rinex, unless already converted.
+        if(!m_bRinexStreamed)
+        {
+            CallGar2rnx();
+        }
+        m_bRinexStreamed = false;
 
         G12State(STATE_IDLE);
     }
@@ -1762,7 +2720,7 @@ void CGarminBinaryDlg::CallGar2rnx()
 {
     // get the path to the Rinex creator.
     CString strRinexPath = m_Profile.GetProfileStr("MainConfig", "Gar2RnxPath" , "");
-    CString strRinexOpts = m_Profile.GetProfileStr("MainConfig", "Gar2RnxOptions" , "-etrex");
+    CString strRinexOpts = GetGar2rnxOptions();
 
     // Change last letter of G12 filename to "O"
     CString strFileNameRinex = m_strFileNameG12.Left(m_strFileNameG12.GetLength()-1) + "O";
@@ -1789,6 +2747,101 @@ void CGarminBinaryDlg::CallGar2rnx()
     }
 }
 
+/////////////////////////////////////////////////////////////////////////////
+///<summary>GAR2RNX options from the profile, with the capability file
+/// so it finds the record layout of the receiver there.</summary>
+CString CGarminBinaryDlg::GetGar2rnxOptions()
+{
+    CString strRinexOpts = m_Profile.GetProfileStr("MainConfig", "Gar2RnxOptions" , "");
+
+    // Given first, so an explicit -caps in the options wins. Quoted, as
+    // the profile folder may hold blanks.
+    return "-caps \"" + m_strCapsFile + "\" " + strRinexOpts;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Look up the receiver of the ID response in the capability
+/// file. A receiver not seen before is added, and GAR2RNX fills in its
+/// record layout from the first recording.</summary>
+void CGarminBinaryDlg::LoadCaps()
+{
+    unsigned int prod    = m_RecvMsg.Payload[0] | m_RecvMsg.Payload[1] << 8;
+    unsigned int version = m_RecvMsg.Payload[2] | m_RecvMsg.Payload[3] << 8;
+
+    if(!caps_find(m_strCapsFile, prod, version, &m_Caps))
+    {
+        m_Caps.async = _ASYNC_MASK;
+        caps_store(m_strCapsFile, &m_Caps, CAPS_ASYNC);
+    }
+
+    CString str;
+    str.Format("Receiver %u v%u.%02u: layout %c, baud %lu, async 0x%04X, quirks %s",
+               prod, version / 100, version % 100, m_Caps.layout,
+               m_Caps.baud, m_Caps.async, m_Caps.quirks);
+    AddToDisplay(str, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>True if the capability file lists this quirk for the
+/// receiver.</summary>
+bool CGarminBinaryDlg::HasQuirk(const char* pName)
+{
+    CString strQuirks = CString(",") + m_Caps.quirks + ",";
+    return strQuirks.Find(CString(",") + pName + ",") >= 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Have the G12 writer convert the records being logged to RINEX
+/// observation and navigation files, using the built in GAR2RNX. Before
+/// the G12 file is opened.</summary>
+void CGarminBinaryDlg::OpenRinexStream()
+{
+    m_bRinexStreamed = false;
+    m_strRinexObs.Empty();
+
+    if(m_Profile.GetProfileInt("MainConfig", "Gar2RnxInProcess" , 1) == 0)
+    {
+        // Use the external gar2rnx.exe at the end instead.
+        return;
+    }
+
+    m_strRinexOpts = GetGar2rnxOptions();
+
+    // Change last letter of G12 filename to "O" and "N"
+    CString strBase = m_strFileNameG12.Left(m_strFileNameG12.GetLength()-1);
+    m_strRinexObs = strBase + "O";
+
+    m_G12Writer.SetRinex(m_strRinexOpts, m_strRinexObs, strBase + "N");
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Report the RINEX files the G12 writer finished on closing.
+/// After CloseG12File.</summary>
+void CGarminBinaryDlg::CloseRinexStream()
+{
+    long nEpochs = 0;
+    long nEph = 0;
+    if(m_strRinexObs.IsEmpty() || !m_G12Writer.GetRinexResult(&nEpochs, &nEph)) return;
+
+    m_strRinexObs.Empty();
+    m_bRinexStreamed = true;
+
+    CString str;
+    if(nEpochs < 0)
+    {
+        str.Format(
+            "No GPS date and position found in the recorded data.\r\n"\
+            "The Rinex observation file was not created.\r\n"\
+            "Ephemerides written: %ld", nEph);
+        AfxMessageBox(str, MB_ICONERROR);
+    }
+    else
+    {
+        str.Format("GAR2RNX done: %ld epochs, %ld ephemerides", nEpochs, nEph);
+        AddToDisplay(str, 0);
+    }
+}
+
 /////////////////////////////////////////////////////////////////////////////
 ///<summary>Change the filename extension of provided filename.</summary>
 CString CGarminBinaryDlg::ChangeExtension(CString strPath, CString strNewExt)
@@ -1854,7 +2907,7 @@ bool CGarminBinaryDlg::IsAtLoBaud()
     CString str;
     m_statBaud.GetWindowText(str);
 
-    if(str != s_StrHiBaud)
+    if(atoi(str) <= atoi(s_StrLoBaud))
     {
         retVal = true;
     }
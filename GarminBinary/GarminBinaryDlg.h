@@ -33,6 +33,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "afxwin.h"
 #include "GarminBinary.h"
+#include "GarminLink.h"
+#include "G12Writer.h"
+#include "../Gar2rnx/gar2rnx.h"
 
 /////////////////////////////////////////////////////////////////////////////
 // CGarminBinaryDlg dialog
@@ -45,11 +48,24 @@ public:
     BOOL PeekAndPump();
     void UpdateBandwidth();
     void SetupPort();
-    void RecvMsg();
+    void PurgePort();
+    void StartRecvThread();
+    void StopRecvThread();
+    static UINT RecvThread(LPVOID pParam);
+    void RecvLoop();
+    void RecvMsg(LPOVERLAPPED pOvRead);
     void SendMsg();
-    void ProcessFrame();
+    void QueueMsg();
+    void SendQueued();
+    void ProcessFrame(bool bValid);
+    static void OnFrame(void* pContext, const uint8_t* pFrame, size_t nBytes, bool bValid);
 
     void G12State(e_STATE_TYPE state = STATE_NEXT);
+    void G12Reply();
+    void BaudState(e_BAUD_STATE state = BAUD_NEXT);
+    void CheckLinkErrors();
+    void SyncState(e_SYNC_STATE state = SYNC_NEXT);
+    void SyncTry();
 
     CString DecodeMsgBuff(t_MSG_FORMAT* pMsg);
     void DecodeLatLon();
@@ -63,7 +79,11 @@ public:
     void UpdateMsgSeen();
     void UpdateErrSeen();
     void ConfirmNewBaud();
-    void AddToLogFile();
+    void RequestBaud(unsigned int baud);
+    void SetLocalBaud(unsigned int baud);
+    unsigned int CurrentBaud();
+    void AddToLogFile(const uint8_t* pFrame, size_t nBytes);
+    void CloseG12File();
     void UpdateHighWater();
 
     CString Latitude2Str(double lat);
@@ -73,6 +93,11 @@ public:
     void TickDown();
     void AsyncMaskOn();
     void CallGar2rnx();
+    CString GetGar2rnxOptions();
+    void LoadCaps();
+    bool HasQuirk(const char* pName);
+    void OpenRinexStream();
+    void CloseRinexStream();
     void SendAck();
     bool IsAtLoBaud();
 
@@ -135,6 +160,7 @@ protected:
     afx_msg void OnBtnGetId();
     afx_msg void OnCloseupCmboPort();
     afx_msg void OnTimer(UINT nIDEvent);
+    afx_msg LRESULT OnRecvFrames(WPARAM wParam, LPARAM lParam);
     afx_msg void OnBtnAsyncOn();
     afx_msg void OnBtnAsyncOff();
     afx_msg void OnBtnClear();
@@ -161,18 +187,88 @@ private:
 
     t_MSG_FORMAT m_SendMsg;
     t_MSG_FORMAT m_RecvMsg;
-    char* m_pRcv;
+
+    // Stuffed frames waiting to be sent in one write.
+    enum { TX_QUEUE_FRAMES = 8 };
+    uint8_t m_TxQueue[TX_QUEUE_FRAMES * CGarminFramer::MAX_STUFFED_BYTES];
+    size_t m_nTxBytes;
+    bool m_bTxBatch;                // SendMsg only queues
     uint8_t m_lastRecv;
 
+    // Receive thread. It owns the framer and the block buffer, writes
+    // the logged frames to the G12 file and hands every frame to the
+    // GUI thread through the queue.
+    CWinThread* m_pRecvThread;
+    HANDLE m_hRecvStop;
+    CGarminFramer m_Framer;
+    CFrameQueue m_RecvQueue;
+    volatile LONG m_nLinkGen;       // Bumped by PurgePort
+    uint32_t m_nFramerGen;          // Last m_nLinkGen seen by the thread
+    volatile LONG m_bFramesPosted;  // WM_RECV_FRAMES is pending
+    volatile LONG m_nRecvHighWater; // Most bytes read in one go
+    volatile LONG m_nRecvBytes;     // Bytes read since start
+
+    // Serial input is read in blocks, up to the driver queue size.
+    enum { RECV_BLOCK_BYTES = 4096 };
+    uint8_t m_RecvBlock[RECV_BLOCK_BYTES];
+
     unsigned int mMsgsSeen[0x100];
     unsigned int mErrFrames;
     unsigned int mHighWater;
 
-    bool m_bIsLogging;
+    volatile LONG m_bIsLogging;     // Set by the GUI, read by the receive thread
     e_STATE_TYPE mG12State;
     unsigned int mTickDown;
 
-    CFile m_OutFile;
+    // Replies the recording session is waiting for.
+    enum
+    {
+        REPLY_ID  = 0x01,
+        REPLY_UTC = 0x02,
+        REPLY_POS = 0x04,
+        REPLY_PVT = 0x08,   // Any PVT message
+        REPLY_FIX = 0x10,   // A PVT message with a 3D fix
+    };
+    unsigned int mG12Pending;
+    unsigned int mStepTries;
+    DWORD mStepStart;               // Step start or last retry, GetTickCount
+    DWORD mFixStart;
+    DWORD mRecStart;
+    unsigned int mRecSecs;
+    DWORD mBandwidthStart;
+
+    // Baud rate negotiation and link quality.
+    e_BAUD_STATE mBaudState;
+    unsigned int mBaudTry;          // Index into the rates tried
+    unsigned int mBaudGood;         // Fastest rate that passed
+    bool mBaudTuning;               // A rate passed in baud up, it is kept
+    bool mBaudDown;                 // Stepping down from the cached rate
+    DWORD mBaudStart;
+    unsigned int mLinkFrames;       // Good frames since start
+    unsigned int mLinkErrs;         // Bad and dropped frames since start
+    unsigned int mBurstFrames;
+    unsigned int mBurstErrs;
+    unsigned int mCheckFrames;
+    unsigned int mCheckErrs;
+    DWORD mCheckStart;
+
+    // Link sync, see SyncState.
+    e_SYNC_STATE mSyncState;
+    DWORD mSyncStart;
+    unsigned int mSyncFrames;
+    unsigned int mSyncErrs;
+    unsigned int mSyncBytes;
+    unsigned int mSyncBadWindows;   // Checks in a row with no good frame
+    unsigned int mSyncFrom;         // Rate in use when sync was lost
+    unsigned int mSyncTry;          // Index into the rates tried
+    unsigned int mSyncLeft;         // Rates left to try
+
+    CG12Writer m_G12Writer;
+    CString m_strRinexOpts;         // GAR2RNX options of the stream
+    CString m_strRinexObs;          // Observation file being streamed, or empty
+    bool m_bRinexStreamed;
+    type_caps m_Caps;               // Receiver of the last ID response
+    CString m_strCapsFile;          // Capability file, shared with GAR2RNX
     HICON m_hIconBtn;
     CFont m_Font;
 
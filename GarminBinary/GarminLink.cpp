@@ -0,0 +1,265 @@
+/****************************************************************************
+GARMIN BINARY EXPLORER for Garmin GPS Receivers that support serial I/O.
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+// GarminLink.cpp: implementation of the CGarminFramer and CFrameQueue classes.
+//
+// Does not use the precompiled header, so it builds without MFC.
+
+#include "GarminLink.h"
+
+#include <cstring>
+
+CGarminFramer::CGarminFramer(FrameHandler pHandler, void* pContext) :
+    mHandler(pHandler),
+    mContext(pContext),
+    mGoodFrames(0),
+    mBadFrames(0)
+{
+    Reset();
+}
+
+CGarminFramer::~CGarminFramer()
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Set the function that receives the frames.</summary>
+void CGarminFramer::SetHandler(FrameHandler pHandler, void* pContext)
+{
+    mHandler = pHandler;
+    mContext = pContext;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Drop any partial frame.</summary>
+void CGarminFramer::Reset()
+{
+    mCount = 0;
+    mOverflow = false;
+    mLastWasDle = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Parse a span of received bytes.</summary>
+///<remarks>
+/// Every byte is stored until DLE ETX is seen, except the second DLE of
+/// a stuffed pair. So the starting DLE is kept, and so is the DLE before
+/// ETX, which is dropped at the end of the frame. Bytes between frames
+/// end up at the start of the next one, which then fails validation.
+///</remarks>
+size_t CGarminFramer::Consume(const uint8_t* pBytes, size_t nBytes)
+{
+    size_t nFrames = 0;
+    const uint8_t* pEnd = pBytes + nBytes;
+
+    while(pBytes < pEnd)
+    {
+        uint8_t byte = *pBytes++;
+
+        if(mLastWasDle)
+        {
+            mLastWasDle = false;
+
+            if(byte == DLE)
+            {
+                // A stuffed DLE, the first one is already stored.
+                continue;
+            }
+
+            if(byte == ETX)
+            {
+                EndOfFrame();
+                ++nFrames;
+                continue;
+            }
+        }
+        else if(byte == DLE)
+        {
+            mLastWasDle = true;
+        }
+
+        // A normal mid-frame byte.
+        if(mCount == sizeof(mFrame))
+        {
+            // No end of frame was seen, this frame won't be valid.
+            mOverflow = true;
+            mCount = 0;
+        }
+        mFrame[mCount++] = byte;
+    }
+
+    return nFrames;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>DLE ETX seen: validate the frame and pass it on.</summary>
+void CGarminFramer::EndOfFrame()
+{
+    // Drop the DLE that came just before ETX.
+    size_t nBytes = mCount ? mCount - 1 : 0;
+
+    bool bValid = !mOverflow && IsValidFrame(mFrame, nBytes);
+
+    if(bValid)
+    {
+        ++mGoodFrames;
+    }
+    else
+    {
+        ++mBadFrames;
+    }
+
+    if(mHandler)
+    {
+        mHandler(mContext, mFrame, nBytes, bValid);
+    }
+
+    mCount = 0;
+    mOverflow = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Calculate the Garmin checksum.</summary>
+uint8_t CGarminFramer::Checksum(uint8_t id, uint8_t size, const uint8_t* pPayload)
+{
+    // Chksum calculated over CmdId, Size, and payload only.
+    uint8_t val = id + size;
+
+    for(int i = 0; i < size; ++i)
+    {
+        val += pPayload[i];
+    }
+
+    // The chksum is the arithmetic negative.
+    return (uint8_t)(-val);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Check start flag, length and checksum of a frame.</summary>
+bool CGarminFramer::IsValidFrame(const uint8_t* pFrame, size_t nBytes)
+{
+    // DLE, Id, Size, Chksum at least.
+    if(nBytes < 4 || pFrame[0] != DLE)
+    {
+        return false;
+    }
+
+    uint8_t size = pFrame[2];
+    if(nBytes != (size_t)size + 4)
+    {
+        return false;
+    }
+
+    return Checksum(pFrame[1], size, pFrame + 3) == pFrame[3 + size];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Serialize a frame, doubling any DLE from Size to Chksum.</summary>
+size_t CGarminFramer::BuildFrame(uint8_t id, uint8_t size, const uint8_t* pPayload, uint8_t* pOut)
+{
+    uint8_t* p = pOut;
+    uint8_t chksum = Checksum(id, size, pPayload);
+
+    *p++ = DLE;
+
+    // The Id is never DLE or ETX, so it is not stuffed.
+    *p++ = id;
+
+    *p++ = size;
+    if(size == DLE) *p++ = DLE;
+
+    for(int i = 0; i < size; ++i)
+    {
+        *p++ = pPayload[i];
+        if(pPayload[i] == DLE) *p++ = DLE;
+    }
+
+    *p++ = chksum;
+    if(chksum == DLE) *p++ = DLE;
+
+    *p++ = DLE;
+    *p++ = ETX;
+
+    return p - pOut;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CFrameQueue
+/////////////////////////////////////////////////////////////////////////////
+
+CFrameQueue::CFrameQueue() :
+    mHead(0),
+    mTail(0),
+    mDropped(0)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Copy a frame into the next free slot.</summary>
+bool CFrameQueue::Push(const uint8_t* pFrame, size_t nBytes, bool bValid, uint32_t nGen)
+{
+    size_t tail = mTail.load(std::memory_order_relaxed);
+
+    if(tail - mHead.load(std::memory_order_acquire) == SLOTS)
+    {
+        // The consumer is behind, lose this frame.
+        ++mDropped;
+        return false;
+    }
+
+    t_Frame& slot = mSlots[tail & (SLOTS - 1)];
+
+    if(nBytes > sizeof(slot.data)) nBytes = sizeof(slot.data);
+    memcpy(slot.data, pFrame, nBytes);
+    slot.nBytes = (uint16_t)nBytes;
+    slot.bValid = bValid;
+    slot.nGen = nGen;
+
+    // Publish the slot to the consumer.
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Oldest frame in the queue, or 0 if empty.</summary>
+const CFrameQueue::t_Frame* CFrameQueue::Front() const
+{
+    size_t head = mHead.load(std::memory_order_relaxed);
+
+    if(head == mTail.load(std::memory_order_acquire))
+    {
+        return 0;
+    }
+
+    return &mSlots[head & (SLOTS - 1)];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Release the frame returned by Front.</summary>
+void CFrameQueue::Pop()
+{
+    mHead.store(mHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+///<summary>Number of frames lost since the last call.</summary>
+unsigned int CFrameQueue::TakeDropped()
+{
+    return mDropped.exchange(0);
+}
@@ -0,0 +1,143 @@
+/****************************************************************************
+GARMIN BINARY EXPLORER for Garmin GPS Receivers that support serial I/O.
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+// GarminLink.h: interface for the CGarminFramer and CFrameQueue classes.
+//
+// Garmin serial link layer: DLE stuffing, DLE/ETX framing and checksum.
+// Plain C++ with no MFC or Win32 dependency, so it can be used by any
+// program reading a Garmin receiver, on any platform.
+//
+// A frame on the wire is:
+//   DLE, Id, Size, Payload[Size], Chksum, DLE, ETX
+// where any DLE (0x10) byte from Size to Chksum is sent twice, and the
+// checksum is the negative of the sum of Id, Size and the payload. No
+// Id is DLE or ETX, as after the starting DLE they would read as a
+// stuffed DLE or the end of the frame.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class CGarminFramer
+{
+public:
+
+    enum
+    {
+        DLE = 0x10,
+        ETX = 0x03,
+        MAX_PAYLOAD = 0xFF,
+
+        // Unstuffed frame: DLE, Id, Size, Payload, Chksum.
+        MAX_FRAME_BYTES = MAX_PAYLOAD + 4,
+
+        // Stuffed frame, worst case every byte from Size to Chksum doubled.
+        MAX_STUFFED_BYTES = 2 + 2 * (MAX_PAYLOAD + 2) + 2,
+    };
+
+    // Called once per received frame. pFrame holds the unstuffed frame
+    // from the starting DLE to the checksum: DLE, Id, Size, Payload, Chksum.
+    // bValid is false when the start, length or checksum is wrong.
+    typedef void (*FrameHandler)(void* pContext, const uint8_t* pFrame, size_t nBytes, bool bValid);
+
+    // Ctor/dtor.
+    CGarminFramer(FrameHandler pHandler = 0, void* pContext = 0);
+    virtual ~CGarminFramer();
+
+    // Set the function that receives the frames.
+    void SetHandler(FrameHandler pHandler, void* pContext);
+
+    // Drop any partial frame, e.g. after the port was purged. Not to be
+    // called from the handler.
+    void Reset();
+
+    // Parse received bytes, any span size. Returns the number of frames
+    // passed to the handler.
+    size_t Consume(const uint8_t* pBytes, size_t nBytes);
+
+    // Garmin checksum over Id, Size and payload.
+    static uint8_t Checksum(uint8_t id, uint8_t size, const uint8_t* pPayload);
+
+    // Check an unstuffed frame as passed to the handler.
+    static bool IsValidFrame(const uint8_t* pFrame, size_t nBytes);
+
+    // Serialize a frame with DLE stuffing into pOut, which must hold
+    // MAX_STUFFED_BYTES. Returns the number of bytes to send.
+    static size_t BuildFrame(uint8_t id, uint8_t size, const uint8_t* pPayload, uint8_t* pOut);
+
+    // Counters since construction.
+    unsigned int GetGoodFrames() const { return mGoodFrames; }
+    unsigned int GetBadFrames() const { return mBadFrames; }
+
+private:
+
+    // Helper methods.
+    void EndOfFrame();
+
+    // Data members
+    FrameHandler mHandler;
+    void* mContext;
+
+    uint8_t mFrame[MAX_FRAME_BYTES + 1];   // + the DLE before ETX
+    size_t mCount;
+    bool mOverflow;
+    bool mLastWasDle;
+
+    unsigned int mGoodFrames;
+    unsigned int mBadFrames;
+};
+
+// Fixed size queue of received frames, from one producer thread (the
+// serial receive thread) to one consumer thread (the GUI). Lock free:
+// each side only writes its own index.
+class CFrameQueue
+{
+public:
+
+    enum { SLOTS = 256 };   // Power of two
+
+    struct t_Frame
+    {
+        uint32_t nGen;      // Link generation, see CGarminBinaryDlg::PurgePort
+        uint16_t nBytes;
+        bool bValid;
+        uint8_t data[CGarminFramer::MAX_FRAME_BYTES];
+    };
+
+    CFrameQueue();
+
+    // Producer side. Returns false, and counts a drop, when full.
+    bool Push(const uint8_t* pFrame, size_t nBytes, bool bValid, uint32_t nGen);
+
+    // Consumer side. Front returns 0 when empty.
+    const t_Frame* Front() const;
+    void Pop();
+
+    // Frames dropped because the queue was full, since the last call.
+    unsigned int TakeDropped();
+
+private:
+
+    t_Frame mSlots[SLOTS];
+    std::atomic<size_t> mHead;      // Next to read, written by the consumer
+    std::atomic<size_t> mTail;      // Next to write, written by the producer
+    std::atomic<unsigned int> mDropped;
+};
@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "stdafx.h"
 #include "Profile.h"
 
+#include <io.h>
+
 // XML strings.
 const CString XML_DIR_NAME = "nzmCoder";
 const CString XML_COMMENT = "This file contains persistent data for the application";
@@ -33,15 +35,26 @@ const char* XML_SECTION = "section";
 const char* XML_ENTRY = "entry";
 const char* XML_VALUE = "value";
 
+// Separates section and entry in the index keys.
+const TCHAR KEY_SEPARATOR = '\n';
+
 CProfile::CProfile() :
    mXmlDocPtr(0),
-   mIsInitialized(false)
+   mIsInitialized(false),
+   mIsDirty(false)
 {
    // Initialize function must be called on every start-up prior to use.
+   mIndex.InitHashTable(67);
 }
 
 CProfile::~CProfile()
 {
+   // Save any change not flushed yet.
+   if (mXmlDocPtr)
+   {
+      Flush();
+   }
+
    delete mXmlDocPtr;
    mXmlDocPtr = 0;
 }
@@ -66,6 +79,10 @@ void CProfile::Initialize(CString strDataFilename, bool useAppDataLoc)
       {
          Clear();
       }
+      else
+      {
+         BuildIndex();
+      }
    }
 }
 
@@ -86,7 +103,47 @@ void CProfile::Clear()
    tinyxml2::XMLElement* pRoot = mXmlDocPtr->NewElement(XML_ROOT);
    mXmlDocPtr->InsertEndChild(pRoot);
 
-   mXmlDocPtr->SaveFile(mStrDataFilename);
+   mIndex.RemoveAll();
+   mIsDirty = true;
+}
+
+bool CProfile::Flush()
+{
+   if (!mIsDirty)
+   {
+      return true;
+   }
+
+   // Write it all to a temporary file next to the profile, and make sure
+   // it is on the disk before it takes the place of the old one.
+   CString strTempFilename = mStrDataFilename + ".tmp";
+
+   FILE* fp = fopen(strTempFilename, "w");
+   if (!fp)
+   {
+      return false;
+   }
+
+   bool isSaved = mXmlDocPtr->SaveFile(fp) == tinyxml2::XML_SUCCESS;
+   isSaved = fflush(fp) == 0 && isSaved;
+   isSaved = _commit(_fileno(fp)) == 0 && isSaved;
+   isSaved = fclose(fp) == 0 && isSaved;
+
+   if (isSaved)
+   {
+      isSaved = MoveFileEx(strTempFilename, mStrDataFilename,
+                           MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+   }
+
+   if (!isSaved)
+   {
+      // The old profile is still there, untouched.
+      DeleteFile(strTempFilename);
+      return false;
+   }
+
+   mIsDirty = false;
+   return true;
 }
 
 int CProfile::GetProfileInt(CString strSection, CString strEntry, int nDefault)
@@ -105,7 +162,6 @@ int CProfile::GetProfileInt(CString strSection, CString strEntry, int nDefault)
    {
       // Element didn't exist, so add it using default.
       AddElement(strSection, strEntry, nDefault);
-      mXmlDocPtr->SaveFile(mStrDataFilename);
    }
 
    return value;
@@ -120,7 +176,9 @@ bool CProfile::WriteProfileInt(CString strSection, CString strEntry, int nValue)
    if (elementPtr)
    {
       // Element existed, so update it.
-      elementPtr->SetAttribute(XML_VALUE, nValue);
+      CString strValue;
+      strValue.Format("%d", nValue);
+      SetValue(elementPtr, strValue);
       isExisting = true;
    }
    else
@@ -129,8 +187,6 @@ bool CProfile::WriteProfileInt(CString strSection, CString strEntry, int nValue)
       AddElement(strSection, strEntry, nValue);
    }
 
-   mXmlDocPtr->SaveFile(mStrDataFilename);
-
    return isExisting;
 }
 
@@ -151,7 +207,6 @@ CString CProfile::GetProfileStr(CString strSection, CString strEntry, CString st
    {
       // Element didn't exist, so add it using default.
       AddElement(strSection, strEntry, strDefault);
-      mXmlDocPtr->SaveFile(mStrDataFilename);
    }
 
    return value;
@@ -166,7 +221,7 @@ bool CProfile::WriteProfileStr(CString strSection, CString strEntry, CString str
    if (elementPtr)
    {
       // Element existed, so update it.
-      elementPtr->SetAttribute(XML_VALUE, strValue);
+      SetValue(elementPtr, strValue);
       isExisting = true;
    }
    else
@@ -175,15 +230,33 @@ bool CProfile::WriteProfileStr(CString strSection, CString strEntry, CString str
       AddElement(strSection, strEntry, strValue);
    }
 
-   mXmlDocPtr->SaveFile(mStrDataFilename);
-
    return isExisting;
 }
 
 tinyxml2::XMLElement* CProfile::FindElement(CString strSection, CString strEntry)
 {
    // Return value.
-   tinyxml2::XMLElement* foundElementPtr = 0;
+   void* foundElementPtr = 0;
+
+   mIndex.Lookup(MakeKey(strSection, strEntry), foundElementPtr);
+
+   return (tinyxml2::XMLElement*)foundElementPtr;
+}
+
+void CProfile::SetValue(tinyxml2::XMLElement* elementPtr, CString strValue)
+{
+   // Only a real change needs saving.
+   CString strXmlValue(elementPtr->Attribute(XML_VALUE));
+   if (!elementPtr->Attribute(XML_VALUE) || strXmlValue != strValue)
+   {
+      elementPtr->SetAttribute(XML_VALUE, strValue);
+      mIsDirty = true;
+   }
+}
+
+void CProfile::BuildIndex()
+{
+   mIndex.RemoveAll();
 
    tinyxml2::XMLElement* pRoot = mXmlDocPtr->FirstChildElement(XML_ROOT);
    if (pRoot)
@@ -191,20 +264,24 @@ tinyxml2::XMLElement* CProfile::FindElement(CString strSection, CString strEntry
       tinyxml2::XMLElement* elementPtr = pRoot->FirstChildElement(XML_ELEMENT);
       while (elementPtr)
       {
-         CString strXmlSection(elementPtr->Attribute(XML_SECTION));
-         CString strXmlEntry(elementPtr->Attribute(XML_ENTRY));
+         CString strKey = MakeKey(elementPtr->Attribute(XML_SECTION),
+                                  elementPtr->Attribute(XML_ENTRY));
 
-         if (strXmlSection == strSection && strXmlEntry == strEntry)
+         // If an entry is repeated, the first one is used.
+         void* existingPtr;
+         if (!mIndex.Lookup(strKey, existingPtr))
          {
-            foundElementPtr = elementPtr;
-            break;
+            mIndex.SetAt(strKey, elementPtr);
          }
 
          elementPtr = elementPtr->NextSiblingElement(XML_ELEMENT);
       }
    }
+}
 
-   return foundElementPtr;
+CString CProfile::MakeKey(CString strSection, CString strEntry)
+{
+   return strSection + KEY_SEPARATOR + strEntry;
 }
 
 void CProfile::AddElement(CString strSection, CString strEntry, int nValue)
@@ -225,6 +302,9 @@ void CProfile::AddElement(CString strSection, CString strEntry, CString strValue
       pNewElement->SetAttribute(XML_ENTRY, strEntry);
       pNewElement->SetAttribute(XML_VALUE, strValue);
       pRoot->InsertEndChild(pNewElement);
+
+      mIndex.SetAt(MakeKey(strSection, strEntry), pNewElement);
+      mIsDirty = true;
    }
 }
 
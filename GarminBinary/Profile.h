@@ -18,6 +18,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 ****************************************************************************/
 // Profile.h: interface for the CProfile class.
+//
+// Settings are read and written in memory. An index of the XML elements
+// by section and entry saves walking the document on every access, and
+// the file is only written by Flush (also called on destruction).
 
 #pragma once
 #include "TinyXml2.h"
@@ -36,6 +40,11 @@ public:
    // Clear out any existing stored data.
    void Clear();
 
+   // Save to the file if anything changed since it was loaded or saved.
+   // A temporary file is written and then renamed over the old one, so a
+   // crash never leaves a half written profile. False if it failed.
+   bool Flush();
+
    // Get and set string persistent data.
    bool WriteProfileStr(CString strSection, CString strEntry, CString strValue);
    CString GetProfileStr(CString strSection, CString strEntry, CString strDefault);
@@ -44,18 +53,24 @@ public:
    bool WriteProfileInt(CString strSection, CString strEntry, int nValue);
    int GetProfileInt(CString strSection, CString strEntry, int nDefault);
 
+   // Convert the provided file name to a fully qualified path and name,
+   // in the same folder as the profile.
+   CString PrepareAppDataFilename(CString strFileName);
+
 private:
 
    // Helper methods.
    tinyxml2::XMLElement* FindElement(CString strSection, CString strEntry);
    void AddElement(CString strSection, CString strEntry, CString strValue);
    void AddElement(CString strSection, CString strEntry, int nValue);
-
-   // Convert the provided file name to a fully qualified path and name.
-   CString PrepareAppDataFilename(CString strFileName);
+   void SetValue(tinyxml2::XMLElement* elementPtr, CString strValue);
+   void BuildIndex();
+   static CString MakeKey(CString strSection, CString strEntry);
 
    // Data members
    tinyxml2::XMLDocument* mXmlDocPtr;
+   CMapStringToPtr mIndex;       // Section and entry -> XMLElement
    CString mStrDataFilename;
    bool mIsInitialized;
+   bool mIsDirty;
 };
@@ -0,0 +1,831 @@
+/****************************************************************************
+GPS SIMULATOR plays a Garmin receiver on a Linux pseudo-terminal
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+
+/****************************************************************************
+
+1.00   First version.
+       * Replays the records of a G12 capture as framed, DLE stuffed
+         packets, paced to the baud rate, one epoch per second.
+       * Answers the product ID request, the 0x0A queries (position,
+         UTC, PVT on/off, power off), the 0x1C async mask and the
+         0x30/0x31 baud change handshake, and ACKs every packet.
+       * Can drop, corrupt and add noise to the bytes it sends, from a
+         seeded random generator, so runs can be repeated exactly.
+       * Bytes are garbled both ways while the baud rate the host set
+         on the pty is not the receiver's (-anyspeed to ignore it).
+       * Only the records turned on by the bits of the 0x1C mask are
+         replayed. Bytes the pty did not take are counted as overrun.
+
+****************************************************************************/
+
+#define VERSION 1.00
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////////////
+// Protocol
+/////////////////////////////////////////////////////////////////////////////
+
+#define DLE 0x10
+#define ETX 0x03
+
+#define ID_ACK          0x06
+#define ID_QUERY        0x0A
+#define ID_UTC          0x0E
+#define ID_LATLON       0x11
+#define ID_NAK          0x15
+#define ID_ASYNC        0x1C
+#define ID_BAUD_CMD     0x30
+#define ID_BAUD_RSP     0x31
+#define ID_PVT          0x33
+#define ID_EPOCH        0x38    // First record of each measurement epoch
+#define ID_PRODUCT_REQ  0xFE
+#define ID_PRODUCT      0xFF
+
+#define QUERY_LATLON    0x02
+#define QUERY_UTC       0x05
+#define QUERY_PWR_OFF   0x08
+#define QUERY_PVT_ON    0x31
+#define QUERY_PVT_OFF   0x32
+#define QUERY_CQCQ      0x3A
+
+#define MAX_PAYLOAD     0xFF
+#define MAX_FRAME       (MAX_PAYLOAD + 4)           // DLE Id Size Payload Chksum
+#define MAX_STUFFED     (2 + 2 * (MAX_PAYLOAD + 2) + 2)
+
+#define OUT_BYTES       65536   // Stuffed bytes waiting for the line
+#define TICK_MSECS      10      // Line pacing step
+#define BAUD_WINDOW     2.0     // Secs for the host to confirm a new baud
+
+/////////////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////////////
+
+typedef unsigned char BYTE;
+typedef unsigned int UINT;
+typedef unsigned char BOOLEAN;
+
+/////////////////////////////////////////////////////////////////////////////
+// Global variables
+/////////////////////////////////////////////////////////////////////////////
+
+// Options
+char *mCaptureFile;
+char *mLinkPath;
+double mBaud = 9600;
+double mLoss;               // Probability of dropping a byte sent
+double mCorrupt;            // Probability of a bit error in a byte sent
+double mBurstProb;          // Probability of a noise burst before a frame
+UINT mBurstBytes;           // Length of a noise burst
+unsigned long mSeed = 1;
+BOOLEAN mFast;              // Don't hold epochs 1 second apart
+BOOLEAN mLoop;              // Replay the capture again when it ends
+BOOLEAN mAsyncAtStart;      // Send async records before any 0x1C
+BOOLEAN mAnySpeed;          // Ignore the baud rate the host sets
+BOOLEAN mVerbose;
+
+// Capture being replayed
+BYTE *mCapture;
+size_t mCaptureLen;
+size_t mReplayPos;          // Next async record
+size_t mPvtPos;             // Next 0x33 record
+long mProductPos = -1;      // Offsets of the query responses, -1 if none
+long mUtcPos = -1;
+long mLatLonPos = -1;
+BYTE mLastReplayed;
+double mNextEpoch;
+
+// Pty
+int mMaster = -1;
+int mSlave = -1;
+
+// Receiver state
+UINT mAsyncMask;
+BOOLEAN mPvtOn;
+double mNextPvt;
+double mNewBaud;            // Baud offered, waiting for the host's CQCQ
+double mBaudDeadline;
+BOOLEAN mPowerOff;
+
+// Bytes on their way to the host
+BYTE mOut[OUT_BYTES];
+size_t mOutLen;
+double mLineCredit;
+
+// Packet being received from the host
+BYTE mIn[MAX_FRAME + 1];
+UINT mInCount;
+BOOLEAN mInDle;
+BOOLEAN mInOverflow;
+
+// Statistics
+unsigned long mFramesSent;
+unsigned long mBytesSent;
+unsigned long mBytesLost;
+unsigned long mBytesCorrupt;
+unsigned long mBytesGarbled;   // Sent or received at the wrong baud rate
+unsigned long mBytesOverrun;   // Not taken by the pty
+unsigned long mNoiseBytes;
+unsigned long mPacketsRcvd;
+unsigned long mPacketsBad;
+
+volatile sig_atomic_t mQuit;
+
+/////////////////////////////////////////////////////////////////////////////
+// Auxiliary functions
+/////////////////////////////////////////////////////////////////////////////
+
+double now_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift32, so a seed gives the same faults on every machine
+UINT rnd()
+{
+    static UINT x;
+    if(x==0) x = mSeed ? (UINT)mSeed : 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+BOOLEAN chance(double p)
+{
+    return p > 0 && rnd() < p * 4294967296.0;
+}
+
+void on_signal(int sig)
+{
+    (void)sig;
+    mQuit = 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Capture file
+/////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////
+// READ THE WHOLE G12 FILE AND FIND THE QUERY RESPONSE RECORDS
+// RETURN 0 if the file can't be read or has no records
+/////////////////////////////////////////////////////////////////////////////
+BOOLEAN load_capture(char *file)
+{
+    FILE *f = fopen(file, "rb");
+    size_t pos;
+
+    if(f==NULL)
+    {
+        printf("Can't open %s\n", file);
+        return 0;
+    }
+
+    fseek(f, 0, SEEK_END);
+    mCaptureLen = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    mCapture = malloc(mCaptureLen + 1);
+    if(mCapture==NULL || fread(mCapture, 1, mCaptureLen, f)!=mCaptureLen)
+    {
+        printf("Can't read %s\n", file);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    // Records are [id][len][payload]. Drop a truncated last record.
+    for(pos=0; pos+2<=mCaptureLen && pos+2+mCapture[pos+1]<=mCaptureLen; pos+=2+mCapture[pos+1])
+    {
+        switch(mCapture[pos])
+        {
+        case ID_PRODUCT:
+            if(mProductPos<0) mProductPos = pos;
+            break;
+        case ID_UTC:
+            if(mUtcPos<0) mUtcPos = pos;
+            break;
+        case ID_LATLON:
+            if(mLatLonPos<0) mLatLonPos = pos;
+            break;
+        }
+    }
+    mCaptureLen = pos;
+
+    if(mCaptureLen==0)
+    {
+        printf("No records in %s\n", file);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Query responses are sent only when asked for
+BOOLEAN is_async_record(BYTE id)
+{
+    return id!=ID_PRODUCT && id!=ID_UTC && id!=ID_LATLON && id!=ID_PVT;
+}
+
+// Bits of the 0x1C mask that turn an async record on. 0x0020 gives the
+// measurement and navigation records and 0x0008 the Doppler ones, as
+// Async asks for with 0x0020 and 0x0028 (+doppler). Any bit turns on
+// the records not known.
+UINT async_bits(BYTE id)
+{
+    switch(id)
+    {
+    case 0x36:
+    case 0x37:
+    case ID_EPOCH:
+    case 0x39:
+        return 0x0020;
+    case 0x16:
+        return 0x0008;
+    default:
+        return 0xffff;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Pseudo-terminal
+/////////////////////////////////////////////////////////////////////////////
+
+BOOLEAN open_pty()
+{
+    struct termios tio;
+    char *name;
+
+    mMaster = posix_openpt(O_RDWR | O_NOCTTY);
+    if(mMaster<0 || grantpt(mMaster)!=0 || unlockpt(mMaster)!=0 || (name = ptsname(mMaster))==NULL)
+    {
+        perror("posix_openpt");
+        return 0;
+    }
+
+    // Keep the slave open, so reads don't fail while no host has it.
+    mSlave = open(name, O_RDWR | O_NOCTTY);
+    if(mSlave<0)
+    {
+        perror(name);
+        return 0;
+    }
+
+    // Binary data, no echo or line editing.
+    tcgetattr(mSlave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(mSlave, TCSANOW, &tio);
+
+    fcntl(mMaster, F_SETFL, fcntl(mMaster, F_GETFL) | O_NONBLOCK);
+
+    printf("Receiver on %s", name);
+    if(mLinkPath)
+    {
+        unlink(mLinkPath);
+        if(symlink(name, mLinkPath)!=0)
+        {
+            perror(mLinkPath);
+            return 0;
+        }
+        printf(" (%s)", mLinkPath);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// BAUD RATE THE HOST HAS SET ON ITS END OF THE PTY
+// RETURN 0 if it is not one a receiver uses
+/////////////////////////////////////////////////////////////////////////////
+double host_baud()
+{
+    static const struct
+    {
+        speed_t speed;
+        double baud;
+    } rates[] =
+    {
+        {B1200, 1200}, {B2400, 2400}, {B4800, 4800}, {B9600, 9600},
+        {B19200, 19200}, {B38400, 38400}, {B57600, 57600}, {B115200, 115200}
+    };
+    struct termios tio;
+    speed_t speed;
+    UINT k;
+
+    // Master and slave share their settings.
+    if(tcgetattr(mMaster, &tio)!=0) return 0;
+    speed = cfgetospeed(&tio);
+
+    for(k=0; k<sizeof(rates)/sizeof(rates[0]); k++)
+        if(rates[k].speed==speed) return rates[k].baud;
+
+    return 0;
+}
+
+// A UART at another baud rate gets framing errors, not the bytes sent
+BOOLEAN wrong_speed(double baud)
+{
+    return !mAnySpeed && host_baud()!=baud;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Sending to the host
+/////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////
+// QUEUE A PACKET FOR THE LINE, WITH DLE STUFFING FROM SIZE TO CHKSUM,
+// AFTER AN OPTIONAL NOISE BURST
+// RETURN 0 if there is no room (nothing is queued)
+/////////////////////////////////////////////////////////////////////////////
+BOOLEAN send_packet(BYTE id, BYTE len, const BYTE *data)
+{
+    BYTE *p;
+    BYTE chk;
+    UINT k;
+
+    if(mOutLen + MAX_STUFFED + mBurstBytes > OUT_BYTES) return 0;
+
+    p = mOut + mOutLen;
+
+    if(chance(mBurstProb))
+    {
+        for(k=0; k<mBurstBytes; k++) *p++ = (BYTE)rnd();
+        mNoiseBytes += mBurstBytes;
+    }
+
+    chk = id + len;
+    *p++ = DLE;
+    *p++ = id;
+    *p++ = len;
+    if(len==DLE) *p++ = DLE;
+    for(k=0; k<len; k++)
+    {
+        chk += data[k];
+        *p++ = data[k];
+        if(data[k]==DLE) *p++ = DLE;
+    }
+    chk = -chk;
+    *p++ = chk;
+    if(chk==DLE) *p++ = DLE;
+    *p++ = DLE;
+    *p++ = ETX;
+
+    mOutLen = p - mOut;
+    mFramesSent++;
+    return 1;
+}
+
+BOOLEAN send_record(size_t pos)
+{
+    return send_packet(mCapture[pos], mCapture[pos+1], mCapture+pos+2);
+}
+
+void send_ack(BYTE type, BYTE id)
+{
+    BYTE data[2] = {id, 0};
+    send_packet(type, 2, data);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// WRITE AS MANY QUEUED BYTES AS THE BAUD RATE ALLOWS SINCE THE LAST CALL,
+// DROPPING AND CORRUPTING THEM AS ASKED
+/////////////////////////////////////////////////////////////////////////////
+void pump_line(double dt)
+{
+    BYTE buf[OUT_BYTES];
+    size_t n, k, m = 0;
+    ssize_t w;
+    BOOLEAN garble;
+
+    // 10 bits per byte on the wire. Don't save up more than a tick.
+    mLineCredit += dt * mBaud / 10;
+    if(mLineCredit > mBaud / 10 * TICK_MSECS / 1000.0 * 2)
+        mLineCredit = mBaud / 10 * TICK_MSECS / 1000.0 * 2;
+
+    n = (size_t)mLineCredit;
+    if(n > mOutLen) n = mOutLen;
+    if(n==0) return;
+
+    garble = wrong_speed(mBaud);
+
+    for(k=0; k<n; k++)
+    {
+        if(chance(mLoss))
+        {
+            mBytesLost++;
+            continue;
+        }
+        buf[m] = mOut[k];
+        if(garble)
+        {
+            buf[m] = (BYTE)rnd();
+            mBytesGarbled++;
+        }
+        else if(chance(mCorrupt))
+        {
+            buf[m] ^= (BYTE)(1 << (rnd() & 7));
+            mBytesCorrupt++;
+        }
+        m++;
+    }
+
+    // The pty buffer is large, a short write just loses the rest,
+    // as a UART overrun would.
+    w = m ? write(mMaster, buf, m) : 0;
+    if(w > 0) mBytesSent += w;
+    mBytesOverrun += m - (w > 0 ? (size_t)w : 0);
+
+    memmove(mOut, mOut+n, mOutLen-n);
+    mOutLen -= n;
+    mLineCredit -= n;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// QUEUE THE NEXT ASYNC RECORDS OF THE CAPTURE, AN EPOCH AT A TIME
+/////////////////////////////////////////////////////////////////////////////
+void feed_async(double now)
+{
+    size_t skipped = 0;
+
+    while(mOutLen < OUT_BYTES / 2)
+    {
+        BYTE id;
+
+        if(mReplayPos>=mCaptureLen)
+        {
+            if(!mLoop) return;
+            mReplayPos = 0;
+        }
+
+        // Once round the capture with nothing the mask turns on.
+        id = mCapture[mReplayPos];
+        if(!is_async_record(id) || !(async_bits(id) & mAsyncMask))
+        {
+            skipped += 2 + mCapture[mReplayPos+1];
+            mReplayPos += 2 + mCapture[mReplayPos+1];
+            if(skipped>=mCaptureLen) return;
+            continue;
+        }
+        skipped = 0;
+
+        // A new epoch starts one second after the last one.
+        if(id==ID_EPOCH && mLastReplayed!=ID_EPOCH && !mFast)
+        {
+            if(now < mNextEpoch) return;
+            mNextEpoch = (now - mNextEpoch > 1.0) ? now + 1.0 : mNextEpoch + 1.0;
+        }
+
+        if(!send_record(mReplayPos)) return;
+
+        mLastReplayed = id;
+        mReplayPos += 2 + mCapture[mReplayPos+1];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// SEND THE NEXT 0x33 RECORD ONCE A SECOND WHILE PVT IS ON
+/////////////////////////////////////////////////////////////////////////////
+void feed_pvt(double now)
+{
+    size_t scanned, len;
+
+    if(now < mNextPvt) return;
+    mNextPvt = now + 1.0;
+
+    // At most once round the capture, which may have no 0x33 at all.
+    for(scanned=0; scanned<mCaptureLen; scanned+=len)
+    {
+        if(mPvtPos>=mCaptureLen) mPvtPos = 0;
+        len = 2 + mCapture[mPvtPos+1];
+
+        if(mCapture[mPvtPos]==ID_PVT)
+        {
+            send_record(mPvtPos);
+            mPvtPos += len;
+            return;
+        }
+        mPvtPos += len;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Receiving from the host
+/////////////////////////////////////////////////////////////////////////////
+
+void show_packet(const char *hdr, BYTE id, BYTE len, const BYTE *data)
+{
+    UINT k;
+
+    printf("%s %02X %3d:", hdr, id, len);
+    for(k=0; k<len && k<16; k++) printf(" %02X", data[k]);
+    if(len>16) printf(" ...");
+    printf("\n");
+    fflush(stdout);
+}
+
+void do_query(UINT cmd, double now)
+{
+    static const BYTE none[16];
+
+    switch(cmd)
+    {
+    case QUERY_LATLON:
+        if(mLatLonPos>=0) send_record(mLatLonPos);
+        else send_packet(ID_LATLON, 16, none);
+        break;
+
+    case QUERY_UTC:
+        if(mUtcPos>=0) send_record(mUtcPos);
+        else send_packet(ID_UTC, 8, none);
+        break;
+
+    case QUERY_PVT_ON:
+        mPvtOn = 1;
+        mNextPvt = now;
+        break;
+
+    case QUERY_PVT_OFF:
+        mPvtOn = 0;
+        break;
+
+    case QUERY_PWR_OFF:
+        mPowerOff = 1;
+        break;
+
+    case QUERY_CQCQ:
+        // The host confirms it is at the new baud.
+        if(mNewBaud)
+        {
+            mBaud = mNewBaud;
+            mNewBaud = 0;
+            printf("Baud changed to %.0f\n", mBaud);
+            fflush(stdout);
+        }
+        break;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ACT ON A PACKET FROM THE HOST
+/////////////////////////////////////////////////////////////////////////////
+void do_packet(BYTE id, BYTE len, const BYTE *data, double now)
+{
+    static const BYTE product[] = {0x00, 0x00, 0x00, 0x00, 'G', 'p', 's', 'S', 'i', 'm', 0};
+
+    if(mVerbose) show_packet("RX", id, len, data);
+
+    if(id==ID_ACK || id==ID_NAK) return;
+    send_ack(ID_ACK, id);
+
+    switch(id)
+    {
+    case ID_PRODUCT_REQ:
+        if(mProductPos>=0) send_record(mProductPos);
+        else send_packet(ID_PRODUCT, sizeof(product), product);
+        break;
+
+    case ID_QUERY:
+        if(len>=2) do_query(data[0] | data[1] << 8, now);
+        break;
+
+    case ID_ASYNC:
+        if(len>=2) mAsyncMask = data[0] | data[1] << 8;
+        if(mVerbose) printf("Async mask 0x%04X\n", mAsyncMask);
+        break;
+
+    case ID_BAUD_CMD:
+        if(len>=4)
+        {
+            // Offer the baud asked for. It takes effect when the host
+            // sends CQCQ at that baud within the window.
+            send_packet(ID_BAUD_RSP, 4, data);
+            mNewBaud = data[0] | data[1] << 8 | data[2] << 16 | (UINT)data[3] << 24;
+            mBaudDeadline = now + BAUD_WINDOW;
+        }
+        break;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// READ WHAT THE HOST SENT AND SPLIT IT INTO PACKETS
+// Same rules as the receivers: a doubled DLE is one DLE, DLE ETX ends
+// the packet, and the packet must check out to be acted on.
+/////////////////////////////////////////////////////////////////////////////
+void read_host(double now)
+{
+    BYTE buf[4096];
+    ssize_t n, k;
+    BOOLEAN garble;
+
+    // After a baud rate offer the receiver listens at the new rate.
+    n = read(mMaster, buf, sizeof(buf));
+    garble = n>0 && wrong_speed(mNewBaud ? mNewBaud : mBaud);
+    if(garble) mBytesGarbled += n;
+
+    for(k=0; k<n; k++)
+    {
+        BYTE c = garble ? (BYTE)rnd() : buf[k];
+
+        if(mInDle)
+        {
+            mInDle = 0;
+            if(c==DLE) continue;
+            if(c==ETX)
+            {
+                UINT count = mInCount ? mInCount-1 : 0;     // Drop the DLE before ETX
+                BYTE chk = 0;
+                UINT j;
+
+                for(j=1; j<count; j++) chk += mIn[j];
+                mPacketsRcvd++;
+
+                if(!mInOverflow && count>=4 && mIn[0]==DLE && count==(UINT)mIn[2]+4 && chk==0)
+                {
+                    do_packet(mIn[1], mIn[2], mIn+3, now);
+                }
+                else
+                {
+                    mPacketsBad++;
+                    if(mVerbose) printf("RX bad packet, %d bytes\n", count);
+                    send_ack(ID_NAK, count>1 ? mIn[1] : 0);
+                }
+                mInCount = 0;
+                mInOverflow = 0;
+                continue;
+            }
+        }
+        else if(c==DLE)
+        {
+            mInDle = 1;
+        }
+
+        if(mInCount==sizeof(mIn))
+        {
+            mInOverflow = 1;
+            mInCount = 0;
+        }
+        mIn[mInCount++] = c;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Main
+/////////////////////////////////////////////////////////////////////////////
+
+void show_usage()
+{
+    printf("GPSSIM %.2f: Garmin receiver on a pseudo-terminal, replaying a G12 file\n\n", VERSION);
+    printf("Usage: GpsSim [options] file.g12\n");
+    printf("  -link path    Make path a symbolic link to the pty\n");
+    printf("  -baud n       Baud rate at start (9600)\n");
+    printf("  -async        Send async records without waiting for a 0x1C mask\n");
+    printf("  -anyspeed     Ignore the baud rate the host sets on the pty\n");
+    printf("  -fast         Send epochs as fast as the baud allows, not 1 per sec\n");
+    printf("  -loop         Replay the file again when it ends\n");
+    printf("  -loss p       Probability of dropping each byte sent\n");
+    printf("  -corrupt p    Probability of a bit error in each byte sent\n");
+    printf("  -burst n p    Probability of n noise bytes before each packet\n");
+    printf("  -seed n       Seed for the faults (1)\n");
+    printf("  -v            Show the packets received\n");
+}
+
+BOOLEAN parse_args(int argc, char **argv)
+{
+    int k;
+
+    for(k=1; k<argc; k++)
+    {
+        if(!strcmp(argv[k], "-link") && k+1<argc) mLinkPath = argv[++k];
+        else if(!strcmp(argv[k], "-baud") && k+1<argc) mBaud = atof(argv[++k]);
+        else if(!strcmp(argv[k], "-async")) mAsyncAtStart = 1;
+        else if(!strcmp(argv[k], "-anyspeed")) mAnySpeed = 1;
+        else if(!strcmp(argv[k], "-fast")) mFast = 1;
+        else if(!strcmp(argv[k], "-loop")) mLoop = 1;
+        else if(!strcmp(argv[k], "-loss") && k+1<argc) mLoss = atof(argv[++k]);
+        else if(!strcmp(argv[k], "-corrupt") && k+1<argc) mCorrupt = atof(argv[++k]);
+        else if(!strcmp(argv[k], "-burst") && k+2<argc)
+        {
+            mBurstBytes = atoi(argv[++k]);
+            mBurstProb = atof(argv[++k]);
+        }
+        else if(!strcmp(argv[k], "-seed") && k+1<argc) mSeed = strtoul(argv[++k], NULL, 0);
+        else if(!strcmp(argv[k], "-v")) mVerbose = 1;
+        else if(argv[k][0]!='-' && mCaptureFile==NULL) mCaptureFile = argv[k];
+        else return 0;
+    }
+
+    if(mBurstBytes > MAX_STUFFED) mBurstBytes = MAX_STUFFED;
+
+    return mCaptureFile!=NULL && mBaud>0;
+}
+
+int main(int argc, char **argv)
+{
+    double last, now;
+    int k;
+
+    if(!parse_args(argc, argv))
+    {
+        show_usage();
+        return 1;
+    }
+
+    if(!load_capture(mCaptureFile) || !open_pty()) return 1;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if(mAsyncAtStart) mAsyncMask = 0xffff;
+
+    last = now_secs();
+    mNextEpoch = last;
+
+    while(!mQuit)
+    {
+        struct pollfd pfd;
+
+        pfd.fd = mMaster;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, TICK_MSECS);
+
+        now = now_secs();
+
+        if(pfd.revents & POLLIN) read_host(now);
+
+        if(mNewBaud && now > mBaudDeadline)
+        {
+            printf("Baud change to %.0f not confirmed, staying at %.0f\n", mNewBaud, mBaud);
+            fflush(stdout);
+            mNewBaud = 0;
+        }
+
+        if(!mPowerOff)
+        {
+            if(mPvtOn) feed_pvt(now);
+            if(mAsyncMask) feed_async(now);
+        }
+
+        pump_line(now - last);
+        last = now;
+
+        // Power off once the ACK is on its way.
+        if(mPowerOff && mOutLen==0) break;
+
+        // Replay done and everything sent.
+        if(mAsyncMask && !mLoop && mReplayPos>=mCaptureLen && mOutLen==0 && mAsyncAtStart) break;
+    }
+
+    // Give the host a moment to read what is still in the pty.
+    for(k=0; k<100 && !mQuit; k++)
+    {
+        int queued = 0;
+        usleep(TICK_MSECS * 1000);
+        if(ioctl(mSlave, FIONREAD, &queued)!=0 || queued==0) break;
+    }
+
+    printf("Sent %lu packets, %lu bytes (%lu lost, %lu corrupted, %lu noise). ",
+           mFramesSent, mBytesSent, mBytesLost, mBytesCorrupt, mNoiseBytes);
+    printf("%lu bytes garbled by the baud rate, %lu overrun. ", mBytesGarbled, mBytesOverrun);
+    printf("Received %lu packets, %lu bad.\n", mPacketsRcvd, mPacketsBad);
+
+    if(mLinkPath) unlink(mLinkPath);
+    close(mSlave);
+    close(mMaster);
+    free(mCapture);
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Batch mode: two G12 files of the same day converted at the same time.
+# Each job must write its .O and its .n with the same session number,
+# so every pair must name the same G12 file in its header. The job with
+# the short file names its .n first, so a job naming them separately
+# gets the pairs crossed about one run in two.
+
+RUNS=${RUNS:-10}
+
+rm -rf work
+mkdir work || exit 1
+../Bench/GarBench.exe -secs 300 -out work/short.g12 || exit 1
+../Bench/GarBench.exe -secs 3600 -out work/long.g12 || exit 1
+cd work || exit 1
+
+# G12 file of a RINEX file. The navigation header names it, the
+# observation header doesn't: the one of long.g12 is the bigger.
+source_of()
+{
+    case $1 in
+    *n)
+        sed -n 's/.*Generated from G12 data file: \([^ ]*\).*/\1/p' "$1"
+        ;;
+    *)
+        for other in TEST*O
+        do
+            if [ `wc -c < $1` -lt `wc -c < $other` ]
+            then
+                echo short.g12
+                return
+            fi
+        done
+        echo long.g12
+        ;;
+    esac
+}
+
+failed=0
+run=1
+while [ $run -le $RUNS ]
+do
+    rm -f TEST*
+    ../gar2rnx -batch long.g12 short.g12 -j 2 -area TEST -caps caps.txt > batch.out || exit 1
+
+    pairs=0
+    for obs in TEST*O
+    do
+        nav=`echo $obs | sed 's/O$/n/'`
+        if [ ! -f "$nav" ]
+        then
+            echo "run $run: $obs has no $nav"
+            failed=1
+        elif [ "`source_of $obs`" != "`source_of $nav`" ]
+        then
+            echo "run $run: $obs is from `source_of $obs`, $nav from `source_of $nav`"
+            failed=1
+        fi
+        pairs=`expr $pairs + 1`
+    done
+
+    if [ $pairs -ne 2 ]
+    then
+        echo "run $run: $pairs observation files, not 2"
+        cat batch.out
+        failed=1
+    fi
+
+    run=`expr $run + 1`
+done
+
+if [ $failed -ne 0 ]
+then
+    echo "TestBatch: FAILED"
+    exit 1
+fi
+
+echo "TestBatch: $RUNS runs, every pair from the same G12 file"
+exit 0
@@ -0,0 +1,173 @@
+/****************************************************************************
+TESTFORMAT checks the number formatting of GAR2RNX against sprintf
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+
+// format_double() (D19.12 of the navigation files) against the sprintf
+// version it replaced, format_double_printf(), and put_fixed() (fields
+// of the observation records) against sprintf("%*.*f"), each on 20
+// million values: raw bit patterns, dyadic values, every decade,
+// integers and near ties. Linked with gar2rnx built as a library.
+//
+// TestFormat [values]   fewer values of each, for a quick run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+int format_double(char *dest, double a);
+int format_double_printf(char *dest, double a);
+char *put_fixed(char *ptr, double a, int width, int decimals);
+
+#define VALUES 20000000
+#define KINDS  5
+
+unsigned long long SEED=88172645463325252ULL;
+
+// xorshift64, the same numbers with every C library
+unsigned long long random64()
+{
+    SEED^=SEED<<13;
+    SEED^=SEED>>7;
+    SEED^=SEED<<17;
+    return SEED;
+}
+
+
+// Uniform in [0,1)
+double random01()
+{
+    return (double)(random64()>>11)/9007199254740992.0;
+}
+
+
+double random_sign(double x)
+{
+    return (random64()&1)? -x:x;
+}
+
+
+// Value n of a kind, for format_double()
+double nav_value(int kind)
+{
+    unsigned long long bits;
+    double a;
+    int e;
+
+    switch(kind)
+    {
+    case 0:     // Any finite double
+        do
+        {
+            bits=random64();
+            memcpy(&a,&bits,sizeof(a));
+        }
+        while(!isfinite(a));
+        return a;
+
+    case 1:     // Dyadic
+        return random_sign(ldexp((double)(random64()>>24),(int)(random64()%120)-80));
+
+    case 2:     // Every decade from 1e-40 to 1e20
+        e=(int)(random64()%61)-40;
+        return random_sign((1+9*random01())*pow(10,e));
+
+    case 3:     // Integers
+        return random_sign((double)(random64()>>(random64()%64)));
+
+    default:    // Near a tie at 12 digits
+        e=(int)(random64()%61)-40;
+        a=(double)(100000000000ULL+random64()%900000000000ULL)+0.5;
+        a+=(double)((long long)(random64()%2001)-1000)*1e-6;
+        return random_sign(a*pow(10,e-11));
+    }
+}
+
+
+// Value of a kind and its format, as the observation records use them
+double obs_value(int kind, int *width, int *decimals)
+{
+    *width=14;
+    *decimals=3;
+
+    switch(kind)
+    {
+    case 0:     // Seconds of the epoch
+        *width=11;
+        *decimals=7;
+        return 60*random01();
+
+    case 1:     // Pseudorange
+        return 1.8e7+1e7*random01();
+
+    case 2:     // Carrier phase and Doppler, either sign
+        return random_sign(ldexp(random01(),(int)(random64()%34)));
+
+    case 3:     // Exact ties, multiples of 1/16
+        return random_sign((double)(random64()%(1ULL<<36))/16);
+
+    default:    // Near ties at 3 decimals
+        return random_sign(((double)(random64()%100000000000ULL)+0.5)/1000);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    char mine[64],theirs[64],*end;
+    long n,values,failed;
+    double a;
+    int kind,width,decimals;
+
+    values= (argc>1)? (long)atof(argv[1]) : VALUES;
+
+    failed=0;
+    for(n=0; n<values; n++)
+    {
+        kind=(int)(n%KINDS);
+
+        a=nav_value(kind);
+        format_double(mine,a);
+        format_double_printf(theirs,a);
+        if(strcmp(mine,theirs))
+        {
+            if(failed<10) printf("TestFormat: format_double(%.17g) gives \"%s\", sprintf \"%s\"\n",a,mine,theirs);
+            failed++;
+        }
+
+        a=obs_value(kind,&width,&decimals);
+        end=put_fixed(mine,a,width,decimals);
+        *end=0;
+        sprintf(theirs,"%*.*f",width,decimals,a);
+        if(strcmp(mine,theirs))
+        {
+            if(failed<10) printf("TestFormat: put_fixed(%.17g) gives \"%s\", sprintf \"%s\"\n",a,mine,theirs);
+            failed++;
+        }
+    }
+
+    if(failed)
+    {
+        printf("TestFormat: FAILED, %ld differences\n",failed);
+        return 1;
+    }
+
+    printf("TestFormat: %ld values of format_double and of put_fixed the same as sprintf\n",values);
+    return 0;
+}
@@ -0,0 +1,262 @@
+/****************************************************************************
+TESTFRAMER checks the Garmin link framing of CGarminFramer
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+
+// Random frames, rich in DLE and ETX bytes, are stuffed by BuildFrame and
+// fed to Consume in spans of every size from 1 byte to more than a frame,
+// and in one span. Every frame must come out whole, valid and in order.
+// Then the stream is corrupted every few frames (a byte changed, the end
+// of a frame cut, noise between frames): the framer may lose the frame
+// hit and the next one, never more, and never passes a wrong one as valid.
+//
+// TestFramer [frames]   fewer frames, for a quick run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "GarminLink.h"
+
+#define FRAMES          200000
+#define CORRUPT_EVERY   50      // Frames between corruptions, on average
+
+typedef unsigned char BYTE;
+
+struct t_Check
+{
+    const std::vector<BYTE>* pFrames;   // Unstuffed frames, back to back
+    const std::vector<size_t>* pStarts;
+    const std::vector<bool>* pMayLose;  // Frames a corruption may take
+    size_t next;                        // Frame expected next
+    long received;
+    long invalid;
+    long failed;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Auxiliary functions
+/////////////////////////////////////////////////////////////////////////////
+
+// xorshift32, so every run checks the same bytes
+uint32_t mRnd = 1;
+
+uint32_t rnd()
+{
+    mRnd ^= mRnd << 13;
+    mRnd ^= mRnd >> 17;
+    mRnd ^= mRnd << 5;
+    return mRnd;
+}
+
+// Mostly DLE and ETX, which the framing has to get right
+BYTE rnd_byte()
+{
+    switch(rnd() % 8)
+    {
+    case 0:
+    case 1:
+        return CGarminFramer::DLE;
+    case 2:
+        return CGarminFramer::ETX;
+    default:
+        return (BYTE)rnd();
+    }
+}
+
+void fail(t_Check* pCheck, const char* what)
+{
+    if(pCheck->failed < 10) printf("TestFramer: frame %lu %s\n", (unsigned long)pCheck->next, what);
+    pCheck->failed++;
+}
+
+// Frame handler: each valid frame must be the next one expected, except
+// for the ones a corruption may have taken.
+void check_frame(void* pContext, const uint8_t* pFrame, size_t nBytes, bool bValid)
+{
+    t_Check* pCheck = (t_Check*)pContext;
+    const std::vector<size_t>& starts = *pCheck->pStarts;
+    size_t count = starts.size() - 1;
+
+    pCheck->received++;
+    if(!bValid)
+    {
+        pCheck->invalid++;
+        return;
+    }
+
+    while(pCheck->next < count)
+    {
+        size_t k = pCheck->next++;
+        size_t len = starts[k + 1] - starts[k];
+
+        if(nBytes == len && !memcmp(pFrame, &(*pCheck->pFrames)[starts[k]], len)) return;
+
+        if(!(*pCheck->pMayLose)[k])
+        {
+            pCheck->next--;
+            fail(pCheck, "lost, or a wrong frame passed as valid");
+            pCheck->next++;
+            return;
+        }
+    }
+    fail(pCheck, "beyond the end passed as valid");
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Tests
+/////////////////////////////////////////////////////////////////////////////
+
+// Feeds the stream in spans of span bytes (all of it if 0) and checks
+// that every frame the corruptions can't take came out.
+long feed(const std::vector<BYTE>& stream, size_t span, t_Check* pCheck, const char* name)
+{
+    CGarminFramer framer(check_frame, pCheck);
+    size_t count = pCheck->pStarts->size() - 1;
+    size_t pos, n, frames = 0;
+
+    pCheck->next = 0;
+    pCheck->received = 0;
+    pCheck->invalid = 0;
+
+    for(pos = 0; pos < stream.size(); pos += n)
+    {
+        n = span ? span : stream.size();
+        if(n > stream.size() - pos) n = stream.size() - pos;
+        frames += framer.Consume(&stream[pos], n);
+    }
+
+    while(pCheck->next < count && (*pCheck->pMayLose)[pCheck->next]) pCheck->next++;
+    if(pCheck->next != count) fail(pCheck, "and the ones after it lost");
+
+    if(frames != (size_t)pCheck->received ||
+       framer.GetGoodFrames() != (unsigned int)(pCheck->received - pCheck->invalid) ||
+       framer.GetBadFrames() != (unsigned int)pCheck->invalid)
+    {
+        printf("TestFramer: %s, span %lu: counters %lu good %u bad %u, handler %ld invalid %ld\n",
+               name, (unsigned long)span, (unsigned long)frames, framer.GetGoodFrames(),
+               framer.GetBadFrames(), pCheck->received, pCheck->invalid);
+        pCheck->failed++;
+    }
+
+    return pCheck->received - pCheck->invalid;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<BYTE> frames, stream, corrupted;
+    std::vector<size_t> starts;
+    std::vector<bool> none, hit;
+    BYTE payload[CGarminFramer::MAX_PAYLOAD];
+    BYTE wire[CGarminFramer::MAX_STUFFED_BYTES];
+    t_Check check;
+    long count, k, good, corruptions;
+    size_t span, n, i;
+
+    count = (argc > 1) ? (long)atof(argv[1]) : FRAMES;
+
+    // Random frames. No Id is DLE or ETX.
+    for(k = 0; k < count; k++)
+    {
+        BYTE id, size;
+
+        do id = (BYTE)rnd(); while(id == CGarminFramer::DLE || id == CGarminFramer::ETX);
+        size = (rnd() % 4) ? (BYTE)rnd() : rnd_byte();
+        for(i = 0; i < size; i++) payload[i] = rnd_byte();
+
+        n = CGarminFramer::BuildFrame(id, size, payload, wire);
+        stream.insert(stream.end(), wire, wire + n);
+
+        starts.push_back(frames.size());
+        frames.push_back(CGarminFramer::DLE);
+        frames.push_back(id);
+        frames.push_back(size);
+        frames.insert(frames.end(), payload, payload + size);
+        frames.push_back(CGarminFramer::Checksum(id, size, payload));
+    }
+    starts.push_back(frames.size());
+    none.assign(count, false);
+
+    memset(&check, 0, sizeof(check));
+    check.pFrames = &frames;
+    check.pStarts = &starts;
+    check.pMayLose = &none;
+
+    // Clean stream, in spans of every size up to more than a whole frame.
+    for(span = 1; span <= CGarminFramer::MAX_STUFFED_BYTES + 1 && !check.failed; span++)
+    {
+        good = feed(stream, span, &check, "clean");
+        if(good != count || check.invalid) fail(&check, "not valid in a clean stream");
+    }
+    if(!check.failed && (feed(stream, 0, &check, "clean") != count || check.invalid))
+    {
+        fail(&check, "not valid in a clean stream");
+    }
+
+    // The same frames, with one corrupted every so often. The frame hit
+    // and the next one may be lost, noise reaching into the next frame.
+    hit.assign(count, false);
+    corruptions = 0;
+    for(k = 0; k < count; k++)
+    {
+        const BYTE* pFrame = &frames[starts[k]];
+
+        n = CGarminFramer::BuildFrame(pFrame[1], pFrame[2], pFrame + 3, wire);
+
+        if(k && (rnd() % CORRUPT_EVERY) == 0)
+        {
+            corruptions++;
+            hit[k] = true;
+            if(k + 1 < count) hit[k + 1] = true;
+
+            switch(rnd() % 3)
+            {
+            case 0:     // A byte changed
+                wire[1 + rnd() % (n - 1)] ^= (BYTE)(1 + rnd() % 255);
+                break;
+            case 1:     // The end of the frame cut
+                n -= 1 + rnd() % (n - 1);
+                break;
+            default:    // Noise before the frame
+                for(i = 1 + rnd() % 20; i; i--) corrupted.push_back(rnd_byte());
+                break;
+            }
+        }
+        corrupted.insert(corrupted.end(), wire, wire + n);
+    }
+
+    check.pMayLose = &hit;
+    for(span = 1; span <= CGarminFramer::MAX_STUFFED_BYTES + 1 && !check.failed; span += 7)
+    {
+        feed(corrupted, span, &check, "corrupted");
+    }
+    if(!check.failed) good = feed(corrupted, 0, &check, "corrupted");
+
+    if(check.failed)
+    {
+        printf("TestFramer: FAILED, %ld differences\n", check.failed);
+        return 1;
+    }
+
+    printf("TestFramer: %ld frames in spans of 1 to %d bytes the same, and %ld of them after %ld corruptions\n",
+           count, (int)CGarminFramer::MAX_STUFFED_BYTES + 1, good, corruptions);
+    return 0;
+}
@@ -0,0 +1,124 @@
+/****************************************************************************
+TESTPARITY checks the navigation word parity of GAR2RNX
+
+Copyright (C) 2016-2020 Norm Moulton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+****************************************************************************/
+
+// parity_word() (one mask per parity bit) against the bit by bit
+// equations it replaced, for every one of the 2^32 words as logged.
+// Linked with gar2rnx built as a library.
+//
+// TestParity [words]   checks only the first words, for a quick run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned char BOOLEAN;
+typedef unsigned int UINT32;
+
+BOOLEAN parity_word(UINT32 w);
+
+
+// The parity check of gar2rnx 1.50, on a word instead of the global
+// NAV_WORD
+#define d1  ( (W>>29) & 1 )
+#define d2  ( (W>>28) & 1 )
+#define d3  ( (W>>27) & 1 )
+#define d4  ( (W>>26) & 1 )
+#define d5  ( (W>>25) & 1 )
+#define d6  ( (W>>24) & 1 )
+#define d7  ( (W>>23) & 1 )
+#define d8  ( (W>>22) & 1 )
+#define d9  ( (W>>21) & 1 )
+#define d10  ( (W>>20) & 1 )
+#define d11  ( (W>>19) & 1 )
+#define d12  ( (W>>18) & 1 )
+#define d13  ( (W>>17) & 1 )
+#define d14  ( (W>>16) & 1 )
+#define d15  ( (W>>15) & 1 )
+#define d16  ( (W>>14) & 1 )
+#define d17  ( (W>>13) & 1 )
+#define d18  ( (W>>12) & 1 )
+#define d19  ( (W>>11) & 1 )
+#define d20  ( (W>>10) & 1 )
+#define d21  ( (W>>9) & 1 )
+#define d22  ( (W>>8) & 1 )
+#define d23  ( (W>>7) & 1 )
+#define d24  ( (W>>6) & 1 )
+
+#define P29  ( (W>>31) & 1 )
+#define P30  ( (W>>30) & 1 )
+
+#define MASK_DATA   0x3fffffc0
+#define MASK_PARITY 0x0000003f
+
+// Parity bits D25..D30 the word should have
+UINT32 old_parity_bits(UINT32 W)
+{
+    UINT32 P;
+
+    if(P30) W ^= MASK_DATA;   // source bits complement
+
+    P = (P29^d1^d2^d3^d5^d6^d10^d11^d12^d13^d14^d17^d18^d20^d23);
+    P = (P<<1) + (P30^d2^d3^d4^d6^d7^d11^d12^d13^d14^d15^d18^d19^d21^d24);
+    P = (P<<1) + (P29^d1^d3^d4^d5^d7^d8^d12^d13^d14^d15^d16^d19^d20^d22);
+    P = (P<<1) + (P30^d2^d4^d5^d6^d8^d9^d13^d14^d15^d16^d17^d20^d21^d23);
+    P = (P<<1) + (P30^d1^d3^d5^d6^d7^d9^d10^d14^d15^d16^d17^d18^d21^d22^d24);
+    P = (P<<1) + (P29^d3^d5^d6^d8^d9^d10^d11^d13^d15^d19^d22^d23^d24);
+
+    return P;
+}
+
+
+BOOLEAN old_parity(UINT32 W)
+{
+    return (old_parity_bits(W)==(W&MASK_PARITY));
+}
+
+
+
+int main(int argc, char **argv)
+{
+    unsigned long long n,words,good,failed;
+    BOOLEAN was;
+
+    words= (argc>1)? (unsigned long long)atof(argv[1]) : 1ULL<<32;
+
+    good=failed=0;
+    for(n=0; n<words; n++)
+    {
+        UINT32 w=(UINT32)n;
+
+        was=old_parity(w);
+        if(parity_word(w)!=was)
+        {
+            if(failed<10) printf("TestParity: word %08X gives %d, was %d\n",w,!was,was);
+            failed++;
+        }
+        good+=was;
+    }
+
+    if(failed)
+    {
+        printf("TestParity: FAILED, %llu differences\n",failed);
+        return 1;
+    }
+
+    printf("TestParity: %llu words (%llu with good parity) the same\n",words,good);
+    return 0;
+}